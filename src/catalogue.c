@@ -0,0 +1,246 @@
+// ABE's catalogue of names; see catalogue.h.
+
+#include "catalogue.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulation.h"
+#include "tokens.h"
+#include "utils.h"
+
+void catalogue_init(struct s_catalogue *catalogue,
+                    const struct s_machine *machine, const uint8_t *memory,
+                    uint16_t top) {
+    assert(catalogue != 0);
+    memset(catalogue, 0, sizeof(*catalogue));
+    catalogue->memory = memory;
+    catalogue->top = top;
+    catalogue->end = mpu_read_u16(machine, 0x00) + 0x41;
+    catalogue->limit = machine->model->himem & 0xff00;
+    for (int i = 0; i < catalogue_list_count; ++i) {
+        catalogue->head[i] = catalogue->tail[i] = -1;
+    }
+}
+
+void catalogue_free(struct s_catalogue *catalogue) {
+    free(catalogue->entries);
+    catalogue->entries = 0;
+}
+
+int catalogue_char_class(uint8_t c, uint8_t y) {
+    if ((y == 0) || (c < '0')) {
+        return 0;
+    }
+    if (c <= '9') {
+        return 1;
+    }
+    if (((c >= '@') && (c <= 'Z')) || ((c >= '_') && (c <= 'z'))) {
+        return 2;
+    }
+    return 0;
+}
+
+bool catalogue_is_initial(uint8_t c) {
+    return ((c >= 'A') && (c <= 'Z')) || ((c >= '_') && (c <= 'z'));
+}
+
+int catalogue_list(uint8_t initial) {
+    if (initial < 0x80) {
+        return initial;
+    }
+    return (initial == token_proc) ? catalogue_list_proc : catalogue_list_fn;
+}
+
+int catalogue_find(const struct s_catalogue *catalogue, uint8_t initial,
+                   const uint8_t *tail, uint8_t tail_length) {
+    for (int i = catalogue->head[catalogue_list(initial)]; i >= 0;
+         i = catalogue->entries[i].next) {
+        const struct s_catalogue_entry *entry = &catalogue->entries[i];
+        if ((entry->tail_length == tail_length) &&
+            (memcmp(entry->tail, tail, tail_length) == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ABE keeps the catalogue above LOMEM and gives up if it reaches the page
+// containing HIMEM.
+bool catalogue_add(struct s_catalogue *catalogue, uint8_t initial,
+                   const uint8_t *tail, uint8_t tail_length) {
+    catalogue->end += tail_length + 3;
+    if (catalogue->end >= catalogue->limit) {
+        catalogue->failed = true; // "No Room"
+        return false;
+    }
+    if (catalogue->entry_count == catalogue->entry_capacity) {
+        catalogue->entry_capacity = (catalogue->entry_capacity > 0) ?
+                                    catalogue->entry_capacity * 2 : 64;
+        catalogue->entries = check_alloc(realloc(
+            catalogue->entries,
+            catalogue->entry_capacity * sizeof(catalogue->entries[0])));
+    }
+    int i = catalogue->entry_count++;
+    struct s_catalogue_entry *entry = &catalogue->entries[i];
+    memcpy(entry->tail, tail, tail_length);
+    entry->tail_length = tail_length;
+    entry->next = -1;
+    int list = catalogue_list(initial);
+    if (catalogue->head[list] < 0) {
+        catalogue->head[list] = i;
+    } else {
+        catalogue->entries[catalogue->tail[list]].next = i;
+    }
+    catalogue->tail[list] = i;
+    return true;
+}
+
+static uint8_t byte_at(const struct s_catalogue *catalogue, uint16_t line,
+                       uint8_t y) {
+    return catalogue->memory[(uint16_t) (line + y)];
+}
+
+// Deal with the name starting with 'initial' at index 'y' of the line after
+// 'line', cataloguing it if it's new, and return the index to carry on from;
+// this follows ABE's &9F44.
+static uint8_t catalogue_name(struct s_catalogue *catalogue, uint16_t line,
+                              uint8_t y, uint8_t initial) {
+    --y;
+    uint8_t previous = byte_at(catalogue, line, y);
+    bool at_start = (y < 4);
+    if (catalogue->assembler & 0x80) {
+        // Only labels count in assembler.
+        if (at_start || (previous != '.')) {
+            return y + 2;
+        }
+    } else if (!at_start && (initial == 'E') &&
+               (catalogue_char_class(previous, y) == 1)) {
+        // An exponent; ABE skips to the next digit, even if that means
+        // going past the end of the line, or of the program into memory we
+        // can't predict, or looking forever.
+        ++y;
+        for (int i = 0; i < 256; ++i) {
+            ++y;
+            if (line + y >= catalogue->top) {
+                break;
+            }
+            if (catalogue_char_class(byte_at(catalogue, line, y), y) == 1) {
+                return y;
+            }
+        }
+        catalogue->failed = true;
+        return y;
+    }
+
+    uint16_t name = line + y + 1;
+    uint8_t length = 1;
+    y += 2;
+    while (catalogue_char_class(byte_at(catalogue, line, y), y) != 0) {
+        ++y;
+        ++length;
+    }
+    if (!(initial & 0x80)) {
+        uint8_t c = byte_at(catalogue, line, y);
+        if ((c == '%') || (c == '$')) {
+            ++length;
+            c = byte_at(catalogue, line, ++y);
+        }
+        if (c == '(') {
+            ++length;
+            ++y;
+        }
+    }
+    uint8_t tail[256];
+    for (int i = 0; i < length - 1; ++i) {
+        tail[i] = catalogue->memory[(uint16_t) (name + 1 + i)];
+    }
+    if (catalogue_find(catalogue, initial, tail, length - 1) < 0) {
+        catalogue_add(catalogue, initial, tail, length - 1);
+    }
+    return y;
+}
+
+bool catalogue_line(struct s_catalogue *catalogue, uint16_t line) {
+    uint8_t y = 4;
+    while (!catalogue->failed) {
+        uint8_t c = byte_at(catalogue, line, y);
+        if (c == cr) {
+            return true;
+        }
+        if (c == '"') {
+            do {
+                c = byte_at(catalogue, line, ++y);
+                if (c == cr) {
+                    return true;
+                }
+            } while (c != '"');
+            ++y;
+            continue;
+        }
+        if (c == token_line_number) {
+            y += 4;
+            continue;
+        }
+        if (catalogue->assembler & 0x80) {
+            if (c == '\\') {
+                do {
+                    c = byte_at(catalogue, line, ++y);
+                    if (c == cr) {
+                        return true;
+                    }
+                } while (c != ':');
+                ++y;
+                continue;
+            }
+            if (c == ']') {
+                catalogue->assembler = c;
+                ++y;
+                continue;
+            }
+        }
+        if (c == '[') {
+            catalogue->assembler = 0xff;
+            ++y;
+            continue;
+        }
+        if ((c == token_rem) || (c == token_data)) {
+            return true;
+        }
+        if (c == '*') {
+            // A star command runs to the end of the line.
+            uint8_t star = y;
+            do {
+                if (--y < 4) {
+                    return true;
+                }
+                c = byte_at(catalogue, line, y);
+            } while (c == ' ');
+            if ((c == ':') || (c == token_then) || (c == token_else)) {
+                return true;
+            }
+            y = star + 1;
+            continue;
+        }
+        if (c == '&') {
+            do {
+                c = byte_at(catalogue, line, ++y);
+            } while ((catalogue_char_class(c, y) != 0) && (c < 'G'));
+            continue;
+        }
+        if (c == token_to) {
+            // TOP is tokenised as TO followed by "P".
+            y += (byte_at(catalogue, line, y + 1) == 'P') ? 2 : 1;
+            continue;
+        }
+        if ((c == token_proc) || (c == token_fn) ||
+            ((c < 0x80) && catalogue_is_initial(c))) {
+            y = catalogue_name(catalogue, line, y, c);
+            continue;
+        }
+        ++y;
+    }
+    return false;
+}
+
+// vi: colorcolumn=80
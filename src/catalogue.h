@@ -0,0 +1,83 @@
+#ifndef CATALOGUE_H
+#define CATALOGUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// ABE's catalogue of the names used in a program, which its "Pack" and
+// "Variables Xref" both build before doing anything else; pack.c and xref.c
+// build it just as ABE does, so they find exactly the same names in the same
+// order.
+//
+// ABE keeps a list of names for each initial character, with PROC and FN
+// names on lists of their own. The initial itself isn't stored, and a
+// renamed entry stays on its original list.
+
+enum {
+    catalogue_list_proc = 0x7b,
+    catalogue_list_fn = 0x7c,
+    catalogue_list_count = 0x80
+};
+
+struct s_catalogue_entry {
+    uint8_t tail[256];
+    uint8_t tail_length;
+    int next;
+};
+
+struct s_catalogue {
+    const uint8_t *memory;
+    uint16_t top;
+    uint32_t end;      // allowing for ABE adding a stray carry
+    uint32_t limit;
+    bool failed;       // hit a case we leave to ABE
+    uint8_t assembler; // bit 7 set inside [ ]; ABE's &87
+
+    struct s_catalogue_entry *entries;
+    int entry_count;
+    int entry_capacity;
+    int head[catalogue_list_count];
+    int tail[catalogue_list_count];
+};
+
+// Start an empty catalogue for the program in 'memory', a copy of
+// 'machine''s memory, which ends at 'top'. Like ABE's, it runs out of room
+// when it reaches the page containing HIMEM.
+void catalogue_init(struct s_catalogue *catalogue,
+                    const struct s_machine *machine, const uint8_t *memory,
+                    uint16_t top);
+
+void catalogue_free(struct s_catalogue *catalogue);
+
+// Classify 'c' as ABE's &9AF4 does: 1 for a digit, 2 for a letter (including
+// '@', '_' and '`') and 0 for anything else. 'y' is ABE's index register;
+// nothing counts at index 0.
+int catalogue_char_class(uint8_t c, uint8_t y);
+
+// Return true if 'c' can start a variable name.
+bool catalogue_is_initial(uint8_t c);
+
+// Return the list for names starting with 'initial', which may be a PROC or
+// FN token.
+int catalogue_list(uint8_t initial);
+
+// Return the index of the entry for the name made of 'initial' and 'tail',
+// or -1 if there isn't one.
+int catalogue_find(const struct s_catalogue *catalogue, uint8_t initial,
+                   const uint8_t *tail, uint8_t tail_length);
+
+// Add an entry to the end of the list for 'initial', returning false if the
+// catalogue has run out of room.
+bool catalogue_add(struct s_catalogue *catalogue, uint8_t initial,
+                   const uint8_t *tail, uint8_t tail_length);
+
+// Catalogue the names in the line after the CR at 'line', as ABE does from
+// &9E9D, returning false if we've hit a case we leave to ABE. The lines must
+// be catalogued in order, as assembler carries on from one to the next.
+bool catalogue_line(struct s_catalogue *catalogue, uint16_t line);
+
+// vi: colorcolumn=80
+
+#endif
@@ -1,4 +1,6 @@
 #include "config.h"
+#include "emulation.h"
+#include "traps.h"
 
 // We default to not tokenising the output because it's terminal-friendly.
 // This isn't always going to be ideal, but I'm reluctant to say (e.g.)
@@ -7,6 +9,14 @@
 struct s_config config = {
     0,      // verbose
     false,  // show all output
+    true,   // translate 6502 code to native code where possible
+    traps_on, // native replacements for BASIC ROM routines
+    0,      // 6502 instruction budget per operation: default
+    0,      // 6502 profile output filename
+    0,      // trace output filename
+    0,      // trace to replay instead of processing a program
+    engine_emulated, // how to do the work
+    model_standard, // emulated machine's memory map
     -1,     // BASIC version
     false,  // assume input is tokenised
     false,  // strip leading spaces
@@ -22,11 +32,15 @@ struct s_config config = {
     10,     // renumber start
     10,     // renumber step
     -1,     // LISTO
+    -1,     // first line to list
+    -1,     // last line to list
+    0,      // PROC or FN to list
     false,  // open output as binary
     false,  // format
     false,  // unpack
     false,  // line_ref
     false,  // variable_xref
+    xref_format_text, // format of --line-ref and --variable-xref output
     false,  // tokenise output
     false,  // ASCII output
 };
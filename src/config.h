@@ -4,9 +4,31 @@
 #include <stdbool.h>
 #include "roms.h"
 
+// How basictool does the work: by driving the emulated ROMs, or natively
+// where an equivalent exists.
+enum {
+    engine_emulated,
+    engine_native
+};
+
+// How --line-ref and --variable-xref write their tables.
+enum {
+    xref_format_text,
+    xref_format_json,
+    xref_format_csv
+};
+
 struct s_config {
     int verbose;
     bool show_all_output;
+    bool jit;
+    int traps;
+    int budget;
+    const char *profile_6502;
+    const char *record_trace;
+    const char *replay_trace;
+    int engine;
+    int model;
     int basic_version;
     bool input_tokenised;
     // TODO: Rename the next two options strip_spaces_{start,end} to match
@@ -25,11 +47,15 @@ struct s_config {
     int renumber_start;
     int renumber_step;
     int listo;
+    int lines_first;
+    int lines_last;
+    const char *proc;
     bool open_output_binary;
     bool format;
     bool unpack;
     bool line_ref;
     bool variable_xref;
+    int xref_format;
     bool output_tokenised;
     bool output_ascii;
 };
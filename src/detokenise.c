@@ -0,0 +1,244 @@
+// A native LIST; see detokenise.h.
+//
+// BASIC 2 and BASIC 4 differ in the details: BASIC 4 doesn't expand tokens
+// after REM, skips empty lines, adjusts the NEXT and UNTIL indentation before
+// printing a line rather than after, and ends lines with CR LF rather than
+// LF CR. Odd programs (e.g. ones with unbalanced loops or top-bit-set
+// characters where tokens are expected) show the differences, so we follow
+// each ROM's code byte for byte, including its use of 8-bit counters.
+
+#include "detokenise.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "roms.h"
+#include "tokens.h"
+#include "utils.h"
+
+// LISTO bits.
+enum {
+    listo_space = 1,
+    listo_for = 2,
+    listo_repeat = 4
+};
+
+static void put_spaces(struct s_buffer *output, int count) {
+    for (int i = 0; i < count; ++i) {
+        buffer_put(output, ' ');
+    }
+}
+
+// Print 'number' right-justified in 'width' characters, as the ROMs do for
+// line numbers.
+static void put_number(struct s_buffer *output, uint16_t number, int width) {
+    char digits[6];
+    int length = sprintf(digits, "%u", (unsigned int) number);
+    put_spaces(output, width - length);
+    for (int i = 0; i < length; ++i) {
+        buffer_put(output, digits[i]);
+    }
+}
+
+// Print the keyword for 'token'. Like the ROM, this takes the first entry in
+// the table with that token and doesn't know where the table ends.
+static void put_token(struct s_buffer *output, const uint8_t *rom,
+                      size_t table, uint8_t token) {
+    size_t entry = table;
+    for (;;) {
+        size_t i = entry + 1;
+        while ((i < rom_size) && (rom[i] < 0x80)) {
+            ++i;
+        }
+        check(i < rom_size, "internal error: token &%02X not found", token);
+        if (rom[i] == token) {
+            break;
+        }
+        entry = i + 2;
+    }
+    for (size_t i = entry; rom[i] < 0x80; ++i) {
+        buffer_put(output, rom[i]);
+    }
+}
+
+// Print the LISTO indentation for 'count', an 8-bit FOR or REPEAT nesting
+// count, if LISTO bit 'bit' is set.
+static void put_indent(struct s_buffer *output, int basic_version, int listo,
+                       int bit, uint8_t count) {
+    if ((listo & bit) == 0) {
+        return;
+    }
+    if (basic_version == basic_2) {
+        if (count >= 0x80) {
+            buffer_put(output, ' ');
+        } else {
+            put_spaces(output, 2 * count);
+        }
+    } else if (count < 0x80) {
+        put_spaces(output, (2 * count) & 0xff);
+    }
+}
+
+// Cursor over the program as the ROM's LIST walks it: 'line' is the offset
+// of the CR before a line and 'y' the offset from there, which is an 8-bit
+// register in the ROM.
+struct s_cursor {
+    const uint8_t *program;
+    size_t length;
+    size_t line;
+    size_t y;
+};
+
+static uint8_t peek(const struct s_cursor *cursor, size_t offset) {
+    size_t i = cursor->line + cursor->y + offset;
+    check((cursor->y + offset <= 0xff) && (i < cursor->length),
+          "error: program is corrupt");
+    return cursor->program[i];
+}
+
+uint16_t detokenise_line_number(const uint8_t *token) {
+    uint8_t lo = ((token[1] << 2) & 0xc0) ^ token[2];
+    uint8_t hi = ((token[1] << 4) & 0xff) ^ token[3];
+    return (hi << 8) | lo;
+}
+
+// Decode the line number token at the cursor, moving past it.
+static uint16_t take_line_number(struct s_cursor *cursor) {
+    peek(cursor, 3);
+    uint16_t number = detokenise_line_number(
+        &cursor->program[cursor->line + cursor->y]);
+    cursor->y += 4;
+    return number;
+}
+
+char *detokenise_error(const char *message, int basic_version) {
+    assert((basic_version >= 0) && (basic_version < basic_count));
+    const uint8_t *rom = rom_basic[basic_version];
+    size_t table = rom_basic_token_table(basic_version);
+    struct s_buffer output = {0};
+    for (const uint8_t *p = (const uint8_t *) message; *p != '\0'; ++p) {
+        if (*p >= 0x80) {
+            put_token(&output, rom, table, *p);
+        } else {
+            buffer_put(&output, *p);
+        }
+    }
+    buffer_put(&output, '\0');
+    return (char *) output.data;
+}
+
+uint8_t *detokenise(const uint8_t *program, size_t length, int basic_version,
+                    int listo, size_t *output_length) {
+    assert((basic_version >= 0) && (basic_version < basic_count));
+    assert(output_length != 0);
+    const uint8_t *rom = rom_basic[basic_version];
+    size_t table = rom_basic_token_table(basic_version);
+    struct s_buffer output = {0};
+    struct s_cursor cursor = {program, length, 0, 1};
+    uint8_t for_count = 0;
+    uint8_t repeat_count = 0;
+    for (;;) {
+        uint16_t line_number = (peek(&cursor, 0) << 8) | peek(&cursor, 1);
+        if (line_number > 0x7fff) {
+            break;
+        }
+        cursor.y = 4;
+
+        if (basic_version == basic_4) {
+            // BASIC 4 looks through the line first, taking off a level of
+            // indentation for each NEXT and UNTIL outside strings and REMs.
+            // This is also where LIST IF matches its string, which it can't
+            // do in an empty line, so empty lines aren't listed at all.
+            if (for_count >= 0x80) {
+                for_count = 0;
+            }
+            if (repeat_count >= 0x80) {
+                repeat_count = 0;
+            }
+            if (peek(&cursor, 0) == cr) {
+                cursor.line += cursor.y;
+                cursor.y = 1;
+                continue;
+            }
+            uint8_t literal = 0;
+            for (size_t y = cursor.y; ; ++y) {
+                uint8_t c = peek(&cursor, y - cursor.y);
+                if (c == cr) {
+                    break;
+                }
+                if (c == token_rem) {
+                    literal = c;
+                } else if (c == '"') {
+                    literal ^= c;
+                }
+                if (literal == 0) {
+                    for_count -= (c == token_next);
+                    repeat_count -= (c == token_until);
+                }
+            }
+        }
+
+        put_number(&output, line_number, 5);
+        if (listo & listo_space) {
+            buffer_put(&output, ' ');
+        }
+        put_indent(&output, basic_version, listo, listo_for, for_count);
+        put_indent(&output, basic_version, listo, listo_repeat, repeat_count);
+
+        // In BASIC 2, a non-zero 'literal' means the text is tokenised; in
+        // BASIC 4, it means it isn't.
+        uint8_t literal = (basic_version == basic_2) ? 0xff : 0;
+        for (;;) {
+            uint8_t c = peek(&cursor, 0);
+            if (c == cr) {
+                break;
+            }
+            if (c == '"') {
+                literal ^= (basic_version == basic_2) ? 0xff : c;
+                buffer_put(&output, c);
+                ++cursor.y;
+                continue;
+            }
+            if ((basic_version == basic_2) ? (literal < 0x80) :
+                                             (literal != 0)) {
+                buffer_put(&output, c);
+                ++cursor.y;
+                continue;
+            }
+            if (c == token_line_number) {
+                put_number(&output, take_line_number(&cursor), 0);
+                continue;
+            }
+            for_count += (c == token_for);
+            repeat_count += (c == token_repeat);
+            if (basic_version == basic_2) {
+                if ((c == token_next) && (for_count != 0)) {
+                    --for_count;
+                }
+                if ((c == token_until) && (repeat_count != 0)) {
+                    --repeat_count;
+                }
+            } else if (c == token_rem) {
+                literal = c;
+            }
+            if (c < 0x80) {
+                buffer_put(&output, c);
+            } else {
+                put_token(&output, rom, table, c);
+            }
+            ++cursor.y;
+        }
+
+        if (basic_version == basic_2) {
+            buffer_put(&output, lf); buffer_put(&output, cr); // OSNEWL
+        } else {
+            buffer_put(&output, cr); buffer_put(&output, lf);
+        }
+        cursor.line += cursor.y;
+        cursor.y = 1;
+    }
+    *output_length = output.length;
+    return output.data;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,31 @@
+#ifndef DETOKENISE_H
+#define DETOKENISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A native equivalent of LIST, for --engine=native. It follows each BASIC
+// ROM's own LIST code, using the ROM's token table, so the output is exactly
+// what the emulated machine would have written.
+
+// Return what BASIC version 'basic_version' writes via OSWRCH for LISTO
+// 'listo' then LIST, minus the command echo and prompt, for the tokenised
+// program in the 'length' bytes at 'program' (i.e. starting with the CR at
+// PAGE); *output_length is set to its length. The caller must free the
+// result.
+uint8_t *detokenise(const uint8_t *program, size_t length, int basic_version,
+                    int listo, size_t *output_length);
+
+// Return 'message', a NUL-terminated error message from an error block, with
+// any tokens in it expanded as BASIC version 'basic_version' prints them when
+// it reports the error (e.g. "\x86 space" is "LINE space"). The caller must
+// free the result.
+char *detokenise_error(const char *message, int basic_version);
+
+// Return the line number in the line number token (&8D and three bytes) at
+// 'token'.
+uint16_t detokenise_line_number(const uint8_t *token);
+
+// vi: colorcolumn=80
+
+#endif
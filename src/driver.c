@@ -6,19 +6,36 @@
 #include <string.h>
 #include "cargs.h"
 #include "config.h"
+#include "detokenise.h"
+#include "driver.h"
 #include "emulation.h"
+#include "layout.h"
+#include "lineindex.h"
 #include "main.h"
+#include "pack.h"
+#include "renumber.h"
+#include "tokenise.h"
+#include "trace.h"
 #include "utils.h"
+#include "xref.h"
 
 #define BASIC_TOP (0x12)
 
-// C-style string maintained by driver_oswrch() to reflect the current line of
-// output from the emulated machine.
+// The characters of the current, incomplete line of output from the emulated
+// machine, exactly as written; driver_oswrch() appends to this.
+static char *raw_output = 0;
+static size_t raw_output_length = 0;
+static size_t raw_output_size = 0;
+
+// C-style string reflecting the current line of output from the emulated
+// machine as it would appear on screen; see update_pending_output().
 static char *pending_output = 0;
 // Number of characters (excluding final NUL) in pending_output. We track this
 // separately so that we can passs NULs embedded in a program through to the
 // output when doing --ascii output.
 static size_t pending_output_length = 0;
+// True if pending_output needs to be brought up to date with raw_output.
+static bool pending_output_stale = true;
 
 // Simple state machine used to decide how to handle each line of output from
 // the emulated machine.
@@ -61,22 +78,33 @@ static char *make_printable(char *s) {
     return s;
 }
 
-// The low-level emulation code calls this function every time the emulated
-// machine calls OSWRCH. It performs very basic terminal emulation to maintain
-// a copy of the current line of output as a C string in pending_output.
-// Whenever a line feed is written, complete_output_line_handler() is called
-// and pending_output is set to an empty string ready for the next line.
-void driver_oswrch(uint8_t c) {
-    // These static variables track state related to pending_offset; since they
-    // aren't in the global namespace, we can use shorter names.
-    static size_t po_cursor_x = 0;
-    static size_t po_buffer_size = 0;
+// Interpret raw_output to set pending_output. This performs very basic
+// terminal emulation, so it's only done when a line is complete or we look at
+// an incomplete one, rather than for every character.
+static void update_pending_output(void) {
+    if (!pending_output_stale) {
+        return;
+    }
+    pending_output_stale = false;
+    pending_output = check_alloc(realloc(pending_output,
+                                         raw_output_length + 1));
+    pending_output_length = 0;
+    pending_output[0] = '\0';
+    if (raw_output_length == 0) {
+        return;
+    }
 
     // We generally just discard NULs in the output; they aren't important for
     // anything we are emulating here and they're not compatible with our
     // strategy of pending_output being a C-style string. We make an exception
     // for os_output_all so --ascii output doesn't strip them.
-    if ((c == '\0') && (output_state != os_output_all)) {
+    bool keep_nuls = (output_state == os_output_all);
+    if ((memchr(raw_output, cr, raw_output_length) == 0) &&
+        (keep_nuls || (memchr(raw_output, '\0', raw_output_length) == 0))) {
+        // The usual case; the line is just its characters.
+        memcpy(pending_output, raw_output, raw_output_length);
+        pending_output_length = raw_output_length;
+        pending_output[pending_output_length] = '\0';
         return;
     }
 
@@ -88,11 +116,47 @@ void driver_oswrch(uint8_t c) {
     // would probably work, but it feels a bit brittle, so instead we model CR
     // moving the cursor non-destructively back to the start of the current
     // line.
-    if (c == cr) {
-        po_cursor_x = 0;
-        return;
+    size_t cursor_x = 0;
+    for (size_t i = 0; i < raw_output_length; ++i) {
+        char c = raw_output[i];
+        if (c == cr) {
+            cursor_x = 0;
+        } else if ((c != '\0') || keep_nuls) {
+            pending_output[cursor_x++] = c;
+            pending_output_length = max(cursor_x, pending_output_length);
+        }
     }
-    if (c == lf) {
+    pending_output[pending_output_length] = '\0';
+}
+
+static void append_raw_output(const uint8_t *data, size_t length) {
+    if (raw_output_length + length > raw_output_size) {
+        raw_output_size = max(raw_output_size, 128);
+        while (raw_output_length + length > raw_output_size) {
+            raw_output_size *= 2;
+        }
+        raw_output = check_alloc(realloc(raw_output, raw_output_size));
+    }
+    memcpy(&raw_output[raw_output_length], data, length);
+    raw_output_length += length;
+    pending_output_stale = true;
+}
+
+// The low-level emulation code calls this function with the characters the
+// emulated machine writes via OSWRCH, in batches. We collect them into lines;
+// whenever a line feed is written, the line before it is interpreted into
+// pending_output, complete_output_line_handler() is called and we start
+// collecting the next line.
+void driver_oswrch(struct s_machine *machine, const uint8_t *data,
+                   size_t length) {
+    const uint8_t *end = data + length;
+    while (data < end) {
+        const uint8_t *eol = memchr(data, lf, end - data);
+        append_raw_output(data, ((eol != 0) ? eol : end) - data);
+        if (eol == 0) {
+            break;
+        }
+        update_pending_output();
         if (config.show_all_output) {
             // make_printable() changes its argument; it probably wouldn't hurt
             // to do this here, but since this is for debugging we don't want
@@ -102,28 +166,29 @@ void driver_oswrch(uint8_t c) {
             free(s);
         }
         complete_output_line_handler();
-        pending_output_length = po_cursor_x = 0;
-        pending_output[0] = '\0';
-        return;
+        raw_output_length = 0;
+        pending_output_stale = true;
+        data = eol + 1;
     }
+}
 
-    if ((po_cursor_x + 2) > po_buffer_size) {
-        if (po_buffer_size == 0) {
-            po_buffer_size = 128;
-        } else {
-            po_buffer_size *= 2;
-        }
-        pending_output = check_alloc(realloc(pending_output, po_buffer_size));
+void driver_error(struct s_machine *machine) {
+    // BASIC's error handler would expand tokens in the message, so the
+    // errors the native engine reports in words match.
+    char *message = detokenise_error(machine->error.message,
+                                     machine->basic_version);
+    print_error_prefix();
+    fprintf(stderr, "error: %s (%d)\n", message, machine->error.number);
+    free(message);
+    if (machine->trace != 0) {
+        // The log of a run which stopped with an error replays up to here.
+        trace_close(machine->trace);
     }
-
-    pending_output[po_cursor_x] = c;
-    pending_output[max(po_cursor_x, pending_output_length) + 1] = '\0';
-    po_cursor_x += 1;
-    pending_output_length = max(po_cursor_x, pending_output_length);
-    assert(strlen(pending_output) <= pending_output_length);
+    exit(EXIT_FAILURE);
 }
 
 static bool is_in_pending_output(const char *s) {
+    update_pending_output();
     return strstr(pending_output, s) != 0;
 }
 
@@ -147,10 +212,9 @@ static void ensure_output_file_open(const char *mode) {
 
 static void output_pending_output(void) {
     ensure_output_file_open("w");
-    for (size_t i = 0; i < pending_output_length; ++i) {
-        check(putc((unsigned char) pending_output[i], output_file) != EOF,
-            "error: error writing to output file \"%s\"", filenames[1]);
-    }
+    check(fwrite(pending_output, 1, pending_output_length, output_file) ==
+          pending_output_length,
+          "error: error writing to output file \"%s\"", filenames[1]);
     check(putc('\n', output_file) >= 0,
           "error: error writing to output file \"%s\"", filenames[1]);
 }
@@ -352,12 +416,48 @@ static int find_trailing_stripped_length(const char *line) {
     return stripped_length;
 }
 
+// Queue 'line' to be typed into the emulated machine; see
+// emulation_queue_input_line(). It isn't echoed if we'd just discard it.
+static void queue_input_line(struct s_machine *machine, const char *line) {
+    bool echo = (output_state != os_discard) || config.show_all_output;
+    emulation_queue_input_line(machine, line, echo, error_line_number);
+}
+
+// Copy the 'length' bytes of tokenised BASIC at 'program' directly into the
+// emulated machine's memory at PAGE and make BASIC recognise it.
+static void load_tokenised_program(struct s_machine *machine,
+                                   const void *program, size_t length) {
+    uint16_t page = machine->model->page;
+    memcpy(&machine->memory[page], program, length);
+    mpu_memory_written(machine, page, length);
+    // Now execute "OLD" so BASIC recognises the program.
+    uint8_t first_line_number_high_byte = machine->memory[page + 1];
+    execute_input_line(machine, "OLD");
+    machine->memory[page + 1] = first_line_number_high_byte;
+    mpu_memory_written(machine, page + 1, 1);
+}
+
 // Given untokenised ASCII BASIC program text loaded in binary mode using
 // load_binary() at 'data' of length 'length', use get_line() to iterate
 // through it line-by-line and type it into the emulated machine so BASIC will
 // tokenise it for us.
-static void type_basic_program(char *data, size_t length) {
-    execute_input_line("NEW");
+static void type_basic_program(struct s_machine *machine, char *data,
+                               size_t length) {
+    // The lines are all queued and then typed in without returning here in
+    // between; the emulated machine is only run once 'data' has been parsed.
+    // The native engine builds the program itself and hands it over at the
+    // end instead.
+    bool native = (config.engine == engine_native);
+    uint8_t *program = 0;
+    size_t program_length = 0;
+    size_t program_size = machine->model->himem - machine->model->page;
+    if (native) {
+        program = check_alloc(malloc(program_size));
+        program[program_length++] = cr;
+        program[program_length++] = 0xff;
+    } else {
+        queue_input_line(machine, "NEW");
+    }
 
     // As with beebasm's PUTBASIC, line numbers are optional on the input. We
     // auto-assign line numbers; line numbers in the input are recognised and
@@ -405,18 +505,65 @@ static void type_basic_program(char *data, size_t length) {
             }
         }
 
-        // Generate the fake input for BASIC and pass it over.
-        enum {buffer_size = 256};
+        // Generate the fake input for BASIC and pass it over. BASIC accepts
+        // lines of up to 238 characters; we check that here, rather than
+        // when the line is typed in, so a line which is too long is reported
+        // before any problem with the lines after it.
+        enum {buffer_size = 256, max_length = 238};
         char buffer[buffer_size];
-        check(snprintf(buffer, buffer_size, "%d%s", basic_line_number, line) <
-              buffer_size, "error: line too long");
-        execute_input_line(buffer);
+        int length = snprintf(buffer, buffer_size, "%d%s", basic_line_number,
+                              line);
+        check((length >= 0) && (length <= max_length),
+              "error: line too long");
+        if (native) {
+            program_length = tokenise_line(program, program_length,
+                                           program_size, buffer,
+                                           config.basic_version,
+                                           machine->memory[0x1f]); // LISTO
+        } else {
+            queue_input_line(machine, buffer);
+        }
 
         ++basic_line_number;
     }
+    if (native) {
+        load_tokenised_program(machine, program, program_length);
+        free(program);
+    } else {
+        emulation_run_queue(machine);
+    }
     error_line_number = -1;
 }
 
+// Each operation runs with a budget of 6502 instructions, in millions, so a
+// bad input or a case we don't handle stops it with an error rather than
+// leaving the emulated machine running forever. The defaults allow several
+// times what the largest program which fits in memory needs (for a 12K
+// program, packing takes 190 million and a variable cross reference 116
+// million); --budget overrides them all.
+enum {
+    budget_load = 100,
+    budget_pack = 5000,
+    budget_renumber = 100,
+    budget_list = 100,
+    budget_format = 100,
+    budget_unpack = 200,
+    budget_xref = 3000
+};
+
+static void start_operation(struct s_machine *machine, const char *name,
+                            int default_budget) {
+    int millions = (config.budget != 0) ? config.budget : default_budget;
+    emulation_set_budget(machine, name, (int64_t) millions * 1000000);
+}
+
+static void end_operation(struct s_machine *machine) {
+    if (config.verbose >= 2) {
+        info("%s took %lld 6502 instructions", machine->operation,
+             (long long) emulation_budget_used(machine));
+    }
+}
+
 bool is_tokenised_basic(const unsigned char *data, size_t length) {
     // We walk through the program as if it were tokenised BASIC and see if we
     // successfully hit an end of program marker. Credit goes to Tom Seddon for
@@ -462,7 +609,7 @@ bool is_tokenised_basic(const unsigned char *data, size_t length) {
     }
 }
 
-void load_basic(const char *filename) {
+void load_basic(struct s_machine *machine, const char *filename) {
     // We load the file as binary data so we can take a look at it and decide
     // whether it's tokenised or text BASIC.
     size_t length;
@@ -488,24 +635,23 @@ void load_basic(const char *filename) {
         warn("--strip-spaces* have no effect with pre-tokenised input");
     }
 
+    start_operation(machine, tokenised ? "loading" : "tokenising",
+                    budget_load);
     if (tokenised) {
-        // Copy the data directly into the emulated machine's memory.
-        size_t max_length = himem - page - 512; // arbitrary safety margin
+        size_t max_length = machine->model->himem - machine->model->page -
+                            512; // arbitrary safety margin
         check(length <= max_length, "error: input is too large");
-        memcpy(&mpu_memory[page], data, length);
-        // Now execute "OLD" so BASIC recognises the program.
-        uint8_t first_line_number_high_byte = mpu_memory[page + 1];
-        execute_input_line("OLD");
-        mpu_memory[page + 1] = first_line_number_high_byte;
+        load_tokenised_program(machine, data, length);
         free(data);
     } else {
-        type_basic_program(data, length);
+        type_basic_program(machine, data, length);
         free(data);
     }
+    end_operation(machine);
 }
 
-static void execute_butil(void) {
-    execute_input_line("*BUTIL");
+static void execute_butil(struct s_machine *machine) {
+    execute_input_line(machine, "*BUTIL");
     check_is_in_pending_output("Ready:");
     assert(output_state == os_discard);
 }
@@ -514,40 +660,100 @@ static const char *no(bool no) {
     return no ? "N" : "Y";
 }
 
-void pack(void) {
-    uint8_t first_line_number_high_byte = mpu_memory[page + 1];
-    execute_butil();
-    execute_osrdch("P"); // pack
-    check_is_in_pending_output("REMs?");
-    execute_osrdch(no(config.pack_rems_n));
-    check_is_in_pending_output("Spaces?");
-    execute_osrdch(no(config.pack_spaces_n));
-    check_is_in_pending_output("Comments?");
-    execute_osrdch(no(config.pack_comments_n));
-    check_is_in_pending_output("Variables?");
-    execute_osrdch(no(config.pack_variables_n));
+// Pack the program using pack_program(), passing on its output as if it had
+// come from ABE; return false if it can't be done.
+static bool pack_native(struct s_machine *machine) {
+    struct s_pack_options options = {
+        .rems = !config.pack_rems_n,
+        .spaces = !config.pack_spaces_n,
+        .comments = !config.pack_comments_n,
+        .variables = !config.pack_variables_n,
+        .singles = !config.pack_variables_n && !config.pack_singles_n,
+        .concatenate = !config.pack_concatenate_n
+    };
+    uint8_t *output;
+    size_t length;
+    if (!pack_program(machine, &options, &output, &length)) {
+        return false;
+    }
+    static const uint8_t newline[] = {lf, cr};
+    driver_oswrch(machine, newline, sizeof(newline));
+    output_state = os_pack_output;
+    driver_oswrch(machine, output, length);
+    driver_oswrch(machine, newline, sizeof(newline));
+    assert(output_state == os_discard);
+    driver_oswrch(machine, (const uint8_t *) ">", 1);
+    free(output);
+    return true;
+}
+
+void pack(struct s_machine *machine) {
+    check_is_in_pending_output(">");
+    if ((config.engine == engine_native) && pack_native(machine)) {
+        return;
+    }
+    start_operation(machine, "packing", budget_pack);
+    uint16_t page = machine->model->page;
+    uint8_t first_line_number_high_byte = machine->memory[page + 1];
+    execute_butil(machine);
+    // The answers to all but the last question are queued, as nothing needs
+    // to be done between them; the output is discarded until then anyway.
+    emulation_queue_osrdch(machine, 'P'); // pack
+    emulation_queue_osrdch(machine, *no(config.pack_rems_n));
+    emulation_queue_osrdch(machine, *no(config.pack_spaces_n));
+    emulation_queue_osrdch(machine, *no(config.pack_comments_n));
+    emulation_queue_osrdch(machine, *no(config.pack_variables_n));
     if (!config.pack_variables_n) {
-        check_is_in_pending_output("Use unused singles?");
-        execute_osrdch(no(config.pack_singles_n));
+        emulation_queue_osrdch(machine, *no(config.pack_singles_n));
     }
+    emulation_run_queue(machine);
     check_is_in_pending_output("Concatenate?");
     assert(output_state == os_discard);
     output_state = os_pack_discard_concatenate;
-    execute_osrdch(no(config.pack_concatenate_n));
-    check_is_in_pending_output("Ready:"); execute_osrdch("Q"); // quit
+    execute_osrdch(machine, no(config.pack_concatenate_n));
+    check_is_in_pending_output("Ready:"); execute_osrdch(machine, "Q"); // quit
     output_state = os_discard;
     // Because *FX138 is implemented as a no-op, ABE's attempt to execute "OLD"
     // won't happen, so do it ourselves.
-    execute_input_line("OLD");
-    mpu_memory[page + 1] = first_line_number_high_byte;
+    execute_input_line(machine, "OLD");
+    machine->memory[page + 1] = first_line_number_high_byte;
+    mpu_memory_written(machine, page + 1, 1);
+    end_operation(machine);
+}
+
+// Renumber the program using renumber_program(), passing on its output as if
+// it had come from the RENUMBER command; return false if it can't be done.
+static bool renumber_native(struct s_machine *machine, int start, int step,
+                            bool rom_table) {
+    uint8_t *output;
+    size_t length;
+    if (!renumber_program(machine, start, step, rom_table, &output,
+                          &length)) {
+        return false;
+    }
+    static const uint8_t newline[] = {lf, cr};
+    driver_oswrch(machine, newline, sizeof(newline));
+    driver_oswrch(machine, output, length);
+    driver_oswrch(machine, (const uint8_t *) ">", 1);
+    free(output);
+    return true;
 }
 
-void renumber(void) {
+static void renumber_lines(struct s_machine *machine, int start, int step) {
     check_is_in_pending_output(">");
+    if ((config.engine == engine_native) &&
+        renumber_native(machine, start, step, true)) {
+        return;
+    }
+    start_operation(machine, "renumbering", budget_renumber);
     char buffer[256];
-    sprintf(buffer, "RENUMBER %d,%d", config.renumber_start,
-            config.renumber_step);
-    execute_input_line(buffer);
+    sprintf(buffer, "RENUMBER %d,%d", start, step);
+    execute_input_line(machine, buffer);
+    end_operation(machine);
+}
+
+void renumber(struct s_machine *machine) {
+    renumber_lines(machine, config.renumber_start, config.renumber_step);
 }
 
 
@@ -561,60 +767,241 @@ static void ensure_output_file_closed(void) {
     }
 }
 
-void save_tokenised_basic(void) {
+void save_tokenised_basic(struct s_machine *machine) {
     FILE *file = fopen_wrapper(filenames[1], "wb");
-    uint16_t top = mpu_read_u16(BASIC_TOP);
+    uint16_t page = machine->model->page;
+    uint16_t top = mpu_read_u16(machine, BASIC_TOP);
     size_t length = top - page;
-    size_t bytes_written = fwrite(&mpu_memory[page], 1, length, file);
+    size_t bytes_written = fwrite(&machine->memory[page], 1, length, file);
     check(bytes_written == length,
           "error: error writing to output file \"%s\"", filenames[1]);
     ensure_output_file_closed();
 }
 
-void save_ascii_basic(void) {
+// Set *first and *last to the lines --lines or --proc selects, returning
+// false if neither was given. 'index' is the index over the program, or 0 if
+// it isn't intact.
+static bool select_lines(const struct s_line_index *index, uint16_t *first,
+                         uint16_t *last) {
+    if (config.proc != 0) {
+        check(index != 0, "error: program is corrupt");
+        check(line_index_find_definition(index, config.proc, first, last),
+              "error: no definition of %s in program", config.proc);
+        return true;
+    }
+    if (config.lines_first >= 0) {
+        *first = config.lines_first;
+        *last = config.lines_last;
+        return true;
+    }
+    return false;
+}
+
+// Write the listing of the program in the memory of 'machine' produced by
+// detokenise(), as if it had been output by LIST, or by LIST first,last if
+// 'selected' is true, using 'index' to find the lines; return false if the
+// selected lines can't be found without the ROM.
+static bool save_ascii_basic_native(struct s_machine *machine,
+                                    const struct s_line_index *index,
+                                    bool selected, uint16_t first,
+                                    uint16_t last) {
+    uint8_t *listing;
+    size_t length;
+    if (selected) {
+        if (index == 0) {
+            return false;
+        }
+        listing = line_index_list(index, machine->basic_version, config.listo,
+                                  first, last, &length);
+    } else {
+        uint16_t page = machine->model->page;
+        listing = detokenise(&machine->memory[page],
+                             machine->model->himem - page,
+                             machine->basic_version, config.listo, &length);
+    }
+    // LIST's output would start on a new line.
+    raw_output_length = 0;
+    pending_output_stale = true;
+    output_state = os_output_all;
+    driver_oswrch(machine, listing, length);
+    output_state = os_discard;
+    free(listing);
+    ensure_output_file_closed();
+    return true;
+}
+
+void save_ascii_basic(struct s_machine *machine) {
     assert(output_state == os_discard);
+    // The index is only needed to find a PROC or FN, or to list some lines
+    // natively, and only for this listing.
+    struct s_line_index index;
+    bool indexed = false;
+    if ((config.proc != 0) ||
+        ((config.lines_first >= 0) && (config.engine == engine_native))) {
+        indexed = line_index_build(&index, machine);
+    }
+    uint16_t first = 0;
+    uint16_t last = 0;
+    bool selected = select_lines(indexed ? &index : 0, &first, &last);
+    bool done = (config.engine == engine_native) &&
+                save_ascii_basic_native(machine, indexed ? &index : 0,
+                                        selected, first, last);
+    if (indexed) {
+        line_index_free(&index);
+    }
+    if (done) {
+        return;
+    }
+    start_operation(machine, "listing", budget_list);
     char buffer[256];
     sprintf(buffer, "LISTO %d", config.listo);
-    execute_input_line(buffer);
+    execute_input_line(machine, buffer);
     output_state = os_list_discard_command;
-    execute_input_line("LIST");
+    if (selected) {
+        sprintf(buffer, "LIST %u,%u", (unsigned int) first,
+                (unsigned int) last);
+        execute_input_line(machine, buffer);
+    } else {
+        execute_input_line(machine, "LIST");
+    }
     output_state = os_discard;
+    end_operation(machine);
     ensure_output_file_closed();
 }
 
-void save_formatted_basic(void) {
-    execute_butil();
-    output_state = os_format_discard_command;
-    execute_osrdch("F"); // format
+// Write what a native equivalent of an ABE command wrote, as it would have
+// been written if it had come from ABE, handling each line as 'state' does.
+static void output_native(struct s_machine *machine, const uint8_t *output,
+                          size_t length, int state) {
+    raw_output_length = 0;
+    pending_output_stale = true;
+    output_state = state;
+    driver_oswrch(machine, output, length);
     output_state = os_discard;
+}
+
+static bool save_formatted_basic_native(struct s_machine *machine) {
+    uint8_t *output;
+    size_t length;
+    if (!format_program(machine, &output, &length)) {
+        return false;
+    }
+    output_native(machine, output, length, os_output_non_blank);
+    free(output);
+    return true;
+}
+
+void save_formatted_basic(struct s_machine *machine) {
+    if ((config.engine != engine_native) ||
+        !save_formatted_basic_native(machine)) {
+        start_operation(machine, "formatting", budget_format);
+        execute_butil(machine);
+        output_state = os_format_discard_command;
+        execute_osrdch(machine, "F"); // format
+        output_state = os_discard;
+        end_operation(machine);
+    }
     ensure_output_file_closed();
 }
 
-void save_unpacked_basic(void) {
-    execute_butil();
-    output_state = os_unpack_discard_command;
-    execute_osrdch("U"); // unpack
-    if (output_state == os_unpack_show_nonblank) {
-        die_help("error: can't unpack, try using --renumber-step to increase "
-                 "gaps between lines");
+// Unpack the program using unpack_program(), renumbering it first if the
+// gaps between its lines are too small rather than giving up as ABE does;
+// return false if it can't be done. The renumbering keeps its table of line
+// numbers in host memory, so a program too big for RENUMBER can still be
+// unpacked.
+static bool save_unpacked_basic_native(struct s_machine *machine) {
+    uint8_t *output;
+    size_t length;
+    int step;
+    if (!unpack_program(machine, &output, &length, &step)) {
+        return false;
+    }
+    if (step != 0) {
+        step = max(step, config.renumber_step);
+        warn("renumbering with step %d to make room to unpack", step);
+        check_is_in_pending_output(">");
+        // This can't fail without the table at TOP.
+        renumber_native(machine, config.renumber_start, step, false);
+        if (!unpack_program(machine, &output, &length, &step)) {
+            return false;
+        }
+        check(step == 0, "error: can't unpack, there are too many lines to "
+              "make room for the new ones");
+    }
+    output_native(machine, output, length, os_output_non_blank);
+    free(output);
+    return true;
+}
+
+void save_unpacked_basic(struct s_machine *machine) {
+    if ((config.engine != engine_native) ||
+        !save_unpacked_basic_native(machine)) {
+        start_operation(machine, "unpacking", budget_unpack);
+        execute_butil(machine);
+        output_state = os_unpack_discard_command;
+        execute_osrdch(machine, "U"); // unpack
+        if (output_state == os_unpack_show_nonblank) {
+            die_help("error: can't unpack, try using --renumber-step to "
+                     "increase gaps between lines");
+        }
+        output_state = os_discard;
+        end_operation(machine);
     }
-    output_state = os_discard;
     ensure_output_file_closed();
 }
 
-void save_line_ref(void) {
-    execute_butil();
-    output_state = os_line_ref_discard_command;
-    execute_osrdch("T"); // table line references
-    output_state = os_discard;
+// Write table 'table' using xref_program(), returning false if ABE should
+// write it instead; text is handled as ABE's output would be in 'state'.
+static bool save_xref_native(struct s_machine *machine, int table,
+                             int state) {
+    uint8_t *output;
+    size_t length;
+    if (!xref_program(machine, table, config.xref_format, &output, &length)) {
+        check(config.xref_format == xref_format_text, "error: Bad program");
+        return false;
+    }
+    if (config.xref_format == xref_format_text) {
+        output_native(machine, output, length, state);
+    } else {
+        ensure_output_file_open("w");
+        check(fwrite(output, 1, length, output_file) == length,
+              "error: error writing to output file \"%s\"", filenames[1]);
+    }
+    free(output);
+    return true;
+}
+
+// JSON and CSV are only available natively.
+static bool use_native_xref(void) {
+    return (config.engine == engine_native) ||
+           (config.xref_format != xref_format_text);
+}
+
+void save_line_ref(struct s_machine *machine) {
+    if (!use_native_xref() ||
+        !save_xref_native(machine, xref_line_references,
+                          os_output_non_blank)) {
+        start_operation(machine, "listing line references", budget_xref);
+        execute_butil(machine);
+        output_state = os_line_ref_discard_command;
+        execute_osrdch(machine, "T"); // table line references
+        output_state = os_discard;
+        end_operation(machine);
+    }
     ensure_output_file_closed();
 }
 
-void save_variable_xref(void) {
-    execute_butil();
-    output_state = os_variable_xref_discard_command;
-    execute_osrdch("V"); // variable xref
-    output_state = os_discard;
+void save_variable_xref(struct s_machine *machine) {
+    if (!use_native_xref() ||
+        !save_xref_native(machine, xref_variables,
+                          os_variable_xref_output)) {
+        start_operation(machine, "listing variable references", budget_xref);
+        execute_butil(machine);
+        output_state = os_variable_xref_discard_command;
+        execute_osrdch(machine, "V"); // variable xref
+        output_state = os_discard;
+        end_operation(machine);
+    }
     ensure_output_file_closed();
 }
 
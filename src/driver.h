@@ -1,48 +1,60 @@
 #ifndef DRIVER_H
 #define DRIVER_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "emulation.h"
 
-// The emulation layer effectively forwards calls to OSWRCH onto this function.
-void driver_oswrch(uint8_t data);
+// The driver works with one emulated machine at a time; it is passed in
+// explicitly to each of the following functions, but the driver's own output
+// handling state is global so only one machine should be driven at once.
 
-// Load a BASIC program from 'filename' into the emulated machine's memory,
+// Passed to emulation_init() so that the emulation layer forwards the
+// emulated machine's output onto this function.
+void driver_oswrch(struct s_machine *machine, const uint8_t *data,
+                   size_t length);
+
+// Set as the emulated machine's 'on_error' handler so that an error in the
+// emulated machine is reported and ends the process, as we can't go on.
+void driver_error(struct s_machine *machine);
+
+// Load a BASIC program from 'filename' into the memory of 'machine',
 // tokenising it if necessary. We will auto-detect whether or not the program
 // is already tokenised, unless config.input_tokenised tells us to assume
 // it's tokenised.
-void load_basic(const char *filename);
+void load_basic(struct s_machine *machine, const char *filename);
 
-// Pack the BASIC program in the emulated machine's memory using ABE's "Pack"
+// Pack the BASIC program in the memory of 'machine' using ABE's "Pack"
 // command.
-void pack(void);
+void pack(struct s_machine *machine);
 
-// Renumber the BASIC program in the emulated machine's memory using BASIC's
+// Renumber the BASIC program in the memory of 'machine' using BASIC's
 // RENUMBER command, with arguments taken from 'config'.
-void renumber(void);
+void renumber(struct s_machine *machine);
 
-// Save the BASIC program in the emulated machine's memory to filenames[1] in
+// Save the BASIC program in the memory of 'machine' to filenames[1] in
 // tokenised format.
-void save_tokenised_basic(void);
+void save_tokenised_basic(struct s_machine *machine);
 
-// Save the BASIC program in the emulated machine's memory to filenames[1] in
+// Save the BASIC program in the memory of 'machine' to filenames[1] in
 // ASCII format, using LISTO option config.listo to control formatting.
-void save_ascii_basic(void);
+void save_ascii_basic(struct s_machine *machine);
 
-// Save the BASIC program in the emulated machine's memory to filenames[1] in
+// Save the BASIC program in the memory of 'machine' to filenames[1] in
 // ASCII format, using ABE's "format" option to print it.
-void save_formatted_basic(void);
+void save_formatted_basic(struct s_machine *machine);
 
-// Save the BASIC program in the emulated machine's memory to filenames[1] in
+// Save the BASIC program in the memory of 'machine' to filenames[1] in
 // ASCII format, using ABE's "unpack" option to print it.
-void save_unpacked_basic(void);
+void save_unpacked_basic(struct s_machine *machine);
 
 // Save the output of ABE's "Table line references" command on the BASIC
-// program in the emulated machine's memory to filenames[1].
-void save_line_ref(void);
+// program in the memory of 'machine' to filenames[1].
+void save_line_ref(struct s_machine *machine);
 
 // Save the output of ABE's "Variables Xref" command on the BASIC
-// program in the emulated machine's memory to filenames[1].
-void save_variable_xref(void);
+// program in the memory of 'machine' to filenames[1].
+void save_variable_xref(struct s_machine *machine);
 
 // vi: colorcolumn=80
 
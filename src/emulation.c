@@ -1,38 +1,23 @@
 #include "emulation.h"
 #include <assert.h>
-#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
-#include "config.h"
 #include "driver.h"
+#include "filing.h"
 #include "lib6502.h"
+#include "profile.h"
 #include "roms.h"
+#include "trace.h"
+#include "traps.h"
 #include "utils.h"
 
-static M6502_Registers mpu_registers;
-M6502_Memory mpu_memory;
-static M6502_Callbacks mpu_callbacks;
-static M6502 *mpu;
-
-// M6502_run() never returns, so we use this jmp_buf to return control when
-// the emulated machine is waiting for user input.
-static jmp_buf mpu_env;
-
-static int vdu_variables[256];
-
-static enum {
-    ms_running,
-    ms_osword_input_line_pending,
-    ms_osrdch_pending,
-} mpu_state = ms_running;
-
 // We copy transient bits of machine code to transient_code for execution; such
 // code must not JSR to anything which could in turn overwrite transient_code,
 // as the code following the JSR might have been overwritten when it returned.
-static const int transient_code = 0x900;
+static const int transient_code = 0xc000;
 // The code to invoke the ROM service handler can't live at transient_code as
 // it needs to JSR into arbitrary ROM code, so it has its own space.
-static const int service_code = 0xb00;
+static const int service_code = 0xc100;
 
 enum {
     os_text_pointer = 0xf2,
@@ -43,40 +28,117 @@ enum {
     oswrch = 0xffee
 };
 
-static void mpu_write_u16(uint16_t address, uint16_t data) {
+// HIMEM is the bottom of the sideways ROM area in both models, as BASIC runs
+// from &8000-&BFFF and reads its own tables there. A second processor's
+// PAGE=&800, HIMEM=&F800 map needs HIBASIC, assembled to run from &B800, and
+// we only have images of the ROMs assembled for &8000; a ROM can't be moved
+// without knowing which of its bytes are addresses.
+const struct s_machine_model machine_models[model_count] = {
+    {"standard", 0xe00, 0x8000},
+    {"page-800", 0x800, 0x8000}
+};
+
+// Reasons for M6502_run() to return control to us.
+enum {
+    stop_osword_input_line = M6502_StopReasons,
+    stop_osrdch,
+    stop_brk
+};
+
+// lib6502 passes callbacks the M6502 object; we gave it our machine as its
+// context when we created it.
+static struct s_machine *get_machine(M6502 *mpu) {
+    return mpu->context;
+}
+
+void mpu_os_memory_written(struct s_machine *machine, uint16_t address,
+                           size_t size) {
+    M6502_written(machine->mpu, address, size);
+}
+
+static void mpu_write_u16(struct s_machine *machine, uint16_t address,
+                          uint16_t data) {
     check(address != 0xffff, "internal error: write_u16 at top of memory");
-    mpu_memory[address    ] = data & 0xff;
-    mpu_memory[address + 1] = (data >> 8) & 0xff;
+    machine->memory[address    ] = data & 0xff;
+    machine->memory[address + 1] = (data >> 8) & 0xff;
+    mpu_os_memory_written(machine, address, 2);
 }
 
-uint16_t mpu_read_u16(uint16_t address) {
+uint16_t mpu_read_u16(const struct s_machine *machine, uint16_t address) {
     check(address != 0xffff, "internal error: read_u16 at top of memory");
-    return (mpu_memory[address + 1] << 8) | mpu_memory[address];
+    return (machine->memory[address + 1] << 8) | machine->memory[address];
+}
+
+void mpu_memory_written(struct s_machine *machine, uint16_t address,
+                        size_t size) {
+    if (machine->trace != 0) {
+        trace_memory_written(machine->trace, machine->memory, address, size);
+    }
+    mpu_os_memory_written(machine, address, size);
+}
+
+// We've just written machine code to 'address' up to (but not including)
+// 'end'.
+static void mpu_code_written(struct s_machine *machine, uint16_t address,
+                             const uint8_t *end) {
+    mpu_os_memory_written(machine, address, end - &machine->memory[address]);
+}
+
+int mpu_error(struct s_machine *machine, uint8_t number,
+              const char *message) {
+    const uint16_t code_address = transient_code;
+    uint8_t *p = &machine->memory[code_address];
+    *p++ = 0x00;                     // BRK
+    *p++ = number;                   // error code
+    strcpy((char *) p, message);     // error string and terminator
+    p += strlen(message) + 1;
+    mpu_code_written(machine, code_address, p);
+    return code_address;
+}
+
+static void mpu_clear_carry(struct s_machine *machine) {
+    machine->registers.p &= ~(1<<0);
+}
+
+// Pass any output the emulated machine has written to its owner.
+static void flush_output(struct s_machine *machine) {
+    if (machine->output_length > 0) {
+        machine->oswrch(machine, machine->output, machine->output_length);
+        machine->output_length = 0;
+    }
 }
 
-static void mpu_clear_carry(void) {
-    mpu_registers.p &= ~(1<<0);
+// Buffer 'c', written by the emulated machine, to pass to its owner.
+static void machine_output(struct s_machine *machine, uint8_t c) {
+    if (machine->trace != 0) {
+        trace_output(machine->trace, c);
+    }
+    if (machine->output_length == sizeof(machine->output)) {
+        flush_output(machine);
+    }
+    machine->output[machine->output_length++] = c;
 }
 
-static void mpu_dump(void) {
+static void mpu_dump(struct s_machine *machine) {
     char buffer[124];
-    M6502_dump(mpu, buffer);
+    M6502_dump(machine->mpu, buffer);
     fprintf(stderr, "6502 state: %s\n", buffer);
 }
 
 // Prepare to enter BASIC, returning the address of code which will actually
 // enter it.
-static uint16_t enter_basic(void) {
-    mpu_registers.a = 1; // language entry special value in A
-    mpu_registers.x = 0;
-    mpu_registers.y = 0;
+static uint16_t enter_basic(struct s_machine *machine) {
+    machine->registers.a = 1; // language entry special value in A
+    machine->registers.x = 0;
+    machine->registers.y = 0;
 
     const uint16_t code_address = transient_code;
-    uint8_t *p = &mpu_memory[code_address];
+    uint8_t *p = &machine->memory[code_address];
     *p++ = 0xa2; *p++ = bank_basic;        // LDX #bank_basic
     *p++ = 0x86; *p++ = romsel_copy;       // STX romsel_copy
     *p++ = 0x8e; *p++ = 0x30; *p++ = 0xfe; // STX &FE30
     *p++ = 0x4c; *p++ = 0x00; *p++ = 0x80; // JMP &8000 (language entry)
+    mpu_code_written(machine, code_address, p);
 
     return code_address;
 }
@@ -98,120 +160,267 @@ NORETURN static int callback_abort_write(M6502 *mpu, uint16_t address, uint8_t d
 }
 
 NORETURN static int callback_abort_call(M6502 *mpu, uint16_t address, uint8_t data) {
-    mpu_dump();
+    mpu_dump(get_machine(mpu));
     callback_abort("call", address, data);
 }
 
-// Pull an RTS-style return address (i.e. target-1) from the emulated machine's
-// stack and return the target address.
-static int pull_rts_target(void) {
-    uint16_t address = mpu_read_u16(0x101 + mpu_registers.s);
-    mpu_registers.s += 2;
+int pull_rts_target(struct s_machine *machine) {
+    uint16_t address = mpu_read_u16(machine, 0x101 + machine->registers.s);
+    machine->registers.s += 2;
     address += 1;
     return address;
 }
 
+// Called on entry to each OS routine.
+static struct s_machine *enter_os(M6502 *mpu, uint16_t address) {
+    struct s_machine *machine = get_machine(mpu);
+    machine->last_os_call = address;
+    if (machine->trace != 0) {
+        trace_os_call(machine->trace, address, &machine->registers);
+    }
+    return machine;
+}
+
+// Pass 'line' to the emulated machine as the result of the OSWORD 0 call it's
+// in, as if typed at the keyboard.
+static void accept_input_line(struct s_machine *machine, const char *line,
+                              bool echo) {
+    uint16_t yx = (machine->registers.y << 8) | machine->registers.x;
+    check(yx <= 0xff00,
+          "internal error: OSWORD 0 block is too near top of memory");
+    uint16_t buffer = mpu_read_u16(machine, yx);
+    check(buffer <= 0xff00,
+          "internal error: OSWORD 0 buffer is too near top of memory");
+    // machine->memory[yx + 2] contains the maximum line length; the buffer
+    // provided is one byte larger to hold the CR terminator.
+    int buffer_size = machine->memory[yx + 2] + 1;
+    size_t pending_length = strlen(line);
+    check(pending_length < buffer_size, "error: line too long");
+    memcpy(&machine->memory[buffer], line, pending_length);
+
+    // OSWORD 0 would echo the typed characters and move to a new line, so do
+    // the same if asked to.
+    if (echo) {
+        for (int i = 0; i < pending_length; ++i) {
+            machine_output(machine, line[i]);
+        }
+        machine_output(machine, lf); machine_output(machine, cr);
+    }
+
+    machine->memory[buffer + pending_length] = cr;
+    mpu_os_memory_written(machine, buffer, pending_length + 1);
+    machine->registers.y = pending_length;
+    mpu_clear_carry(machine); // input not terminated by Escape
+}
+
+enum {
+    queued_line = 'L',
+    queued_line_no_echo = 'l',
+    queued_osrdch = 'K'
+};
+
+static void queue_input(struct s_machine *machine, char type,
+                        const char *text, int error_line) {
+    size_t text_size = strlen(text) + 1;
+    size_t size = 1 + sizeof(error_line) + text_size;
+    if (machine->input_queue.length + size > machine->input_queue.capacity) {
+        size_t capacity = machine->input_queue.capacity;
+        capacity = (capacity > 0) ? capacity * 2 : 4096;
+        while (capacity < machine->input_queue.length + size) {
+            capacity *= 2;
+        }
+        machine->input_queue.data =
+            check_alloc(realloc(machine->input_queue.data, capacity));
+        machine->input_queue.capacity = capacity;
+    }
+    char *p = &machine->input_queue.data[machine->input_queue.length];
+    *p++ = type;
+    memcpy(p, &error_line, sizeof(error_line));
+    memcpy(p + sizeof(error_line), text, text_size);
+    machine->input_queue.length += size;
+}
+
+// If the next queued item has one of the types 'type1' and 'type2', take it,
+// returning its type and its text in *text; otherwise return 0. The text is
+// valid until more input is queued.
+static char take_queued_input(struct s_machine *machine, char type1,
+                              char type2, const char **text) {
+    if (machine->input_queue.offset == machine->input_queue.length) {
+        return 0;
+    }
+    char *p = &machine->input_queue.data[machine->input_queue.offset];
+    char type = *p++;
+    if ((type != type1) && (type != type2)) {
+        return 0;
+    }
+    memcpy(&error_line_number, p, sizeof(error_line_number));
+    *text = p + sizeof(error_line_number);
+    machine->input_queue.offset += 1 + sizeof(error_line_number) +
+                                   strlen(*text) + 1;
+    if (machine->input_queue.offset == machine->input_queue.length) {
+        // The text stays where it is until more input is queued.
+        machine->input_queue.offset = machine->input_queue.length = 0;
+    }
+    return type;
+}
+
+// If the next queued input is a line, pass it to the emulated machine as the
+// result of the OSWORD 0 call it's in and return true.
+static bool take_queued_input_line(struct s_machine *machine) {
+    const char *line;
+    char type = take_queued_input(machine, queued_line, queued_line_no_echo,
+                                  &line);
+    if (type == 0) {
+        return false;
+    }
+    if (machine->trace != 0) {
+        trace_input_line(machine->trace, line, type == queued_line);
+    }
+    accept_input_line(machine, line, type == queued_line);
+    return true;
+}
+
+// If the next queued input is a keypress, return it from the OSRDCH call the
+// emulated machine is in and return true.
+static bool take_queued_osrdch(struct s_machine *machine) {
+    const char *s;
+    if (take_queued_input(machine, queued_osrdch, queued_osrdch, &s) == 0) {
+        return false;
+    }
+    if (machine->trace != 0) {
+        trace_osrdch(machine->trace, s[0]);
+    }
+    machine->registers.a = s[0];
+    mpu_clear_carry(machine); // no error
+    return true;
+}
+
 static int callback_osrdch(M6502 *mpu, uint16_t address, uint8_t data) {
-    mpu_state = ms_osrdch_pending;
-    longjmp(mpu_env, 1);
+    struct s_machine *machine = enter_os(mpu, address);
+    uint8_t c;
+    if ((machine->filing_system != 0) &&
+        filing_exec_read(machine->filing_system, &c)) {
+        machine->registers.a = c;
+        mpu_clear_carry(machine); // no error
+        return pull_rts_target(machine);
+    }
+    if (take_queued_osrdch(machine)) {
+        return pull_rts_target(machine);
+    }
+    M6502_stop(mpu, stop_osrdch);
+    return 0;
 }
 
 static int callback_oswrch(M6502 *mpu, uint16_t address, uint8_t data) {
-    driver_oswrch(mpu_registers.a);
-    return pull_rts_target();
+    struct s_machine *machine = enter_os(mpu, address);
+    machine_output(machine, machine->registers.a);
+    return pull_rts_target(machine);
 }
 
 static int callback_osnewl(M6502 *mpu, uint16_t address, uint8_t data) {
-    driver_oswrch(lf);
-    driver_oswrch(cr);
-    return pull_rts_target();
+    struct s_machine *machine = enter_os(mpu, address);
+    machine_output(machine, lf);
+    machine_output(machine, cr);
+    return pull_rts_target(machine);
 }
 
 static int callback_osasci(M6502 *mpu, uint16_t address, uint8_t data) {
-    if (mpu_registers.a == cr) {
+    if (enter_os(mpu, address)->registers.a == cr) {
         return callback_osnewl(mpu, address, data);
     } else {
         return callback_oswrch(mpu, address, data);
     }
 }
 
-static int callback_osbyte_return_x(uint8_t x) {
-    mpu_registers.x = x;
-    return pull_rts_target();
+static int callback_osbyte_return_x(struct s_machine *machine, uint8_t x) {
+    machine->registers.x = x;
+    return pull_rts_target(machine);
 }
 
-static int callback_osbyte_return_u16(uint16_t value) {
-    mpu_registers.x = value & 0xff;
-    mpu_registers.y = (value >> 8) & 0xff;
-    return pull_rts_target();
+static int callback_osbyte_return_u16(struct s_machine *machine,
+                                      uint16_t value) {
+    machine->registers.x = value & 0xff;
+    machine->registers.y = (value >> 8) & 0xff;
+    return pull_rts_target(machine);
 }
 
-static int callback_osbyte_read_vdu_variable(void) {
-    uint8_t i = mpu_registers.x;
-    if (vdu_variables[i] == -1) {
-        mpu_dump();
+static int callback_osbyte_read_vdu_variable(struct s_machine *machine) {
+    uint8_t i = machine->registers.x;
+    if (machine->vdu_variables[i] == -1) {
+        mpu_dump(machine);
         die("internal error: unsupported VDU variable %d read", i);
     }
     uint8_t j = i + 1; // use uint8_t intermediate so we wrap around (unlikely)
-    if (vdu_variables[j] == -1) {
-        mpu_dump();
+    if (machine->vdu_variables[j] == -1) {
+        mpu_dump(machine);
         die("internal error: unsupported VDU variable %d read", j);
     }
-    mpu_registers.x = vdu_variables[i];
-    mpu_registers.y = vdu_variables[j];
-    return pull_rts_target();
+    machine->registers.x = machine->vdu_variables[i];
+    machine->registers.y = machine->vdu_variables[j];
+    return pull_rts_target(machine);
 }
 
 static int callback_osbyte(M6502 *mpu, uint16_t address, uint8_t data) {
-    switch (mpu_registers.a) {
+    struct s_machine *machine = enter_os(mpu, address);
+    switch (machine->registers.a) {
         case 0x03: // select output device
-            return pull_rts_target(); // treat as no-op
+            return pull_rts_target(machine); // treat as no-op
         case 0x0f: // flush buffers
-            return pull_rts_target(); // treat as no-op
+            return pull_rts_target(machine); // treat as no-op
         case 0x7c: // clear Escape condition
-            return pull_rts_target(); // treat as no-op
+            return pull_rts_target(machine); // treat as no-op
         case 0x7e: // acknowledge Escape condition
-            return callback_osbyte_return_x(0); // no Escape condition pending
+            // no Escape condition pending
+            return callback_osbyte_return_x(machine, 0);
+        case 0x7f: // check for end of file
+            if (machine->filing_system == 0) {
+                break;
+            }
+            return filing_osbyte_eof(machine);
+        case 0x82: // read machine high order address
+            // We are the I/O processor.
+            return callback_osbyte_return_u16(machine, 0xffff);
         case 0x83: // read OSHWM
-            return callback_osbyte_return_u16(page);
+            return callback_osbyte_return_u16(machine, machine->model->page);
         case 0x84: // read HIMEM
-            return callback_osbyte_return_u16(himem);
+            return callback_osbyte_return_u16(machine, machine->model->himem);
         case 0x86: // read text cursor position
             // We just return with X=Y=0; this is good enough in practice.
-            return callback_osbyte_return_u16(0);
+            return callback_osbyte_return_u16(machine, 0);
         case 0x8a: // place character into buffer
             // ABE uses this to type "OLD<cr>" when re-entering BASIC. It might
             // be nice to emulate this properly, but it also seems silly to
             // complicate the I/O emulation further when we can simply do this
             // explicitly.
-            return pull_rts_target(); // treat as no-op
+            return pull_rts_target(machine); // treat as no-op
         case 0xa0:
-            return callback_osbyte_read_vdu_variable();
-        default:
-            mpu_dump();
-            die("internal error: unsupported OSBYTE");
+            return callback_osbyte_read_vdu_variable(machine);
     }
+    mpu_dump(machine);
+    die("internal error: unsupported OSBYTE");
 }
 
 static int callback_oscli(M6502 *mpu, uint16_t address, uint8_t data) {
-    uint16_t yx = (mpu_registers.y << 8) | mpu_registers.x;
+    struct s_machine *machine = enter_os(mpu, address);
+    uint16_t yx = (machine->registers.y << 8) | machine->registers.x;
     // The following case is never going to happen in practice, so let's just
     // explicitly check for it then we don't have to worry about wrapping or
-    // accessing past the end of mpu_memory in the following code.
+    // accessing past the end of memory in the following code.
     check(yx <= 0xff00,
           "internal error: command tail is too near top of memory");
 
-    mpu_memory[os_text_pointer    ] = mpu_registers.x;
-    mpu_memory[os_text_pointer + 1] = mpu_registers.y;
+    machine->memory[os_text_pointer    ] = machine->registers.x;
+    machine->memory[os_text_pointer + 1] = machine->registers.y;
+    mpu_os_memory_written(machine, os_text_pointer, 2);
 
     // Because our ROMSEL implementation will treat it as an error to page in
     // an empty bank, the following code only works with ABE in banks 0 and 1.
     // This could be changed if necessary.
     assert(bank_editor_a == 0);
     assert(bank_editor_b == 1);
-    mpu_registers.a = 4; // unrecognised * command
-    mpu_registers.x = bank_editor_b; // first ROM bank to try
-    mpu_registers.y = 0; // command tail offset
+    machine->registers.a = 4; // unrecognised * command
+    machine->registers.x = bank_editor_b; // first ROM bank to try
+    machine->registers.y = 0; // command tail offset
 
     // It's tempting to implement a "mini OS" in assembler which would replace
     // the following mixture of C and machine code, as well as other fragments
@@ -222,20 +431,31 @@ static int callback_oscli(M6502 *mpu, uint16_t address, uint8_t data) {
 
     // Skip leading "*"s on the command; this is essential to have it
     // recognised properly (as that's what the real OS does).
-    while (mpu_memory[yx + mpu_registers.y] == '*') {
-        ++mpu_registers.y;
+    // The command may be in a ROM (e.g. ABE issues "*BASIC" to re-enter
+    // BASIC), so we must read it via lib6502's view of memory.
+    while (M6502_read(mpu, yx + machine->registers.y) == '*') {
+        ++machine->registers.y;
         // Y is very unlikely to wrap wround, but be paranoid.
-        check(mpu_registers.y != 0, "internal error: too many *s on OSCLI");
+        check(machine->registers.y != 0,
+              "internal error: too many *s on OSCLI");
     }
 
     // This isn't case-insensitive and doesn't recognise abbreviations, but
     // in practice it's good enough.
-    if (memcmp((char *) &mpu_memory[yx + mpu_registers.y], "BASIC", 5) == 0) {
-        return enter_basic();
+    char command[5];
+    for (int i = 0; i < sizeof(command); ++i) {
+        command[i] = M6502_read(mpu, yx + machine->registers.y + i);
+    }
+    if (memcmp(command, "BASIC", 5) == 0) {
+        return enter_basic(machine);
+    }
+    if ((machine->filing_system != 0) && (memcmp(command, "EXEC", 4) == 0) &&
+        ((command[4] == ' ') || (command[4] == cr))) {
+        return filing_exec(machine, yx + machine->registers.y + 4);
     }
 
     const uint16_t code_address = service_code;
-    uint8_t *p = &mpu_memory[code_address];
+    uint8_t *p = &machine->memory[code_address];
                                            // .loop
     *p++ = 0x86; *p++ = romsel_copy;       // STX romsel_copy
     *p++ = 0x8e; *p++ = 0x30; *p++ = 0xfe; // STX &FE30
@@ -250,223 +470,467 @@ static int callback_oscli(M6502 *mpu, uint16_t address, uint8_t data) {
     *p++ = 0x00;                           // BRK
     *p++ = 0xfe;                           // error code
     strcpy((char *) p, "Bad command");     // error string and terminator
-    
+    mpu_code_written(machine, code_address, p);
+
     return code_address;
 }
 
-static int callback_osword_input_line(void) {
-    mpu_state = ms_osword_input_line_pending;
-    longjmp(mpu_env, 1);
+static int callback_osword_input_line(struct s_machine *machine) {
+    // *EXEC and queued input are taken at once, without returning to the
+    // host.
+    char line[256];
+    if ((machine->filing_system != 0) &&
+        filing_exec_line(machine->filing_system, line, sizeof(line))) {
+        accept_input_line(machine, line, true);
+        return pull_rts_target(machine);
+    }
+    if (take_queued_input_line(machine)) {
+        return pull_rts_target(machine);
+    }
+    M6502_stop(machine->mpu, stop_osword_input_line);
+    return 0;
 }
 
-static int callback_osword_read_io_memory(void) {
+static int callback_osword_read_io_memory(struct s_machine *machine) {
     // We do this access via dynamically generated code so we don't bypass any
     // lib6502 callbacks.
-    uint16_t yx = (mpu_registers.y << 8) | mpu_registers.x;
-    uint16_t src = mpu_read_u16(yx);
+    uint16_t yx = (machine->registers.y << 8) | machine->registers.x;
+    uint16_t src = mpu_read_u16(machine, yx);
     uint16_t dest = yx + 4;
     const uint16_t code_address = transient_code;
-    uint8_t *p = &mpu_memory[code_address];
+    uint8_t *p = &machine->memory[code_address];
     *p++ = 0xad; *p++ = src & 0xff; *p++ = (src >> 8) & 0xff;   // LDA src
     *p++ = 0x8d; *p++ = dest & 0xff; *p++ = (dest >> 8) & 0xff; // STA dest
     *p++ = 0x60;                                                // RTS
+    mpu_code_written(machine, code_address, p);
     return code_address;
 }
 
 static int callback_osword(M6502 *mpu, uint16_t address, uint8_t data) {
-    switch (mpu_registers.a) {
+    struct s_machine *machine = enter_os(mpu, address);
+    switch (machine->registers.a) {
         case 0x00: // input line
-            return callback_osword_input_line();
+            return callback_osword_input_line(machine);
         case 0x05: // read I/O processor memory
-            return callback_osword_read_io_memory();
+            return callback_osword_read_io_memory(machine);
         default:
-            mpu_dump();
+            mpu_dump(machine);
             die("internal error: unsupported OSWORD");
     }
 }
 
+// Called on entry to each filing system OS routine; these are only
+// implemented if the machine has a filing system.
+static struct s_machine *enter_filing_os(M6502 *mpu, uint16_t address,
+                                         uint8_t data) {
+    struct s_machine *machine = enter_os(mpu, address);
+    if (machine->filing_system == 0) {
+        callback_abort_call(mpu, address, data);
+    }
+    return machine;
+}
+
+static int callback_osfile(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osfile(enter_filing_os(mpu, address, data));
+}
+
+static int callback_osfind(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osfind(enter_filing_os(mpu, address, data));
+}
+
+static int callback_osgbpb(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osgbpb(enter_filing_os(mpu, address, data));
+}
+
+static int callback_osbput(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osbput(enter_filing_os(mpu, address, data));
+}
+
+static int callback_osbget(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osbget(enter_filing_os(mpu, address, data));
+}
+
+static int callback_osargs(M6502 *mpu, uint16_t address, uint8_t data) {
+    return filing_osargs(enter_filing_os(mpu, address, data));
+}
+
 static int callback_read_escape_flag(M6502 *mpu, uint16_t address,
                                      uint8_t data) {
     return 0; // Escape flag not set
 }
 
 static int callback_romsel_write(M6502 *mpu, uint16_t address, uint8_t data) {
-    uint8_t *rom_start = &mpu_memory[0x8000];
+    struct s_machine *machine = get_machine(mpu);
+    const uint8_t *rom;
     switch (data) {
         case bank_editor_a:
-            memcpy(rom_start, rom_editor_a, rom_size);
+            rom = rom_editor_a;
             break;
         case bank_editor_b:
-            memcpy(rom_start, rom_editor_b, rom_size);
+            rom = rom_editor_b;
             break;
         case bank_basic:
-            check(config.basic_version != -1,
+            check(machine->basic_version != -1,
                   "internal error: no BASIC version selected");
-            memcpy(rom_start, rom_basic[config.basic_version], rom_size);
+            rom = rom_basic[machine->basic_version];
             break;
         default:
             die("internal error: invalid ROM bank %d selected", data);
             break;
     }
+    // Rather than copying the ROM into memory, we point the emulated CPU's
+    // view of the sideways ROM area at the (read-only) ROM image.
+    if (machine->trace != 0) {
+        trace_romsel(machine->trace, data);
+    }
+    M6502_mapMemory(mpu, 0x8000, rom_size, rom);
+    ++machine->romsel_writes;
     return 0; // return value ignored
 }
 
 static int callback_irq(M6502 *mpu, uint16_t address, uint8_t data) {
     // The only possible cause of an interrupt on our emulated machine is a BRK
-    // instruction.
-    uint16_t error_string_ptr = mpu_read_u16(0x102 + mpu_registers.s);
-    mpu_registers.s += 2; // not really necessary, as we're about to exit()
-    uint16_t error_num_address = error_string_ptr - 1;
-    print_error_prefix();
-    fprintf(stderr, "error: ");
-    for (uint8_t c; (c = mpu_memory[error_string_ptr]) != '\0';
+    // instruction. We don't resume after one, so S is left alone.
+    struct s_machine *machine = get_machine(mpu);
+    uint16_t error_string_ptr =
+        mpu_read_u16(machine, 0x102 + machine->registers.s);
+    // The error block is usually in ROM, so we must read it via lib6502.
+    machine->error.number = M6502_read(mpu, error_string_ptr - 1);
+    size_t length = 0;
+    for (uint8_t c; (c = M6502_read(mpu, error_string_ptr)) != '\0';
          ++error_string_ptr) {
-        putc(c, stderr);
+        if (length + 1 < sizeof(machine->error.message)) {
+            machine->error.message[length++] = c;
+        }
     }
-    uint8_t error_num = mpu_memory[error_num_address];
-    fprintf(stderr, " (%d)\n", error_num);
-    exit(EXIT_FAILURE);
+    machine->error.message[length] = '\0';
+    M6502_stop(mpu, stop_brk);
+    return 0;
 }
 
 static void callback_poll(M6502 *mpu) {
 }
 
-static void set_abort_callback(uint16_t address) {
-    M6502_setCallback(mpu, read,  address, callback_abort_read);
-    M6502_setCallback(mpu, write, address, callback_abort_write);
+// The OS callbacks are the same for every machine, so they're built at
+// compile time and shared; nothing is allocated or filled in at startup. The
+// REPEAT* macros fill a range of a page with one handler, and later
+// designated initialisers override individual entries within it.
+#define REPEAT4(x) x, x, x, x
+#define REPEAT16(x) REPEAT4(x), REPEAT4(x), REPEAT4(x), REPEAT4(x)
+#define REPEAT64(x) REPEAT16(x), REPEAT16(x), REPEAT16(x), REPEAT16(x)
+#define REPEAT256(x) REPEAT64(x), REPEAT64(x), REPEAT64(x), REPEAT64(x)
+
+// Abort on read or write of anywhere in OS workspace we haven't explicitly
+// allowed; this makes it more obvious if the OS emulation needs to be
+// extended. Addresses 0x90-0xaf are part of OS workspace which we allow
+// access to; they're omitted to save listing each of them as supported.
+// os_text_pointer, romsel_copy and the error pointer at &FD/&FE are supported
+// as far as necessary. Since we don't have an actual Escape handler, any read
+// from &FF just returns 0.
+#define ZERO_PAGE_CALLBACKS(handler) \
+    [0xb0] = REPEAT16(handler), REPEAT64(handler), \
+    [os_text_pointer] = 0, 0, \
+    [romsel_copy] = 0, \
+    [0xfd] = 0, 0
+
+static const M6502_CallbackPage read_page_00 = {
+    ZERO_PAGE_CALLBACKS(callback_abort_read),
+    [0xff] = callback_read_escape_flag
+};
+
+static const M6502_CallbackPage write_page_00 = {
+    ZERO_PAGE_CALLBACKS(callback_abort_write)
+};
+
+// Trap access to unimplemented OS vectors.
+#define VECTOR_PAGE_CALLBACKS(handler) \
+    [0x00] = REPEAT16(handler), REPEAT16(handler), REPEAT16(handler), \
+    REPEAT4(handler), handler, handler, \
+    [brkv & 0xff] = 0, 0, \
+    [wrchv & 0xff] = 0, 0
+
+static const M6502_CallbackPage read_page_02 = {
+    VECTOR_PAGE_CALLBACKS(callback_abort_read)
+};
+
+static const M6502_CallbackPage write_page_02 = {
+    VECTOR_PAGE_CALLBACKS(callback_abort_write)
+};
+
+// Hardware ROM paging emulation.
+static const M6502_CallbackPage write_page_fe = {
+    [0x30] = callback_romsel_write
+};
+
+// Handlers for OS entry points, using a default for unimplemented ones. The
+// interrupt handler lets us catch BRK.
+static const M6502_CallbackPage call_page_abort = {
+    REPEAT256(callback_abort_call)
+};
+
+static const M6502_CallbackPage call_page_f0 = {
+    REPEAT256(callback_abort_call),
+    [fake_irq_handler & 0xff] = callback_irq
+};
+
+static const M6502_CallbackPage call_page_ff = {
+    REPEAT256(callback_abort_call),
+    [0xce] = callback_osfind,
+    [0xd1] = callback_osgbpb,
+    [0xd4] = callback_osbput,
+    [0xd7] = callback_osbget,
+    [0xda] = callback_osargs,
+    [0xdd] = callback_osfile,
+    [0xe0] = callback_osrdch,
+    [0xe3] = callback_osasci,
+    [0xe7] = callback_osnewl,
+    [oswrch & 0xff] = callback_oswrch,
+    [0xf1] = callback_osword,
+    [0xf4] = callback_osbyte,
+    [0xf7] = callback_oscli
+};
+
+#define PAGE_BIT M6502_PageBit
+
+static const M6502_Callbacks os_callbacks = {
+    .read = {
+        .used = {[0] = PAGE_BIT(0x00) | PAGE_BIT(0x02)},
+        .page = {[0x00] = &read_page_00, [0x02] = &read_page_02}
+    },
+    .write = {
+        .used = {
+            [0] = PAGE_BIT(0x00) | PAGE_BIT(0x02),
+            [0xfe >> 5] = PAGE_BIT(0xfe)
+        },
+        .page = {
+            [0x00] = &write_page_00,
+            [0x02] = &write_page_02,
+            [0xfe] = &write_page_fe
+        }
+    },
+    .call = {
+        .used = {[0xc0 >> 5] = 0xffffffff, [0xe0 >> 5] = 0xffffffff},
+        .page = {
+            [0xc0] = REPEAT16(&call_page_abort), REPEAT16(&call_page_abort),
+            REPEAT16(&call_page_abort),
+            [0xf0] = &call_page_f0,
+            REPEAT4(&call_page_abort), REPEAT4(&call_page_abort),
+            REPEAT4(&call_page_abort), &call_page_abort, &call_page_abort,
+            [0xff] = &call_page_ff
+        }
+    }
+};
+
+#undef PAGE_BIT
+
+// Run the emulated machine until it waits for input.
+static void mpu_run(struct s_machine *machine) {
+    machine->state = ms_running;
+    int stop = (machine->profile != 0) ?
+        profile_run(machine->profile, machine->mpu, machine->operation) :
+        M6502_run(machine->mpu, callback_poll);
+    flush_output(machine);
+    switch (stop) {
+        case stop_osword_input_line:
+            machine->state = ms_osword_input_line_pending;
+            break;
+        case stop_osrdch:
+            machine->state = ms_osrdch_pending;
+            break;
+        case stop_brk:
+            machine->state = ms_error;
+            if (machine->on_error != 0) {
+                machine->on_error(machine);
+            }
+            break;
+        case M6502_OutOfBudget:
+            mpu_dump(machine);
+            fprintf(stderr, "6502 budget: ran %lld instructions, last OS call "
+                    "&%04X\n", (long long) emulation_budget_used(machine),
+                    machine->last_os_call);
+            die("error: %s took more than %lld 6502 instructions",
+                machine->operation, (long long) machine->budget);
+        default:
+            mpu_dump(machine);
+            die("internal error: undefined instruction");
+    }
 }
 
-static void mpu_run() {
-    if (setjmp(mpu_env) == 0) {
-        mpu_state = ms_running;
-        M6502_run(mpu, callback_poll); // returns only via longjmp(mpu_env)
+// Start 'machine' from 'snapshot' instead of booting it; the result is just as
+// if emulation_init() had booted it, including the output.
+static void restore_snapshot(struct s_machine *machine,
+                             const struct s_snapshot *snapshot) {
+    for (size_t i = 0; i < snapshot->page_count; ++i) {
+        memcpy(&machine->memory[snapshot->page_numbers[i] << 8],
+               snapshot->pages[i], 256);
+    }
+    machine->registers = snapshot->registers;
+    machine->state = snapshot->state;
+    machine->romsel_writes = snapshot->romsel_writes;
+    M6502_mapMemory(machine->mpu, 0x8000, rom_size,
+                    rom_basic[machine->basic_version]);
+    if (snapshot->output_length > 0) {
+        machine->oswrch(machine, snapshot->output, snapshot->output_length);
     }
 }
 
-void emulation_init(void) {
-    mpu = check_alloc(M6502_new(&mpu_registers, mpu_memory, &mpu_callbacks));
-    M6502_reset(mpu);
-    
-    // Install handlers to abort on read or write of anywhere in OS workspace
-    // we haven't explicitly allowed; this makes it more obvious if the OS
-    // emulation needs to be extended. Addresses 0x90-0xaf are part of OS
-    // workspace which we allow access to; they're omitted from the loop to
-    // save writing case statements for each of them.
-    for (uint16_t address = 0xb0; address < 0x100; ++address) {
-        switch (address) {
-            case os_text_pointer:
-            case os_text_pointer + 1:
-            case romsel_copy:
-            case 0xfd: // error pointer
-            case 0xfe: // error pointer
-                // Supported as far as necessary, don't install a handler.
-                break;
+void emulation_init(struct s_machine *machine, int model, int basic_version,
+                    machine_oswrch_fn oswrch_handler,
+                    unsigned int mpu_flags) {
+    assert(oswrch_handler != 0);
+    assert((model >= 0) && (model < model_count));
+    assert((basic_version >= 0) && (basic_version < basic_count));
+    memset(machine->memory, 0, sizeof(machine->memory));
+    memset(&machine->registers, 0, sizeof(machine->registers));
+    machine->model = &machine_models[model];
+    machine->basic_version = basic_version;
+    machine->oswrch = oswrch_handler;
+    machine->output_length = 0;
+    machine->romsel_writes = 0;
+    machine->trap_mode = traps_off;
+    machine->last_os_call = 0;
+    machine->profile = 0;
+    machine->trace = 0;
+    machine->filing_system = 0;
+    machine->on_error = 0;
+    machine->input_queue.data = 0;
+    machine->input_queue.length = machine->input_queue.capacity = 0;
+    machine->input_queue.offset = 0;
+    M6502 *mpu = check_alloc(M6502_new(&machine->registers, machine->memory,
+                                       &os_callbacks, mpu_flags, machine));
+    machine->mpu = mpu;
+    emulation_set_budget(machine, "booting", M6502_NoBudget);
 
-            default:
-                set_abort_callback(address);
-                break;
-        }
+    // Set up VDU variables.
+    for (int i = 0; i < 256; ++i) {
+        machine->vdu_variables[i] = -1;
     }
+    machine->vdu_variables[0x55] = 7; // screen mode
+    machine->vdu_variables[0x56] = 4; // memory map type: 1K mode
 
-    // Trap access to unimplemented OS vectors.
-    for (uint16_t address = 0x200; address < 0x236; ++address) {
-        switch (address) {
-            case brkv:
-            case brkv + 1:
-            case wrchv:
-            case wrchv + 1:
-                // Supported as far as necessary, don't install a handler.
-                break;
-            default:
-                set_abort_callback(address);
-                break;
-        }
+    if ((model == model_standard) && (boot_snapshots[basic_version] != 0)) {
+        restore_snapshot(machine, boot_snapshots[basic_version]);
+        return;
     }
 
-    // Install handlers for OS entry points, using a default for unimplemented
-    // ones.
-    for (uint16_t address = 0xc000; address != 0; ++address) {
-        M6502_setCallback(mpu, call, address, callback_abort_call);
-    }
-    M6502_setCallback(mpu, call, 0xffe0, callback_osrdch);
-    M6502_setCallback(mpu, call, 0xffe3, callback_osasci);
-    M6502_setCallback(mpu, call, 0xffe7, callback_osnewl);
-    M6502_setCallback(mpu, call, oswrch, callback_oswrch);
-    M6502_setCallback(mpu, call, 0xfff1, callback_osword);
-    M6502_setCallback(mpu, call, 0xfff4, callback_osbyte);
-    M6502_setCallback(mpu, call, 0xfff7, callback_oscli);
+    M6502_reset(mpu);
 
     // Install fake OS vectors. Because of the way our implementation works,
     // these vectors actually point to the official entry points.
-    mpu_write_u16(wrchv, oswrch);
+    mpu_write_u16(machine, wrchv, oswrch);
 
-    // Since we don't have an actual Escape handler, just ensure any read from
-    // &ff always returns 0.
-    M6502_setCallback(mpu, read, 0xff, callback_read_escape_flag);
-
-    // Install handler for hardware ROM paging emulation.
-    M6502_setCallback(mpu, write, 0xfe30, callback_romsel_write);
-
-    // Install interrupt handler so we can catch BRK.
+    // Point the IRQ vector at our fake interrupt handler so we can catch BRK.
     M6502_setVector(mpu, IRQ, fake_irq_handler);
-    M6502_setCallback(mpu, call, fake_irq_handler, callback_irq);
 
-    // Set up VDU variables.
-    for (int i = 0; i < 256; ++i) {
-        vdu_variables[i] = -1;
+    machine->registers.s = 0xff;
+    machine->registers.pc = enter_basic(machine);
+    mpu_run(machine);
+}
+
+void emulation_set_budget(struct s_machine *machine, const char *operation,
+                          int64_t instructions) {
+    if (machine->trace != 0) {
+        trace_operation(machine->trace, operation, instructions);
     }
-    vdu_variables[0x55] = 7; // screen mode
-    vdu_variables[0x56] = 4; // memory map type: 1K mode
+    machine->operation = operation;
+    machine->budget = instructions;
+    machine->mpu->budget = instructions;
+}
+
+int64_t emulation_budget_used(const struct s_machine *machine) {
+    return machine->budget - machine->mpu->budget;
+}
+
+void emulation_snapshot(struct s_machine *machine,
+                        struct s_machine_snapshot *snapshot) {
+    check(machine->state != ms_running,
+          "internal error: can't snapshot a running machine");
+    memcpy(snapshot->memory, machine->memory, sizeof(machine->memory));
+    snapshot->registers = machine->registers;
+    snapshot->state = machine->state;
+    snapshot->romsel_writes = machine->romsel_writes;
+    snapshot->rom = machine->mpu->pages[0x80];
+    memset(machine->mpu->dirty, 0, sizeof(machine->mpu->dirty));
+}
 
-    mpu_registers.s = 0xff;
-    mpu_registers.pc = enter_basic();
-    mpu_run();
+void emulation_restore(struct s_machine *machine,
+                       const struct s_machine_snapshot *snapshot) {
+    M6502 *mpu = machine->mpu;
+    // Zero page and the stack aren't tracked, so they're always copied.
+    mpu->dirty[0x00] = mpu->dirty[0x01] = 1;
+    for (int page = 0; page < 0x100; ++page) {
+        if (mpu->dirty[page]) {
+            memcpy(&machine->memory[page << 8], &snapshot->memory[page << 8],
+                   256);
+            // This discards any code translated from the page.
+            M6502_written(mpu, page << 8, 256);
+        }
+    }
+    memset(mpu->dirty, 0, sizeof(mpu->dirty));
+    machine->registers = snapshot->registers;
+    machine->state = snapshot->state;
+    machine->romsel_writes = snapshot->romsel_writes;
+    M6502_mapMemory(mpu, 0x8000, rom_size, snapshot->rom);
+    if (machine->filing_system != 0) {
+        filing_system_reset(machine->filing_system);
+    }
 }
 
-void execute_osrdch(const char *s) {
+void execute_osrdch(struct s_machine *machine, const char *s) {
     // We could in principle handle a multiple character string by returning
     // the values automatically over multiple OSRDCH calls, but we don't need
     // this at the moment.
     assert(s != 0);
     check(strlen(s) == 1,
           "internal error: attempt to return multiple characters from OSRDCH");
-    check(mpu_state == ms_osrdch_pending,
+    check(machine->state == ms_osrdch_pending,
           "internal error: emulated machine isn't waiting for OSRDCH");
-    mpu_registers.a = s[0];
-    mpu_clear_carry(); // no error
-    mpu_registers.pc = pull_rts_target();
-    mpu_run();
+    if (machine->trace != 0) {
+        trace_osrdch(machine->trace, s[0]);
+    }
+    machine->registers.a = s[0];
+    mpu_clear_carry(machine); // no error
+    machine->registers.pc = pull_rts_target(machine);
+    mpu_run(machine);
 } 
 
-void execute_input_line(const char *line) {
+void execute_input_line(struct s_machine *machine, const char *line) {
     assert(line != 0);
-    check(mpu_state == ms_osword_input_line_pending,
+    check(machine->state == ms_osword_input_line_pending,
           "internal error: emulated machine isn't waiting for OSWORD 0");
-    uint16_t yx = (mpu_registers.y << 8) | mpu_registers.x;
-    check(yx <= 0xff00,
-          "internal error: OSWORD 0 block is too near top of memory");
-    uint16_t buffer = mpu_read_u16(yx);
-    check(buffer <= 0xff00,
-          "internal error: OSWORD 0 buffer is too near top of memory");
-    // mpu_memory[yx + 2] contains the maximum line length; the buffer provided
-    // is one byte larger to hold the CR terminator.
-    int buffer_size = mpu_memory[yx + 2] + 1;
-    size_t pending_length = strlen(line);
-    check(pending_length < buffer_size, "error: line too long");
-    memcpy(&mpu_memory[buffer], line, pending_length);
-
-    // OSWORD 0 would echo the typed characters and move to a new line, so do
-    // the same.
-    for (int i = 0; i < pending_length; ++i) {
-        driver_oswrch(line[i]);
+    if (machine->trace != 0) {
+        trace_input_line(machine->trace, line, true);
     }
-    driver_oswrch(lf); driver_oswrch(cr);
+    accept_input_line(machine, line, true);
+    machine->registers.pc = pull_rts_target(machine);
+    mpu_run(machine);
+}
+
+void emulation_queue_input_line(struct s_machine *machine, const char *line,
+                                bool echo, int error_line) {
+    assert(line != 0);
+    queue_input(machine, echo ? queued_line : queued_line_no_echo, line,
+                error_line);
+}
 
-    mpu_memory[buffer + pending_length] = cr;
-    mpu_registers.y = pending_length;
-    mpu_clear_carry(); // input not terminated by Escape
-    mpu_registers.pc = pull_rts_target();
-    mpu_run();
+void emulation_queue_osrdch(struct s_machine *machine, char c) {
+    char s[2] = {c, '\0'};
+    queue_input(machine, queued_osrdch, s, error_line_number);
+}
+
+void emulation_run_queue(struct s_machine *machine) {
+    bool taken = false;
+    if (machine->state == ms_osword_input_line_pending) {
+        taken = take_queued_input_line(machine);
+    } else if (machine->state == ms_osrdch_pending) {
+        taken = take_queued_osrdch(machine);
+    }
+    check(taken, "internal error: emulated machine isn't waiting for the "
+          "queued input");
+    machine->registers.pc = pull_rts_target(machine);
+    mpu_run(machine);
+    check(machine->input_queue.length == 0,
+          "internal error: emulated machine didn't take all its queued input");
 }
 
 // vi: colorcolumn=80
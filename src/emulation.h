@@ -1,21 +1,207 @@
 #ifndef EMULATION_H
 #define EMULATION_H
 
+#include <stdbool.h>
 #include "lib6502.h"
+#include "roms.h"
 
-static const uint16_t page = 0xe00;
-static const uint16_t himem = 0x8000;
+// The memory maps the emulated machine can have, which set the space available
+// for a BASIC program.
+enum {
+    model_standard, // PAGE=&E00, as on a BBC Master
+    model_page_800, // PAGE=&800, with HIMEM still at &8000
+    model_count
+};
 
+struct s_machine_model {
+    const char *name;
+    uint16_t page;  // OSHWM, where BASIC programs start
+    uint16_t himem; // top of memory available to BASIC
+};
+
+extern const struct s_machine_model machine_models[model_count];
+
+struct s_filing_system;
+struct s_machine;
+struct s_profile;
+struct s_trace;
+
+// Function called with the characters the emulated machine writes via OSWRCH,
+// OSASCI and OSNEWL. They're collected in the machine's output buffer and
+// passed on in batches, whenever it fills up and before the machine stops to
+// wait for input or exits with an error.
+typedef void (*machine_oswrch_fn)(struct s_machine *machine,
+                                  const uint8_t *data, size_t length);
+
+// Function called when the emulated machine stops with an error; see
+// s_machine's 'on_error'.
+typedef void (*machine_error_fn)(struct s_machine *machine);
+
+// All the state of one emulated machine. There is no global emulation state,
+// so any number of these can exist side by side in the same process.
+//
 // Code outside the emulation is free to read/write the emulated machine's
-// memory directly.
-extern M6502_Memory mpu_memory;
+// memory directly, as long as it calls mpu_memory_written() after writing;
+// the other members should be treated as private to emulation.c.
+struct s_machine {
+    M6502_Memory memory;
+    M6502_Registers registers;
+    M6502 *mpu;
+
+    enum {
+        ms_running,
+        ms_osword_input_line_pending,
+        ms_osrdch_pending,
+        ms_error // stopped at a BRK; see 'error'
+    } state;
+
+    // The error the machine stopped with when 'state' is ms_error.
+    struct {
+        uint8_t number;
+        char message[256];
+    } error;
+
+    // If not null, this is called when the machine stops with an error,
+    // after which whatever was running it returns. Nothing else stops the
+    // process, so one machine's error leaves any others alone; the machine
+    // can be used again after emulation_restore(). The owner sets this after
+    // emulation_init().
+    machine_error_fn on_error;
+
+    int vdu_variables[256];
+    const struct s_machine_model *model;
+    int basic_version;
+    machine_oswrch_fn oswrch;
+
+    // Output not yet passed to 'oswrch'.
+    uint8_t output[4096];
+    size_t output_length;
+
+    // Number of writes to ROMSEL; each one would have copied a whole ROM
+    // image into memory if we didn't map ROMs in place.
+    unsigned long romsel_writes;
+
+    // How native replacements for BASIC ROM routines are used; see traps.h.
+    int trap_mode;
+
+    // The OS entry point most recently called, for diagnostics.
+    uint16_t last_os_call;
+
+    // What the emulated machine is doing and how many instructions it was
+    // allowed for it; see emulation_set_budget().
+    const char *operation;
+    int64_t budget;
+
+    // If not null, every instruction the emulated machine runs is recorded
+    // here; see profile.h. The owner sets this after emulation_init().
+    struct s_profile *profile;
+
+    // If not null, the machine's interaction with the outside world is
+    // logged or checked here; see trace.h.
+    struct s_trace *trace;
+
+    // If not null, the OS file routines and *EXEC use this; see filing.h.
+    // The owner sets this after emulation_init() and deletes it.
+    struct s_filing_system *filing_system;
+
+    // Input queued by emulation_queue_input_line() and
+    // emulation_queue_osrdch(); each item is a type byte, the
+    // error_line_number to report it with and NUL-terminated text.
+    struct {
+        char *data;
+        size_t length;
+        size_t capacity;
+        size_t offset; // of the next item
+    } input_queue;
+};
 
 // Read a little-endian 16-bit word from the emulated machine's memory.
-uint16_t mpu_read_u16(uint16_t address);
+uint16_t mpu_read_u16(const struct s_machine *machine, uint16_t address);
+
+// Record that [address, address + size) of the emulated machine's memory has
+// been written directly rather than by the emulated CPU, so it's put back by
+// emulation_restore() and any code translated from it is discarded.
+void mpu_memory_written(struct s_machine *machine, uint16_t address,
+                        size_t size);
+
+// Record a write to memory made by the emulated OS (e.g. loading a file),
+// which unlike one by the host is repeated by replaying a trace.
+void mpu_os_memory_written(struct s_machine *machine, uint16_t address,
+                           size_t size);
+
+// Arrange for the emulated machine to raise error 'number' with 'message',
+// returning the address to continue at from an OS callback to do so.
+int mpu_error(struct s_machine *machine, uint8_t number, const char *message);
+
+// Pull an RTS-style return address (i.e. target-1) from the emulated machine's
+// stack and return the target address.
+int pull_rts_target(struct s_machine *machine);
+
+// The state of a machine which has booted into BASIC and is waiting at the
+// first prompt; this is the same every time for a given ROM, so mksnapshot
+// generates one for each BASIC version at build time. Only non-zero pages of
+// memory are included.
+struct s_snapshot {
+    M6502_Registers registers;
+    int state;
+    unsigned long romsel_writes;
+    const uint8_t *output; // written via OSWRCH while booting
+    size_t output_length;
+    size_t page_count;
+    const uint8_t *page_numbers;
+    const uint8_t (*pages)[256];
+};
+
+// emulation_init() starts machines with model_standard from these rather
+// than booting them if they're not null; they must be provided by the
+// program, normally by linking with snapshots.c.
+extern const struct s_snapshot *const boot_snapshots[basic_count];
+
+// Flags for M6502_new() selecting the cheapest M6502_run() loop; nothing in
+// the emulation needs interrupt polling or cycle counts. A machine which will
+// be profiled should leave out M6502_NoCycles.
+#define EMULATION_MPU_FLAGS (M6502_NoPolling | M6502_NoCycles)
 
-// Initialise the emulated machine; this will return to the caller with the
-// emulated machine waiting at the BASIC prompt.
-void emulation_init(void);
+// Initialise the emulated machine 'machine' to have the memory map
+// machine_models['model'], use BASIC version 'basic_version' and pass its
+// output to 'oswrch'; this will return to the caller with the emulated
+// machine waiting at the BASIC prompt. 'mpu_flags' is passed to M6502_new();
+// normally this should be EMULATION_MPU_FLAGS.
+void emulation_init(struct s_machine *machine, int model, int basic_version,
+                    machine_oswrch_fn oswrch, unsigned int mpu_flags);
+
+// A copy of a machine's state, for resetting it between jobs much more
+// cheaply than emulation_init() can; see emulation_snapshot().
+struct s_machine_snapshot {
+    M6502_Memory memory;
+    M6502_Registers registers;
+    int state;
+    unsigned long romsel_writes;
+    const uint8_t *rom; // mapped at &8000
+};
+
+// Save the state of 'machine', which must be waiting for input, in
+// 'snapshot'.
+void emulation_snapshot(struct s_machine *machine,
+                        struct s_machine_snapshot *snapshot);
+
+// Put 'machine' back into the state saved in 'snapshot'. Only the pages of
+// memory written since the last emulation_snapshot() or emulation_restore()
+// are copied, so 'snapshot' must be the most recent snapshot of 'machine'.
+// Files the machine left open are closed and any *EXEC input is dropped, so
+// nothing carries over into the next job.
+void emulation_restore(struct s_machine *machine,
+                       const struct s_machine_snapshot *snapshot);
+
+// Allow the emulated machine at most 'instructions' more 6502 instructions,
+// for 'operation', which is named in the error if it uses them all; this
+// stops a bad input or a case we don't handle leaving it running forever.
+void emulation_set_budget(struct s_machine *machine, const char *operation,
+                          int64_t instructions);
+
+// Return how many 6502 instructions the emulated machine has run since
+// emulation_set_budget() was last called.
+int64_t emulation_budget_used(const struct s_machine *machine);
 
 // The next two functions rely on the caller to know the OS input routine
 // the emulated machine is waiting in. In practice this isn't a problem -
@@ -30,12 +216,28 @@ void emulation_init(void);
 // with CR or LF, this function will automatically append CR. This assumes
 // the emulated machine is waiting for input via OSWORD 0; the caller is
 // responsible for ensuring that is the case.
-void execute_input_line(const char *line);
+void execute_input_line(struct s_machine *machine, const char *line);
 
 // Enter s[0] as if typed at the keyboard; 's' should be a single-character
 // string. This assumes the emulated machine is waiting for input via OSRDCH;
 // the caller is responsible for ensuring that is the case.
-void execute_osrdch(const char *s);
+void execute_osrdch(struct s_machine *machine, const char *s);
+
+// Queue 'line', as for execute_input_line(), to be entered when the emulated
+// machine next reads a line via OSWORD 0 after any input queued before it.
+// It's echoed only if 'echo' is true; callers discarding the output can save
+// the time. error_line_number is set to 'error_line' while it's processed.
+void emulation_queue_input_line(struct s_machine *machine, const char *line,
+                                bool echo, int error_line);
+
+// Queue 'c' to be returned by OSRDCH in the same way.
+void emulation_queue_osrdch(struct s_machine *machine, char c);
+
+// Pass the queued input to the emulated machine, which must be waiting for the
+// first item, and run it until it's waiting for input again. The machine
+// takes each item from inside the OS call which asks for it, so this runs the
+// whole queue without returning here in between; it must use up the queue.
+void emulation_run_queue(struct s_machine *machine);
 
 // vi: colorcolumn=80
 
@@ -0,0 +1,549 @@
+// A filing system for emulated machines backed by a host directory; see
+// filing.h.
+//
+// Each open file is held in a buffer which grows as it's written; handles
+// &11-&15 refer to its slots, as on DFS.
+
+#include "filing.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulation.h"
+#include "utils.h"
+
+enum {
+    first_handle = 0x11,
+    file_count = 5,
+    max_name_length = 255,
+    // Far more than any BBC filing system holds, but small enough that a
+    // bad PTR or EXT can't make us allocate gigabytes.
+    max_file_length = 16 * 1024 * 1024
+};
+
+// BBC filing system error numbers.
+enum {
+    error_cant_extend = 0xbf,
+    error_too_many_open_files = 0xc0,
+    error_read_only = 0xc1,
+    error_disc_fault = 0xc7,
+    error_bad_name = 0xcc,
+    error_not_found = 0xd6,
+    error_channel = 0xde,
+    error_bad_address = 0xfc
+};
+
+struct s_file {
+    char *path; // null if this slot is free
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    size_t ptr;
+    bool write; // written back to the host when closed
+};
+
+struct s_filing_system {
+    char *root;
+    // Room for the root, a separator and max_name_length characters; see
+    // get_path().
+    char *path;
+    struct s_file files[file_count];
+
+    // *EXEC input, if any.
+    uint8_t *exec_data;
+    size_t exec_length;
+    size_t exec_ptr;
+};
+
+struct s_filing_system *filing_system_new(const char *root) {
+    assert(root != 0);
+    struct s_filing_system *fs = check_alloc(calloc(1, sizeof(*fs)));
+    fs->root = check_alloc(malloc(strlen(root) + 1));
+    strcpy(fs->root, root);
+    fs->path = check_alloc(malloc(strlen(root) + 1 + max_name_length + 1));
+    return fs;
+}
+
+// Read all of the host file 'path', returning null if it can't be opened.
+static uint8_t *read_host_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == 0) {
+        return 0;
+    }
+    check(fseek(file, 0, SEEK_END) == 0, "error: can't read \"%s\"", path);
+    long size = ftell(file);
+    check((size >= 0) && (fseek(file, 0, SEEK_SET) == 0),
+          "error: can't read \"%s\"", path);
+    // Allocate at least one byte so a successful read never returns null.
+    uint8_t *data = check_alloc(malloc(size + 1));
+    *length = fread(data, 1, size, file);
+    check(!ferror(file) && (*length == size),
+          "error: error reading from input file \"%s\"", path);
+    fclose(file);
+    return data;
+}
+
+static bool write_host_file(const char *path, const uint8_t *data,
+                            size_t length) {
+    FILE *file = fopen(path, "wb");
+    if (file == 0) {
+        return false;
+    }
+    // An empty file may have no data allocated.
+    if (length > 0) {
+        fwrite(data, 1, length, file);
+    }
+    bool ok = !ferror(file);
+    return (fclose(file) == 0) && ok;
+}
+
+static bool close_file(struct s_file *file) {
+    bool ok = !file->write ||
+              write_host_file(file->path, file->data, file->length);
+    free(file->path);
+    free(file->data);
+    memset(file, 0, sizeof(*file));
+    return ok;
+}
+
+void filing_system_reset(struct s_filing_system *fs) {
+    for (int i = 0; i < file_count; ++i) {
+        if (fs->files[i].path != 0) {
+            check(close_file(&fs->files[i]),
+                  "error: error writing to output file");
+        }
+    }
+    free(fs->exec_data);
+    fs->exec_data = 0;
+}
+
+void filing_system_delete(struct s_filing_system *fs) {
+    filing_system_reset(fs);
+    free(fs->path);
+    free(fs->root);
+    free(fs);
+}
+
+static uint16_t get_yx(const struct s_machine *machine) {
+    return (machine->registers.y << 8) | machine->registers.x;
+}
+
+static void set_carry(struct s_machine *machine, bool carry) {
+    machine->registers.p = (machine->registers.p & ~(1<<0)) | (carry ? 1 : 0);
+}
+
+static uint32_t read_u32(struct s_machine *machine, uint16_t address) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | M6502_read(machine->mpu, address + i);
+    }
+    return value;
+}
+
+static void write_u32(struct s_machine *machine, uint16_t address,
+                      uint32_t value) {
+    check(address <= 0xfffc, "internal error: write_u32 at top of memory");
+    for (int i = 0; i < 4; ++i) {
+        machine->memory[address + i] = (value >> (8 * i)) & 0xff;
+    }
+    mpu_os_memory_written(machine, address, 4);
+}
+
+// Return the host path of the file whose name is at 'address', built in the
+// filing system's path buffer, so it's only valid until the next call. Leading
+// spaces are skipped and the name ends at a space or control character. Return
+// null if the name is empty or could refer to something outside the root.
+static const char *get_path(struct s_machine *machine, uint16_t address) {
+    struct s_filing_system *fs = machine->filing_system;
+    while (M6502_read(machine->mpu, address) == ' ') {
+        ++address;
+    }
+    size_t root_length = strlen(fs->root);
+    memcpy(fs->path, fs->root, root_length);
+    char *name = &fs->path[root_length];
+    *name++ = '/';
+    size_t length = 0;
+    for (uint8_t c; (c = M6502_read(machine->mpu, address + length)) > ' ';
+         ++length) {
+        if ((length == max_name_length) || (c == '/') || (c == '\\') ||
+            (c == ':') || (c >= 0x7f)) {
+            return 0;
+        }
+        name[length] = c;
+    }
+    name[length] = '\0';
+    return ((length > 0) && (name[0] != '.')) ? fs->path : 0;
+}
+
+static struct s_file *get_file(struct s_machine *machine, uint8_t handle) {
+    int i = handle - first_handle;
+    if ((i < 0) || (i >= file_count) ||
+        (machine->filing_system->files[i].path == 0)) {
+        return 0;
+    }
+    return &machine->filing_system->files[i];
+}
+
+// Make room for 'file' to hold 'length' bytes, zero-filling any gap. Return
+// false if 'length' is more than we allow.
+static bool extend_file(struct s_file *file, size_t length) {
+    if (length > max_file_length) {
+        return false;
+    }
+    if (length > file->capacity) {
+        size_t capacity = (file->capacity > 0) ? file->capacity : 256;
+        while (capacity < length) {
+            capacity *= 2;
+        }
+        file->data = check_alloc(realloc(file->data, capacity));
+        file->capacity = capacity;
+    }
+    if (length > file->length) {
+        memset(&file->data[file->length], 0, length - file->length);
+        file->length = length;
+    }
+    return true;
+}
+
+static int cant_extend(struct s_machine *machine) {
+    return mpu_error(machine, error_cant_extend, "Can't extend");
+}
+
+// Fill in the attributes of a file of 'length' bytes in the OSFILE control
+// block at 'block'; we don't keep load or execution addresses.
+static void write_file_info(struct s_machine *machine, uint16_t block,
+                            size_t length) {
+    write_u32(machine, block + 2, 0);
+    write_u32(machine, block + 6, 0);
+    write_u32(machine, block + 10, length);
+    write_u32(machine, block + 14, 0);
+}
+
+int filing_osfile(struct s_machine *machine) {
+    uint16_t block = get_yx(machine);
+    check(block <= 0xffee,
+          "internal error: OSFILE block is too near top of memory");
+    const char *path = get_path(machine, mpu_read_u16(machine, block));
+    if (path == 0) {
+        return mpu_error(machine, error_bad_name, "Bad name");
+    }
+    size_t length;
+    uint8_t *data;
+    switch (machine->registers.a) {
+        case 0x00: { // save
+            uint32_t start = read_u32(machine, block + 10) & 0xffff;
+            uint32_t end = read_u32(machine, block + 14) & 0xffff;
+            if (end < start) {
+                return mpu_error(machine, error_bad_address, "Bad address");
+            }
+            // The program may be anywhere, including ROM, so copy it via
+            // lib6502's view of memory.
+            data = check_alloc(malloc(end - start + 1));
+            for (uint32_t i = start; i < end; ++i) {
+                data[i - start] = M6502_read(machine->mpu, i);
+            }
+            bool ok = write_host_file(path, data, end - start);
+            free(data);
+            if (!ok) {
+                return mpu_error(machine, error_disc_fault, "Disc fault");
+            }
+            machine->registers.a = 1;
+            break;
+        }
+        case 0xff: { // load
+            if (machine->memory[block + 6] != 0) {
+                // We don't keep a file's own load address.
+                return mpu_error(machine, error_bad_address, "Bad address");
+            }
+            data = read_host_file(path, &length);
+            if (data == 0) {
+                return mpu_error(machine, error_not_found, "Not found");
+            }
+            uint16_t load = read_u32(machine, block + 2) & 0xffff;
+            if (length > sizeof(M6502_Memory) - load) {
+                free(data);
+                return mpu_error(machine, error_bad_address, "Bad address");
+            }
+            memcpy(&machine->memory[load], data, length);
+            free(data);
+            mpu_os_memory_written(machine, load, length);
+            write_file_info(machine, block, length);
+            machine->registers.a = 1;
+            break;
+        }
+        case 0x01: case 0x02: case 0x03: case 0x04: // write attributes
+        case 0x05: // read attributes
+        case 0x06: // delete
+            data = read_host_file(path, &length);
+            if (data == 0) {
+                machine->registers.a = 0; // not found
+                break;
+            }
+            free(data);
+            if (machine->registers.a >= 0x05) {
+                write_file_info(machine, block, length);
+            }
+            if ((machine->registers.a == 0x06) && (remove(path) != 0)) {
+                return mpu_error(machine, error_disc_fault, "Disc fault");
+            }
+            machine->registers.a = 1;
+            break;
+        default:
+            die("internal error: unsupported OSFILE &%02X",
+                machine->registers.a);
+    }
+    return pull_rts_target(machine);
+}
+
+int filing_osfind(struct s_machine *machine) {
+    struct s_filing_system *fs = machine->filing_system;
+    uint8_t a = machine->registers.a;
+    if (a == 0x00) { // close
+        bool ok = true;
+        if (machine->registers.y == 0) {
+            for (int i = 0; i < file_count; ++i) {
+                if (fs->files[i].path != 0) {
+                    ok = close_file(&fs->files[i]) && ok;
+                }
+            }
+        } else {
+            struct s_file *file = get_file(machine, machine->registers.y);
+            if (file == 0) {
+                return mpu_error(machine, error_channel, "Channel");
+            }
+            ok = close_file(file);
+        }
+        if (!ok) {
+            return mpu_error(machine, error_disc_fault, "Disc fault");
+        }
+        return pull_rts_target(machine);
+    }
+
+    check((a == 0x40) || (a == 0x80) || (a == 0xc0),
+          "internal error: unsupported OSFIND &%02X", a);
+    const char *path = get_path(machine, get_yx(machine));
+    if (path == 0) {
+        return mpu_error(machine, error_bad_name, "Bad name");
+    }
+    int i = 0;
+    while ((i < file_count) && (fs->files[i].path != 0)) {
+        ++i;
+    }
+    if (i == file_count) {
+        return mpu_error(machine, error_too_many_open_files,
+                         "Too many open files");
+    }
+    struct s_file *file = &fs->files[i];
+    if (a == 0x80) { // open for output, creating an empty file now
+        if (!write_host_file(path, 0, 0)) {
+            return mpu_error(machine, error_disc_fault, "Disc fault");
+        }
+        file->data = 0;
+        file->length = 0;
+    } else {
+        file->data = read_host_file(path, &file->length);
+        if (file->data == 0) {
+            machine->registers.a = 0; // not found
+            return pull_rts_target(machine);
+        }
+    }
+    file->capacity = file->length;
+    file->ptr = 0;
+    file->write = (a != 0x40);
+    file->path = check_alloc(malloc(strlen(path) + 1));
+    strcpy(file->path, path);
+    machine->registers.a = first_handle + i;
+    return pull_rts_target(machine);
+}
+
+int filing_osbget(struct s_machine *machine) {
+    struct s_file *file = get_file(machine, machine->registers.y);
+    if (file == 0) {
+        return mpu_error(machine, error_channel, "Channel");
+    }
+    if (file->ptr >= file->length) {
+        machine->registers.a = 0xfe;
+        set_carry(machine, true);
+    } else {
+        machine->registers.a = file->data[file->ptr++];
+        set_carry(machine, false);
+    }
+    return pull_rts_target(machine);
+}
+
+int filing_osbput(struct s_machine *machine) {
+    struct s_file *file = get_file(machine, machine->registers.y);
+    if (file == 0) {
+        return mpu_error(machine, error_channel, "Channel");
+    }
+    if (!file->write) {
+        return mpu_error(machine, error_read_only, "Read only");
+    }
+    if (!extend_file(file, file->ptr + 1)) {
+        return cant_extend(machine);
+    }
+    file->data[file->ptr++] = machine->registers.a;
+    return pull_rts_target(machine);
+}
+
+int filing_osargs(struct s_machine *machine) {
+    uint8_t a = machine->registers.a;
+    check(machine->registers.y != 0,
+          "internal error: unsupported OSARGS &%02X with Y=0", a);
+    struct s_file *file = get_file(machine, machine->registers.y);
+    if (file == 0) {
+        return mpu_error(machine, error_channel, "Channel");
+    }
+    // The argument is in four bytes of zero page at X.
+    uint16_t zp = machine->registers.x;
+    switch (a) {
+        case 0x00: // read PTR
+            write_u32(machine, zp, file->ptr);
+            break;
+        case 0x01: // write PTR
+            file->ptr = read_u32(machine, zp);
+            if (file->write && !extend_file(file, file->ptr)) {
+                return cant_extend(machine);
+            }
+            break;
+        case 0x02: // read EXT
+            write_u32(machine, zp, file->length);
+            break;
+        case 0x03: // write EXT
+            if (!file->write) {
+                return mpu_error(machine, error_read_only, "Read only");
+            }
+            if (!extend_file(file, read_u32(machine, zp))) {
+                return cant_extend(machine);
+            }
+            file->length = read_u32(machine, zp);
+            break;
+        case 0xff: // flush
+            if (file->write &&
+                !write_host_file(file->path, file->data, file->length)) {
+                return mpu_error(machine, error_disc_fault, "Disc fault");
+            }
+            break;
+        default:
+            die("internal error: unsupported OSARGS &%02X", a);
+    }
+    return pull_rts_target(machine);
+}
+
+int filing_osgbpb(struct s_machine *machine) {
+    uint16_t block = get_yx(machine);
+    check(block <= 0xfff2,
+          "internal error: OSGBPB block is too near top of memory");
+    uint8_t a = machine->registers.a;
+    check((a >= 0x01) && (a <= 0x04),
+          "internal error: unsupported OSGBPB &%02X", a);
+    struct s_file *file = get_file(machine, machine->memory[block]);
+    if (file == 0) {
+        return mpu_error(machine, error_channel, "Channel");
+    }
+    bool write = (a <= 0x02);
+    if (write && !file->write) {
+        return mpu_error(machine, error_read_only, "Read only");
+    }
+    uint32_t address = read_u32(machine, block + 1) & 0xffff;
+    uint32_t count = read_u32(machine, block + 5);
+    if ((a == 0x01) || (a == 0x03)) {
+        file->ptr = read_u32(machine, block + 9);
+    }
+    // Both are up to 32 bits, so don't add them.
+    if ((address > sizeof(M6502_Memory)) ||
+        (count > sizeof(M6502_Memory) - address)) {
+        return mpu_error(machine, error_bad_address, "Bad address");
+    }
+    size_t n = count;
+    if (write) {
+        if (!extend_file(file, file->ptr + n)) {
+            return cant_extend(machine);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            file->data[file->ptr + i] = M6502_read(machine->mpu, address + i);
+        }
+    } else {
+        n = (file->ptr < file->length) ? file->length - file->ptr : 0;
+        if (n > count) {
+            n = count;
+        }
+        memcpy(&machine->memory[address], &file->data[file->ptr], n);
+        mpu_os_memory_written(machine, address, n);
+    }
+    file->ptr += n;
+    write_u32(machine, block + 1, address + n);
+    write_u32(machine, block + 5, count - n);
+    write_u32(machine, block + 9, file->ptr);
+    machine->registers.a = 0; // supported
+    set_carry(machine, n < count);
+    return pull_rts_target(machine);
+}
+
+int filing_osbyte_eof(struct s_machine *machine) {
+    struct s_file *file = get_file(machine, machine->registers.x);
+    if (file == 0) {
+        return mpu_error(machine, error_channel, "Channel");
+    }
+    machine->registers.x = (file->ptr >= file->length) ? 0xff : 0;
+    return pull_rts_target(machine);
+}
+
+int filing_exec(struct s_machine *machine, uint16_t name) {
+    struct s_filing_system *fs = machine->filing_system;
+    free(fs->exec_data);
+    fs->exec_data = 0;
+    while (M6502_read(machine->mpu, name) == ' ') {
+        ++name;
+    }
+    if (M6502_read(machine->mpu, name) != cr) {
+        const char *path = get_path(machine, name);
+        if (path == 0) {
+            return mpu_error(machine, error_bad_name, "Bad name");
+        }
+        fs->exec_data = read_host_file(path, &fs->exec_length);
+        if (fs->exec_data == 0) {
+            return mpu_error(machine, error_not_found, "Not found");
+        }
+        fs->exec_ptr = 0;
+    }
+    return pull_rts_target(machine);
+}
+
+bool filing_exec_read(struct s_filing_system *fs, uint8_t *c) {
+    if (fs->exec_data == 0) {
+        return false;
+    }
+    if (fs->exec_ptr == fs->exec_length) {
+        free(fs->exec_data);
+        fs->exec_data = 0;
+        return false;
+    }
+    *c = fs->exec_data[fs->exec_ptr++];
+    return true;
+}
+
+bool filing_exec_line(struct s_filing_system *fs, char *line, size_t size) {
+    uint8_t c;
+    if (!filing_exec_read(fs, &c)) {
+        return false;
+    }
+    size_t length = 0;
+    while ((c != cr) && (c != lf)) {
+        check(length + 1 < size, "error: line too long");
+        line[length++] = c;
+        if (!filing_exec_read(fs, &c)) {
+            break;
+        }
+    }
+    line[length] = '\0';
+    // Treat CRLF and LFCR as a single line ending.
+    if ((fs->exec_data != 0) && (fs->exec_ptr < fs->exec_length) &&
+        ((c == cr) || (c == lf)) &&
+        (fs->exec_data[fs->exec_ptr] == (c ^ cr ^ lf))) {
+        ++fs->exec_ptr;
+    }
+    return true;
+}
+
+// vi: colorcolumn=80
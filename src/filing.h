@@ -0,0 +1,56 @@
+#ifndef FILING_H
+#define FILING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// A filing system for an emulated machine whose files are the files in a
+// host directory, so BASIC's LOAD, SAVE, CHAIN and OPENIN etc. and ABE's file
+// operations work on host files. Names are used as they are, except that
+// names which could refer to anything outside the directory are rejected.
+//
+// Each file is read into memory in full when it's opened and written back in
+// full when it's closed, so transferring each byte is just a memory access.
+struct s_filing_system;
+
+// Return a filing system rooted at 'root'; the owner sets a machine's
+// 'filing_system' member to it to make it available to that machine. Without
+// one, calls to the filing system OS routines are errors as before.
+struct s_filing_system *filing_system_new(const char *root);
+
+// Close any files still open, writing them back, and stop any *EXEC, as
+// emulation_restore() does between jobs.
+void filing_system_reset(struct s_filing_system *fs);
+
+// Reset 'fs' as filing_system_reset() does and free it.
+void filing_system_delete(struct s_filing_system *fs);
+
+// OS routines, called by emulation.c with their arguments in the machine's
+// registers; each returns the address to continue at.
+int filing_osfile(struct s_machine *machine);
+int filing_osfind(struct s_machine *machine);
+int filing_osgbpb(struct s_machine *machine);
+int filing_osbput(struct s_machine *machine);
+int filing_osbget(struct s_machine *machine);
+int filing_osargs(struct s_machine *machine);
+
+// OSBYTE &7F: set X to &FF if the file with handle X is at its end, else 0.
+int filing_osbyte_eof(struct s_machine *machine);
+
+// *EXEC: take keyboard input from the file named by the CR-terminated string
+// at 'name' in the machine's memory, or stop doing so if the name is empty.
+int filing_exec(struct s_machine *machine, uint16_t name);
+
+// If *EXEC input is pending, store its next character in *c and return true.
+bool filing_exec_read(struct s_filing_system *fs, uint8_t *c);
+
+// If *EXEC input is pending, store its next line, without the CR, LF, CRLF or
+// LFCR which ends it, in the 'size'-byte buffer 'line' and return true.
+bool filing_exec_line(struct s_filing_system *fs, char *line, size_t size);
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,495 @@
+// A native "Format listing" and "Unpack"; see layout.h.
+//
+// "Format listing" lists each statement on a line of its own, indented by
+// how deeply it is nested in FOR, REPEAT and IF, with its own idea of where
+// a nest ends: an ELSE or UNTIL closes one level, a NEXT one level for each
+// variable it names, and IF is only counted to the end of the line.
+//
+// "Unpack" makes two passes over the program. The first only checks that
+// each line's number leaves room for the new lines which will follow it;
+// the second copies each line through a buffer, putting a space before any
+// keyword which follows a name or number, and ends the line at each colon
+// which separates statements, starting a new line with the next number for
+// the rest. Lines which start with "*" or DATA are left alone, as are the
+// rest of a line after IF, REM or ERROR and any line which would overflow the
+// buffer. ABE writes each line it stores, so that is its output. Neither
+// command fusses over 8-bit counters which overflow, and nor do we.
+
+#include "layout.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "detokenise.h"
+#include "emulation.h"
+#include "roms.h"
+#include "tokens.h"
+#include "utils.h"
+
+struct s_output {
+    struct s_buffer buffer;
+    bool failed; // hit a token ABE doesn't know
+};
+
+static void put(struct s_output *output, uint8_t c) {
+    buffer_put(&output->buffer, c);
+}
+
+static void put_newline(struct s_output *output) {
+    put(output, lf); put(output, cr); // OSNEWL
+}
+
+// Print 'number' right-justified in 'width' characters.
+static void put_number(struct s_output *output, uint16_t number, int width) {
+    char digits[8];
+    int length = sprintf(digits, "%*u", width, (unsigned int) number);
+    for (int i = 0; i < length; ++i) {
+        put(output, digits[i]);
+    }
+}
+
+// Print 'c' as ABE's &8F5D does, showing control characters as "|" and a
+// letter, and return what it printed last.
+static uint8_t put_char(struct s_output *output, uint8_t c) {
+    if ((c < ' ') || (c == 0x7f)) {
+        put(output, '|');
+        c ^= 0x40;
+    }
+    put(output, c);
+    return c;
+}
+
+// Print the keyword for 'token' from ABE's keyword table, as ABE's &884A
+// does; like BASIC, it takes the first entry with that token.
+static void put_token(struct s_output *output, uint8_t token) {
+    const uint8_t *rom = rom_editor_b;
+    size_t entry = rom_editor_token_table();
+    for (;;) {
+        size_t i = entry + 1;
+        while (rom[i] < 0x80) {
+            ++i;
+        }
+        if (rom[i] == token) {
+            break;
+        }
+        if (rom[i] == 0xd3) {
+            // ABE would carry on looking through its own code.
+            output->failed = true;
+            return;
+        }
+        entry = i + 2;
+    }
+    for (size_t i = entry; rom[i] < 0x80; ++i) {
+        put(output, rom[i]);
+    }
+}
+
+static uint16_t line_number(const uint8_t *line) {
+    return (line[1] << 8) | line[2];
+}
+
+// Check that the program at 'page' is intact, as far as ABE can tell, and
+// that neither command will wander off the end of a line, setting *end to the
+// CR which ends it; unless 'allow_cr' is true, lines may not contain CR.
+static bool check_program(const uint8_t *m, uint16_t page, uint16_t himem,
+                          bool allow_cr, uint16_t *end) {
+    uint16_t line = page;
+    for (;;) {
+        if ((m[line] != cr) || ((uint32_t) line + 4 > himem)) {
+            return false;
+        }
+        if (m[line + 1] & 0x80) {
+            *end = line;
+            return true;
+        }
+        uint8_t length = m[line + 3];
+        if ((length < 4) || ((uint32_t) line + length >= himem)) {
+            return false;
+        }
+        for (int i = 4; i < length; ++i) {
+            if (((m[line + i] == cr) && !allow_cr) ||
+                ((m[line + i] == token_line_number) && (i + 3 >= length))) {
+                return false;
+            }
+        }
+        line += length;
+    }
+}
+
+// ABE's "Format listing" state.
+struct s_format {
+    const uint8_t *memory;
+    uint8_t if_depth;     // ABE's &75
+    uint8_t for_depth;    // ABE's &76
+    uint8_t repeat_depth; // ABE's &77
+    bool indented;        // the current output line has been indented
+    struct s_output output;
+};
+
+// Take one from a nesting depth, but not below zero, as ABE does.
+static void leave(uint8_t *depth) {
+    if (--*depth & 0x80) {
+        ++*depth;
+    }
+}
+
+// Start a new output line if anything has been written on this one; this is
+// ABE's &A0ED.
+static void format_break(struct s_format *f) {
+    if (f->indented) {
+        put_newline(&f->output);
+        for (int i = 0; i < 5; ++i) {
+            put(&f->output, ' ');
+        }
+        f->indented = false;
+    }
+}
+
+// Indent the output line by two spaces for each level of nesting, plus one;
+// this is ABE's &A104.
+static void format_indent(struct s_format *f) {
+    unsigned int sum = f->if_depth + f->for_depth;
+    uint8_t x = (sum + f->repeat_depth + (sum >> 8)) << 1;
+    do {
+        put(&f->output, ' ');
+    } while (!(--x & 0x80));
+    f->indented = true;
+}
+
+static void format_line(struct s_format *f, uint16_t line) {
+    const uint8_t *m = f->memory;
+    f->if_depth = 0;
+    f->indented = false;
+    bool quote = false;
+    put_number(&f->output, line_number(&m[line]), 5);
+    uint8_t y = 4;
+    for (;;) {
+        uint8_t c = m[(uint16_t) (line + y)];
+        if (c == cr) {
+            put_newline(&f->output);
+            return;
+        }
+        if ((c == '"') || quote) {
+            quote ^= (c == '"');
+            if (!f->indented) {
+                format_indent(f);
+            }
+            put_char(&f->output, c);
+            ++y;
+            continue;
+        }
+        if (c == token_line_number) {
+            put_number(&f->output,
+                       detokenise_line_number(&m[(uint16_t) (line + y)]), 0);
+            y += 4;
+            continue;
+        }
+        if (c == ':') {
+            if (!f->indented) {
+                format_indent(f);
+            }
+            put_char(&f->output, c);
+            format_break(f);
+            ++y;
+            continue;
+        }
+
+        // FOR, REPEAT, IF and THEN start a new line indented to the level
+        // outside what they open; ELSE, UNTIL and NEXT start one indented to
+        // the level after what they close.
+        if ((c == token_for) || (c == token_repeat) || (c == token_if) ||
+            (c == token_then)) {
+            format_break(f);
+            format_indent(f);
+            if (c == token_for) {
+                ++f->for_depth;
+            } else if (c == token_repeat) {
+                ++f->repeat_depth;
+            } else if (c == token_if) {
+                ++f->if_depth;
+            }
+        } else if ((c == token_else) || (c == token_until) ||
+                   (c == token_next)) {
+            if (c == token_else) {
+                leave(&f->if_depth);
+            } else if (c == token_until) {
+                leave(&f->repeat_depth);
+            } else {
+                // Leave one FOR, and another for each comma up to the end of
+                // the statement.
+                uint8_t i = y;
+                leave(&f->for_depth);
+                for (;;) {
+                    uint8_t d = m[(uint16_t) (line + ++i)];
+                    if ((d == ':') || (d == cr) || (d == token_else)) {
+                        break;
+                    }
+                    if (d == ',') {
+                        leave(&f->for_depth);
+                    }
+                }
+            }
+            format_break(f);
+        }
+        if (!f->indented) {
+            format_indent(f);
+        }
+        if (c >= 0x80) {
+            put_token(&f->output, c);
+        } else if (put_char(&f->output, c) < '@') {
+            ++y;
+            continue;
+        }
+        // A keyword or letter followed by a keyword gets a space after it.
+        if (m[(uint16_t) (line + ++y)] & 0x80) {
+            put(&f->output, ' ');
+        }
+    }
+}
+
+bool format_program(const struct s_machine *machine, uint8_t **output,
+                    size_t *output_length) {
+    assert((output != 0) && (output_length != 0));
+    const uint8_t *m = machine->memory;
+    uint16_t line = m[0x18] << 8;
+    uint16_t end;
+    if (!check_program(m, line, mpu_read_u16(machine, 0x06), true, &end)) {
+        return false;
+    }
+    struct s_format f = {.memory = m};
+    for (; line != end; line += m[line + 3]) {
+        format_line(&f, line);
+    }
+    if (f.output.failed) {
+        free(f.output.buffer.data);
+        return false;
+    }
+    *output = f.output.buffer.data;
+    *output_length = f.output.buffer.length;
+    return true;
+}
+
+// ABE's "Unpack" state. We work on a copy of the program, from PAGE to TOP,
+// which can grow without limit.
+struct s_unpack {
+    uint8_t *program;
+    size_t length;
+    size_t capacity;
+    bool checking;          // the first pass; ABE's &85 bit 7
+    bool no_room;           // ABE's &87 bit 7
+    uint8_t max_statements; // the most new lines after any line checked
+
+    // ABE's line buffer; index i is for &06FC + i.
+    uint8_t buffer[0x100];
+
+    struct s_output output;
+};
+
+// Write the line at 'line' as ABE's &91CA does.
+static void unpack_put_line(struct s_unpack *u, size_t line) {
+    const uint8_t *m = &u->program[line];
+    struct s_output *output = &u->output;
+    put_number(output, line_number(m), 5);
+    put(output, ' ');
+    bool quote = false;
+    for (uint8_t y = 4; m[y] != cr;) {
+        uint8_t c = m[y];
+        if (c == '"') {
+            quote = !quote;
+        }
+        if ((c == '"') || quote || (c < 0x80)) {
+            put_char(output, c);
+            ++y;
+        } else if (c == token_line_number) {
+            put_number(output, detokenise_line_number(&m[y]), 0);
+            y += 4;
+        } else {
+            put_token(output, c);
+            ++y;
+        }
+    }
+    put_newline(output);
+}
+
+// Replace the text of the line at 'line' with that in the buffer, which ends
+// with CR at 'x', moving what follows its character 'y' along to make room
+// and, if 'split' is true, making a new line of the text after character
+// 'y', with the next line number. Return the next line. This is ABE's &A286.
+static size_t unpack_store(struct s_unpack *u, size_t line, uint8_t x,
+                           uint8_t y, bool split) {
+    u->buffer[x] = cr;
+    uint8_t old_length = u->program[line + 3];
+    uint16_t number = line_number(&u->program[line]);
+    size_t from = line + y + 1;
+    uint8_t gap = x - y + (split ? 3 : 0);
+    if (u->length + gap > u->capacity) {
+        while (u->length + gap > u->capacity) {
+            u->capacity *= 2;
+        }
+        u->program = check_alloc(realloc(u->program, u->capacity));
+    }
+    uint8_t *m = u->program;
+    memmove(&m[from + gap], &m[from], u->length - from);
+    u->length += gap;
+    m[line + 3] = x;
+    memcpy(&m[line + 4], &u->buffer[4], x - 3);
+    unpack_put_line(u, line);
+    line += x;
+    if (split) {
+        // ABE only adds one to the low byte and carries, so line 32767 would
+        // be followed by the end of the program.
+        m[line + 3] = old_length - y + 3;
+        m[line + 2] = (number + 1) & 0xff;
+        m[line + 1] = ((number >> 8) + ((number & 0xff) == 0xff)) & 0xff;
+    }
+    return line;
+}
+
+// Check there is room for 'statements' new lines after the line numbered
+// 'number', before the line at 'next'; this is ABE's &A23C, which can be
+// fooled when the high bytes of the numbers differ.
+static void unpack_check_room(struct s_unpack *u, uint16_t number,
+                              uint8_t statements, size_t next) {
+    const uint8_t *m = &u->program[next];
+    if (statements > u->max_statements) {
+        u->max_statements = statements;
+    }
+    unsigned int low = (number & 0xff) + statements;
+    uint8_t high = (number >> 8) + (low >> 8);
+    if (!(m[1] & 0x80) && (high >= m[1]) && ((low & 0xff) >= m[2])) {
+        u->no_room = true;
+    } else if (number == 0x7fff) {
+        u->no_room = true;
+    }
+}
+
+// Return true if a keyword after 'c' should have a space put before it; the
+// keywords ending in "(" don't.
+static bool is_spaced(uint8_t c) {
+    static const uint8_t no_space[] = {0xa7, 0xc0, 0xc1, 0xb0, 0xc2, 0xc4,
+                                       0x8a};
+    if ((c < '0') || ((c > '9') && (c < '@'))) {
+        return false;
+    }
+    return memchr(no_space, c, sizeof(no_space)) == 0;
+}
+
+static void unpack_pass(struct s_unpack *u) {
+    size_t line = 0;
+    for (;;) {
+        const uint8_t *m = &u->program[line];
+        if (m[1] & 0x80) {
+            return;
+        }
+        uint16_t number = line_number(m);
+        uint8_t statements = 0;
+        bool no_split = false;
+        uint8_t y = 4;
+        while (m[y] == ' ') {
+            ++y;
+        }
+        if ((m[y] == '*') || (m[y] == token_data)) {
+            line += m[3];
+            continue;
+        }
+
+        bool quote = false;
+        uint8_t x = 3;
+        for (y = 4; ++x != 0; ++y) {
+            uint8_t c = m[y];
+            u->buffer[x] = c;
+            if (c == cr) {
+                break;
+            }
+            if (quote) {
+                quote = (c != '"');
+                continue;
+            }
+            if ((c == token_if) || (c == token_rem) || (c == token_error)) {
+                no_split = true;
+            }
+            if (c == token_line_number) {
+                for (int i = 0; i < 3; ++i) {
+                    ++y;
+                    if (++x == 0) {
+                        break;
+                    }
+                    u->buffer[x] = m[y];
+                }
+                if (x == 0) {
+                    break;
+                }
+            } else if (c == '"') {
+                quote = true;
+            } else if (c == ':') {
+                if (!no_split && (y != 4)) {
+                    ++statements;
+                    if (!u->checking) {
+                        break;
+                    }
+                }
+            } else if (is_spaced(c) && (m[y + 1] & 0x80)) {
+                if (++x == 0) {
+                    break;
+                }
+                u->buffer[x] = ' ';
+            }
+        }
+
+        if (x == 0) {
+            // The line would overflow the buffer, so ABE leaves it alone.
+            line += m[3];
+        } else if (!u->checking) {
+            line = unpack_store(u, line, x, y, m[y] == ':');
+        } else {
+            assert(m[y] == cr);
+            line += m[3];
+            if ((statements != 0) && (y >= 7)) {
+                unpack_check_room(u, number, statements, line);
+            }
+        }
+    }
+}
+
+bool unpack_program(const struct s_machine *machine, uint8_t **output,
+                    size_t *output_length, int *step) {
+    assert((output != 0) && (output_length != 0) && (step != 0));
+    const uint8_t *m = machine->memory;
+    uint16_t page = m[0x18] << 8;
+    uint16_t end;
+    // ABE moves everything from a line to TOP along to make room for what it
+    // adds, so TOP mustn't be before the end of the program.
+    if (!check_program(m, page, mpu_read_u16(machine, 0x06), false, &end) ||
+        ((end != page) && (mpu_read_u16(machine, 0x12) < end + 2))) {
+        return false;
+    }
+    struct s_unpack *u = check_alloc(calloc(1, sizeof(*u)));
+    u->length = end + 2 - page;
+    u->capacity = 2 * u->length;
+    u->program = check_alloc(malloc(u->capacity));
+    memcpy(u->program, &m[page], u->length);
+
+    u->checking = true;
+    unpack_pass(u);
+    bool done = true;
+    *step = 0;
+    if (u->no_room) {
+        *step = u->max_statements + 1;
+    } else {
+        u->checking = false;
+        unpack_pass(u);
+        done = !u->output.failed;
+    }
+    if (done && (*step == 0)) {
+        *output = u->output.buffer.data;
+        *output_length = u->output.buffer.length;
+    } else {
+        free(u->output.buffer.data);
+    }
+    free(u->program);
+    free(u);
+    return done;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,37 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// Native equivalents of ABE's "Format listing" and "Unpack", for
+// --engine=native. They follow ABE's code closely, using its own keyword
+// table, so the output is exactly what ABE would have written.
+
+// Set *output to what ABE's "Format listing" writes via OSWRCH for the
+// program in 'machine''s memory, after its own command has been echoed and up
+// to the end of the last line, and *output_length to its length; the caller
+// must free *output. Return false for programs we leave to ABE: ones which
+// aren't intact, or whose line number tokens run into the end of a line, or
+// which contain a token ABE doesn't know.
+bool format_program(const struct s_machine *machine, uint8_t **output,
+                    size_t *output_length);
+
+// Unpack the program in 'machine''s memory as ABE's "Unpack" does, setting
+// *output to what it writes via OSWRCH while it works (each line it changes,
+// as it is stored), *output_length to its length and *step to 0; the caller
+// must free *output. The unpacked program isn't limited by HIMEM, so it isn't
+// put back in memory. If the gaps between the line numbers are too small for
+// the new lines, which ABE would report with "Renumber line(s):", set *step
+// to the smallest RENUMBER step which would leave room instead. Return false
+// for the programs format_program() leaves to ABE and for ones containing CR
+// or whose TOP is before their end.
+bool unpack_program(const struct s_machine *machine, uint8_t **output,
+                    size_t *output_length, int *step);
+
+// vi: colorcolumn=80
+
+#endif
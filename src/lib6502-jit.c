@@ -0,0 +1,1064 @@
+/* lib6502-jit.c -- translate 6502 code to x86-64	-*- C -*- */
+
+/* With M6502_Jit, M6502_run() translates straight-line runs of 6502 code
+ * into native code, entered at any instruction and left at the first
+ * instruction which isn't translated or whose destination is unknown.
+ * Anything unusual -- callbacks, BRK and RTI, decimal mode, undefined
+ * instructions, reads and writes which might hit a callback -- is left to
+ * the interpreter, one instruction at a time, so the translator only has to
+ * get the common cases right.
+ *
+ * Translations are cached per source of each page, i.e. per mpu->pages[]
+ * entry, so each paged ROM bank keeps its own.  A write by the emulated CPU
+ * to a RAM page which has been translated discards that page's translations;
+ * writes made behind its back need M6502_written().  Translated stores also
+ * keep mpu->dirty[] up to date, as the interpreter does.
+ *
+ * Translated code counts the instructions it runs against mpu->budget
+ * exactly, but only checks the budget at backward branches within a block
+ * and between blocks, so it may overrun by up to a block.
+ *
+ * On other hosts M6502__jitRun() returns 0 and M6502_run() interprets.
+ */
+
+#define _DEFAULT_SOURCE		/* for MAP_ANONYMOUS */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib6502.h"
+#include "lib6502-jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+enum {
+  flagN= (1<<7),
+  flagV= (1<<6),
+  flagD= (1<<3),
+  flagZ= (1<<1),
+  flagC= (1<<0),
+  flagsNZCV= flagN | flagV | flagZ | flagC
+};
+
+/* per-address bits in Jit.hooks, tested by translated code before it
+   touches memory; any of them sends the instruction to the interpreter */
+enum {
+  hookRead=  1,			/* read callback */
+  hookWrite= 2,			/* write callback */
+  hookCode=  4			/* page has been translated from RAM */
+};
+
+/* values returned by translated code */
+enum {
+  exitContinue,			/* carry on at registers->pc */
+  exitStep,			/* interpret the instruction at registers->pc */
+  exitStepWrite			/* the same, and it writes to Jit.written */
+};
+
+enum {
+  codeSize=  8 << 20,		/* bytes of translated code before starting again */
+  codeSlack= 32 << 10,		/* room always left for one more translation */
+  maxInsns=  64,		/* per translation */
+  loopLimitMax= INT32_MAX - maxInsns	/* keeps Jit.looped from overflowing */
+};
+
+/* translated code keeps the 6502 registers in M6502_Registers, pointed to by
+   rbx; r12 points to memory, r13 to the Jit, r14 to mpu->pages, r15 to
+   Jit.hooks and rbp to mpu->dirty.  eax, ecx, edx, esi and edi are scratch. */
+enum {
+  rA= offsetof(M6502_Registers, a),
+  rX= offsetof(M6502_Registers, x),
+  rY= offsetof(M6502_Registers, y),
+  rP= offsetof(M6502_Registers, p),
+  rS= offsetof(M6502_Registers, s),
+  rPC= offsetof(M6502_Registers, pc)
+};
+
+typedef struct _Table Table;
+
+struct _Table
+{
+  const byte *key;		/* the mpu->pages[] entry translated from */
+  Table	     *next;
+  byte	     *entry[0x100];	/* translation of each address, or stepOnly */
+  byte	      index[0x100];	/* its instruction's index in its block */
+};
+
+typedef int (*Enter)(M6502_Registers *registers, byte *memory, void *jit, const byte **pages, byte *hooks, byte *code);
+
+typedef struct
+{
+  byte	      nzc[0x100];	/* 6502 N, Z and C for each x86 AH after LAHF */
+  uint32_t    written;		/* address for exitStepWrite */
+  int	      stale;		/* callbacks have changed */
+  byte	      hooks[0x10000];
+  byte	     *code;		/* trampoline then translations */
+  byte	     *blocks;
+  byte	     *free;
+  byte	     *limit;
+  Enter	      enter;
+  Table	     *tables[64];
+  const byte *boundKey[0x100];	/* mpu->pages[] entry bound[] was looked up for */
+  Table	     *bound[0x100];
+  byte	     *dirty;		/* mpu->dirty */
+  int32_t     exitIndex;	/* index of the last instruction run in the block left */
+  int32_t     looped;		/* instructions run by backward branches in the block */
+  int32_t     loopLimit;	/* leave the block when looped reaches this */
+} Jit;
+
+static byte stepOnly[1];
+
+
+/* instructions, from lib6502-insns.h; anything not named here is left to the
+   interpreter */
+
+#define kinds(_)							\
+  _(step, 0,	     0,	       0)					\
+  _(lda,  flagN|flagZ, 0,      R)  _(ldx, flagN|flagZ, 0, R)  _(ldy, flagN|flagZ, 0, R)	\
+  _(sta,  0,	     0,	       W)  _(stx, 0, 0, W)  _(sty, 0, 0, W)  _(stz, 0, 0, W)	\
+  _(adc,  flagsNZCV, flagC,    R)  _(sbc, flagsNZCV, flagC, R)	\
+  _(and,  flagN|flagZ, 0,      R)  _(ora, flagN|flagZ, 0, R)  _(eor, flagN|flagZ, 0, R)	\
+  _(cmp,  flagN|flagZ|flagC, 0, R) _(cpx, flagN|flagZ|flagC, 0, R)  _(cpy, flagN|flagZ|flagC, 0, R)	\
+  _(bit,  flagN|flagV|flagZ, 0, R) _(bti, flagZ, 0, R)		\
+  _(inc,  flagN|flagZ, 0,      R|W) _(dec, flagN|flagZ, 0, R|W)	\
+  _(ina,  flagN|flagZ, 0,      0)  _(dea, flagN|flagZ, 0, 0)	\
+  _(inx,  flagN|flagZ, 0,      0)  _(dex, flagN|flagZ, 0, 0)	\
+  _(iny,  flagN|flagZ, 0,      0)  _(dey, flagN|flagZ, 0, 0)	\
+  _(asl,  flagN|flagZ|flagC, 0, R|W) _(lsr, flagN|flagZ|flagC, 0, R|W)	\
+  _(rol,  flagN|flagZ|flagC, flagC, R|W) _(ror, flagN|flagZ|flagC, flagC, R|W)	\
+  _(asla, flagN|flagZ|flagC, 0, 0) _(lsra, flagN|flagZ|flagC, 0, 0)	\
+  _(rola, flagN|flagZ|flagC, flagC, 0) _(rora, flagN|flagZ|flagC, flagC, 0)	\
+  _(tax,  flagN|flagZ, 0,      0)  _(txa, flagN|flagZ, 0, 0)	\
+  _(tay,  flagN|flagZ, 0,      0)  _(tya, flagN|flagZ, 0, 0)	\
+  _(tsx,  flagN|flagZ, 0,      0)  _(txs, 0, 0, 0)		\
+  _(pha,  0,	     0,	       0)  _(php, 0, flagsNZCV, 0)	\
+  _(phx,  0,	     0,	       0)  _(phy, 0, 0, 0)		\
+  _(pla,  flagN|flagZ, 0,      0)  _(plp, flagsNZCV, 0, 0)	\
+  _(plx,  flagN|flagZ, 0,      0)  _(ply, flagN|flagZ, 0, 0)	\
+  _(clc,  flagC,     0,	       0)  _(sec, flagC, 0, 0)		\
+  _(cld,  0,	     0,	       0)  _(sed, 0, 0, 0)		\
+  _(cli,  0,	     0,	       0)  _(sei, 0, 0, 0)		\
+  _(clv,  flagV,     0,	       0)  _(nop, 0, 0, 0)		\
+  _(bcc,  0,	     flagC,    0)  _(bcs, 0, flagC, 0)		\
+  _(bne,  0,	     flagZ,    0)  _(beq, 0, flagZ, 0)		\
+  _(bpl,  0,	     flagN,    0)  _(bmi, 0, flagN, 0)		\
+  _(bvc,  0,	     flagV,    0)  _(bvs, 0, flagV, 0)		\
+  _(bra,  0,	     0,	       0)  _(jmp, 0, 0, 0)		\
+  _(jsr,  0,	     0,	       0)  _(rts, 0, 0, 0)
+
+enum { R= 1, W= 2 };
+
+#define kindEnum(name, sets, uses, access)	k_##name,
+enum { kinds(kindEnum) };
+#undef kindEnum
+
+static const struct { byte sets, uses, access; } kindInfo[]= {
+#define kindInfo(name, sets, uses, access)	{ sets, uses, access },
+  kinds(kindInfo)
+#undef kindInfo
+};
+
+#define k_brk	k_step
+#define k_rti	k_step
+#define k_ill	k_step
+#define k_tsb	k_step
+#define k_trb	k_step
+#define k_rmb0	k_step
+#define k_rmb1	k_step
+#define k_rmb2	k_step
+#define k_rmb3	k_step
+#define k_rmb4	k_step
+#define k_rmb5	k_step
+#define k_rmb6	k_step
+#define k_rmb7	k_step
+#define k_smb0	k_step
+#define k_smb1	k_step
+#define k_smb2	k_step
+#define k_smb3	k_step
+#define k_smb4	k_step
+#define k_smb5	k_step
+#define k_smb6	k_step
+#define k_smb7	k_step
+#define k_bbr0	k_step
+#define k_bbr1	k_step
+#define k_bbr2	k_step
+#define k_bbr3	k_step
+#define k_bbr4	k_step
+#define k_bbr5	k_step
+#define k_bbr6	k_step
+#define k_bbr7	k_step
+#define k_bbs0	k_step
+#define k_bbs1	k_step
+#define k_bbs2	k_step
+#define k_bbs3	k_step
+#define k_bbs4	k_step
+#define k_bbs5	k_step
+#define k_bbs6	k_step
+#define k_bbs7	k_step
+
+enum { m_implied, m_immediate, m_relative, m_zp, m_zpx, m_zpy, m_indx, m_indy, m_indzp,
+       m_abs, m_absx, m_absy, m_indirect, m_indabsx, m_zpr };
+
+static const byte lengths[]= { 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3 };
+
+#include "lib6502-insns.h"
+
+static struct { byte kind, mode; } opcodes[0x100];
+
+static void initOpcodes(void)
+{
+# define opcode(num, insn, addressing, cycles)	opcodes[0x##num].kind= k_##insn;  opcodes[0x##num].mode= m_##addressing
+  do_insns(opcode);
+# undef opcode
+}
+
+
+/* code generation */
+
+typedef struct
+{
+  word	  pc;
+  byte	  kind, mode, len;
+  word	  ea;			/* operand: immediate value, address or base address */
+  byte	  dynamic;		/* address depends on registers or memory */
+  byte	  exits;		/* may leave translated code before it executes */
+  byte	  ends;			/* nothing after it is reached */
+  byte	  needs;		/* flags it sets which are read before being set again */
+  byte	 *native;
+} Insn;
+
+typedef struct
+{
+  byte	 *at;			/* rel32 to patch */
+  byte	  kind;			/* exit* */
+  int	  last;			/* index of the last instruction run before it */
+  byte	  dynamic;		/* written address is in ecx */
+  word	  pc;
+  word	  addr;
+} Fixup;
+
+typedef struct
+{
+  M6502	 *mpu;
+  Jit	 *jit;
+  byte	 *out;
+  Insn	  insns[maxInsns];
+  int	  count;
+  Fixup	  fixups[3 * maxInsns + 1];
+  int	  nfixups;
+} Translation;
+
+static void emit(Translation *t, int n, ...)
+{
+  va_list ap;
+  va_start(ap, n);
+  while (n--) *t->out++= (byte)va_arg(ap, int);
+  va_end(ap);
+}
+
+static void emit16(Translation *t, unsigned int v)	{ emit(t, 2, v, v >> 8); }
+static void emit32(Translation *t, uint32_t v)		{ emit(t, 4, v, v >> 8, v >> 16, v >> 24); }
+
+#define jz	0x84
+#define jnz	0x85
+#define jmp	-1
+
+/* jump (conditionally) to a stub which leaves translated code, or to the
+   translation of PC if it is in this block */
+static void exitTo(Translation *t, int cc, int kind, int last, word pc, word addr, int dynamic)
+{
+  Fixup *f= &t->fixups[t->nfixups++];
+  if (cc == jmp) emit(t, 1, 0xe9);  else emit(t, 2, 0x0f, cc);
+  f->at= t->out;
+  emit32(t, 0);
+  f->kind= kind;
+  f->last= last;
+  f->pc= pc;
+  f->addr= addr;
+  f->dynamic= dynamic;
+}
+
+static int indexOf(Translation *t, Insn *in)
+{
+  return in - t->insns;
+}
+
+static void stepAt(Translation *t, int cc, Insn *in)
+{
+  exitTo(t, cc, exitStep, indexOf(t, in) - 1, in->pc, 0, 0);
+}
+
+static void stepWrite(Translation *t, int cc, Insn *in)
+{
+  exitTo(t, cc, exitStepWrite, indexOf(t, in) - 1, in->pc, in->ea, in->dynamic);
+}
+
+/* IN, which has run, continues at PC */
+static void gotoPC(Translation *t, int cc, Insn *in, word pc)
+{
+  exitTo(t, cc, exitContinue, indexOf(t, in), pc, 0, 0);
+}
+
+static void setExitIndex(Translation *t, int last)
+{
+  emit(t, 3, 0x41, 0xc7, 0x85);  emit32(t, offsetof(Jit, exitIndex));  emit32(t, last);	/* mov [r13+exitIndex], last */
+}
+
+/* P.flags in NEED= x86 SF, ZF and CF (inverted if BORROW), OF, and AL for
+   C if CARRYINAL */
+static void setFlags(Translation *t, int need, int borrow, int carryInAL)
+{
+  if (!need) return;
+  if (need & flagV)		emit(t, 4, 0x40, 0x0f, 0x90, 0xc7);		/* seto dil */
+  if (borrow && (need & flagC))	emit(t, 1, 0xf5);				/* cmc */
+  emit(t, 1, 0x9f);								/* lahf */
+  emit(t, 3, 0x0f, 0xb6, 0xf4);							/* movzx esi, ah */
+  emit(t, 6, 0x41, 0x0f, 0xb6, 0x74, 0x35, offsetof(Jit, nzc));			/* movzx esi, [r13+rsi+nzc] */
+  if (need & flagV)
+    {
+      emit(t, 4, 0x40, 0x0f, 0xb6, 0xff);					/* movzx edi, dil */
+      emit(t, 3, 0xc1, 0xe7, 0x06);						/* shl edi, 6 */
+      emit(t, 2, 0x09, 0xfe);							/* or esi, edi */
+    }
+  if (carryInAL)
+    {
+      emit(t, 3, 0x0f, 0xb6, 0xc0);						/* movzx eax, al */
+      emit(t, 2, 0x09, 0xc6);							/* or esi, eax */
+    }
+  emit(t, 3, 0x83, 0xe6, need);							/* and esi, need */
+  emit(t, 4, 0x80, 0x63, rP, ~need);						/* and [rbx+P], ~need */
+  emit(t, 4, 0x40, 0x08, 0x73, rP);						/* or [rbx+P], sil */
+}
+
+/* set N and Z from DL */
+static void testFlags(Translation *t, int need)
+{
+  if (!need) return;
+  emit(t, 2, 0x84, 0xd2);							/* test dl, dl */
+  setFlags(t, need, 0, 0);
+}
+
+/* ecx= the address of a dynamic operand */
+static void address(Translation *t, Insn *in)
+{
+  switch (in->mode)
+    {
+    case m_zpx:
+    case m_zpy:
+      emit(t, 4, 0x0f, 0xb6, 0x4b, in->mode == m_zpx ? rX : rY);		/* movzx ecx, [rbx+X] */
+      emit(t, 3, 0x80, 0xc1, in->ea);						/* add cl, zp */
+      break;
+    case m_absx:
+    case m_absy:
+      emit(t, 4, 0x0f, 0xb6, 0x4b, in->mode == m_absx ? rX : rY);		/* movzx ecx, [rbx+X] */
+      emit(t, 2, 0x81, 0xc1);  emit32(t, in->ea);				/* add ecx, abs */
+      emit(t, 3, 0x0f, 0xb7, 0xc9);						/* movzx ecx, cx */
+      break;
+    case m_indx:
+      /* like the interpreter, the pointer isn't wrapped within zero page */
+      emit(t, 4, 0x0f, 0xb6, 0x4b, rX);						/* movzx ecx, [rbx+X] */
+      emit(t, 3, 0x80, 0xc1, in->ea);						/* add cl, zp */
+      emit(t, 6, 0x41, 0x0f, 0xb6, 0x44, 0x0c, 0x01);				/* movzx eax, [r12+rcx+1] */
+      emit(t, 5, 0x41, 0x0f, 0xb6, 0x0c, 0x0c);					/* movzx ecx, [r12+rcx] */
+      emit(t, 3, 0xc1, 0xe0, 0x08);						/* shl eax, 8 */
+      emit(t, 2, 0x09, 0xc1);							/* or ecx, eax */
+      break;
+    case m_indy:
+    case m_indzp:
+      emit(t, 5, 0x41, 0x0f, 0xb6, 0x8c, 0x24);  emit32(t, in->ea);		/* movzx ecx, [r12+zp] */
+      emit(t, 5, 0x41, 0x0f, 0xb6, 0x84, 0x24);  emit32(t, in->ea + 1);	/* movzx eax, [r12+zp+1] */
+      emit(t, 3, 0xc1, 0xe0, 0x08);						/* shl eax, 8 */
+      emit(t, 2, 0x09, 0xc1);							/* or ecx, eax */
+      if (in->mode == m_indy)
+	{
+	  emit(t, 4, 0x0f, 0xb6, 0x43, rY);					/* movzx eax, [rbx+Y] */
+	  emit(t, 2, 0x01, 0xc1);						/* add ecx, eax */
+	  emit(t, 3, 0x0f, 0xb7, 0xc9);						/* movzx ecx, cx */
+	}
+      break;
+    }
+}
+
+/* leave the instruction to the interpreter if any of MASK is set for ecx */
+static void testHooks(Translation *t, Insn *in, int mask)
+{
+  emit(t, 5, 0x41, 0xf6, 0x04, 0x0f, mask);					/* test [r15+rcx], mask */
+  if (mask & (hookWrite | hookCode))
+    stepWrite(t, jnz, in);
+  else
+    stepAt(t, jnz, in);
+}
+
+/* dl= the byte at the operand's address, read as the interpreter does */
+static void load(Translation *t, Insn *in)
+{
+  if (!in->dynamic)
+    {
+      if (in->ea < 0x200)	/* zero page and the stack can't be mapped */
+	{
+	  emit(t, 4, 0x41, 0x8a, 0x94, 0x24);  emit32(t, in->ea);		/* mov dl, [r12+ea] */
+	}
+      else
+	{
+	  emit(t, 3, 0x49, 0x8b, 0xb6);  emit32(t, (in->ea >> 8) * 8);		/* mov rsi, [r14+page*8] */
+	  emit(t, 2, 0x8a, 0x96);  emit32(t, in->ea & 0xff);			/* mov dl, [rsi+offset] */
+	}
+    }
+  else if (in->mode == m_zpx || in->mode == m_zpy)
+    emit(t, 4, 0x41, 0x8a, 0x14, 0x0c);						/* mov dl, [r12+rcx] */
+  else
+    {
+      emit(t, 2, 0x89, 0xce);							/* mov esi, ecx */
+      emit(t, 3, 0xc1, 0xee, 0x08);						/* shr esi, 8 */
+      emit(t, 4, 0x49, 0x8b, 0x34, 0xf6);					/* mov rsi, [r14+rsi*8] */
+      emit(t, 3, 0x0f, 0xb6, 0xf9);						/* movzx edi, cl */
+      emit(t, 3, 0x8a, 0x14, 0x3e);						/* mov dl, [rsi+rdi] */
+    }
+}
+
+/* write dl to the operand's address */
+static void store(Translation *t, Insn *in)
+{
+  if (!in->dynamic)
+    {
+      emit(t, 4, 0x41, 0x88, 0x94, 0x24);  emit32(t, in->ea);			/* mov [r12+ea], dl */
+      if (in->ea >= 0x200)
+	{
+	  emit(t, 2, 0xc6, 0x85);  emit32(t, in->ea >> 8);  emit(t, 1, 1);	/* mov byte [rbp+page], 1 */
+	}
+    }
+  else
+    {
+      emit(t, 4, 0x41, 0x88, 0x14, 0x0c);					/* mov [r12+rcx], dl */
+      emit(t, 3, 0x0f, 0xb6, 0xf5);						/* movzx esi, ch */
+      emit(t, 5, 0xc6, 0x44, 0x35, 0x00, 0x01);					/* mov byte [rbp+rsi], 1 */
+    }
+}
+
+/* dl= the operand of an instruction which only reads it */
+static void operand(Translation *t, Insn *in)
+{
+  if (in->mode == m_immediate)
+    emit(t, 2, 0xb2, in->ea);							/* mov dl, imm */
+  else
+    {
+      if (in->dynamic)
+	{
+	  address(t, in);
+	  testHooks(t, in, hookRead);
+	}
+      load(t, in);
+    }
+}
+
+/* start an instruction which writes its operand (and reads it if READS) */
+static void destination(Translation *t, Insn *in, int reads)
+{
+  if (in->dynamic)
+    {
+      address(t, in);
+      testHooks(t, in, hookWrite | hookCode | (reads ? hookRead : 0));
+    }
+  else if (in->ea >= 0x200)
+    {
+      emit(t, 3, 0x41, 0xf6, 0x87);  emit32(t, in->ea);  emit(t, 1, hookCode);	/* test [r15+ea], hookCode */
+      stepWrite(t, jnz, in);
+    }
+  if (reads)
+    load(t, in);
+}
+
+static int regOf(int kind)
+{
+  switch (kind)
+    {
+    case k_ldx: case k_stx: case k_cpx: case k_inx: case k_dex: case k_phx: case k_plx:
+      return rX;
+    case k_ldy: case k_sty: case k_cpy: case k_iny: case k_dey: case k_phy: case k_ply:
+      return rY;
+    }
+  return rA;
+}
+
+static void push(Translation *t)
+{
+  emit(t, 4, 0x0f, 0xb6, 0x4b, rS);						/* movzx ecx, [rbx+S] */
+  emit(t, 8, 0x41, 0x88, 0x94, 0x0c, 0x00, 0x01, 0x00, 0x00);			/* mov [r12+rcx+0x100], dl */
+  emit(t, 3, 0xfe, 0x4b, rS);							/* dec byte [rbx+S] */
+}
+
+static void pull(Translation *t)
+{
+  emit(t, 3, 0xfe, 0x43, rS);							/* inc byte [rbx+S] */
+  emit(t, 4, 0x0f, 0xb6, 0x4b, rS);						/* movzx ecx, [rbx+S] */
+  emit(t, 8, 0x41, 0x8a, 0x94, 0x0c, 0x00, 0x01, 0x00, 0x00);			/* mov dl, [r12+rcx+0x100] */
+}
+
+static void translateInsn(Translation *t, Insn *in)
+{
+  int r= regOf(in->kind);
+
+  switch (in->kind)
+    {
+    case k_lda: case k_ldx: case k_ldy:
+      operand(t, in);
+      emit(t, 3, 0x88, 0x53, r);						/* mov [rbx+r], dl */
+      testFlags(t, in->needs);
+      break;
+
+    case k_sta: case k_stx: case k_sty: case k_stz:
+      destination(t, in, 0);
+      if (in->kind == k_stz)
+	emit(t, 2, 0x31, 0xd2);							/* xor edx, edx */
+      else
+	emit(t, 3, 0x8a, 0x53, r);						/* mov dl, [rbx+r] */
+      store(t, in);
+      break;
+
+    case k_adc: case k_sbc:
+      emit(t, 4, 0xf6, 0x43, rP, flagD);					/* test [rbx+P], D */
+      stepAt(t, jnz, in);
+      operand(t, in);
+      emit(t, 5, 0x0f, 0xba, 0x63, rP, 0);					/* bt [rbx+P], 0 */
+      if (in->kind == k_adc)
+	emit(t, 2, 0x10, 0x13);							/* adc [rbx+A], dl */
+      else
+	emit(t, 3, 0xf5, 0x18, 0x13);						/* cmc; sbb [rbx+A], dl */
+      setFlags(t, in->needs, in->kind == k_sbc, 0);
+      break;
+
+    case k_and: case k_ora: case k_eor:
+      operand(t, in);
+      emit(t, 2, in->kind == k_and ? 0x20 : in->kind == k_ora ? 0x08 : 0x30, 0x13);	/* op [rbx+A], dl */
+      setFlags(t, in->needs, 0, 0);
+      break;
+
+    case k_cmp: case k_cpx: case k_cpy:
+      operand(t, in);
+      emit(t, 3, 0x38, 0x53, r);						/* cmp [rbx+r], dl */
+      setFlags(t, in->needs, 1, 0);
+      break;
+
+    case k_bit:
+      operand(t, in);
+      if (in->needs)
+	{
+	  emit(t, 2, 0x84, 0x13);						/* test [rbx+A], dl */
+	  emit(t, 3, 0x0f, 0x94, 0xc0);						/* setz al */
+	  emit(t, 2, 0x00, 0xc0);						/* add al, al */
+	  emit(t, 3, 0x80, 0xe2, flagN | flagV);				/* and dl, N|V */
+	  emit(t, 2, 0x08, 0xc2);						/* or dl, al */
+	  emit(t, 3, 0x80, 0xe2, in->needs);					/* and dl, need */
+	  emit(t, 4, 0x80, 0x63, rP, ~in->needs);				/* and [rbx+P], ~need */
+	  emit(t, 3, 0x08, 0x53, rP);						/* or [rbx+P], dl */
+	}
+      break;
+
+    case k_bti:
+      if (in->needs)
+	{
+	  emit(t, 2, 0xb2, in->ea);						/* mov dl, imm */
+	  emit(t, 2, 0x84, 0x13);						/* test [rbx+A], dl */
+	  emit(t, 3, 0x0f, 0x94, 0xc0);						/* setz al */
+	  emit(t, 2, 0x00, 0xc0);						/* add al, al */
+	  emit(t, 4, 0x80, 0x63, rP, ~flagZ);					/* and [rbx+P], ~Z */
+	  emit(t, 3, 0x08, 0x43, rP);						/* or [rbx+P], al */
+	}
+      break;
+
+    case k_inc: case k_dec: case k_asl: case k_lsr: case k_rol: case k_ror:
+    case k_asla: case k_lsra: case k_rola: case k_rora:
+      {
+	int rotate= in->kind == k_rol || in->kind == k_ror || in->kind == k_rola || in->kind == k_rora;
+	int accumulator= in->mode == m_implied;
+	if (accumulator)
+	  emit(t, 2, 0x8a, 0x13);						/* mov dl, [rbx+A] */
+	else
+	  destination(t, in, 1);
+	if (rotate)
+	  emit(t, 5, 0x0f, 0xba, 0x63, rP, 0);					/* bt [rbx+P], 0 */
+	switch (in->kind)
+	  {
+	  case k_inc:			emit(t, 2, 0xfe, 0xc2);  break;		/* inc dl */
+	  case k_dec:			emit(t, 2, 0xfe, 0xca);  break;		/* dec dl */
+	  case k_asl:  case k_asla:	emit(t, 2, 0xd0, 0xe2);  break;		/* shl dl, 1 */
+	  case k_lsr:  case k_lsra:	emit(t, 2, 0xd0, 0xea);  break;		/* shr dl, 1 */
+	  case k_rol:  case k_rola:	emit(t, 2, 0xd0, 0xd2);  break;		/* rcl dl, 1 */
+	  case k_ror:  case k_rora:	emit(t, 2, 0xd0, 0xda);  break;		/* rcr dl, 1 */
+	  }
+	if (rotate)
+	  emit(t, 3, 0x0f, 0x92, 0xc0);						/* setc al */
+	if (accumulator)
+	  emit(t, 2, 0x88, 0x13);						/* mov [rbx+A], dl */
+	else
+	  store(t, in);
+	if (rotate)
+	  {
+	    if (in->needs)
+	      {
+		emit(t, 2, 0x84, 0xd2);						/* test dl, dl */
+		setFlags(t, in->needs, 0, 1);
+	      }
+	  }
+	else
+	  setFlags(t, in->needs, 0, 0);
+	break;
+      }
+
+    case k_ina: case k_inx: case k_iny:
+      emit(t, 3, 0xfe, 0x43, r);						/* inc byte [rbx+r] */
+      setFlags(t, in->needs, 0, 0);
+      break;
+
+    case k_dea: case k_dex: case k_dey:
+      emit(t, 3, 0xfe, 0x4b, r);						/* dec byte [rbx+r] */
+      setFlags(t, in->needs, 0, 0);
+      break;
+
+    case k_tax: case k_txa: case k_tay: case k_tya: case k_tsx: case k_txs:
+      {
+	static const byte from[]= { [k_tax]= rA, [k_txa]= rX, [k_tay]= rA, [k_tya]= rY, [k_tsx]= rS, [k_txs]= rX };
+	static const byte to[]=   { [k_tax]= rX, [k_txa]= rA, [k_tay]= rY, [k_tya]= rA, [k_tsx]= rX, [k_txs]= rS };
+	emit(t, 3, 0x8a, 0x53, from[in->kind]);					/* mov dl, [rbx+from] */
+	emit(t, 3, 0x88, 0x53, to[in->kind]);					/* mov [rbx+to], dl */
+	testFlags(t, in->needs);
+	break;
+      }
+
+    case k_pha: case k_phx: case k_phy: case k_php:
+      emit(t, 3, 0x8a, 0x53, in->kind == k_php ? rP : r);			/* mov dl, [rbx+r] */
+      if (in->kind == k_php)
+	emit(t, 3, 0x80, 0xca, 0x30);						/* or dl, X|B */
+      push(t);
+      break;
+
+    case k_pla: case k_plx: case k_ply: case k_plp:
+      pull(t);
+      emit(t, 3, 0x88, 0x53, in->kind == k_plp ? rP : r);			/* mov [rbx+r], dl */
+      if (in->kind != k_plp)
+	testFlags(t, in->needs);
+      break;
+
+    case k_clc: case k_cld: case k_cli: case k_clv:
+      {
+	static const byte flag[]= { [k_clc]= flagC, [k_cld]= flagD, [k_cli]= 1<<2, [k_clv]= flagV };
+	emit(t, 4, 0x80, 0x63, rP, ~flag[in->kind]);				/* and [rbx+P], ~flag */
+	break;
+      }
+
+    case k_sec: case k_sed: case k_sei:
+      {
+	static const byte flag[]= { [k_sec]= flagC, [k_sed]= flagD, [k_sei]= 1<<2 };
+	emit(t, 4, 0x80, 0x4b, rP, flag[in->kind]);				/* or [rbx+P], flag */
+	break;
+      }
+
+    case k_nop:
+      break;
+
+    case k_bcc: case k_bcs: case k_bne: case k_beq: case k_bpl: case k_bmi: case k_bvc: case k_bvs:
+      {
+	static const byte flag[]= { [k_bcc]= flagC, [k_bcs]= flagC, [k_bne]= flagZ, [k_beq]= flagZ,
+				    [k_bpl]= flagN, [k_bmi]= flagN, [k_bvc]= flagV, [k_bvs]= flagV };
+	int ifSet= in->kind == k_bcs || in->kind == k_beq || in->kind == k_bmi || in->kind == k_bvs;
+	emit(t, 4, 0xf6, 0x43, rP, flag[in->kind]);				/* test [rbx+P], flag */
+	gotoPC(t, ifSet ? jnz : jz, in, in->ea);
+	break;
+      }
+
+    case k_bra: case k_jmp:
+      gotoPC(t, jmp, in, in->ea);
+      break;
+
+    case k_jsr:
+      {
+	word ret= in->pc + 2;
+	emit(t, 4, 0x0f, 0xb6, 0x4b, rS);					/* movzx ecx, [rbx+S] */
+	emit(t, 9, 0x41, 0xc6, 0x84, 0x0c, 0x00, 0x01, 0x00, 0x00, ret >> 8);	/* mov [r12+rcx+0x100], hi */
+	emit(t, 2, 0xfe, 0xc9);							/* dec cl */
+	emit(t, 9, 0x41, 0xc6, 0x84, 0x0c, 0x00, 0x01, 0x00, 0x00, ret & 0xff);	/* mov [r12+rcx+0x100], lo */
+	emit(t, 2, 0xfe, 0xc9);							/* dec cl */
+	emit(t, 3, 0x88, 0x4b, rS);						/* mov [rbx+S], cl */
+	gotoPC(t, jmp, in, in->ea);
+	break;
+      }
+
+    case k_rts:
+      emit(t, 4, 0x0f, 0xb6, 0x4b, rS);						/* movzx ecx, [rbx+S] */
+      emit(t, 2, 0xfe, 0xc1);							/* inc cl */
+      emit(t, 9, 0x41, 0x0f, 0xb6, 0x84, 0x0c, 0x00, 0x01, 0x00, 0x00);		/* movzx eax, [r12+rcx+0x100] */
+      emit(t, 2, 0xfe, 0xc1);							/* inc cl */
+      emit(t, 9, 0x41, 0x0f, 0xb6, 0x94, 0x0c, 0x00, 0x01, 0x00, 0x00);		/* movzx edx, [r12+rcx+0x100] */
+      emit(t, 3, 0x88, 0x4b, rS);						/* mov [rbx+S], cl */
+      emit(t, 3, 0xc1, 0xe2, 0x08);						/* shl edx, 8 */
+      emit(t, 2, 0x09, 0xd0);							/* or eax, edx */
+      emit(t, 2, 0xff, 0xc0);							/* inc eax */
+      emit(t, 4, 0x66, 0x89, 0x43, rPC);					/* mov [rbx+PC], ax */
+      setExitIndex(t, indexOf(t, in));
+      emit(t, 3, 0x31, 0xc0, 0xc3);						/* xor eax, eax; ret */
+      break;
+    }
+}
+
+/* code for F to jump to: a stub which leaves translated code, or the code for
+   its destination in this block, via one which keeps count if that skips or
+   repeats instructions */
+static byte *resolve(Translation *t, Fixup *f)
+{
+  byte *stub= t->out;
+  int i;
+
+  if (f->kind == exitContinue)
+    for (i= 0;  i < t->count;  ++i)
+      if (t->insns[i].pc == f->pc)
+	{
+	  if (i == f->last + 1)
+	    return t->insns[i].native;
+	  emit(t, 3, 0x41, 0x81, 0x85);  emit32(t, offsetof(Jit, looped));  emit32(t, f->last + 1 - i);	/* add [r13+looped], last+1-i */
+	  if (i > f->last)
+	    {
+	      emit(t, 1, 0xe9);  emit32(t, t->insns[i].native - (t->out + 4));	/* jmp insn */
+	      return stub;
+	    }
+	  emit(t, 3, 0x41, 0x8b, 0x85);  emit32(t, offsetof(Jit, looped));	/* mov eax, [r13+looped] */
+	  emit(t, 3, 0x41, 0x3b, 0x85);  emit32(t, offsetof(Jit, loopLimit));	/* cmp eax, [r13+loopLimit] */
+	  emit(t, 2, 0x0f, 0x8c);  emit32(t, t->insns[i].native - (t->out + 4));	/* jl insn */
+	  f->last= i - 1;
+	  break;
+	}
+  setExitIndex(t, f->last);
+  if (f->kind == exitStepWrite)
+    {
+      if (f->dynamic)
+	{
+	  emit(t, 3, 0x41, 0x89, 0x8d);  emit32(t, offsetof(Jit, written));	/* mov [r13+written], ecx */
+	}
+      else
+	{
+	  emit(t, 3, 0x41, 0xc7, 0x85);  emit32(t, offsetof(Jit, written));	/* mov [r13+written], addr */
+	  emit32(t, f->addr);
+	}
+    }
+  emit(t, 4, 0x66, 0xc7, 0x43, rPC);  emit16(t, f->pc);				/* mov [rbx+PC], pc */
+  emit(t, 1, 0xb8);  emit32(t, f->kind);					/* mov eax, kind */
+  emit(t, 1, 0xc3);								/* ret */
+  return stub;
+}
+
+
+/* translation */
+
+static int decode(M6502 *mpu, const byte *src, word pc, Insn *in)
+{
+  int op= src[pc & 0xff];
+  int lo, hi, access;
+
+  in->pc= pc;
+  in->kind= opcodes[op].kind;
+  in->mode= opcodes[op].mode;
+  in->len= lengths[in->mode];
+  if (in->kind == k_step || (pc & 0xff) + in->len > 0x100)
+    return 0;
+  lo= (in->len > 1) ? src[(pc + 1) & 0xff] : 0;
+  hi= (in->len > 2) ? src[(pc + 2) & 0xff] : 0;
+  in->ea= lo | (hi << 8);
+  if (in->mode == m_relative)
+    in->ea= pc + 2 + (int8_t)lo;
+  in->dynamic= (in->mode >= m_zpx && in->mode <= m_indzp) || in->mode == m_absx || in->mode == m_absy;
+  access= (in->mode == m_immediate || in->mode == m_implied) ? 0 : kindInfo[in->kind].access;
+
+  if (in->kind == k_jmp && in->mode != m_abs)
+    return 0;
+  if (!in->dynamic)
+    {
+      if ((access & R) && M6502_lookupCallback(&mpu->callbacks->read, in->ea))
+	return 0;
+      if ((access & W) && M6502_lookupCallback(&mpu->callbacks->write, in->ea))
+	return 0;
+    }
+  if ((in->kind == k_jmp || in->kind == k_jsr) && M6502_lookupCallback(&mpu->callbacks->call, in->ea))
+    return 0;
+
+  in->exits= (in->dynamic && access)
+    || (!in->dynamic && (access & W) && in->ea >= 0x200)
+    || in->kind == k_adc || in->kind == k_sbc
+    || (in->kind >= k_bcc && in->kind <= k_bvs);
+  in->ends= in->kind == k_bra || in->kind == k_jmp || in->kind == k_jsr || in->kind == k_rts;
+  return 1;
+}
+
+static void invalidatePage(M6502 *mpu, Jit *jit, int page)
+{
+  const byte *key= mpu->memory + (page << 8);
+  Table *t;
+  int i;
+
+  for (i= 0;  i < 0x100;  ++i)
+    jit->hooks[(page << 8) + i] &= ~hookCode;
+  for (t= jit->tables[((uintptr_t)key >> 8) & 63];  t;  t= t->next)
+    if (t->key == key)
+      memset(t->entry, 0, sizeof(t->entry));
+}
+
+static byte *translate(M6502 *mpu, Jit *jit, Table *table, word start)
+{
+  Translation t;
+  int page= start >> 8;
+  word pc= start;
+  int stopped= 0;
+  int live, i;
+
+  t.mpu= mpu;
+  t.jit= jit;
+  t.count= 0;
+  t.nfixups= 0;
+
+  /* zero page and the stack are written directly by the interpreter, so code
+     there is never translated */
+  if (page < 2)
+    return table->entry[start & 0xff]= stepOnly;
+  while (t.count < maxInsns)
+    {
+      Insn *in= &t.insns[t.count];
+      if (!decode(mpu, table->key, pc, in))
+	{
+	  stopped= 1;
+	  break;
+	}
+      ++t.count;
+      pc += in->len;
+      if (in->ends || (pc >> 8) != page)
+	break;
+    }
+  if (!t.count)
+    return table->entry[start & 0xff]= stepOnly;
+
+  /* flags which nothing reads before they're set again needn't be computed;
+     all of them must be right whenever translated code might be left */
+  live= flagsNZCV;
+  for (i= t.count - 1;  i >= 0;  --i)
+    {
+      Insn *in= &t.insns[i];
+      in->needs= kindInfo[in->kind].sets & live;
+      live= (live & ~kindInfo[in->kind].sets) | kindInfo[in->kind].uses;
+      if (in->exits)
+	live= flagsNZCV;
+    }
+
+  t.out= jit->free;
+  for (i= 0;  i < t.count;  ++i)
+    {
+      t.insns[i].native= t.out;
+      translateInsn(&t, &t.insns[i]);
+    }
+  if (!t.insns[t.count - 1].ends)
+    exitTo(&t, jmp, stopped ? exitStep : exitContinue, t.count - 1, pc, 0, 0);
+  for (i= 0;  i < t.nfixups;  ++i)
+    {
+      Fixup *f= &t.fixups[i];
+      byte  *to= resolve(&t, f);
+      int32_t rel= to - (f->at + 4);
+      memcpy(f->at, &rel, 4);
+    }
+  jit->free= t.out;
+
+  if (table->key == mpu->memory + (page << 8))
+    for (i= 0;  i < 0x100;  ++i)
+      jit->hooks[(page << 8) + i] |= hookCode;
+  for (i= 0;  i < t.count;  ++i)
+    if (!table->entry[t.insns[i].pc & 0xff])
+      {
+	table->entry[t.insns[i].pc & 0xff]= t.insns[i].native;
+	table->index[t.insns[i].pc & 0xff]= i;
+      }
+  table->entry[start & 0xff]= t.insns[0].native;
+  table->index[start & 0xff]= 0;
+  return t.insns[0].native;
+}
+
+
+/* the cache */
+
+static void flush(Jit *jit)
+{
+  int i;
+  for (i= 0;  i < 64;  ++i)
+    while (jit->tables[i])
+      {
+	Table *t= jit->tables[i];
+	jit->tables[i]= t->next;
+	free(t);
+      }
+  memset(jit->boundKey, 0, sizeof(jit->boundKey));
+  for (i= 0;  i < 0x10000;  ++i)
+    jit->hooks[i] &= ~hookCode;
+  jit->free= jit->blocks;
+}
+
+static void hookCallbacks(M6502 *mpu, Jit *jit)
+{
+  int addr;
+  for (addr= 0;  addr < 0x10000;  ++addr)
+    jit->hooks[addr]= (M6502_lookupCallback(&mpu->callbacks->read,  addr) ? hookRead  : 0)
+		    | (M6502_lookupCallback(&mpu->callbacks->write, addr) ? hookWrite : 0);
+  jit->stale= 0;
+}
+
+static byte *lookup(M6502 *mpu, Jit *jit, word pc)
+{
+  int page= pc >> 8;
+  const byte *key= mpu->pages[page];
+  Table *t= jit->bound[page];
+  byte *code;
+
+  if (jit->boundKey[page] != key)
+    {
+      Table **bucket= &jit->tables[((uintptr_t)key >> 8) & 63];
+      for (t= *bucket;  t && t->key != key;  t= t->next);
+      if (!t)
+	{
+	  if (!(t= calloc(1, sizeof(Table))))
+	    return stepOnly;
+	  t->key= key;
+	  t->next= *bucket;
+	  *bucket= t;
+	}
+      jit->boundKey[page]= key;
+      jit->bound[page]= t;
+    }
+  code= t->entry[pc & 0xff];
+  return code ? code : translate(mpu, jit, t, pc);
+}
+
+static Jit *newJit(M6502 *mpu)
+{
+  Jit *jit= calloc(1, sizeof(Jit));
+  Translation t;
+  int i;
+
+  if (!jit) return 0;
+  jit->code= mmap(0, codeSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED)
+    {
+      free(jit);
+      return 0;
+    }
+  jit->limit= jit->code + codeSize;
+  jit->dirty= mpu->dirty;
+
+  /* enter(registers, memory, jit, pages, hooks, code) */
+  t.out= jit->code;
+  emit(&t, 1, 0x53);								/* push rbx */
+  emit(&t, 1, 0x55);								/* push rbp */
+  emit(&t, 8, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);			/* push r12-r15 */
+  emit(&t, 4, 0x48, 0x83, 0xec, 0x08);						/* sub rsp, 8 */
+  emit(&t, 3, 0x48, 0x89, 0xfb);						/* mov rbx, rdi */
+  emit(&t, 3, 0x48, 0x8b, 0xaa);  emit32(&t, offsetof(Jit, dirty));		/* mov rbp, [rdx+dirty] */
+  emit(&t, 3, 0x49, 0x89, 0xf4);						/* mov r12, rsi */
+  emit(&t, 3, 0x49, 0x89, 0xd5);						/* mov r13, rdx */
+  emit(&t, 3, 0x49, 0x89, 0xce);						/* mov r14, rcx */
+  emit(&t, 3, 0x4d, 0x89, 0xc7);						/* mov r15, r8 */
+  emit(&t, 3, 0x41, 0xff, 0xd1);						/* call r9 */
+  emit(&t, 4, 0x48, 0x83, 0xc4, 0x08);						/* add rsp, 8 */
+  emit(&t, 8, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c);			/* pop r15-r12 */
+  emit(&t, 1, 0x5d);								/* pop rbp */
+  emit(&t, 1, 0x5b);								/* pop rbx */
+  emit(&t, 1, 0xc3);								/* ret */
+  jit->enter= (Enter)jit->code;
+  jit->blocks= jit->free= t.out;
+
+  for (i= 0;  i < 0x100;  ++i)
+    jit->nzc[i]= (i & 0x80 ? flagN : 0) | (i & 0x40 ? flagZ : 0) | (i & 0x01 ? flagC : 0);
+  hookCallbacks(mpu, jit);
+  initOpcodes();
+  return jit;
+}
+
+int M6502__jitRun(M6502 *mpu)
+{
+  Jit *jit= mpu->jit;
+  int stop;
+
+  if (!jit && !(jit= mpu->jit= newJit(mpu)))
+    {
+      mpu->flags &= ~M6502_Jit;
+      return 0;
+    }
+  for (;;)
+    {
+      byte *code;
+      int status;
+
+      if (jit->stale)
+	{
+	  flush(jit);
+	  hookCallbacks(mpu, jit);
+	}
+      if (jit->limit - jit->free < codeSlack)
+	flush(jit);
+      if (mpu->budget <= 0)
+	return M6502_OutOfBudget;
+      code= lookup(mpu, jit, mpu->registers->pc);
+      if (code == stepOnly)
+	status= exitStep;
+      else
+	{
+	  int entryIndex= jit->bound[mpu->registers->pc >> 8]->index[mpu->registers->pc & 0xff];
+	  jit->looped= 0;
+	  /* leave room for the last backward branch to overshoot the limit */
+	  jit->loopLimit= mpu->budget < loopLimitMax ? mpu->budget : loopLimitMax;
+	  status= jit->enter(mpu->registers, mpu->memory, jit, mpu->pages, jit->hooks, code);
+	  mpu->budget -= (int64_t)jit->exitIndex - entryIndex + 1 + jit->looped;
+	}
+      if (status != exitContinue)
+	{
+	  if ((stop= M6502_step(mpu)))
+	    return stop;
+	  if (status == exitStepWrite && (jit->hooks[jit->written] & hookCode))
+	    invalidatePage(mpu, jit, jit->written >> 8);
+	}
+    }
+}
+
+void M6502__jitInvalidate(M6502 *mpu, unsigned int addr, unsigned int size)
+{
+  Jit *jit= mpu->jit;
+  unsigned int page;
+
+  if (!jit || !size) return;
+  for (page= addr >> 8;  page <= ((addr + size - 1) >> 8) && page < 0x100;  ++page)
+    if (jit->hooks[page << 8] & hookCode)
+      invalidatePage(mpu, jit, page);
+}
+
+void M6502__jitCallbacksChanged(M6502 *mpu)
+{
+  if (mpu->jit)
+    ((Jit *)mpu->jit)->stale= 1;
+}
+
+void M6502__jitDelete(M6502 *mpu)
+{
+  Jit *jit= mpu->jit;
+
+  if (!jit) return;
+  flush(jit);
+  munmap(jit->code, codeSize);
+  free(jit);
+  mpu->jit= 0;
+}
+
+#else /* no translator for this host */
+
+int  M6502__jitRun(M6502 *mpu)						{ mpu->flags &= ~M6502_Jit;  return 0; }
+void M6502__jitInvalidate(M6502 *mpu, unsigned int addr, unsigned int size)	{}
+void M6502__jitCallbacksChanged(M6502 *mpu)				{}
+void M6502__jitDelete(M6502 *mpu)					{}
+
+#endif
@@ -0,0 +1,16 @@
+/* lib6502-jit.h -- interface between lib6502.c and lib6502-jit.c	-*- C -*- */
+
+#ifndef __m6502_jit_h
+#define __m6502_jit_h
+
+#include "lib6502.h"
+
+/* run translated code; returns 0 at once if the translator can't be used on
+   this host, otherwise what M6502_run() returns */
+extern int  M6502__jitRun(M6502 *mpu);
+
+extern void M6502__jitInvalidate(M6502 *mpu, unsigned int addr, unsigned int size);
+extern void M6502__jitCallbacksChanged(M6502 *mpu);
+extern void M6502__jitDelete(M6502 *mpu);
+
+#endif /* __m6502_jit_h */
@@ -0,0 +1,179 @@
+/* lib6502-run.h -- M6502_run() template	-*- C -*- */
+
+/* Included by lib6502.c once per run loop variant, with RUN_NAME defined as
+ * the name of the function to define and RUN_POLL and RUN_CYCLES defined as
+ * 0 or 1 to say whether it polls for interrupts (and counts instructions) and
+ * whether it counts cycles in mpu->elapsed. Callers which need neither get a
+ * noticeably faster loop; ../test/bench.c measures the difference.
+ *
+ * RUN_STEP 1 makes a function which executes a single instruction and
+ * returns, for the JIT (lib6502-jit.c) to fall back on.  RUN_PREDECODED 1
+ * (which needs RUN_POLL, RUN_CYCLES and RUN_STEP 0) makes one which takes
+ * each instruction and its operand from mpu->decoded[] where it can; see
+ * M6502_Predecode.  Every variant returns
+ * M6502_Undefined if it stopped at an undefined instruction, or a callback's
+ * reason if it called M6502_stop(); a step returns 0 otherwise.
+ */
+
+#ifndef RUN_PREDECODED
+# define RUN_PREDECODED 0
+#endif
+
+#if RUN_PREDECODED && (RUN_POLL || RUN_CYCLES || RUN_STEP)
+# error "RUN_PREDECODED needs RUN_POLL, RUN_CYCLES and RUN_STEP 0"
+#endif
+
+#undef tick
+#undef tickIf
+
+#if RUN_CYCLES
+# define tick(n)    elapsed+=n
+# define tickIf(p)  (p && elapsed++)
+#else
+# define tick(n)
+# define tickIf(p)
+#endif
+
+static int RUN_NAME(M6502 *mpu, M6502_PollInterruptsCallback poll)
+{
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+
+  static void *itab[256]= { &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f,
+			    &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f,
+			    &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f,
+			    &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f,
+			    &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f,
+			    &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f,
+			    &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f,
+			    &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f,
+			    &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f,
+			    &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f,
+			    &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af,
+			    &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf,
+			    &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf,
+			    &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df,
+			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
+			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff };
+
+  register void **itabp= &itab[0];
+  register void  *tpc;
+
+# if RUN_PREDECODED
+#  define fetch()				tpc= itabp[decode()]
+#  define begin()				fetch();  next()
+#  define next()				    do { charge(1);  goto *tpc; } while (0)
+# elif RUN_STEP
+#  define fetch()
+#  define begin()				(void)tpc;  charge(0);  goto *itabp[readMemory(PC++)]
+#  define next()				    do { externalise();  return 0; } while (0)
+# else
+#  define fetch()				pollints();  tpc= itabp[readMemory(PC++)]
+#  define begin()				fetch();  next()
+#  define next()				    do { charge(1);  goto *tpc; } while (0)
+# endif
+# define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
+# define end()
+
+#else /* (!__GNUC__) || (__STRICT_ANSI__) */
+
+# if RUN_PREDECODED
+#  define begin()				for (;;) { charge(0);  switch (decode()) {
+#  define end()					} }
+# elif RUN_STEP
+#  define begin()				charge(0);  switch (readMemory(PC++)) {
+#  define end()					}
+# else
+#  define begin()				for (;;) { charge(0);  pollints();  switch (readMemory(PC++)) {
+#  define end()					} }
+# endif
+# define fetch()
+# define next()					break
+# define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
+
+#endif
+
+/* count an instruction against the budget before running it, returning
+   instead if there's none left; FETCHED says PC is already past its opcode */
+#define charge(fetched)								\
+  if (--budget < 0)								\
+    {										\
+      ++budget;									\
+      PC -= (fetched);								\
+      externalise();								\
+      return M6502_OutOfBudget;							\
+    }
+
+#if RUN_POLL
+# define pollints()	if (((instructions++)&7)==0) { externalise(); poll(mpu); internalise(); }
+#else
+# define pollints()
+#endif
+
+  register byte  *memory= mpu->memory;
+  const byte    **pages= mpu->pages;
+  register word   PC;
+  word		  ea;
+  byte		  A, X, Y, P, S;
+  byte		  N, Z, C;	/* see getP() */
+  int		  elapsed;
+  unsigned long	  instructions;
+  int64_t	  budget;
+  const M6502_CallbackMap *readCallbacks=  &mpu->callbacks->read;
+  const M6502_CallbackMap *writeCallbacks= &mpu->callbacks->write;
+  const M6502_CallbackMap *callCallbacks=  &mpu->callbacks->call;
+  M6502_Callback callback;
+#if RUN_PREDECODED
+  const M6502_Decoded **decoded= mpu->decoded;
+  const M6502_Decoded *d;
+  word		  operand;
+
+  /* decode the instruction at PC, taking its operand from the predecoded
+     form if there is one and reading it from memory otherwise */
+# define decode()	(d= &decoded[PC >> 8][PC & 0xff],  PC++,				\
+			 d->code ? (operand= d->operand,  d->code & 0xff)			\
+				 : (operand= readMemory(PC) + (readMemory(PC + 1) << 8),  readMemory(PC - 1)))
+# undef operand8
+# undef operand16
+# define operand8()	((byte)operand)
+# define operand16()	operand
+#endif
+
+# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  setP(mpu->registers->p);  S= mpu->registers->s;  PC= mpu->registers->pc;  elapsed= mpu->elapsed;  instructions= mpu->instructions;  budget= mpu->budget
+# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= getP();  mpu->registers->s= S;  mpu->registers->pc= PC;  mpu->elapsed= elapsed;  mpu->instructions= instructions;  mpu->budget= budget
+
+  internalise();
+
+  begin();
+  do_insns(dispatch);
+  end();
+#if RUN_STEP
+  externalise();
+#endif
+
+# undef begin
+# undef internalise
+# undef externalise
+# undef fetch
+# undef next
+# undef dispatch
+# undef decode
+#if RUN_PREDECODED
+# undef operand8
+# undef operand16
+# define operand8()	readMemory(PC)
+# define operand16()	(readMemory(PC) + (readMemory(PC + 1) << 8))
+#endif
+# undef end
+# undef pollints
+# undef charge
+
+  (void)oops;
+  (void)poll;
+  return 0;
+}
+
+#undef RUN_NAME
+#undef RUN_POLL
+#undef RUN_CYCLES
+#undef RUN_STEP
+#undef RUN_PREDECODED
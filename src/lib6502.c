@@ -33,14 +33,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib6502.h"
+#include "lib6502-jit.h"
 
 typedef uint8_t  byte;
 typedef uint16_t word;
 
-extern int tracing;
-
 enum {
   flagN= (1<<7),	/* negative 	 */
   flagV= (1<<6),	/* overflow 	 */
@@ -52,38 +52,88 @@ enum {
   flagC= (1<<0)		/* carry         */
 };
 
-#define getN()	(P & flagN)
+/* N, Z and C live outside P while running: N and Z hold the byte they were
+   last set from and C is 0 or 1, so ALU instructions store a result rather
+   than rebuilding P.  getP() and setP() convert when P itself is needed. */
+
+#define getN()	(N & 0x80)
 #define getV()	(P & flagV)
 #define getB()	(P & flagB)
 #define getD()	(P & flagD)
 #define getI()	(P & flagI)
-#define getZ()	(P & flagZ)
-#define getC()	(P & flagC)
+#define getZ()	(!Z)
+#define getC()	(C)
+
+#define getP()	((P & ~(flagN | flagZ | flagC)) | (N & 0x80) | (Z ? 0 : flagZ) | C)
+#define setP(B)	(P= (B),  N= P,  Z= ~P & flagZ,  C= P & flagC)
 
-#define setNVZC(N,V,Z,C)	(P= (P & ~(flagN | flagV | flagZ | flagC)) | (N) | ((V)<<6) | ((Z)<<1) | (C))
-#define setNZC(N,Z,C)		(P= (P & ~(flagN |         flagZ | flagC)) | (N) |            ((Z)<<1) | (C))
-#define setNZ(N,Z)		(P= (P & ~(flagN |         flagZ        )) | (N) |            ((Z)<<1)      )
-#define setZ(Z)			(P= (P & ~(                flagZ        )) |                  ((Z)<<1)      )
-#define setC(C)			(P= (P & ~(                        flagC)) |                             (C))
+#define setNVZC(R,V,C_)		(N= Z= (R),  P= (P & ~flagV) | ((V)<<6),  C= (C_))
+#define setNZC(R,C_)		(N= Z= (R),  C= (C_))
+#define setNZ(R)		(N= Z= (R))
+#define setC(C_)		(C= (C_))
 
 #define NAND(P, Q)	(!((P) & (Q)))
 
-static int elapsed;
+/* memory reads go through the page map so that pages can be mapped onto read-only images
+   (e.g. paged ROMs) without copying them; writes always go to memory[] */
+
+static inline byte readMapped(const byte **pages, word addr)
+{
+  return pages[addr >> 8][addr & 0xff];
+}
+
+#define readMemory(ADDR)	readMapped(pages, (ADDR))
+
+/* the operand bytes at PC; lib6502-run.h takes them from the predecoded form
+   instead for code in images predecoded with M6502_Predecode */
+
+#define operand8()	readMemory(PC)
+#define operand16()	(readMemory(PC) + (readMemory(PC + 1) << 8))
+
+/* with M6502_Predecode each byte of a mapped image has an entry saying which
+   instruction starts there and what its operand is, so running it needs
+   neither the opcode nor the operand bytes; code 0 means decode it as usual,
+   as for every byte of RAM and instructions which run past a page */
 
-#define tick(n)    elapsed+=n
-#define tickIf(p)  (p && elapsed++)
+struct _M6502_Decoded
+{
+  uint16_t code;	/* 0x100 | opcode, or 0 */
+  uint16_t operand;
+};
+
+typedef struct _M6502_Image M6502_Image;
+
+struct _M6502_Image
+{
+  const byte	*data;
+  unsigned int	 size;
+  M6502_Decoded	*decoded;
+  M6502_Image	*next;
+};
 
-/* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED MORE THAN ONCE! */
+static const M6502_Decoded undecoded[0x100];
 
-#define putMemory(ADDR, BYTE)			\
-  ( writeCallback[ADDR]				\
-      ? writeCallback[ADDR](mpu, ADDR, BYTE)	\
-      : (memory[ADDR]= BYTE) )
+/* memory access (indirect if callback installed) */
 
-#define getMemory(ADDR)				\
-  ( readCallback[ADDR]				\
-      ?  readCallback[ADDR](mpu, ADDR, 0)	\
-      :  memory[ADDR] )
+static inline void writeVia(M6502 *mpu, const M6502_CallbackMap *callbacks, word addr, byte data)
+{
+  M6502_Callback callback= M6502_lookupCallback(callbacks, addr);
+  mpu->dirty[addr >> 8]= 1;
+  if (callback)
+    callback(mpu, addr, data);
+  else
+    mpu->memory[addr]= data;
+}
+
+static inline byte readVia(M6502 *mpu, const M6502_CallbackMap *callbacks, const byte **pages, word addr)
+{
+  M6502_Callback callback= M6502_lookupCallback(callbacks, addr);
+  return callback ? callback(mpu, addr, 0) : readMapped(pages, addr);
+}
+
+#define putMemory(ADDR, BYTE)	writeVia(mpu, writeCallbacks, (ADDR), (BYTE))
+#define getMemory(ADDR)		readVia(mpu, readCallbacks, pages, (ADDR))
+#define getCall(ADDR)	M6502_lookupCallback(callCallbacks, ADDR)
 
 /* stack access (always direct) */
 
@@ -101,18 +151,18 @@ static int elapsed;
 
 #define abs(ticks)				\
   tick(ticks);					\
-  ea= memory[PC] + (memory[PC + 1] << 8);	\
+  ea= operand16();	\
   PC += 2;
 
 #define relative(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++];				\
+  ea= operand8();  PC++;				\
   if (ea & 0x80) ea -= 0x100;			\
   tickIf((ea >> 8) != (PC >> 8));
 
 #define zpr(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++];				\
+  ea= readMemory(PC++);				\
   fprintf(stderr, "\nea: %02X\n", ea);        \
   if (ea & 0x80) ea -= 0x100;			\
   tickIf((ea >> 8) != (PC >> 8));
@@ -121,50 +171,50 @@ static int elapsed;
   tick(ticks);					\
   {						\
     word tmp;					\
-    tmp= memory[PC]  + (memory[PC  + 1] << 8);	\
-    ea = memory[tmp] + (memory[tmp + 1] << 8);	\
+    tmp= operand16();	\
+    ea = readMemory(tmp) + (readMemory(tmp + 1) << 8);	\
     PC += 2;					\
   }
 
 #define absx(ticks)						\
   tick(ticks);							\
-  ea= memory[PC] + (memory[PC + 1] << 8);			\
+  ea= operand16();			\
   PC += 2;							\
   tickIf((ticks == 4) && ((ea >> 8) != ((ea + X) >> 8)));	\
   ea += X;
 
 #define absy(ticks)						\
   tick(ticks);							\
-  ea= memory[PC] + (memory[PC + 1] << 8);			\
+  ea= operand16();			\
   PC += 2;							\
   tickIf((ticks == 4) && ((ea >> 8) != ((ea + Y) >> 8)));	\
   ea += Y
 
 #define zp(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++];
+  ea= operand8();  PC++;
 
 #define zpx(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++] + X;				\
+  ea= operand8() + X;  PC++;				\
   ea &= 0x00ff;
 
 #define zpy(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++] + Y;				\
+  ea= operand8() + Y;  PC++;				\
   ea &= 0x00ff;
 
 #define indx(ticks)				\
   tick(ticks);					\
   {						\
-    byte tmp= memory[PC++] + X;			\
+    byte tmp= operand8() + X;  PC++;			\
     ea= memory[tmp] + (memory[tmp + 1] << 8);	\
   }
 
 #define indy(ticks)						\
   tick(ticks);							\
   {								\
-    byte tmp= memory[PC++];					\
+    byte tmp= operand8();  PC++;					\
     ea= memory[tmp] + (memory[tmp + 1] << 8);			\
     tickIf((ticks == 5) && ((ea >> 8) != ((ea + Y) >> 8)));	\
     ea += Y;							\
@@ -174,15 +224,15 @@ static int elapsed;
   tick(ticks);						\
   {							\
     word tmp;						\
-    tmp= memory[PC ] + (memory[PC  + 1] << 8) + X;	\
-    ea = memory[tmp] + (memory[tmp + 1] << 8);		\
+    tmp= operand16() + X;	\
+    ea = readMemory(tmp) + (readMemory(tmp + 1) << 8);		\
   }
 
 #define indzp(ticks)					\
   tick(ticks);						\
   {							\
     byte tmp;						\
-    tmp= memory[PC++];					\
+    tmp= operand8();  PC++;					\
     ea = memory[tmp] + (memory[tmp + 1] << 8);		\
   }
 
@@ -198,7 +248,7 @@ static int elapsed;
 	int v= (int8_t)A + (int8_t)B + getC();						\
 	fetch();									\
 	A= c;										\
-	setNVZC((A & 0x80), (((A & 0x80) > 0) ^ (v < 0)), (A == 0), ((c & 0x100) > 0));	\
+	setNVZC(A, (((A & 0x80) > 0) ^ (v < 0)), ((c & 0x100) > 0));			\
 	next();										\
       }											\
     else										\
@@ -212,7 +262,7 @@ static int elapsed;
 	fetch();									\
 	s= h | (l & 0x0F);								\
 	/* only C is valid on NMOS 6502 */						\
-	setNVZC(s & 0x80, !(((A ^ B) & 0x80) && ((A ^ s) & 0x80)), !s, !!(h & 0x80));	\
+	setNVZC(s, !(((A ^ B) & 0x80) && ((A ^ s) & 0x80)), !!(h & 0x80));  Z= !!s;		\
 	A= s;										\
 	tick(1);									\
 	next();										\
@@ -225,12 +275,12 @@ static int elapsed;
     byte B= getMemory(ea);								\
     if (!getD())									\
       {											\
-	int b= 1 - (P &0x01);								\
+	int b= 1 - getC();								\
 	int c= A - B - b;								\
 	int v= (int8_t)A - (int8_t) B - b;						\
 	fetch();									\
 	A= c;										\
-	setNVZC(A & 0x80, ((A & 0x80) > 0) ^ ((v & 0x100) != 0), A == 0, c >= 0);	\
+	setNVZC(A, ((A & 0x80) > 0) ^ ((v & 0x100) != 0), c >= 0);			\
 	next();										\
       }											\
     else										\
@@ -245,7 +295,7 @@ static int elapsed;
 	fetch();									\
 	s= h | (l & 0x0F);								\
 	/* only C is valid on NMOS 6502 */						\
-	setNVZC(s & 0x80, !(((A ^ B) & 0x80) && ((A ^ s) & 0x80)), !s, !!(h & 0x80));	\
+	setNVZC(s, !(((A ^ B) & 0x80) && ((A ^ s) & 0x80)), !!(h & 0x80));  Z= !!s;		\
 	A= s;										\
 	tick(1);									\
 	next();										\
@@ -258,7 +308,7 @@ static int elapsed;
   {						\
     byte B= getMemory(ea);			\
     byte d= R - B;				\
-    setNZC(d & 0x80, !d, R >= B);		\
+    setNZC(d, R >= B);				\
   }						\
   next();
 
@@ -273,7 +323,7 @@ static int elapsed;
     byte B= getMemory(ea);			\
     --B;					\
     putMemory(ea, B);				\
-    setNZ(B & 0x80, !B);			\
+    setNZ(B);					\
   }						\
   next();
 
@@ -281,7 +331,7 @@ static int elapsed;
   fetch();					\
   tick(ticks);					\
   --R;						\
-  setNZ(R & 0x80, !R);				\
+  setNZ(R);					\
   next();
 
 #define dea(ticks, adrmode)	decR(ticks, adrmode, A)
@@ -295,7 +345,7 @@ static int elapsed;
     byte B= getMemory(ea);			\
     ++B;					\
     putMemory(ea, B);				\
-    setNZ(B & 0x80, !B);			\
+    setNZ(B);					\
   }						\
   next();
 
@@ -303,7 +353,7 @@ static int elapsed;
   fetch();					\
   tick(ticks);					\
   ++R;						\
-  setNZ(R & 0x80, !R);				\
+  setNZ(R);					\
   next();
 
 #define ina(ticks, adrmode)	incR(ticks, adrmode, A)
@@ -315,8 +365,9 @@ static int elapsed;
   fetch();					\
   {						\
     byte B= getMemory(ea);			\
-    P= (P & ~(flagN | flagV | flagZ))		\
-      | (B & (0xC0)) | (((A & B) == 0) << 1);	\
+    P= (P & ~flagV) | (B & flagV);		\
+    N= B;					\
+    Z= A & B;					\
   }						\
   next();
 
@@ -325,8 +376,7 @@ static int elapsed;
   fetch();					\
   {						\
     byte B= getMemory(ea);			\
-    P= (P & ~flagZ)		\
-      | (((A & B) == 0) << 1);	\
+    Z= A & B;					\
   }						\
   next();
 
@@ -335,7 +385,7 @@ static int elapsed;
   fetch();					\
   {						\
     byte b= getMemory(ea);			\
-    setZ(!(b & A));				\
+    Z= b & A;					\
     b |= A;					\
     putMemory(ea, b);				\
   }						\
@@ -346,7 +396,7 @@ static int elapsed;
   fetch();					\
   {						\
     byte b= getMemory(ea);			\
-    setZ(!(b & A));				\
+    Z= b & A;					\
     b &= (A ^ 0xFF);				\
     putMemory(ea, b);				\
   }						\
@@ -394,7 +444,7 @@ static int elapsed;
   adrmode(ticks);				\
   fetch();					\
   A op##= getMemory(ea);			\
-  setNZ(A & 0x80, !A);				\
+  setNZ(A);					\
   next();
 
 #define and(ticks, adrmode)	bitwise(ticks, adrmode, &)
@@ -407,7 +457,7 @@ static int elapsed;
     unsigned int i= getMemory(ea) << 1;		\
     putMemory(ea, i);				\
     fetch();					\
-    setNZC(i & 0x80, !(i & 0xFF), i >> 8);		\
+    setNZC(i, i >> 8);					\
   }						\
   next();
 
@@ -417,7 +467,7 @@ static int elapsed;
   {						\
     int c= A >> 7;				\
     A <<= 1;					\
-    setNZC(A & 0x80, !A, c);			\
+    setNZC(A, c);				\
   }						\
   next();
 
@@ -429,7 +479,7 @@ static int elapsed;
     fetch();					\
     b >>= 1;					\
     putMemory(ea, b);				\
-    setNZC(0, !b, c);				\
+    setNZC(b, c);				\
   }						\
   next();
 
@@ -439,7 +489,7 @@ static int elapsed;
   {						\
     int c= A & 1;				\
     A >>= 1;					\
-    setNZC(0, !A, c);				\
+    setNZC(A, c);				\
   }						\
   next();
 
@@ -449,7 +499,7 @@ static int elapsed;
     word b= (getMemory(ea) << 1) | getC();	\
     fetch();					\
     putMemory(ea, b);				\
-    setNZC(b & 0x80, !(b & 0xFF), b >> 8);	\
+    setNZC(b, b >> 8);				\
   }						\
   next();
 
@@ -459,7 +509,7 @@ static int elapsed;
   {						\
     word b= (A << 1) | getC();			\
     A= b;					\
-    setNZC(A & 0x80, !A, b >> 8);		\
+    setNZC(A, b >> 8);				\
   }						\
   next();
 
@@ -471,7 +521,7 @@ static int elapsed;
     byte b= (c << 7) | (m >> 1);		\
     fetch();					\
     putMemory(ea, b);				\
-    setNZC(b & 0x80, !b, m & 1);		\
+    setNZC(b, m & 1);				\
   }						\
   next();
 
@@ -482,7 +532,7 @@ static int elapsed;
     int co= A & 1;				\
     fetch();					\
     A= (ci << 7) | (A >> 1);			\
-    setNZC(A & 0x80, !A, co);			\
+    setNZC(A, co);				\
   }						\
   next();
 
@@ -490,7 +540,7 @@ static int elapsed;
   fetch();					\
   tick(ticks);					\
   S= R;						\
-  setNZ(S & 0x80, !S);				\
+  setNZ(S);					\
   next();
 
 #define tax(ticks, adrmode)	tRS(ticks, adrmode, A, X)
@@ -509,7 +559,7 @@ static int elapsed;
   adrmode(ticks);				\
   fetch();					\
   R= getMemory(ea);				\
-  setNZ(R & 0x80, !R);				\
+  setNZ(R);					\
   next();
 
 #define lda(ticks, adrmode)	ldR(ticks, adrmode, A)
@@ -558,36 +608,52 @@ static int elapsed;
   tick(1);					\
   next();
 
-#define bbr0(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<0)))
-#define bbr1(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<1)))
-#define bbr2(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<2)))
-#define bbr3(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<3)))
-#define bbr4(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<4)))
-#define bbr5(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<5)))
-#define bbr6(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<6)))
-#define bbr7(ticks, adrmode)	branch(ticks, adrmode, !(memory[memory[PC++]] & (1<<7)))
-
-#define bbs0(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<0)))
-#define bbs1(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<1)))
-#define bbs2(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<2)))
-#define bbs3(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<3)))
-#define bbs4(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<4)))
-#define bbs5(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<5)))
-#define bbs6(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<6)))
-#define bbs7(ticks, adrmode)	branch(ticks, adrmode,  (memory[memory[PC++]] & (1<<7)))
+#define bbr0(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<0)))
+#define bbr1(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<1)))
+#define bbr2(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<2)))
+#define bbr3(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<3)))
+#define bbr4(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<4)))
+#define bbr5(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<5)))
+#define bbr6(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<6)))
+#define bbr7(ticks, adrmode)	branch(ticks, adrmode, !(memory[readMemory(PC++)] & (1<<7)))
+
+#define bbs0(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<0)))
+#define bbs1(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<1)))
+#define bbs2(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<2)))
+#define bbs3(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<3)))
+#define bbs4(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<4)))
+#define bbs5(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<5)))
+#define bbs6(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<6)))
+#define bbs7(ticks, adrmode)	branch(ticks, adrmode,  (memory[readMemory(PC++)] & (1<<7)))
+
+/* after a call callback: return from M6502_run() if it called M6502_stop() */
+#define stopIfAsked()					\
+  if (mpu->stop)					\
+    {							\
+      externalise();					\
+      return takeStop(mpu);				\
+    }
+
+static inline int takeStop(M6502 *mpu)
+{
+  int stop= mpu->stop;
+  mpu->stop= 0;
+  return stop;
+}
 
 #define jmp(ticks, adrmode)				\
   adrmode(ticks);					\
   PC= ea;						\
-  if (mpu->callbacks->call[ea])				\
+  if ((callback= getCall(ea)))				\
     {							\
       word addr;					\
       externalise();					\
-      if ((addr= mpu->callbacks->call[ea](mpu, ea, 0)))	\
+      if ((addr= callback(mpu, ea, 0)))	\
 	{						\
 	  internalise();				\
 	  PC= addr;					\
 	}						\
+      stopIfAsked();					\
     }							\
   fetch();						\
   next();
@@ -598,17 +664,20 @@ static int elapsed;
   push(PC & 0xff);					\
   PC--;							\
   adrmode(ticks);					\
-  if (mpu->callbacks->call[ea])				\
+  if ((callback= getCall(ea)))				\
     {							\
       word addr;					\
       externalise();					\
-      if ((addr= mpu->callbacks->call[ea](mpu, ea, 0)))	\
+      if ((addr= callback(mpu, ea, 0)))	\
 	{						\
 	  internalise();				\
 	  PC= addr;					\
+	  stopIfAsked();				\
 	  fetch();					\
 	  next();					\
 	}						\
+      PC= ea;						\
+      stopIfAsked();					\
     }							\
   PC=ea;						\
   fetch();						\
@@ -627,21 +696,23 @@ static int elapsed;
   PC++;								\
   push(PC >> 8);						\
   push(PC & 0xff);						\
-  P |= flagB;							\
+  P= getP() | flagB;						\
   push(P | flagX);						\
   P |= flagI;							\
-  P &= !flagD;							\
+  setP(P & !flagD);						\
   {								\
     word hdlr= getMemory(0xfffe) + (getMemory(0xffff) << 8);	\
-    if (mpu->callbacks->call[hdlr])				\
+    if ((callback= getCall(hdlr)))				\
       {								\
 	word addr;						\
 	externalise();						\
-	if ((addr= mpu->callbacks->call[hdlr](mpu, PC - 2, 0)))	\
+	if ((addr= callback(mpu, PC - 2, 0)))	\
 	  {							\
 	    internalise();					\
 	    hdlr= addr;						\
 	  }							\
+	PC= hdlr;						\
+	stopIfAsked();						\
       }								\
     PC= hdlr;							\
   }								\
@@ -650,7 +721,7 @@ static int elapsed;
 
 #define rti(ticks, adrmode)			\
   tick(ticks);					\
-  P=     pop();					\
+  setP(pop());					\
   PC=    pop();					\
   PC |= (pop() << 8);				\
   fetch();					\
@@ -665,9 +736,9 @@ static int elapsed;
   fetch();								\
   tick(ticks);								\
   fflush(stdout);							\
-  fprintf(stderr, "\nundefined instruction %02X at %04X\n", memory[PC-2], PC-2);        \
+  fprintf(stderr, "\nundefined instruction %02X at %04X\n", readMemory(PC-2), PC-2);        \
   externalise(); M6502_trace(mpu); \
-  return;
+  return M6502_Undefined;
 
 #define phR(ticks, adrmode, R)			\
   fetch();					\
@@ -678,13 +749,13 @@ static int elapsed;
 #define pha(ticks, adrmode)	phR(ticks, adrmode, A)
 #define phx(ticks, adrmode)	phR(ticks, adrmode, X)
 #define phy(ticks, adrmode)	phR(ticks, adrmode, Y)
-#define php(ticks, adrmode)	phR(ticks, adrmode, P | flagX | flagB)
+#define php(ticks, adrmode)	phR(ticks, adrmode, getP() | flagX | flagB)
 
 #define plR(ticks, adrmode, R)			\
   fetch();					\
   tick(ticks);					\
   R= pop();					\
-  setNZ(R & 0x80, !R);				\
+  setNZ(R);					\
   next();
 
 #define pla(ticks, adrmode)	plR(ticks, adrmode, A)
@@ -694,7 +765,13 @@ static int elapsed;
 #define plp(ticks, adrmode)			\
   fetch();					\
   tick(ticks);					\
-  P= pop();					\
+  setP(pop());					\
+  next();
+
+#define stC(ticks, adrmode, c)			\
+  fetch();					\
+  tick(ticks);					\
+  setC(c);					\
   next();
 
 #define clF(ticks, adrmode, F)			\
@@ -703,7 +780,7 @@ static int elapsed;
   P &= ~F;					\
   next();
 
-#define clc(ticks, adrmode)	clF(ticks, adrmode, flagC)
+#define clc(ticks, adrmode)	stC(ticks, adrmode, 0)
 #define cld(ticks, adrmode)	clF(ticks, adrmode, flagD)
 #define cli(ticks, adrmode)	clF(ticks, adrmode, flagI)
 #define clv(ticks, adrmode)	clF(ticks, adrmode, flagV)
@@ -714,75 +791,11 @@ static int elapsed;
   P |= F;					\
   next();
 
-#define sec(ticks, adrmode)	seF(ticks, adrmode, flagC)
+#define sec(ticks, adrmode)	stC(ticks, adrmode, 1)
 #define sed(ticks, adrmode)	seF(ticks, adrmode, flagD)
 #define sei(ticks, adrmode)	seF(ticks, adrmode, flagI)
 
-#define do_insns(_)												\
-  _(00, brk, implied,   7);  _(01, ora, indx,      6);  _(02, ill, implied,   2);  _(03, ill, implied, 2);      \
-  _(04, tsb, zp,        3);  _(05, ora, zp,        3);  _(06, asl, zp,        5);  _(07, rmb0, zp,     2);      \
-  _(08, php, implied,   3);  _(09, ora, immediate, 3);  _(0a, asla,implied,   2);  _(0b, ill, implied, 2);      \
-  _(0c, tsb, abs,       4);  _(0d, ora, abs,       4);  _(0e, asl, abs,       6);  _(0f, bbr0, zpr,    2);      \
-  _(10, bpl, relative,  2);  _(11, ora, indy,      5);  _(12, ora, indzp,     3);  _(13, ill, implied, 2);      \
-  _(14, trb, zp,        3);  _(15, ora, zpx,       4);  _(16, asl, zpx,       6);  _(17, rmb1, zp,     2);      \
-  _(18, clc, implied,   2);  _(19, ora, absy,      4);  _(1a, ina, implied,   2);  _(1b, ill, implied, 2);      \
-  _(1c, trb, abs,       4);  _(1d, ora, absx,      4);  _(1e, asl, absx,      7);  _(1f, bbr1, zpr,    2);      \
-  _(20, jsr, abs,       6);  _(21, and, indx,      6);  _(22, ill, implied,   2);  _(23, ill, implied, 2);      \
-  _(24, bit, zp,        3);  _(25, and, zp,        3);  _(26, rol, zp,        5);  _(27, rmb2, zp,     2);      \
-  _(28, plp, implied,   4);  _(29, and, immediate, 3);  _(2a, rola,implied,   2);  _(2b, ill, implied, 2);      \
-  _(2c, bit, abs,       4);  _(2d, and, abs,       4);  _(2e, rol, abs,       6);  _(2f, bbr2, zpr,    2);      \
-  _(30, bmi, relative,  2);  _(31, and, indy,      5);  _(32, and, indzp,     3);  _(33, ill, implied, 2);      \
-  _(34, bit, zpx,       4);  _(35, and, zpx,       4);  _(36, rol, zpx,       6);  _(37, rmb3, zp,     2);      \
-  _(38, sec, implied,   2);  _(39, and, absy,      4);  _(3a, dea, implied,   2);  _(3b, ill, implied, 2);      \
-  _(3c, bit, absx,      4);  _(3d, and, absx,      4);  _(3e, rol, absx,      7);  _(3f, bbr3, zpr,    2);      \
-  _(40, rti, implied,   6);  _(41, eor, indx,      6);  _(42, ill, implied,   2);  _(43, ill, implied, 2);      \
-  _(44, ill, implied,   2);  _(45, eor, zp,        3);  _(46, lsr, zp,        5);  _(47, rmb4, zp,     2);      \
-  _(48, pha, implied,   3);  _(49, eor, immediate, 3);  _(4a, lsra,implied,   2);  _(4b, ill, implied, 2);      \
-  _(4c, jmp, abs,       3);  _(4d, eor, abs,       4);  _(4e, lsr, abs,       6);  _(4f, bbr4, zpr,    2);      \
-  _(50, bvc, relative,  2);  _(51, eor, indy,      5);  _(52, eor, indzp,     3);  _(53, ill, implied, 2);      \
-  _(54, ill, implied,   2);  _(55, eor, zpx,       4);  _(56, lsr, zpx,       6);  _(57, rmb5, zp,     2);      \
-  _(58, cli, implied,   2);  _(59, eor, absy,      4);  _(5a, phy, implied,   3);  _(5b, ill, implied, 2);      \
-  _(5c, ill, implied,   2);  _(5d, eor, absx,      4);  _(5e, lsr, absx,      7);  _(5f, bbr5, zpr,    2);      \
-  _(60, rts, implied,   6);  _(61, adc, indx,      6);  _(62, ill, implied,   2);  _(63, ill, implied, 2);      \
-  _(64, stz, zp,        3);  _(65, adc, zp,        3);  _(66, ror, zp,        5);  _(67, rmb6, zp,     2);      \
-  _(68, pla, implied,   4);  _(69, adc, immediate, 3);  _(6a, rora,implied,   2);  _(6b, ill, implied, 2);      \
-  _(6c, jmp, indirect,  5);  _(6d, adc, abs,       4);  _(6e, ror, abs,       6);  _(6f, bbr6, zpr,    2);      \
-  _(70, bvs, relative,  2);  _(71, adc, indy,      5);  _(72, adc, indzp,     3);  _(73, ill, implied, 2);      \
-  _(74, stz, zpx,       4);  _(75, adc, zpx,       4);  _(76, ror, zpx,       6);  _(77, rmb7, zp,     2);      \
-  _(78, sei, implied,   2);  _(79, adc, absy,      4);  _(7a, ply, implied,   4);  _(7b, ill, implied, 2);      \
-  _(7c, jmp, indabsx,   6);  _(7d, adc, absx,      4);  _(7e, ror, absx,      7);  _(7f, bbr7, zpr,    2);      \
-  _(80, bra, relative,  2);  _(81, sta, indx,      6);  _(82, ill, implied,   2);  _(83, ill, implied, 2);      \
-  _(84, sty, zp,        2);  _(85, sta, zp,        2);  _(86, stx, zp,        2);  _(87, smb0, zp,     2);      \
-  _(88, dey, implied,   2);  _(89, bti, immediate, 2);  _(8a, txa, implied,   2);  _(8b, ill, implied, 2);      \
-  _(8c, sty, abs,       4);  _(8d, sta, abs,       4);  _(8e, stx, abs,       4);  _(8f, bbs0,    zpr, 2);      \
-  _(90, bcc, relative,  2);  _(91, sta, indy,      6);  _(92, sta, indzp,     3);  _(93, ill, implied, 2);      \
-  _(94, sty, zpx,       4);  _(95, sta, zpx,       4);  _(96, stx, zpy,       4);  _(97, smb1, zp,     2);      \
-  _(98, tya, implied,   2);  _(99, sta, absy,      5);  _(9a, txs, implied,   2);  _(9b, ill, implied, 2);      \
-  _(9c, stz, abs,       4);  _(9d, sta, absx,      5);  _(9e, stz, absx,      5);  _(9f, bbs1,    zpr, 2);      \
-  _(a0, ldy, immediate, 3);  _(a1, lda, indx,      6);  _(a2, ldx, immediate, 3);  _(a3, ill, implied, 2);      \
-  _(a4, ldy, zp,        3);  _(a5, lda, zp,        3);  _(a6, ldx, zp,        3);  _(a7, smb2, zp,     2);      \
-  _(a8, tay, implied,   2);  _(a9, lda, immediate, 3);  _(aa, tax, implied,   2);  _(ab, ill, implied, 2);      \
-  _(ac, ldy, abs,       4);  _(ad, lda, abs,       4);  _(ae, ldx, abs,       4);  _(af, bbs2,    zpr, 2);      \
-  _(b0, bcs, relative,  2);  _(b1, lda, indy,      5);  _(b2, lda, indzp,     3);  _(b3, ill, implied, 2);      \
-  _(b4, ldy, zpx,       4);  _(b5, lda, zpx,       4);  _(b6, ldx, zpy,       4);  _(b7, smb3, zp,     2);      \
-  _(b8, clv, implied,   2);  _(b9, lda, absy,      4);  _(ba, tsx, implied,   2);  _(bb, ill, implied, 2);      \
-  _(bc, ldy, absx,      4);  _(bd, lda, absx,      4);  _(be, ldx, absy,      4);  _(bf, bbs3,    zpr, 2);      \
-  _(c0, cpy, immediate, 3);  _(c1, cmp, indx,      6);  _(c2, ill, implied,   2);  _(c3, ill, implied, 2);      \
-  _(c4, cpy, zp,        3);  _(c5, cmp, zp,        3);  _(c6, dec, zp,        5);  _(c7, smb4, zp,     2);      \
-  _(c8, iny, implied,   2);  _(c9, cmp, immediate, 3);  _(ca, dex, implied,   2);  _(cb, ill, implied, 2);      \
-  _(cc, cpy, abs,       4);  _(cd, cmp, abs,       4);  _(ce, dec, abs,       6);  _(cf, bbs4,    zpr, 2);      \
-  _(d0, bne, relative,  2);  _(d1, cmp, indy,      5);  _(d2, cmp, indzp,     3);  _(d3, ill, implied, 2);      \
-  _(d4, ill, implied,   2);  _(d5, cmp, zpx,       4);  _(d6, dec, zpx,       6);  _(d7, smb5, zp,     2);      \
-  _(d8, cld, implied,   2);  _(d9, cmp, absy,      4);  _(da, phx, implied,   3);  _(db, ill, implied, 2);      \
-  _(dc, ill, implied,   2);  _(dd, cmp, absx,      4);  _(de, dec, absx,      7);  _(df, bbs5,    zpr, 2);      \
-  _(e0, cpx, immediate, 3);  _(e1, sbc, indx,      6);  _(e2, ill, implied,   2);  _(e3, ill, implied, 2);      \
-  _(e4, cpx, zp,        3);  _(e5, sbc, zp,        3);  _(e6, inc, zp,        5);  _(e7, smb6, zp,     2);      \
-  _(e8, inx, implied,   2);  _(e9, sbc, immediate, 3);  _(ea, nop, implied,   2);  _(eb, ill, implied, 2);      \
-  _(ec, cpx, abs,       4);  _(ed, sbc, abs,       4);  _(ee, inc, abs,       6);  _(ef, bbs6,    zpr, 2);      \
-  _(f0, beq, relative,  2);  _(f1, sbc, indy,      5);  _(f2, sbc, indzp,     3);  _(f3, ill, implied, 2);      \
-  _(f4, ill, implied,   2);  _(f5, sbc, zpx,       4);  _(f6, inc, zpx,       6);  _(f7, smb7, zp,     2);      \
-  _(f8, sed, implied,   2);  _(f9, sbc, absy,      4);  _(fa, plx, implied,   4);  _(fb, ill, implied, 2);      \
-  _(fc, ill, implied,   2);  _(fd, sbc, absx,      4);  _(fe, inc, absx,      7);  _(ff, bbs7,    zpr, 2);      \
+#include "lib6502-insns.h"
 
 
 
@@ -826,101 +839,93 @@ static void oops(void)
   fprintf(stderr, "\noops -- instruction dispatch missing\n");
 }
 
-static int previousPC;
-
 void M6502_trace(M6502 *mpu)
 {
   char state[124];
 
-  if(elapsed > 40123000){
+  if(mpu->elapsed > 40123000){
   M6502_dump(mpu, state);
   fflush(stdout);
   fprintf(stderr, "Trace: %s\n", state);
   }
 
-  if (mpu->registers->pc == previousPC){
+  if (mpu->registers->pc == mpu->previousPC){
     fprintf(stderr, "Trace abort: branch to self\n");
     // exit(1);
   }
-  previousPC = mpu->registers->pc;
+  mpu->previousPC = mpu->registers->pc;
 }
 
-void M6502_run(M6502 *mpu, M6502_PollInterruptsCallback poll)
-//void M6502_run(M6502 *mpu)
+#define RUN_NAME   runInstrumented
+#define RUN_POLL   1
+#define RUN_CYCLES 1
+#define RUN_STEP   0
+#include "lib6502-run.h"
+
+#define RUN_NAME   runPredecoded
+#define RUN_POLL   0
+#define RUN_CYCLES 0
+#define RUN_STEP   0
+#define RUN_PREDECODED 1
+#include "lib6502-run.h"
+
+#define RUN_NAME   runNoCycles
+#define RUN_POLL   1
+#define RUN_CYCLES 0
+#define RUN_STEP   0
+#include "lib6502-run.h"
+
+#define RUN_NAME   runNoPolling
+#define RUN_POLL   0
+#define RUN_CYCLES 1
+#define RUN_STEP   0
+#include "lib6502-run.h"
+
+#define RUN_NAME   runFast
+#define RUN_POLL   0
+#define RUN_CYCLES 0
+#define RUN_STEP   0
+#include "lib6502-run.h"
+
+#define RUN_NAME   runStep
+#define RUN_POLL   0
+#define RUN_CYCLES 0
+#define RUN_STEP   1
+#include "lib6502-run.h"
+
+#define RUN_NAME   runStepCycles
+#define RUN_POLL   0
+#define RUN_CYCLES 1
+#define RUN_STEP   1
+#include "lib6502-run.h"
+
+int M6502_step(M6502 *mpu)
 {
-#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
-
-  static void *itab[256]= { &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f,
-			    &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f,
-			    &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f,
-			    &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f,
-			    &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f,
-			    &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f,
-			    &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f,
-			    &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f,
-			    &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f,
-			    &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f,
-			    &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af,
-			    &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf,
-			    &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf,
-			    &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df,
-			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
-			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff };
-
-  register void **itabp= &itab[0];
-  register void  *tpc;
-
-  int instrcount=0;
-
-# define pollints()             externalise(); poll(mpu); internalise()
-# define begin()				fetch();  next()
-# define fetch()				if (((instrcount++)&7)==0) {pollints();} tpc= itabp[memory[PC++]]
-# define next()				    goto *tpc
-# define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
-# define end()
-
-#else /* (!__GNUC__) || (__STRICT_ANSI__) */
-
-# define begin()				for (;;) switch (memory[PC++]) {
-# define fetch()
-# define next()					break
-# define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
-# define end()					}
-
-#endif
-
-  register byte  *memory= mpu->memory;
-  register word   PC;
-  word		  ea;
-  byte		  A, X, Y, P, S;
-  M6502_Callback *readCallback=  mpu->callbacks->read;
-  M6502_Callback *writeCallback= mpu->callbacks->write;
-
-# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc
-# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC
-
-  internalise();
-
-  begin();
-  do_insns(dispatch);
-  end();
-
-# undef begin
-# undef internalise
-# undef externalise
-# undef fetch
-# undef next
-# undef dispatch
-# undef end
-
-  (void)oops;
+  if (mpu->flags & M6502_NoCycles)
+    return runStep(mpu, 0);
+  return runStepCycles(mpu, 0);
 }
 
+int M6502_run(M6502 *mpu, M6502_PollInterruptsCallback poll)
+{
+  int stop;
+  if ((mpu->flags & M6502_Jit) && (stop= M6502__jitRun(mpu)))
+    return stop;
+  switch (mpu->flags & (M6502_NoPolling | M6502_NoCycles))
+    {
+    case 0:				return runInstrumented(mpu, poll);
+    case M6502_NoPolling:		return runNoPolling(mpu, poll);
+    case M6502_NoCycles:		return runNoCycles(mpu, poll);
+    default:
+      if (mpu->flags & M6502_Predecode)	return runPredecoded(mpu, poll);
+      return runFast(mpu, poll);
+    }
+}
 
 int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
 {
   char *s= buffer;
-  byte *b= mpu->memory + ip;
+  byte b[3]= { M6502_read(mpu, ip), M6502_read(mpu, ip + 1), M6502_read(mpu, ip + 2) };
 
   switch (b[0])
     {
@@ -955,15 +960,97 @@ void M6502_dump(M6502 *mpu, char buffer[124])
   uint8_t p= r->p;
 # define P(N,C) (p & (1 << (N)) ? (C) : '-')
   sprintf(buffer, "PC=%04X M[PC]=%02X SP=%04X A=%02X X=%02X Y=%02X P=%02X %c%c%c%c%c%c%c%c elapsed: %d",
-	  r->pc-1, mpu->memory[r->pc-1], 0x0100 + r->s,
+	  r->pc-1, M6502_read(mpu, r->pc-1), 0x0100 + r->s,
 	  r->a, r->x, r->y, r->p,
 	  P(7,'N'), P(6,'V'), P(5,'?'), P(4,'B'), P(3,'D'), P(2,'I'), P(1,'Z'), P(0,'C'),
-	  elapsed
+	  mpu->elapsed
 	  );
 # undef P
 }
 
 
+static int insnLength(byte opcode)
+{
+# define length_implied		1
+# define length_immediate	2
+# define length_zp		2
+# define length_zpx		2
+# define length_zpy		2
+# define length_relative	2
+# define length_indzp		2
+# define length_indx		2
+# define length_indy		2
+# define length_abs		3
+# define length_absx		3
+# define length_absy		3
+# define length_indirect	3
+# define length_indabsx		3
+# define length_zpr		0	/* two operands: never predecoded */
+# define length(num, name, mode, cycles) case 0x##num: return length_##mode
+  switch (opcode)
+    {
+      do_insns(length);
+    }
+# undef length
+  return 0;
+}
+
+/* the predecoded form of [DATA, DATA + SIZE), decoding the image if it's
+   the first time part of it has been mapped */
+static const M6502_Decoded *predecode(M6502 *mpu, const byte *data, unsigned int size)
+{
+  M6502_Image *image;
+  unsigned int i;
+  for (image= mpu->predecoded;  image;  image= image->next)
+    if (data >= image->data && data + size <= image->data + image->size)
+      return image->decoded + (data - image->data);
+  image= calloc(1, sizeof(M6502_Image));
+  if (!image || !(image->decoded= calloc(size, sizeof(M6502_Decoded))))
+    {
+      free(image);
+      return 0;
+    }
+  image->data= data;
+  image->size= size;
+  for (i= 0;  i < size;  ++i)
+    {
+      int length= insnLength(data[i]);
+      M6502_Decoded *d= &image->decoded[i];
+      if (!length || (i & 0xff) + length > 0x100 || i + length > size)
+	continue;
+      d->code= 0x100 | data[i];
+      if (length == 2) d->operand= data[i + 1];
+      if (length == 3) d->operand= data[i + 1] | (data[i + 2] << 8);
+    }
+  image->next= mpu->predecoded;
+  mpu->predecoded= image;
+  return image->decoded;
+}
+
+void M6502_mapMemory(M6502 *mpu, unsigned int addr, unsigned int size, const uint8_t *data)
+{
+  const M6502_Decoded *decoded= 0;
+  unsigned int page;
+  if (data && (mpu->flags & M6502_Predecode))
+    decoded= predecode(mpu, data, size);
+  for (page= 0;  page < (size >> 8);  ++page)
+    {
+      mpu->pages[(addr >> 8) + page]= data ? data + (page << 8) : mpu->memory + addr + (page << 8);
+      mpu->decoded[(addr >> 8) + page]= decoded ? decoded + (page << 8) : undecoded;
+    }
+}
+
+
+void M6502_written(M6502 *mpu, unsigned int addr, unsigned int size)
+{
+  unsigned int page;
+  if (!size) return;
+  for (page= addr >> 8;  page <= ((addr + size - 1) >> 8) && page < 0x100;  ++page)
+    mpu->dirty[page]= 1;
+  M6502__jitInvalidate(mpu, addr, size);
+}
+
+
 static void outOfMemory(void)
 {
   fflush(stdout);
@@ -972,10 +1059,12 @@ static void outOfMemory(void)
 }
 
 
-M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks)
+M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, const M6502_Callbacks *callbacks, unsigned int flags, void *context)
 {
   M6502 *mpu= calloc(1, sizeof(M6502));
   if (!mpu) outOfMemory();
+  mpu->flags= flags & (M6502_NoPolling | M6502_NoCycles | M6502_Jit | M6502_Predecode);
+  mpu->budget= M6502_NoBudget;
 
   if (!registers)  { registers = (M6502_Registers *)calloc(1, sizeof(M6502_Registers));  mpu->flags |= M6502_RegistersAllocated; }
   if (!memory   )  { memory    = (uint8_t         *)calloc(1, sizeof(M6502_Memory   ));  mpu->flags |= M6502_MemoryAllocated;    }
@@ -986,14 +1075,71 @@ M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callback
   mpu->registers = registers;
   mpu->memory    = memory;
   mpu->callbacks = callbacks;
+  mpu->context   = context;
+  M6502_mapMemory(mpu, 0, 0x10000, 0);
 
   return mpu;
 }
 
 
+static void freeCallbackPages(M6502_CallbackMap *map)
+{
+  int page;
+  for (page= 0;  page < 0x100;  ++page)
+    if (map->owned[page >> 5] & M6502_PageBit(page))
+      free((void *)map->page[page]);
+}
+
+
+void M6502__setCallback(M6502 *mpu, size_t map, uint16_t addr, M6502_Callback fn)
+{
+  M6502_Callbacks *callbacks;
+  M6502_CallbackMap *m;
+  M6502_CallbackPage *page;
+  int p= addr >> 8;
+
+  if (!(mpu->flags & M6502_CallbacksAllocated))
+    {
+      /* the page arrays stay shared; 'owned' is all clear in the copy */
+      callbacks= calloc(1, sizeof(M6502_Callbacks));
+      if (!callbacks) outOfMemory();
+      *callbacks= *mpu->callbacks;
+      mpu->callbacks= callbacks;
+      mpu->flags |= M6502_CallbacksAllocated;
+    }
+  m= (M6502_CallbackMap *)((char *)mpu->callbacks + map);
+  if (!(m->owned[p >> 5] & M6502_PageBit(p)))
+    {
+      page= calloc(1, sizeof(M6502_CallbackPage));
+      if (!page) outOfMemory();
+      if (m->page[p]) memcpy(page, m->page[p], sizeof(M6502_CallbackPage));
+      m->page[p]= (const M6502_CallbackPage *)page;
+      m->owned[p >> 5] |= M6502_PageBit(p);
+      m->used[p >> 5]  |= M6502_PageBit(p);
+    }
+  (*(M6502_CallbackPage *)m->page[p])[addr & 0xff]= fn;
+  M6502__jitCallbacksChanged(mpu);
+}
+
+
 void M6502_delete(M6502 *mpu)
 {
-  if (mpu->flags & M6502_CallbacksAllocated) free(mpu->callbacks);
+  M6502__jitDelete(mpu);
+  while (mpu->predecoded)
+    {
+      M6502_Image *image= mpu->predecoded;
+      mpu->predecoded= image->next;
+      free(image->decoded);
+      free(image);
+    }
+  if (mpu->flags & M6502_CallbacksAllocated)
+    {
+      M6502_Callbacks *callbacks= (M6502_Callbacks *)mpu->callbacks;
+      freeCallbackPages(&callbacks->read);
+      freeCallbackPages(&callbacks->write);
+      freeCallbackPages(&callbacks->call);
+      free(callbacks);
+    }
   if (mpu->flags & M6502_MemoryAllocated   ) free(mpu->memory);
   if (mpu->flags & M6502_RegistersAllocated) free(mpu->registers);
 
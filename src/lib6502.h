@@ -3,15 +3,18 @@
 
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct _M6502		M6502;
 typedef struct _M6502_Registers	M6502_Registers;
+typedef struct _M6502_CallbackMap	M6502_CallbackMap;
 typedef struct _M6502_Callbacks	M6502_Callbacks;
+typedef struct _M6502_Decoded	M6502_Decoded;
 
 typedef int   (*M6502_Callback)(M6502 *mpu, uint16_t address, uint8_t data);
 
-typedef M6502_Callback	M6502_CallbackTable[0x10000];
+typedef M6502_Callback	M6502_CallbackPage[0x100];
 typedef uint8_t		M6502_Memory[0x10000];
 
 // For testing for IRQ
@@ -33,37 +36,122 @@ struct _M6502_Registers
   uint16_t pc;	/* program counter */
 };
 
+/* Callbacks are held per 256-byte page. A page with no callbacks has its bit
+ * clear in 'used' and a null entry in 'page', so the common case of a memory
+ * access with no callback only touches the 32-byte bitmap. A set of callbacks
+ * can be a compile-time constant shared by any number of M6502 objects; see
+ * M6502_PageBit().
+ */
+struct _M6502_CallbackMap
+{
+  uint32_t		    used[8];	/* bit per page: page[n] is not null */
+  uint32_t		    owned[8];	/* bit per page: page[n] was allocated by lib6502 */
+  const M6502_CallbackPage *page[0x100];
+};
+
 struct _M6502_Callbacks
 {
-  M6502_CallbackTable read;
-  M6502_CallbackTable write;
-  M6502_CallbackTable call;
+  M6502_CallbackMap read;
+  M6502_CallbackMap write;
+  M6502_CallbackMap call;
 };
 
+/* Initialiser for element PAGE >> 5 of M6502_CallbackMap.used; OR together
+ * the bits for pages which share an element.
+ */
+#define M6502_PageBit(PAGE)	((uint32_t)1 << ((PAGE) & 31))
+
 struct _M6502
 {
   M6502_Registers *registers;
   uint8_t	  *memory;
-  M6502_Callbacks *callbacks;
+  const M6502_Callbacks *callbacks;
   unsigned int	   flags;
+  void		  *context;	/* owner's state, for use by callbacks */
+  const uint8_t	  *pages[0x100];	/* where reads from each page come from */
+  const M6502_Decoded *decoded[0x100];	/* pages[] predecoded, if M6502_Predecode */
+  void		  *predecoded;	/* images predecoded so far */
+  int		   elapsed;	/* cycles executed, unless M6502_NoCycles */
+  unsigned long	   instructions;	/* instructions executed, unless M6502_NoPolling */
+  int		   previousPC;	/* used by M6502_trace() */
+  void		  *jit;		/* translated code, if M6502_Jit */
+  uint8_t	   dirty[0x100];	/* nonzero for each page written since cleared */
+  int		   stop;	/* reason passed to M6502_stop(), or 0 */
+  int64_t	   budget;	/* instructions left to run; see M6502_OutOfBudget */
 };
 
 enum {
   M6502_RegistersAllocated = 1 << 0,
   M6502_MemoryAllocated    = 1 << 1,
-  M6502_CallbacksAllocated = 1 << 2
+  M6502_CallbacksAllocated = 1 << 2,
+  /* flags for M6502_new() to select a specialised M6502_run() loop; with
+     neither, it is fully instrumented */
+  M6502_NoPolling	   = 1 << 3,	/* never call the poll callback */
+  M6502_NoCycles	   = 1 << 4,	/* don't count cycles */
+  /* run translated native code where possible (x86-64 Linux only, otherwise
+     ignored); never polls or counts cycles, so pass the two flags above too */
+  M6502_Jit		   = 1 << 5,
+  /* run instructions in images mapped by M6502_mapMemory() from a form
+     decoded once when each image is first mapped, rather than decoding them
+     every time; like M6502_Jit it only applies with the two flags above */
+  M6502_Predecode	   = 1 << 6
 };
 
-extern M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks);
+extern M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, const M6502_Callbacks *callbacks, unsigned int flags, void *context);
 extern void   M6502_reset(M6502 *mpu);
 extern void   M6502_nmi(M6502 *mpu);
 extern void   M6502_irq(M6502 *mpu);
-extern void   M6502_run(M6502 *mpu, M6502_PollInterruptsCallback poll);
+/* Run until an undefined instruction, returning M6502_Undefined with PC at
+ * it, or until a callback calls M6502_stop(), returning its REASON with the
+ * registers as the callback left them.  Calling it again carries on from
+ * there.
+ */
+extern int    M6502_run(M6502 *mpu, M6502_PollInterruptsCallback poll);
 //extern void   M6502_run(M6502 *mpu);
+/* Execute one instruction with the interpreter; 0, or what M6502_run() would
+   return after it.  Adds its cycles to elapsed unless M6502_NoCycles. */
+extern int    M6502_step(M6502 *mpu);
 extern int    M6502_disassemble(M6502 *mpu, uint16_t addr, char buffer[64]);
 extern void   M6502_dump(M6502 *mpu, char buffer[124]);
 extern void   M6502_delete(M6502 *mpu);
 
+/* Make reads from the page-aligned range [ADDR, ADDR + SIZE) come from DATA,
+ * without copying it; writes to the range still go to memory. Passing a null
+ * DATA maps the range back onto memory. Zero page and the stack are always
+ * accessed directly so must not be mapped. With M6502_Predecode, DATA must
+ * not change for the life of the M6502, as it's decoded only once.
+ */
+extern void   M6502_mapMemory(M6502 *mpu, unsigned int addr, unsigned int size, const uint8_t *data);
+
+/* Writes by the emulated CPU set dirty[] for the page written, except that
+ * zero page and the stack may be written without; the owner clears dirty[]
+ * whenever it likes. After writing [ADDR, ADDR + SIZE) of memory directly
+ * rather than via the emulated CPU, call this to mark its pages dirty too and
+ * discard any code translated from it.
+ */
+extern void   M6502_written(M6502 *mpu, unsigned int addr, unsigned int size);
+
+/* M6502_run() returns M6502_OutOfBudget, with PC at the next instruction,
+ * once it has run mpu->budget instructions; translated code may overrun it
+ * by up to a block of instructions, leaving budget negative.  The budget is
+ * M6502_NoBudget after M6502_new().
+ */
+enum {
+  M6502_Undefined= 1,
+  M6502_OutOfBudget,
+  M6502_StopReasons		/* the first REASON free for M6502_stop() */
+};
+
+#define M6502_NoBudget	INT64_MAX
+
+/* Called from a call callback (or the BRK handler's), make M6502_run() return
+ * REASON once the callback returns; PC is then the callback's continuation
+ * address, or the address called if it returned 0.
+ */
+#define M6502_stop(MPU, REASON)	((MPU)->stop= (REASON))
+
+#define M6502_read(MPU, ADDR)	((MPU)->pages[(uint16_t)(ADDR) >> 8][(ADDR) & 0xff])
+
 #define M6502_getVector(MPU, VEC)			\
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]) )		\
     | ((MPU)->memory[M6502_##VEC##VectorMSB] << 8) )
@@ -72,8 +160,20 @@ extern void   M6502_delete(M6502 *mpu);
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]= ((uint8_t)(ADDR)) & 0xff) )	\
     , ((MPU)->memory[M6502_##VEC##VectorMSB]= (uint8_t)((ADDR) >> 8)) )
 
-#define M6502_getCallback(MPU, TYPE, ADDR)	((MPU)->callbacks->TYPE[ADDR])
-#define M6502_setCallback(MPU, TYPE, ADDR, FN)	((MPU)->callbacks->TYPE[ADDR]= (FN))
+static inline M6502_Callback M6502_lookupCallback(const M6502_CallbackMap *map, uint16_t addr)
+{
+  if (!(map->used[addr >> 13] & M6502_PageBit(addr >> 8))) return 0;
+  return (*map->page[addr >> 8])[addr & 0xff];
+}
+
+/* Setting a callback on an M6502 whose callbacks were passed to M6502_new()
+ * first gives it a private copy of them, so shared callbacks are never
+ * modified.
+ */
+extern void M6502__setCallback(M6502 *mpu, size_t map, uint16_t addr, M6502_Callback fn);
+
+#define M6502_getCallback(MPU, TYPE, ADDR)	M6502_lookupCallback(&(MPU)->callbacks->TYPE, (ADDR))
+#define M6502_setCallback(MPU, TYPE, ADDR, FN)	M6502__setCallback((MPU), offsetof(M6502_Callbacks, TYPE), (ADDR), (FN))
 
 
 #endif /* __m6502_h */
@@ -0,0 +1,247 @@
+// An index over the program's lines and definitions; see lineindex.h.
+
+#include "lineindex.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "detokenise.h"
+#include "emulation.h"
+#include "tokens.h"
+#include "utils.h"
+
+static bool is_name_char(uint8_t c) {
+    return ((c >= '0') && (c <= '9')) || ((c >= 'A') && (c <= 'Z')) ||
+           ((c >= '_') && (c <= 'z'));
+}
+
+static void add_line(struct s_line_index *index, uint16_t number,
+                     uint16_t offset) {
+    if (index->line_count == index->line_capacity) {
+        index->line_capacity = (index->line_capacity > 0) ?
+                               index->line_capacity * 2 : 256;
+        index->lines = check_alloc(realloc(
+            index->lines, index->line_capacity * sizeof(index->lines[0])));
+    }
+    if ((index->line_count > 0) &&
+        (number < index->lines[index->line_count - 1].number)) {
+        index->in_order = false;
+    }
+    struct s_line_index_line *line = &index->lines[index->line_count++];
+    line->number = number;
+    line->offset = offset;
+}
+
+// Add the PROC or FN defined by the line at 'offset', if there is one. As
+// when BASIC looks for a definition, DEF must be the first thing on the line
+// other than spaces.
+static void add_definition(struct s_line_index *index, uint16_t offset) {
+    const uint8_t *m = &index->program[offset];
+    uint8_t length = m[3];
+    int y = 4;
+    while ((y < length) && (m[y] == ' ')) {
+        ++y;
+    }
+    if ((y == length) || (m[y] != token_def)) {
+        return;
+    }
+    do {
+        ++y;
+    } while ((y < length) && (m[y] == ' '));
+    if ((y == length) || ((m[y] != token_proc) && (m[y] != token_fn))) {
+        return;
+    }
+    uint8_t token = m[y];
+    int name = ++y;
+    while ((y < length) && is_name_char(m[y])) {
+        ++y;
+    }
+    if (y == name) {
+        return;
+    }
+    if (index->definition_count == index->definition_capacity) {
+        index->definition_capacity = (index->definition_capacity > 0) ?
+                                     index->definition_capacity * 2 : 64;
+        index->definitions = check_alloc(realloc(
+            index->definitions,
+            index->definition_capacity * sizeof(index->definitions[0])));
+    }
+    struct s_line_index_definition *definition =
+        &index->definitions[index->definition_count++];
+    definition->token = token;
+    definition->name = offset + name;
+    definition->name_length = y - name;
+    definition->line = index->line_count - 1;
+    definition->end = 0; // set once the whole program is indexed
+}
+
+// Compare a definition with the given token and name, ordering by token and
+// then by name.
+static int compare_definition_names(const struct s_line_index *index,
+                                    const struct s_line_index_definition *d,
+                                    uint8_t token, const uint8_t *name,
+                                    uint8_t name_length) {
+    if (d->token != token) {
+        return (d->token < token) ? -1 : 1;
+    }
+    uint8_t length = (d->name_length < name_length) ? d->name_length :
+                                                      name_length;
+    int result = memcmp(&index->program[d->name], name, length);
+    if (result != 0) {
+        return result;
+    }
+    return d->name_length - name_length;
+}
+
+// Sort the definitions by name. They start in program order and an insertion
+// sort is stable, so definitions of the same name stay in that order.
+static void sort_definitions(struct s_line_index *index) {
+    struct s_line_index_definition *definitions = index->definitions;
+    for (int i = 1; i < index->definition_count; ++i) {
+        struct s_line_index_definition definition = definitions[i];
+        const uint8_t *name = &index->program[definition.name];
+        int j = i;
+        while ((j > 0) &&
+               (compare_definition_names(index, &definitions[j - 1],
+                                         definition.token, name,
+                                         definition.name_length) > 0)) {
+            definitions[j] = definitions[j - 1];
+            --j;
+        }
+        definitions[j] = definition;
+    }
+}
+
+bool line_index_build(struct s_line_index *index,
+                      const struct s_machine *machine) {
+    assert(index != 0);
+    memset(index, 0, sizeof(*index));
+    uint16_t page = machine->model->page;
+    uint16_t himem = machine->model->himem;
+    index->program = &machine->memory[page];
+    index->in_order = true;
+    uint32_t offset = 0;
+    for (;;) {
+        if ((page + offset + 4 > himem) || (index->program[offset] != cr)) {
+            line_index_free(index);
+            return false;
+        }
+        if (index->program[offset + 1] & 0x80) {
+            break;
+        }
+        uint8_t length = index->program[offset + 3];
+        if ((length < 4) || (page + offset + length >= himem)) {
+            line_index_free(index);
+            return false;
+        }
+        add_line(index, (index->program[offset + 1] << 8) |
+                        index->program[offset + 2], offset);
+        add_definition(index, offset);
+        offset += length;
+    }
+    index->end = offset;
+
+    for (int i = 0; i < index->definition_count; ++i) {
+        index->definitions[i].end = (i + 1 < index->definition_count) ?
+                                    index->definitions[i + 1].line :
+                                    index->line_count;
+    }
+    sort_definitions(index);
+    return true;
+}
+
+void line_index_free(struct s_line_index *index) {
+    free(index->lines);
+    free(index->definitions);
+    index->lines = 0;
+    index->definitions = 0;
+    index->line_count = index->definition_count = 0;
+}
+
+int line_index_find_line(const struct s_line_index *index, uint16_t number) {
+    if (!index->in_order) {
+        int i = 0;
+        while ((i < index->line_count) && (index->lines[i].number < number)) {
+            ++i;
+        }
+        return i;
+    }
+    int low = 0;
+    int high = index->line_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (index->lines[middle].number < number) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool line_index_find_definition(const struct s_line_index *index,
+                                const char *name, uint16_t *first,
+                                uint16_t *last) {
+    uint8_t token = token_proc;
+    if (strncmp(name, "PROC", 4) == 0) {
+        name += 4;
+    } else if (strncmp(name, "FN", 2) == 0) {
+        token = token_fn;
+        name += 2;
+    }
+    size_t name_length = strlen(name);
+    if ((name_length == 0) || (name_length > 255)) {
+        return false;
+    }
+    int low = 0;
+    int high = index->definition_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (compare_definition_names(index, &index->definitions[middle],
+                                     token, (const uint8_t *) name,
+                                     name_length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if ((low == index->definition_count) ||
+        (compare_definition_names(index, &index->definitions[low], token,
+                                  (const uint8_t *) name,
+                                  name_length) != 0)) {
+        return false;
+    }
+    const struct s_line_index_definition *definition =
+        &index->definitions[low];
+    *first = index->lines[definition->line].number;
+    *last = (definition->end < index->line_count) ?
+            index->lines[definition->end - 1].number : 32767;
+    return true;
+}
+
+uint8_t *line_index_list(const struct s_line_index *index, int basic_version,
+                         int listo, uint16_t first, uint16_t last,
+                         size_t *output_length) {
+    // LIST stops at the first line numbered higher than 'last'.
+    int start = line_index_find_line(index, first);
+    int stop = start;
+    while ((stop < index->line_count) &&
+           (index->lines[stop].number <= last)) {
+        ++stop;
+    }
+    uint16_t from = (start < index->line_count) ?
+                    index->lines[start].offset : index->end;
+    uint16_t to = (stop < index->line_count) ?
+                  index->lines[stop].offset : index->end;
+    // Copy the lines with the CR after them and an end of program marker.
+    size_t length = to - from + 3;
+    uint8_t *program = check_alloc(malloc(length));
+    memcpy(program, &index->program[from], length - 2);
+    program[length - 2] = program[length - 1] = 0xff;
+    uint8_t *output = detokenise(program, length, basic_version, listo,
+                                 output_length);
+    free(program);
+    return output;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,75 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// An index over the tokenised program in memory, mapping line numbers and
+// the names of the PROCs and FNs it defines to where they are, so part of a
+// large program can be listed without walking the rest of it. It's used by
+// --lines and --proc; the caller owns it, and it points into one machine's
+// memory, so it's only good until that program changes.
+
+struct s_line_index_line {
+    uint16_t number;
+    uint16_t offset; // of the CR before the line, from PAGE
+};
+
+struct s_line_index_definition {
+    uint8_t token;       // PROC or FN
+    uint16_t name;       // offset of the name after the token, from PAGE
+    uint8_t name_length;
+    int line;            // index of the line with the DEF
+    int end;             // index of the next line with a DEF, or line_count
+};
+
+struct s_line_index {
+    const uint8_t *program; // at PAGE
+    uint16_t end;           // offset of the CR ending the program
+    bool in_order;
+
+    struct s_line_index_line *lines; // in program order
+    int line_count;
+    int line_capacity;
+
+    // Sorted by name, with each name's definitions in program order.
+    struct s_line_index_definition *definitions;
+    int definition_count;
+    int definition_capacity;
+};
+
+// Index the program in 'machine''s memory, returning false if it isn't
+// intact.
+bool line_index_build(struct s_line_index *index,
+                      const struct s_machine *machine);
+
+void line_index_free(struct s_line_index *index);
+
+// Return the index of the line BASIC's LIST would start from for 'number',
+// the first in program order numbered at least that high, or line_count if
+// there isn't one.
+int line_index_find_line(const struct s_line_index *index, uint16_t number);
+
+// Set *first and *last to the numbers of the first and last lines of the
+// PROC or FN 'name', written as after DEF (e.g. "PROCfoo" or "FNbar"; a name
+// without either is taken to be a PROC's), returning false if the program
+// doesn't define it. A definition runs from its DEF to the line before the
+// next DEF, or the end of the program; like BASIC, we use the first
+// definition of a name.
+bool line_index_find_definition(const struct s_line_index *index,
+                                const char *name, uint16_t *first,
+                                uint16_t *last);
+
+// Return what BASIC version 'basic_version' writes for LISTO 'listo' then
+// LIST first,last, as detokenise() does, detokenising only those lines;
+// *output_length is set to its length. The caller must free the result.
+uint8_t *line_index_list(const struct s_line_index *index, int basic_version,
+                         int listo, uint16_t first, uint16_t last,
+                         size_t *output_length);
+
+// vi: colorcolumn=80
+
+#endif
@@ -35,6 +35,7 @@
 
 #include "main.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,7 +43,10 @@
 #include "config.h"
 #include "driver.h"
 #include "emulation.h"
+#include "profile.h"
 #include "roms.h"
+#include "trace.h"
+#include "traps.h"
 #include "utils.h"
 #ifdef _MSC_VER
 #include <fcntl.h>
@@ -63,11 +67,28 @@
 const char *program_name = 0;
 const char *filenames[2] = {"-", "-"};
 
+// The emulated machine we use to process the input; this is large, so we
+// don't want it on the stack.
+static struct s_machine machine;
+
+// Created by the first option which needs it.
+static struct s_profile *profile = 0;
+
 enum option_id {
     oi_help,
     oi_roms,
     oi_verbose,
     oi_show_all_output,
+    oi_no_jit,
+    oi_no_traps,
+    oi_verify_traps,
+    oi_budget,
+    oi_profile_6502,
+    oi_profile_symbols,
+    oi_record_trace,
+    oi_replay_trace,
+    oi_engine,
+    oi_model,
     oi_basic_2,
     oi_basic_4,
     oi_input_tokenised,
@@ -85,6 +106,9 @@ enum option_id {
     oi_renumber_start,
     oi_renumber_step,
     oi_listo,
+    oi_lines,
+    oi_proc,
+    oi_xref_format,
     oi_open_output_binary,
     oi_output_ascii,
     oi_output_tokenised,
@@ -123,6 +147,78 @@ static struct cag_option options[] = {
       .access_name = "show-all-output",
       .description = "show all output from emulated machine" },
 
+    { .identifier = oi_no_jit,
+      .access_letters = 0,
+      .access_name = "no-jit",
+      .description = "interpret 6502 code instead of translating it" },
+
+    { .identifier = oi_no_traps,
+      .access_letters = 0,
+      .access_name = "no-traps",
+      .description = "emulate all BASIC ROM code instead of running native "
+                     "replacements for some routines" },
+
+    { .identifier = oi_verify_traps,
+      .access_letters = 0,
+      .access_name = "verify-traps",
+      .description = "check native replacements for BASIC ROM routines "
+                     "against the ROM code (slow)" },
+
+    { .identifier = oi_budget,
+      .access_letters = 0,
+      .access_name = "budget",
+      .value_name = "N",
+      .description = "stop with an error if any step runs more than N "
+                     "million 6502 instructions (default depends on step)" },
+
+    { .identifier = oi_profile_6502,
+      .access_letters = 0,
+      .access_name = "profile-6502",
+      .value_name = "FILE",
+      .description = "count the instructions and cycles the emulated 6502 "
+                     "runs at each address and write a summary to FILE and "
+                     "folded stacks for flame graphs to FILE.folded (slow)" },
+
+    { .identifier = oi_profile_symbols,
+      .access_letters = 0,
+      .access_name = "profile-symbols",
+      .value_name = "FILE",
+      .description = "name addresses in the 6502 profile using FILE (can be "
+                     "repeated)" },
+
+    { .identifier = oi_record_trace,
+      .access_letters = 0,
+      .access_name = "record-trace",
+      .value_name = "FILE",
+      .description = "log the emulated machine's input, OS calls and output "
+                     "to FILE" },
+
+    { .identifier = oi_replay_trace,
+      .access_letters = 0,
+      .access_name = "replay-trace",
+      .value_name = "FILE",
+      .description = "replay a log written by --record-trace, check the "
+                     "emulated machine does the same and report how long it "
+                     "took, then exit" },
+
+    { .identifier = oi_engine,
+      .access_letters = 0,
+      .access_name = "engine",
+      .value_name = "ENGINE",
+      .description = "\"emulated\" (default) runs the ROMs to do the work; "
+                     "\"native\" uses native code where basictool has an "
+                     "exact equivalent (currently tokenising, "
+                     "renumbering, packing and --ascii, --format, "
+                     "--unpack, --line-ref and --variable-xref output)" },
+
+    { .identifier = oi_model,
+      .access_letters = 0,
+      .access_name = "model",
+      .value_name = "MODEL",
+      .description = "emulate a machine with MODEL's memory map: \"standard\" "
+                     "(PAGE=&E00, default) or \"page-800\" (PAGE=&800, for "
+                     "programs up to 1.5K larger); HIMEM is &8000 in both" },
+
     { .identifier = oi_basic_2,
       .access_letters = "2",
       .access_name = "basic-2",
@@ -215,6 +311,28 @@ static struct cag_option options[] = {
       .value_name = "N",
       .description = "use LISTO N to indent ASCII output" },
 
+    { .identifier = oi_lines,
+      .access_letters = 0,
+      .access_name = "lines",
+      .value_name = "FIRST-LAST",
+      .description = "list only lines FIRST to LAST, as LIST FIRST,LAST "
+                     "would; either may be left out" },
+
+    { .identifier = oi_proc,
+      .access_letters = 0,
+      .access_name = "proc",
+      .value_name = "NAME",
+      .description = "list only the definition of PROC or FN NAME (e.g. "
+                     "PROCfoo or FNbar), from its DEF up to the next DEF" },
+
+    { .identifier = oi_xref_format,
+      .access_letters = 0,
+      .access_name = "xref-format",
+      .value_name = "FORMAT",
+      .description = "write --line-ref and --variable-xref output as "
+                     "\"text\" (default), \"json\" or \"csv\"; json and "
+                     "csv always use native code" },
+
     { .identifier = oi_open_output_binary,
       .access_letters = 0,
       .access_name = "output-binary",
@@ -365,6 +483,86 @@ static long parse_long_argument(const char *name, const char *value, int min,
     return result;
 }
 
+static int parse_model(const char *value) {
+    if ((value == 0) || (*value == '\0')) {
+        die_help("error: missing value for --model");
+    }
+    for (int model = 0; model < model_count; ++model) {
+        if (strcmp(value, machine_models[model].name) == 0) {
+            return model;
+        }
+    }
+    die_help("error: invalid --model value \"%s\"", value);
+}
+
+static int parse_engine(const char *value) {
+    if ((value == 0) || (*value == '\0')) {
+        die_help("error: missing value for --engine");
+    }
+    if (strcmp(value, "emulated") == 0) {
+        return engine_emulated;
+    }
+    if (strcmp(value, "native") == 0) {
+        return engine_native;
+    }
+    die_help("error: invalid --engine value \"%s\"", value);
+}
+
+// Parse the value of --lines into config.lines_first and config.lines_last.
+static void parse_line_range(const char *value) {
+    if ((value == 0) || (*value == '\0')) {
+        die_help("error: missing value for --lines");
+    }
+    const char *dash = strchr(value, '-');
+    long first = 0;
+    long last = 32767;
+    char *end;
+    if ((dash == 0) || (dash > value)) {
+        first = strtol(value, &end, 10);
+        if (end != ((dash != 0) ? dash : value + strlen(value))) {
+            die_help("error: invalid --lines value \"%s\"", value);
+        }
+        if (dash == 0) {
+            last = first;
+        }
+    }
+    if ((dash != 0) && (dash[1] != '\0')) {
+        last = strtol(dash + 1, &end, 10);
+        if ((*end != '\0') || (dash[1] == '-') || (dash[1] == '+')) {
+            die_help("error: invalid --lines value \"%s\"", value);
+        }
+    }
+    if ((first < 0) || (last > 32767) || (first > last)) {
+        die_help("error: invalid --lines value \"%s\"", value);
+    }
+    config.lines_first = (int) first;
+    config.lines_last = (int) last;
+}
+
+static int parse_xref_format(const char *value) {
+    if ((value == 0) || (*value == '\0')) {
+        die_help("error: missing value for --xref-format");
+    }
+    if (strcmp(value, "text") == 0) {
+        return xref_format_text;
+    }
+    if (strcmp(value, "json") == 0) {
+        return xref_format_json;
+    }
+    if (strcmp(value, "csv") == 0) {
+        return xref_format_csv;
+    }
+    die_help("error: invalid --xref-format value \"%s\"", value);
+}
+
+static const char *get_filename_argument(const char *name,
+                                         const char *value) {
+    if ((value == 0) || (*value == '\0')) {
+        die_help("error: missing value for %s", name);
+    }
+    return value;
+}
+
 int main(int argc, char *argv[]) {
     program_name = parse_program_name(argv[0]);
 
@@ -401,6 +599,54 @@ int main(int argc, char *argv[]) {
                 config.show_all_output = true;
                 break;
 
+            case oi_no_jit:
+                config.jit = false;
+                break;
+
+            case oi_no_traps:
+                config.traps = traps_off;
+                break;
+
+            case oi_verify_traps:
+                config.traps = traps_verify;
+                break;
+
+            case oi_budget:
+                config.budget = (int) parse_long_argument(
+                    "--budget", cag_option_get_value(&context), 1, INT_MAX);
+                break;
+
+            case oi_profile_6502:
+                config.profile_6502 = get_filename_argument(
+                    "--profile-6502", cag_option_get_value(&context));
+                break;
+
+            case oi_profile_symbols:
+                if (profile == 0) {
+                    profile = profile_new();
+                }
+                profile_load_symbols(profile, get_filename_argument(
+                    "--profile-symbols", cag_option_get_value(&context)));
+                break;
+
+            case oi_record_trace:
+                config.record_trace = get_filename_argument(
+                    "--record-trace", cag_option_get_value(&context));
+                break;
+
+            case oi_replay_trace:
+                config.replay_trace = get_filename_argument(
+                    "--replay-trace", cag_option_get_value(&context));
+                break;
+
+            case oi_engine:
+                config.engine = parse_engine(cag_option_get_value(&context));
+                break;
+
+            case oi_model:
+                config.model = parse_model(cag_option_get_value(&context));
+                break;
+
             case oi_basic_2:
                 set_basic_version(basic_2);
                 break;
@@ -483,6 +729,22 @@ int main(int argc, char *argv[]) {
                     "--listo", cag_option_get_value(&context), 0, 7);
                 break;
 
+            case oi_lines:
+                parse_line_range(cag_option_get_value(&context));
+                break;
+
+            case oi_proc:
+                config.proc = cag_option_get_value(&context);
+                if ((config.proc == 0) || (*config.proc == '\0')) {
+                    die_help("error: missing value for --proc");
+                }
+                break;
+
+            case oi_xref_format:
+                config.xref_format =
+                    parse_xref_format(cag_option_get_value(&context));
+                break;
+
             case oi_open_output_binary:
                 config.open_output_binary = true;
                 break;
@@ -522,6 +784,14 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (config.replay_trace != 0) {
+        // The trace says which BASIC to use and gives all the input.
+        trace_replay(config.replay_trace,
+                     EMULATION_MPU_FLAGS | (config.jit ? M6502_Jit : 0),
+                     config.traps);
+        return EXIT_SUCCESS;
+    }
+
     int filename_count = 0;
     const int max_filenames = CAG_ARRAY_SIZE(filenames);
     int i;
@@ -566,6 +836,21 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if ((config.lines_first >= 0) && (config.proc != 0)) {
+        die_help("error: Please don't use both --lines and --proc.");
+    }
+    if (((config.lines_first >= 0) || (config.proc != 0)) &&
+        !config.output_ascii) {
+        warn("--lines and --proc only have an effect with the --ascii output "
+             "type");
+    }
+
+    if ((config.xref_format != xref_format_text) && !config.line_ref &&
+        !config.variable_xref) {
+        warn("--xref-format only has an effect with the --line-ref and "
+             "--variable-xref output types");
+    }
+
     if (config.pack && config.unpack) {
         warn("program will be packed and then unpacked");
     }
@@ -574,6 +859,13 @@ int main(int argc, char *argv[]) {
         warn("--pack-singles-n has no effect with --pack-variables-n");
     }
 
+    if ((profile != 0) && (config.profile_6502 == 0)) {
+        die_help("error: --profile-symbols needs --profile-6502");
+    }
+    if ((config.profile_6502 != 0) && (profile == 0)) {
+        profile = profile_new();
+    }
+
 #ifdef _MSC_VER
     if (config.open_output_binary) {
         // TODO: Would it be better to make stdout binary even when not
@@ -584,8 +876,23 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-    emulation_init();
-    load_basic(filenames[0]);
+    unsigned int mpu_flags = EMULATION_MPU_FLAGS;
+    if (profile != 0) {
+        // The profile counts cycles as it steps through the code, so the JIT
+        // would never be used.
+        mpu_flags &= ~M6502_NoCycles;
+    } else if (config.jit) {
+        mpu_flags |= M6502_Jit;
+    }
+    emulation_init(&machine, config.model, config.basic_version, driver_oswrch,
+                   mpu_flags);
+    machine.profile = profile;
+    machine.on_error = driver_error;
+    traps_install(&machine, config.traps);
+    if (config.record_trace != 0) {
+        machine.trace = trace_record(config.record_trace, &machine);
+    }
+    load_basic(&machine, filenames[0]);
     if (config.pack) {
         if (config.renumber) {
             // We renumber before packing as well as afterwards; this shouldn't
@@ -595,26 +902,39 @@ int main(int argc, char *argv[]) {
             // program and make it pack correctly. See the sub-thread starting
             // at https://stardot.org.uk/forums/viewtopic.php?p=335039#p335039
             // for discussion on this.
-            renumber();
+            renumber(&machine);
         }
-        pack();
+        pack(&machine);
     }
     if (config.renumber) {
-        renumber();
+        renumber(&machine);
     }
     if (config.format) {
-        save_formatted_basic();
+        save_formatted_basic(&machine);
     } else if (config.unpack) {
-        save_unpacked_basic();
+        save_unpacked_basic(&machine);
     } else if (config.line_ref) {
-        save_line_ref();
+        save_line_ref(&machine);
     } else if (config.variable_xref) {
-        save_variable_xref();
+        save_variable_xref(&machine);
     } else if (config.output_tokenised) {
-        save_tokenised_basic();
+        save_tokenised_basic(&machine);
     } else {
         assert(config.output_ascii);
-        save_ascii_basic();
+        save_ascii_basic(&machine);
+    }
+
+    if (config.verbose >= 2) {
+        info("%lu ROM bank switches, %lu bytes of ROM copying avoided",
+             machine.romsel_writes, machine.romsel_writes * rom_size);
+    }
+
+    if (profile != 0) {
+        profile_write(profile, config.profile_6502);
+        profile_delete(profile);
+    }
+    if (machine.trace != 0) {
+        trace_close(machine.trace);
     }
 }
 
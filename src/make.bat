@@ -13,5 +13,14 @@ bintoinc ../roms/Basic2 > zz-basic-2.c
 bintoinc ../roms/Basic432 > zz-basic-4.c
 @IF ERRORLEVEL 1 EXIT /B 1
 
-cl /MP /MT /Zi /O2 /D_CRT_DECLARE_NONSTDC_NAMES=0 /std:c11 /Fd:../basictool.pdb /Fe:../basictool.exe main.c config.c emulation.c driver.c roms.c utils.c lib6502.c cargs.c
+cl /MP /MT /O2 /D_CRT_DECLARE_NONSTDC_NAMES=0 /std:c11 /Fe:mksnapshot.exe mksnapshot.c config.c emulation.c roms.c traps.c utils.c lib6502.c lib6502-jit.c profile.c trace.c filing.c
+@IF ERRORLEVEL 1 EXIT /B 1
+
+mksnapshot 2 > zz-snapshot-2.c
+@IF ERRORLEVEL 1 EXIT /B 1
+
+mksnapshot 4 > zz-snapshot-4.c
+@IF ERRORLEVEL 1 EXIT /B 1
+
+cl /MP /MT /Zi /O2 /D_CRT_DECLARE_NONSTDC_NAMES=0 /std:c11 /Fd:../basictool.pdb /Fe:../basictool.exe main.c config.c emulation.c driver.c roms.c snapshots.c traps.c utils.c lib6502.c lib6502-jit.c profile.c trace.c filing.c detokenise.c tokenise.c renumber.c catalogue.c pack.c layout.c xref.c lineindex.c cargs.c
 @IF ERRORLEVEL 1 EXIT /B 1
@@ -18,6 +18,13 @@ gcc -o bintoinc -Wall -g --std=c99 bintoinc.c
 ./bintoinc ../roms/Basic2 > zz-basic-2.c
 ./bintoinc ../roms/Basic432 > zz-basic-4.c
 
-gcc -o ../basictool -g -O2 -Wall -Werror --std=c99 main.c config.c emulation.c driver.c roms.c utils.c lib6502.c cargs.c
+# Generate the state of each BASIC at its first prompt, so basictool doesn't
+# have to boot the emulated machine every time. snapshots.c #includes these
+# auto-generated files.
+gcc -o mksnapshot -g -O2 -Wall -Werror --std=c99 mksnapshot.c config.c emulation.c roms.c traps.c utils.c lib6502.c lib6502-jit.c profile.c trace.c filing.c
+./mksnapshot 2 > zz-snapshot-2.c
+./mksnapshot 4 > zz-snapshot-4.c
+
+gcc -o ../basictool -g -O2 -Wall -Werror --std=c99 main.c config.c emulation.c driver.c roms.c snapshots.c traps.c utils.c lib6502.c lib6502-jit.c profile.c trace.c filing.c detokenise.c tokenise.c renumber.c catalogue.c pack.c layout.c xref.c lineindex.c cargs.c
 
 # vi: colorcolumn=80
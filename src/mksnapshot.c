@@ -0,0 +1,110 @@
+// Boot an emulated machine into BASIC and write its state at the first prompt
+// as C source, so emulation_init() can start machines from that instead of
+// booting them every time; snapshots.c #includes the output. This runs at
+// build time, like bintoinc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulation.h"
+#include "roms.h"
+#include "utils.h"
+
+// utils.c expects these to be provided by the program.
+const char *program_name = "mksnapshot";
+const char *filenames[2] = {"-", "-"};
+
+// emulation_init() boots machines when there's no snapshot to start from,
+// which is how we make them.
+const struct s_snapshot *const boot_snapshots[basic_count] = {0};
+
+static struct s_machine machine;
+static uint8_t output[1024];
+static size_t output_length = 0;
+
+static void capture_oswrch(struct s_machine *machine, const uint8_t *data,
+                           size_t length) {
+    check(output_length + length <= sizeof(output),
+          "error: too much output at boot");
+    memcpy(&output[output_length], data, length);
+    output_length += length;
+}
+
+static void print_bytes(const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        printf("0x%02x,%s", data[i], ((i % 16) == 15) ? "\n" : " ");
+    }
+    if ((length % 16) != 0) {
+        printf("\n");
+    }
+}
+
+static bool page_is_empty(int page) {
+    for (int i = 0; i < 256; ++i) {
+        if (machine.memory[(page << 8) + i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if ((argc != 2) || ((strcmp(argv[1], "2") != 0) &&
+                        (strcmp(argv[1], "4") != 0))) {
+        fprintf(stderr, "Syntax: mksnapshot 2|4\n");
+        exit(EXIT_FAILURE);
+    }
+    int basic_version = (argv[1][0] == '2') ? basic_2 : basic_4;
+    const char *name = argv[1];
+
+    emulation_init(&machine, model_standard, basic_version, capture_oswrch,
+                   EMULATION_MPU_FLAGS);
+    check(machine.state == ms_osword_input_line_pending,
+          "error: BASIC didn't reach the prompt");
+    check(machine.mpu->pages[0x80] == rom_basic[basic_version],
+          "error: BASIC isn't paged in at the prompt");
+
+    printf("// AUTO-GENERATED FILE - DO NOT EDIT\n\n");
+
+    printf("static const uint8_t snapshot_basic_%s_output[] = {\n", name);
+    print_bytes(output, output_length);
+    printf("};\n\n");
+
+    // Most of memory is still zero, so we only include pages which aren't.
+    int page_count = 0;
+    printf("static const uint8_t snapshot_basic_%s_page_numbers[] = {\n",
+           name);
+    for (int page = 0; page < 0x100; ++page) {
+        if (!page_is_empty(page)) {
+            printf("0x%02x,%s", page, ((++page_count % 16) == 0) ? "\n" : " ");
+        }
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint8_t snapshot_basic_%s_pages[][256] = {\n", name);
+    for (int page = 0; page < 0x100; ++page) {
+        if (!page_is_empty(page)) {
+            printf("{\n");
+            print_bytes(&machine.memory[page << 8], 256);
+            printf("},\n");
+        }
+    }
+    printf("};\n\n");
+
+    const M6502_Registers *r = &machine.registers;
+    printf("static const struct s_snapshot snapshot_basic_%s = {\n", name);
+    printf("    {0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%04x},\n",
+           r->a, r->x, r->y, r->p, r->s, r->pc);
+    printf("    %d,\n", machine.state);
+    printf("    %lu,\n", machine.romsel_writes);
+    printf("    snapshot_basic_%s_output,\n", name);
+    printf("    sizeof(snapshot_basic_%s_output),\n", name);
+    printf("    %d,\n", page_count);
+    printf("    snapshot_basic_%s_page_numbers,\n", name);
+    printf("    snapshot_basic_%s_pages\n", name);
+    printf("};\n");
+
+    return EXIT_SUCCESS;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,976 @@
+// A native "Pack"; see pack.h.
+//
+// ABE's "Pack" works in up to three stages, each of which we follow closely
+// as the details show in the result:
+//
+// - It catalogues the names used in the program, then takes each in turn,
+//   counts where it's used and, if it can find a shorter name which isn't in
+//   the catalogue, replaces it throughout the program using its search and
+//   replace code.
+// - It copies each line through a buffer, leaving out REMs, spaces and
+//   assembler comments as asked.
+// - It joins each line with the lines after it until the result would be
+//   too long or the next line is referred to or can't safely be joined.
+//
+// ABE puts each line it changes back where a line with that number belongs,
+// which is where it came from only if the lines are in order, and in places
+// it relies on lines not containing CR, so we leave other programs to ABE. We
+// also leave it the cases where it runs out of room or strays beyond the end
+// of the program, where what it does depends on the state of the machine.
+
+#include "pack.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "catalogue.h"
+#include "detokenise.h"
+#include "emulation.h"
+#include "tokens.h"
+#include "utils.h"
+
+// Characters with special meanings in ABE's search patterns and
+// replacements; in a replacement, any of them stands for the character at
+// that point in the line.
+enum {
+    pattern_any = 0,
+    pattern_non_digit = 1,
+    pattern_boundary = 2,
+    pattern_special_count = 3
+};
+
+enum {
+    search_match,
+    search_next_line,
+    search_end
+};
+
+struct s_pack {
+    uint8_t *memory;
+    uint16_t page;
+    uint16_t top;
+    uint16_t himem;
+    bool failed;              // hit a case we leave to ABE
+    uint8_t assembler;        // bit 7 set inside [ ]; ABE's &87
+
+    // The search pattern and replacement, as ABE keeps them at &0556 and
+    // &05AB, and the state of a search.
+    uint8_t pattern[256];
+    uint8_t pattern_length;
+    uint8_t min_length;       // the shortest line text worth searching
+    uint8_t replacement[256];
+    uint8_t replacement_length;
+    uint16_t line;            // the CR before the line being searched
+    uint16_t at;              // where the pattern is being compared
+    uint8_t offset;           // 'at' relative to 'line'
+    bool quote;
+
+    // ABE's line buffer; index i is for &06FC + i.
+    uint8_t buffer[0x104];
+
+    struct s_catalogue catalogue;
+
+    bool referenced[0x10000];
+
+    struct s_buffer output;
+};
+
+static void put(struct s_pack *p, uint8_t c) {
+    buffer_put(&p->output, c);
+}
+
+static void put_string(struct s_pack *p, const char *s) {
+    buffer_put_string(&p->output, s);
+}
+
+static void put_newline(struct s_pack *p) {
+    put(p, lf); put(p, cr); // OSNEWL
+}
+
+static void put_top(struct s_pack *p) {
+    char buffer[16];
+    sprintf(buffer, "TOP=&%04X", (unsigned int) p->top);
+    put_string(p, buffer);
+}
+
+static void put_decimal(struct s_pack *p, uint16_t n) {
+    char buffer[8];
+    sprintf(buffer, "%u", (unsigned int) n);
+    put_string(p, buffer);
+}
+
+// Write a character of a name, which may be a PROC or FN token.
+static void put_name_char(struct s_pack *p, uint8_t c) {
+    if (c == token_proc) {
+        put_string(p, "PROC");
+    } else if (c == token_fn) {
+        put_string(p, "FN");
+    } else {
+        assert(c < 0x80);
+        put(p, c);
+    }
+}
+
+static uint8_t byte_at(const struct s_pack *p, uint16_t line, uint8_t y) {
+    return p->memory[(uint16_t) (line + y)];
+}
+
+// Check that the program is intact, its lines are in order and TOP is where
+// it ends, and that ABE won't wander off the end of it.
+static bool check_program(const struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    uint16_t line = p->page;
+    int previous_number = -1;
+    for (;;) {
+        if ((m[line] != cr) || ((uint32_t) line + 4 > p->himem)) {
+            return false;
+        }
+        if (m[line + 1] & 0x80) {
+            return p->top == line + 2;
+        }
+        int number = (m[line + 1] << 8) | m[line + 2];
+        uint8_t length = m[line + 3];
+        if ((number <= previous_number) || (length < 4)) {
+            return false;
+        }
+        // ABE finds the end of the program by looking for CR followed by a
+        // byte with the top bit set wherever a new line could start, and
+        // skips the three bytes after a line number token blindly, so lines
+        // containing CR or ending with part of a token could confuse it.
+        for (int i = 4; i < length; ++i) {
+            if ((m[line + i] == cr) ||
+                ((m[line + i] == token_line_number) && (i + 3 >= length))) {
+                return false;
+            }
+        }
+        previous_number = number;
+        line += length;
+    }
+}
+
+// Replace the line after 'line' with one with the same number and the text
+// at 'text', which ends with CR, or delete it if the text is empty. This is
+// what ABE's &88A5 does when the lines are in order.
+static void store_line(struct s_pack *p, uint16_t line, const uint8_t *text) {
+    uint8_t *m = p->memory;
+    uint8_t number_high = m[line + 1];
+    uint8_t number_low = m[line + 2];
+    uint8_t old_length = m[line + 3];
+    memmove(&m[line + 1], &m[line + 1 + old_length],
+            p->top - (line + 1 + old_length));
+    p->top -= old_length;
+    const uint8_t *text_end = memchr(text, cr, 256);
+    assert(text_end != 0);
+    size_t length = (text_end - text) + 4;
+    if (length == 4) {
+        return;
+    }
+    if ((length > 0xff) || (p->top + length > p->himem)) {
+        p->failed = true; // "Line space"
+        return;
+    }
+    memmove(&m[line + 1 + length], &m[line + 1], p->top - (line + 1));
+    m[line + 1] = number_high;
+    m[line + 2] = number_low;
+    m[line + 3] = (uint8_t) length;
+    memcpy(&m[line + 4], text, length - 3);
+    p->top += length;
+}
+
+static void search_check_quote(struct s_pack *p) {
+    if (p->memory[p->at] == '"') {
+        p->quote = !p->quote;
+    }
+}
+
+// Return true if 'c' can come before or, if 'after' is true, after a name.
+static bool is_boundary(const struct s_pack *p, uint8_t c, bool after) {
+    if ((c == '&') || catalogue_is_initial(c)) {
+        return false;
+    }
+    if (!after) {
+        return (c != token_proc) && (c != token_fn);
+    }
+    if (((c >= '0') && (c <= '9')) || (c == '%') || (c == '$')) {
+        return false;
+    }
+    if (c != '(') {
+        return true;
+    }
+    // "name(" is an array, unless the name is a PROC or FN.
+    for (int i = p->pattern_length - 1; i >= 0; --i) {
+        if ((p->pattern[i] == token_proc) || (p->pattern[i] == token_fn)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compare the pattern with the line from 'at', starting with pattern index
+// 'y' with 'x' characters of the pattern left, moving along the line until it
+// matches or the line ends; this follows ABE's &90EE.
+static int search_compare(struct s_pack *p, uint8_t y, uint8_t x) {
+    for (;;) {
+        uint8_t c = p->memory[(uint16_t) (p->at + y)];
+        uint8_t code = p->pattern[y];
+        if (c == cr) {
+            // A trailing special character matches the end of the line.
+            bool match = (x == 1) && (y != 0) &&
+                         (code < pattern_special_count);
+            return match ? search_match : search_next_line;
+        }
+        bool matched;
+        if (code == pattern_any) {
+            matched = true;
+        } else if (code == pattern_non_digit) {
+            matched = (c < '0') || (c > '9');
+        } else if (code == pattern_boundary) {
+            matched = is_boundary(p, c, x == 1);
+        } else {
+            matched = (c == code);
+        }
+        if (matched) {
+            ++y;
+            if (--x == 0) {
+                return search_match;
+            }
+        } else {
+            ++p->at;
+            if (++p->offset == 0) {
+                return search_next_line;
+            }
+            search_check_quote(p);
+            y = 0;
+            x = p->pattern_length;
+        }
+    }
+}
+
+// Carry on searching from 'at', as ABE's &90DE does.
+static int search_from(struct s_pack *p) {
+    search_check_quote(p);
+    return search_compare(p, 0, p->pattern_length);
+}
+
+// Carry on searching after a match, as ABE's &9127 does.
+static int search_next(struct s_pack *p) {
+    ++p->at;
+    if (++p->offset == 0) {
+        return search_next_line;
+    }
+    return search_from(p);
+}
+
+// Search the line after 'line', as ABE's &909C does.
+static int search_line(struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    p->quote = false;
+    assert(m[p->line] == cr);
+    if (byte_at(p, p->line, 1) & 0x80) {
+        return search_end;
+    }
+    if (byte_at(p, p->line, 3) - 4 < p->min_length) {
+        return search_next_line;
+    }
+    // A leading special character matches the start of the line.
+    uint8_t y = 0;
+    uint8_t x = p->pattern_length;
+    p->offset = 4;
+    if ((x != 1) && (p->pattern[0] < pattern_special_count)) {
+        y = 1;
+        --x;
+        p->offset = 3;
+    }
+    p->at = p->line + p->offset;
+    return search_compare(p, y, x);
+}
+
+static void search_next_line_of_program(struct s_pack *p) {
+    p->line += byte_at(p, p->line, 3);
+}
+
+// Count the matches for the pattern outside strings.
+static uint16_t count_matches(struct s_pack *p) {
+    uint16_t count = 0;
+    p->line = p->page;
+    for (;;) {
+        int result = search_line(p);
+        while (result == search_match) {
+            if (!p->quote) {
+                ++count;
+            }
+            result = search_next(p);
+        }
+        if (result == search_end) {
+            return count;
+        }
+        search_next_line_of_program(p);
+    }
+}
+
+// Replace the match at 'at' and store the resulting line, as ABE does from
+// &939C.
+static void replace_match(struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    uint8_t *b = p->buffer;
+    uint8_t y = 4;
+    uint8_t x = p->offset - 3;
+    if (x == 0) {
+        x = 1; // the leading special character matched the start of the line
+    } else {
+        for (--x; x != 0; --x) {
+            b[y] = byte_at(p, p->line, y);
+            ++y;
+        }
+    }
+    for (;;) {
+        uint8_t c = p->replacement[x++];
+        if (c == cr) {
+            break;
+        }
+        if (c < pattern_special_count) {
+            c = byte_at(p, p->line, y);
+        }
+        b[y] = c;
+        if (c == cr) {
+            store_line(p, p->line, &b[4]);
+            return;
+        }
+        if (++y == 0) {
+            p->failed = true; // "Line too long"
+            return;
+        }
+    }
+
+    // Copy the rest of the line, keeping the character matched by a trailing
+    // special character.
+    --x;
+    if (x != 0) {
+        --x;
+    }
+    uint8_t last = p->replacement[x];
+    x = y;
+    y = p->pattern_length;
+    if ((last | p->pattern[y - 1]) < pattern_special_count) {
+        --x;
+        --y;
+    }
+    for (;;) {
+        uint8_t c = m[(uint16_t) (p->at + y)];
+        b[x] = c;
+        if (c == cr) {
+            break;
+        }
+        ++y;
+        if (++x == 0) {
+            p->failed = true; // "Line too long"
+            return;
+        }
+    }
+    store_line(p, p->line, &b[4]);
+}
+
+// Replace every match for the pattern outside strings, as ABE's &9340 does.
+static void replace_all(struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    p->line = p->page;
+    int result = search_line(p);
+    while (result != search_end) {
+        if (result == search_next_line) {
+            search_next_line_of_program(p);
+            result = search_line(p);
+            continue;
+        }
+
+        // Leave alone matches in strings and in the last three bytes of a
+        // line number token.
+        bool skip = p->quote;
+        uint8_t y = p->offset;
+        for (int i = 0; !skip && (i < 3); ++i) {
+            if (--y < 4) {
+                break;
+            }
+            skip = (m[(uint16_t) (p->line + y)] == token_line_number);
+        }
+        if (skip) {
+            result = search_next(p);
+            continue;
+        }
+
+        replace_match(p);
+        if (p->failed) {
+            return;
+        }
+        if (p->buffer[4] == cr) {
+            result = search_line(p); // the line has gone
+            continue;
+        }
+        uint8_t x = p->replacement_length;
+        if ((x != 0) && (p->pattern[0] < pattern_special_count)) {
+            --x;
+        }
+        p->at += x;
+        p->offset += x;
+        result = search_from(p);
+    }
+}
+
+// Finish the candidate name in the replacement, using the suffix of the
+// name being replaced, and return true if it's in the catalogue; this is
+// ABE's &9E1D. *name_length is the candidate's length allowing for a suffix.
+static bool candidate_exists(struct s_pack *p, uint8_t *name_length) {
+    uint8_t *r = p->replacement;
+    uint8_t last = p->pattern[p->pattern_length - 1];
+    uint8_t before = p->pattern[p->pattern_length - 2];
+    uint8_t x = p->replacement_length;
+    if (last < pattern_special_count) {
+        --*name_length;
+    }
+    if ((last == '(') && ((before == '%') || (before == '$'))) {
+        r[x] = '(';
+        ++p->replacement_length;
+        ++*name_length;
+        last = before;
+    }
+    r[x - 1] = last;
+    return catalogue_find(&p->catalogue, r[1], &r[2], *name_length - 1) >= 0;
+}
+
+// Return true if a single letter name with initial 'initial' and the
+// replacement's suffix might be confused with an entry on the list for
+// 'initial'.
+static bool single_conflicts(const struct s_pack *p, uint8_t initial) {
+    uint8_t ours = p->replacement[p->replacement_length - 1];
+    uint8_t ours_before = p->replacement[p->replacement_length - 2];
+    const struct s_catalogue *c = &p->catalogue;
+    for (int i = c->head[catalogue_list(initial)]; i >= 0;
+         i = c->entries[i].next) {
+        const struct s_catalogue_entry *entry = &c->entries[i];
+        int n = entry->tail_length;
+        uint8_t last = (n > 0) ? entry->tail[n - 1] : 0xff;
+        if (last >= '0') {
+            if (ours < pattern_special_count) {
+                return true;
+            }
+        } else if (last != '(') {
+            if (last == ours) {
+                return true;
+            }
+        } else if (ours == '(') {
+            if ((n < 2) || (entry->tail[n - 2] >= '0')) {
+                if (ours_before >= '0') {
+                    return true;
+                }
+            } else if (entry->tail[n - 2] == ours_before) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Step on to the next character ABE tries as the second of a new name,
+// returning false when there are none left.
+static bool next_second_char(uint8_t *c) {
+    ++*c;
+    if (*c == '{') {
+        *c = '0';
+    }
+    if (*c == ':') {
+        return false;
+    }
+    if (*c == '[') {
+        *c = '_';
+    }
+    return true;
+}
+
+// Give the entry at 'index' the name in the replacement, writing the name,
+// and replace the old name throughout the program.
+static void apply_rename(struct s_pack *p, int index) {
+    struct s_catalogue_entry *entry = &p->catalogue.entries[index];
+    const uint8_t *r = p->replacement;
+    uint8_t tail_length = 0;
+    for (int i = 1; r[i] >= ' '; ++i) {
+        put_name_char(p, r[i]);
+        if (i > 1) {
+            entry->tail[tail_length++] = r[i];
+        }
+    }
+    entry->tail_length = tail_length;
+    replace_all(p);
+}
+
+// Find a shorter name for the entry at 'index', which has just been listed,
+// as ABE does from &9D02. It tries the initial alone, then any unused single
+// letter if 'singles' is set, then the initial followed by each of the name's
+// own characters and then by other characters in turn.
+static void rename_entry(struct s_pack *p, int index, bool singles) {
+    uint8_t *r = p->replacement;
+    uint8_t length = p->pattern_length;
+    uint8_t initial = r[1];
+    if (length <= ((initial & 0x80) ? 4 : 3)) {
+        return;
+    }
+    r[3] = r[4] = r[5] = cr;
+    uint8_t name_length;
+    if (!(initial & 0x80) &&
+        ((p->pattern[length - 2] >= '&') || (length >= 5))) {
+        name_length = 2;
+        p->replacement_length = 3;
+        if (!candidate_exists(p, &name_length)) {
+            apply_rename(p, index);
+            return;
+        }
+        if (singles) {
+            for (r[1] = 'A'; r[1] < '{'; ++r[1]) {
+                if (r[1] == '[') {
+                    r[1] = 'a';
+                }
+                if (!single_conflicts(p, r[1])) {
+                    if (catalogue_add(&p->catalogue, r[1], &r[2],
+                                      name_length - 1)) {
+                        apply_rename(p, index);
+                    } else {
+                        p->failed = true;
+                    }
+                    return;
+                }
+            }
+        }
+    }
+
+    uint8_t own = 2;
+    uint8_t other = '@';
+    for (;;) {
+        r[1] = initial;
+        if (length < 5) {
+            return;
+        }
+        name_length = 3;
+        p->replacement_length = 4;
+        uint8_t y = ++own;
+        uint8_t c = p->pattern[y - 1];
+        if ((y >= length) && !next_second_char(&other)) {
+            return;
+        }
+        if (y >= length) {
+            c = other;
+        }
+        while ((c == '$') || (c == '%')) {
+            if ((y < 5) || !next_second_char(&other)) {
+                return;
+            }
+            c = other;
+        }
+        r[2] = c;
+        if (!candidate_exists(p, &name_length)) {
+            apply_rename(p, index);
+            return;
+        }
+    }
+}
+
+// List a name, with the number of times it's used and any new name, as ABE
+// does from &9C8F. 'boundary' is the pattern character to match before it.
+static void list_name(struct s_pack *p, uint8_t boundary, uint8_t initial,
+                      const uint8_t *tail, uint8_t tail_length, int index,
+                      bool singles) {
+    p->pattern[0] = boundary;
+    p->replacement[0] = boundary;
+    p->replacement[1] = initial;
+    p->pattern[1] = initial;
+    put_name_char(p, initial);
+    uint8_t y = 2;
+    for (int i = 0; i < tail_length; ++i) {
+        p->pattern[y++] = tail[i];
+        put_name_char(p, tail[i]);
+    }
+    p->pattern_length = y--;
+    if ((y == 1) || (catalogue_char_class(p->pattern[y], y) != 0)) {
+        p->pattern[p->pattern_length++] = pattern_boundary;
+    }
+    p->min_length = y;
+    uint16_t count = count_matches(p);
+    put_string(p, " [");
+    put_decimal(p, count);
+    put_string(p, "]");
+    // ABE pads to column 16, but the emulated cursor is always at column 0.
+    for (int i = 0; i < 16; ++i) {
+        put(p, ' ');
+    }
+    if (index >= 0) {
+        rename_entry(p, index, singles);
+    }
+    put_newline(p);
+}
+
+// Catalogue the names in the program, then list and rename them, as ABE's
+// &9C16 does.
+static void pack_variables(struct s_pack *p, bool singles) {
+    struct s_catalogue *c = &p->catalogue;
+    for (uint16_t line = p->page; !(byte_at(p, line, 1) & 0x80);
+         line += byte_at(p, line, 3)) {
+        if (!catalogue_line(c, line)) {
+            p->failed = true;
+            return;
+        }
+    }
+    // Names added while renaming aren't listed.
+    int listed = c->entry_count;
+    put_newline(p);
+    static const uint8_t at_percent_tail[] = {'%'};
+    list_name(p, pattern_boundary, '@', at_percent_tail, 1, -1, singles);
+    for (int list = 'A'; list <= catalogue_list_fn; ++list) {
+        uint8_t boundary = pattern_boundary;
+        uint8_t initial = list;
+        if (list >= catalogue_list_proc) {
+            boundary = pattern_any;
+            initial = (list == catalogue_list_proc) ? token_proc : token_fn;
+        }
+        for (int i = c->head[list]; (i >= 0) && (i < listed);
+             i = c->entries[i].next) {
+            list_name(p, boundary, initial, c->entries[i].tail,
+                      c->entries[i].tail_length, i, singles);
+            if (p->failed) {
+                return;
+            }
+        }
+    }
+    p->assembler = 0;
+}
+
+// The state of copying a line without its REMs, spaces or comments.
+struct s_strip {
+    const uint8_t *memory;
+    uint8_t *buffer;
+    uint16_t source;
+    uint8_t x;    // the buffer index, for &06FF + x
+    uint8_t y;    // the source index
+    uint8_t last; // the last character copied; ABE's &81
+};
+
+static uint8_t strip_put(struct s_strip *s, uint8_t c) {
+    s->buffer[s->x + 3] = c;
+    s->last = c;
+    ++s->x;
+    ++s->y;
+    return c;
+}
+
+static uint8_t strip_copy(struct s_strip *s) {
+    return strip_put(s, s->memory[(uint16_t) (s->source + s->y)]);
+}
+
+// Copy the space at the source index if it's needed to keep two things
+// apart, as ABE does from &9A8D.
+static void strip_space(struct s_strip *s) {
+    uint8_t x = s->x;
+    uint8_t y = s->y;
+    uint8_t next = s->memory[(uint16_t) (s->source + y + 1)];
+    int next_class = catalogue_char_class(next, y + 1);
+    bool keep = false;
+    uint8_t i = x - 1;
+    if ((next_class != 0) && (catalogue_char_class(s->last, i) != 0)) {
+        // Look back over the name or number before the space, noting
+        // whether it or the next character makes the space necessary.
+        bool needed = (next_class == 1);
+        int c_class = 1;
+        uint8_t c;
+        ++i;
+        do {
+            needed = needed || (c_class == 2);
+            --i;
+            c = s->buffer[i + 3];
+            c_class = catalogue_char_class(c, i);
+        } while (c_class != 0);
+        if ((i != 0) && (c == '&')) {
+            keep = (next >= 'A') && (next < 'G');
+        } else if (needed) {
+            keep = true;
+        } else {
+            // A number followed by E would look like an exponent.
+            keep = (next == 'E') && (catalogue_char_class(s->last, i) == 1);
+        }
+    }
+    s->x = x;
+    s->y = y;
+    if (keep) {
+        strip_copy(s);
+    } else {
+        ++s->y;
+    }
+}
+
+// Copy the line at the source into the buffer, leaving out what isn't
+// wanted, as ABE does from &9997.
+static void strip_line(struct s_pack *p, struct s_strip *s,
+                       const struct s_pack_options *options) {
+    for (;;) {
+        uint8_t c = s->memory[(uint16_t) (s->source + s->y)];
+        if (c == cr) {
+            return;
+        }
+        if (c == '"') {
+            strip_put(s, c);
+            do {
+                c = strip_copy(s);
+                if (c == cr) {
+                    return;
+                }
+            } while (c != '"');
+            continue;
+        }
+        if (c == token_line_number) {
+            for (int i = 0; i < 4; ++i) {
+                strip_copy(s);
+            }
+            continue;
+        }
+        if (p->assembler & 0x80) {
+            if (c == '\\') {
+                uint8_t comment = s->x;
+                do {
+                    c = strip_copy(s);
+                } while ((c != cr) && (c != ':'));
+                if (options->comments) {
+                    s->x = comment;
+                    if ((c == ':') && (comment != 1)) {
+                        --s->y;
+                        strip_copy(s);
+                    }
+                }
+                if (c == cr) {
+                    return;
+                }
+                continue;
+            }
+            if (c == ']') {
+                p->assembler = c;
+            }
+        }
+        if (c == '[') {
+            p->assembler = 0x80 | (p->assembler >> 1);
+        }
+        if (c == token_rem) {
+            uint8_t rem = s->x;
+            while (strip_copy(s) != cr) {
+            }
+            if (options->rems) {
+                // This also drops the character before the REM.
+                s->x = (rem != 1) ? rem - 1 : rem;
+            }
+            return;
+        }
+        if ((c == token_data) ||
+            ((c == '*') && ((s->x == 1) || (s->last == ':') ||
+                            (s->last == token_then) ||
+                            (s->last == token_else)))) {
+            while (strip_copy(s) != cr) {
+            }
+            return;
+        }
+        if ((c == ' ') && options->spaces) {
+            strip_space(s);
+            continue;
+        }
+        strip_put(s, c);
+    }
+}
+
+// Strip each line in turn, moving the lines down over the bytes saved, as
+// ABE does from &997D.
+static void strip(struct s_pack *p, const struct s_pack_options *options) {
+    uint8_t *m = p->memory;
+    uint16_t destination = p->page;
+    struct s_strip s = {m, p->buffer, p->page, 0, 0, 0};
+    for (;;) {
+        uint8_t number_high = m[s.source + 1];
+        m[destination + 1] = number_high;
+        if (number_high & 0x80) {
+            return;
+        }
+        m[destination + 2] = m[s.source + 2];
+        uint8_t old_length = m[s.source + 3];
+        s.x = 1;
+        s.y = 4;
+        strip_line(p, &s, options);
+        p->buffer[s.x + 3] = cr;
+        s.source += old_length;
+
+        uint8_t y = 3;
+        do {
+            ++y;
+            m[destination + y] = p->buffer[y];
+        } while (p->buffer[y] != cr);
+        uint8_t length = 0;
+        if (y != 4) {
+            length = y;
+            m[destination + 3] = length;
+            destination += length;
+        }
+        p->top = p->top + length - old_length;
+        put(p, cr);
+        put_top(p);
+    }
+}
+
+// Record the line numbers referred to by line number tokens, as ABE's
+// search at &8F9C finds them. Joining lines doesn't change this.
+static void find_references(struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    memset(p->referenced, 0, sizeof(p->referenced));
+    for (uint16_t line = p->page; !(m[line + 1] & 0x80); line += m[line + 3]) {
+        for (uint8_t y = 4; m[line + y] != cr; ++y) {
+            if (m[line + y] == token_line_number) {
+                p->referenced[detokenise_line_number(&m[line + y])] = true;
+                y += 3;
+            }
+        }
+    }
+}
+
+// Return true if ABE would join the line after 'line' and the one after
+// 'next', as checked from &9B66.
+static bool can_join(const struct s_pack *p, uint16_t line, uint16_t next) {
+    const uint8_t *m = p->memory;
+    if ((m[line + 3] - 3) + m[next + 3] > 0xff) {
+        return false;
+    }
+    if (p->referenced[(m[next + 1] << 8) | m[next + 2]]) {
+        return false;
+    }
+    if ((m[line + 4] == '*') || (m[next + 4] == token_def) ||
+        (m[next + 4] == token_data)) {
+        return false;
+    }
+    for (uint8_t y = 4; ; ) {
+        uint8_t c = m[line + y++];
+        if (c == cr) {
+            return true;
+        }
+        if ((c == token_if) || (c == token_rem) || (c == token_data) ||
+            (c == token_error) || ((c == ':') && (m[line + y] == '*'))) {
+            return false;
+        }
+    }
+}
+
+// Join the line after 'line' and the one after 'next' with a colon, as ABE
+// does from &9BC0.
+static void join(struct s_pack *p, uint16_t line, uint16_t next) {
+    const uint8_t *m = p->memory;
+    uint8_t *b = p->buffer;
+    uint8_t y = 3;
+    do {
+        ++y;
+        b[y] = m[line + y];
+    } while (b[y] != cr);
+    b[y] = ':';
+    uint8_t x = y + 1;
+    y = 4;
+    while (m[next + y] == ':') {
+        ++y;
+    }
+    uint8_t c;
+    do {
+        c = m[next + y++];
+        b[x++] = c;
+    } while (c != cr);
+    store_line(p, line, &b[4]);
+    if (p->failed) {
+        return;
+    }
+    static const uint8_t empty[] = {cr};
+    store_line(p, line + m[line + 3], empty);
+}
+
+static void concatenate(struct s_pack *p) {
+    const uint8_t *m = p->memory;
+    find_references(p);
+    uint16_t line = p->page;
+    while (!(m[line + 1] & 0x80)) {
+        uint16_t next = line + m[line + 3];
+        if (m[next + 1] & 0x80) {
+            return;
+        }
+        if (!can_join(p, line, next)) {
+            line = next;
+            continue;
+        }
+        join(p, line, next);
+        if (p->failed) {
+            return;
+        }
+        put(p, cr);
+        put_top(p);
+    }
+}
+
+bool pack_program(struct s_machine *machine,
+                  const struct s_pack_options *options, uint8_t **output,
+                  size_t *output_length) {
+    assert(options != 0);
+    assert((output != 0) && (output_length != 0));
+    struct s_pack *p = check_alloc(calloc(1, sizeof(*p)));
+    // We work on a copy of memory so we can leave it alone if we give up.
+    uint8_t *m = check_alloc(malloc(0x10000));
+    memcpy(m, machine->memory, 0x10000);
+    p->memory = m;
+    p->page = m[0x18] << 8;
+    p->top = mpu_read_u16(machine, 0x12);
+    p->himem = mpu_read_u16(machine, 0x06);
+    p->assembler = m[0x87];
+    catalogue_init(&p->catalogue, machine, m, p->top);
+
+    bool done = check_program(p);
+    if (done) {
+        uint16_t old_top = p->top;
+        put_top(p);
+        if (options->variables) {
+            pack_variables(p, options->singles);
+        }
+        if (!p->failed) {
+            put_newline(p);
+            put_top(p);
+            if (options->rems || options->spaces || options->comments) {
+                strip(p, options);
+            }
+        }
+        if (!p->failed && options->concatenate) {
+            concatenate(p);
+        }
+        if (!p->failed) {
+            // ABE writes this with OSASCI, so its CR is a newline.
+            put_newline(p);
+            put_string(p, "Bytes saved= ");
+            put_decimal(p, old_top - p->top);
+        }
+        // After ABE quits, pack() in driver.c restores the high byte of the
+        // first line number, which changes the program if removing lines
+        // changed that byte.
+        done = !p->failed && (m[p->page + 1] == machine->memory[p->page + 1]);
+    }
+    if (done) {
+        memcpy(&machine->memory[p->page], &m[p->page], p->top - p->page);
+        mpu_memory_written(machine, p->page, p->top - p->page);
+        // ABE sets LOMEM, VARTOP and TOP to the end of the program.
+        static const uint16_t pointers[] = {0x00, 0x02, 0x12};
+        for (size_t i = 0; i < sizeof(pointers) / sizeof(pointers[0]); ++i) {
+            machine->memory[pointers[i]] = p->top & 0xff;
+            machine->memory[pointers[i] + 1] = p->top >> 8;
+            mpu_memory_written(machine, pointers[i], 2);
+        }
+        *output = p->output.data;
+        *output_length = p->output.length;
+    } else {
+        free(p->output.data);
+    }
+    free(m);
+    catalogue_free(&p->catalogue);
+    free(p);
+    return done;
+}
+
+// vi: colorcolumn=80
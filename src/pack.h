@@ -0,0 +1,40 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// A native equivalent of ABE's "Pack", for --engine=native. It works on the
+// program in the emulated machine's memory just as ABE does, so it gives
+// exactly the same results, including the names it gives variables and the
+// output ABE writes while it works.
+
+// The answers to the questions "Pack" asks; true means "Y".
+struct s_pack_options {
+    bool rems;
+    bool spaces;
+    bool comments;
+    bool variables;
+    bool singles;
+    bool concatenate;
+};
+
+// Pack the program in 'machine''s memory as ABE's "Pack" does with the
+// answers in 'options', setting *output to what ABE writes via OSWRCH after
+// the last question has been answered and its newline printed, up to and
+// including the number of bytes saved, and *output_length to its length; the
+// caller must free *output. Return false, leaving memory alone, for the cases
+// we leave to ABE: programs whose lines aren't in order or contain CR or an
+// incomplete line number token, running out of room for the variable
+// catalogue or a line, and removing the first line when the next one's number
+// has a different high byte (or there isn't a next one).
+bool pack_program(struct s_machine *machine,
+                  const struct s_pack_options *options, uint8_t **output,
+                  size_t *output_length);
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,532 @@
+// Exact profiling of emulated 6502 code; see profile.h.
+//
+// The call tree is built by watching the stack pointer rather than matching
+// RTS instructions, as BASIC often discards return addresses (e.g. resetting
+// the stack on an error) or returns with something other than RTS: a frame is
+// pushed when a JSR leaves S two lower than it was, and popped once S is back
+// at or above where it was before that JSR.
+
+#include "profile.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roms.h"
+#include "utils.h"
+
+enum {
+    opcode_jsr = 0x20
+};
+
+enum {
+    bank_ram,
+    bank_basic_2_rom,
+    bank_basic_4_rom,
+    bank_editor_a_rom,
+    bank_editor_b_rom,
+    bank_count
+};
+
+static const char *const bank_names[bank_count] = {
+    "RAM", "BASIC2", "BASIC4", "EDITORA", "EDITORB"
+};
+
+// Counters are kept for every address of RAM and every address of each ROM,
+// indexed by slot().
+enum {
+    slot_count = 0x10000 + (bank_count - 1) * rom_size
+};
+
+// How many addresses the summary shows, busiest first.
+static const int top_addresses = 40;
+
+struct s_counts {
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+struct s_symbol {
+    int bank;
+    uint16_t address;
+    char *name;
+};
+
+// A node in the call tree, which is a child of its caller's node. Root nodes
+// have no caller and are named after the operation being run instead.
+struct s_node {
+    int parent;
+    int first_child;
+    int next_sibling;
+    int bank;
+    uint16_t address;
+    const char *operation;
+    struct s_counts self;
+};
+
+struct s_frame {
+    int node;
+    int bank;
+    uint16_t address;
+    uint8_t s_at_call;
+};
+
+struct s_profile {
+    struct s_counts *addresses; // indexed by slot()
+    struct s_counts opcodes[256];
+    char mnemonics[256][4];
+
+    struct s_symbol *symbols; // sorted by bank and address
+    size_t symbol_count;
+
+    struct s_node *nodes;
+    int node_count;
+    int node_capacity;
+
+    // The call stack; each JSR uses two bytes of the 6502 stack, so it can't
+    // usefully be deeper than this.
+    struct s_frame stack[128];
+    int depth;
+    int root;
+};
+
+static int slot(int bank, uint16_t address) {
+    if (bank == bank_ram) {
+        return address;
+    }
+    return 0x10000 + (bank - 1) * rom_size + (address - 0x8000);
+}
+
+// Return the bank 'address' is currently read from.
+static int bank_of(const M6502 *mpu, uint16_t address) {
+    if ((address < 0x8000) || (address >= 0x8000 + rom_size)) {
+        return bank_ram;
+    }
+    const uint8_t *rom = mpu->pages[0x80];
+    if (rom == rom_basic[basic_2]) {
+        return bank_basic_2_rom;
+    } else if (rom == rom_basic[basic_4]) {
+        return bank_basic_4_rom;
+    } else if (rom == rom_editor_a) {
+        return bank_editor_a_rom;
+    } else if (rom == rom_editor_b) {
+        return bank_editor_b_rom;
+    }
+    return bank_ram;
+}
+
+static void add_counts(struct s_counts *counts, uint64_t cycles) {
+    ++counts->instructions;
+    counts->cycles += cycles;
+}
+
+// Return the child of node 'parent' for a call to 'address' in 'bank', or
+// for 'operation' if it's not null, creating it if necessary.
+static int child_node(struct s_profile *profile, int parent, int bank,
+                      uint16_t address, const char *operation) {
+    int i = (parent >= 0) ? profile->nodes[parent].first_child : profile->root;
+    for (; i >= 0; i = profile->nodes[i].next_sibling) {
+        const struct s_node *node = &profile->nodes[i];
+        if ((operation != 0) ? (node->operation == operation) :
+                ((node->bank == bank) && (node->address == address))) {
+            return i;
+        }
+    }
+    if (profile->node_count == profile->node_capacity) {
+        profile->node_capacity = max(256, profile->node_capacity * 2);
+        profile->nodes = check_alloc(realloc(
+            profile->nodes, profile->node_capacity * sizeof(struct s_node)));
+    }
+    i = profile->node_count++;
+    struct s_node *node = &profile->nodes[i];
+    node->parent = parent;
+    node->first_child = -1;
+    node->bank = bank;
+    node->address = address;
+    node->operation = operation;
+    node->self.instructions = 0;
+    node->self.cycles = 0;
+    if (parent >= 0) {
+        node->next_sibling = profile->nodes[parent].first_child;
+        profile->nodes[parent].first_child = i;
+    } else {
+        // Roots are chained from the first one, which is never replaced.
+        node->next_sibling = -1;
+        if (profile->root >= 0) {
+            int last = profile->root;
+            while (profile->nodes[last].next_sibling >= 0) {
+                last = profile->nodes[last].next_sibling;
+            }
+            profile->nodes[last].next_sibling = i;
+        }
+    }
+    return i;
+}
+
+struct s_profile *profile_new(void) {
+    struct s_profile *profile = check_alloc(calloc(1, sizeof(*profile)));
+    profile->addresses =
+        check_alloc(calloc(slot_count, sizeof(struct s_counts)));
+    profile->root = -1;
+    return profile;
+}
+
+void profile_delete(struct s_profile *profile) {
+    if (profile == 0) {
+        return;
+    }
+    for (size_t i = 0; i < profile->symbol_count; ++i) {
+        free(profile->symbols[i].name);
+    }
+    free(profile->symbols);
+    free(profile->nodes);
+    free(profile->addresses);
+    free(profile);
+}
+
+static int compare_symbols(const void *lhs_ptr, const void *rhs_ptr) {
+    const struct s_symbol *lhs = lhs_ptr;
+    const struct s_symbol *rhs = rhs_ptr;
+    if (lhs->bank != rhs->bank) {
+        return lhs->bank - rhs->bank;
+    }
+    return (int) lhs->address - (int) rhs->address;
+}
+
+void profile_load_symbols(struct s_profile *profile, const char *filename) {
+    size_t length;
+    char *data = load_binary(filename, &length);
+    char *data_ptr = data;
+    char *line;
+    int line_number = 0;
+    while ((line = get_line(&data_ptr, &length)) != 0) {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment != 0) {
+            *comment = '\0';
+        }
+        const char *separators = " \t";
+        char *bank_name = strtok(line, separators);
+        if (bank_name == 0) {
+            continue;
+        }
+        char *address_text = strtok(0, separators);
+        char *name = strtok(0, separators);
+        check((name != 0) && (strtok(0, separators) == 0),
+              "error: %s:%d: expected \"BANK ADDRESS NAME\"", filename,
+              line_number);
+        int bank;
+        for (bank = 0; bank < bank_count; ++bank) {
+            if (strcmp(bank_name, bank_names[bank]) == 0) {
+                break;
+            }
+        }
+        check(bank < bank_count, "error: %s:%d: unknown bank \"%s\"",
+              filename, line_number, bank_name);
+        if ((*address_text == '&') || (*address_text == '$')) {
+            ++address_text;
+        }
+        char *end;
+        long address = strtol(address_text, &end, 16);
+        check(isxdigit((unsigned char) *address_text) && (*end == '\0') &&
+              (address >= 0) && (address <= 0xffff),
+              "error: %s:%d: invalid address \"%s\"", filename, line_number,
+              address_text);
+        check((bank == bank_ram) ||
+              ((address >= 0x8000) && (address < 0x8000 + rom_size)),
+              "error: %s:%d: address \"%s\" is outside %s", filename,
+              line_number, address_text, bank_names[bank]);
+        // Names become frames in the folded stacks, where ";" separates them.
+        check(strchr(name, ';') == 0, "error: %s:%d: invalid name \"%s\"",
+              filename, line_number, name);
+
+        profile->symbols = check_alloc(realloc(
+            profile->symbols,
+            (profile->symbol_count + 1) * sizeof(struct s_symbol)));
+        struct s_symbol *symbol = &profile->symbols[profile->symbol_count++];
+        symbol->bank = bank;
+        symbol->address = (uint16_t) address;
+        symbol->name = ourstrdup(name);
+    }
+    free(data);
+    qsort(profile->symbols, profile->symbol_count, sizeof(struct s_symbol),
+          compare_symbols);
+}
+
+// Name 'address' in 'bank' in 'buffer', using the nearest symbol at or below
+// it in the same bank if there is one.
+static const char *address_name(const struct s_profile *profile, int bank,
+                                uint16_t address, char buffer[128]) {
+    const struct s_symbol *best = 0;
+    size_t lo = 0;
+    size_t hi = profile->symbol_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct s_symbol *symbol = &profile->symbols[mid];
+        if ((symbol->bank < bank) ||
+            ((symbol->bank == bank) && (symbol->address <= address))) {
+            if (symbol->bank == bank) {
+                best = symbol;
+            }
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (best == 0) {
+        snprintf(buffer, 128, "%s:&%04X", bank_names[bank], address);
+    } else if (best->address == address) {
+        snprintf(buffer, 128, "%s:%s", bank_names[bank], best->name);
+    } else {
+        snprintf(buffer, 128, "%s:%s+&%X", bank_names[bank], best->name,
+                 address - best->address);
+    }
+    return buffer;
+}
+
+static int slot_bank(int i) {
+    return (i < 0x10000) ? bank_ram : 1 + (i - 0x10000) / rom_size;
+}
+
+static void slot_name(const struct s_profile *profile, int i,
+                      char buffer[128]) {
+    int bank = slot_bank(i);
+    uint16_t address = (bank == bank_ram) ?
+        i : 0x8000 + (i - 0x10000) % rom_size;
+    address_name(profile, bank, address, buffer);
+}
+
+// Make the current call stack's frames children of a root for 'operation'.
+static void set_operation(struct s_profile *profile, const char *operation) {
+    if ((profile->root >= 0) &&
+        (profile->nodes[profile->stack[0].node].operation == operation)) {
+        return;
+    }
+    int node = child_node(profile, -1, bank_ram, 0, operation);
+    if (profile->root < 0) {
+        profile->root = node;
+    }
+    profile->stack[0].node = node;
+    for (int i = 1; i < profile->depth; ++i) {
+        struct s_frame *frame = &profile->stack[i];
+        node = child_node(profile, node, frame->bank, frame->address, 0);
+        frame->node = node;
+    }
+}
+
+int profile_run(struct s_profile *profile, M6502 *mpu, const char *operation) {
+    const int max_depth = sizeof(profile->stack) / sizeof(profile->stack[0]);
+    if (profile->depth == 0) {
+        // The bottom frame stands for the operation itself and is never
+        // popped.
+        profile->stack[0].s_at_call = 0;
+        profile->depth = 1;
+    }
+    set_operation(profile, operation);
+
+    M6502_Registers *registers = mpu->registers;
+    for (;;) {
+        uint16_t pc = registers->pc;
+        uint8_t s = registers->s;
+        uint8_t opcode = M6502_read(mpu, pc);
+        int bank = bank_of(mpu, pc);
+        if (profile->mnemonics[opcode][0] == '\0') {
+            char buffer[64];
+            M6502_disassemble(mpu, pc, buffer);
+            memcpy(profile->mnemonics[opcode], buffer, 3); // e.g. "LDA "
+        }
+
+        mpu->elapsed = 0;
+        int stop = M6502_step(mpu);
+        if (stop == M6502_OutOfBudget) {
+            return stop;
+        }
+        add_counts(&profile->addresses[slot(bank, pc)], mpu->elapsed);
+        add_counts(&profile->opcodes[opcode], mpu->elapsed);
+        struct s_frame *top = &profile->stack[profile->depth - 1];
+        add_counts(&profile->nodes[top->node].self, mpu->elapsed);
+
+        if ((opcode == opcode_jsr) && (registers->s == (uint8_t) (s - 2))) {
+            if (profile->depth < max_depth) {
+                struct s_frame *frame = &profile->stack[profile->depth++];
+                frame->bank = bank_of(mpu, registers->pc);
+                frame->address = registers->pc;
+                frame->s_at_call = s;
+                frame->node = child_node(profile, top->node, frame->bank,
+                                         frame->address, 0);
+            }
+        } else {
+            while ((profile->depth > 1) &&
+                   (registers->s >=
+                    profile->stack[profile->depth - 1].s_at_call)) {
+                --profile->depth;
+            }
+        }
+        if (stop != 0) {
+            return stop;
+        }
+    }
+}
+
+struct s_entry {
+    char name[128];
+    struct s_counts counts;
+};
+
+static int compare_entries(const void *lhs_ptr, const void *rhs_ptr) {
+    const struct s_entry *lhs = lhs_ptr;
+    const struct s_entry *rhs = rhs_ptr;
+    if (lhs->counts.cycles != rhs->counts.cycles) {
+        return (lhs->counts.cycles < rhs->counts.cycles) ? 1 : -1;
+    }
+    return strcmp(lhs->name, rhs->name);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return (total == 0) ? 0.0 : (100.0 * part) / total;
+}
+
+// Write the non-empty entries of 'entries' busiest first, at most 'limit' of
+// them if that's not negative.
+static void write_entries(FILE *file, const char *heading,
+                          struct s_entry *entries, size_t count,
+                          const struct s_counts *total, int limit) {
+    qsort(entries, count, sizeof(struct s_entry), compare_entries);
+    fprintf(file, "\n%s:\n%14s %7s %14s %7s  %s\n", heading, "instructions",
+            "%", "cycles", "%", "name");
+    for (size_t i = 0; i < count; ++i) {
+        const struct s_counts *counts = &entries[i].counts;
+        if ((counts->instructions == 0) ||
+            ((limit >= 0) && (i >= (size_t) limit))) {
+            break;
+        }
+        fprintf(file, "%14llu %6.2f%% %14llu %6.2f%%  %s\n",
+                (unsigned long long) counts->instructions,
+                percent(counts->instructions, total->instructions),
+                (unsigned long long) counts->cycles,
+                percent(counts->cycles, total->cycles), entries[i].name);
+    }
+}
+
+static void write_summary(const struct s_profile *profile, FILE *file) {
+    struct s_counts total = {0, 0};
+    for (int opcode = 0; opcode < 256; ++opcode) {
+        total.instructions += profile->opcodes[opcode].instructions;
+        total.cycles += profile->opcodes[opcode].cycles;
+    }
+    fprintf(file, "6502 profile: %llu instructions, %llu cycles\n",
+            (unsigned long long) total.instructions,
+            (unsigned long long) total.cycles);
+
+    struct s_entry *entries =
+        check_alloc(calloc(slot_count, sizeof(struct s_entry)));
+
+    // Banks.
+    for (int bank = 0; bank < bank_count; ++bank) {
+        strcpy(entries[bank].name, bank_names[bank]);
+    }
+    for (int i = 0; i < slot_count; ++i) {
+        int bank = slot_bank(i);
+        entries[bank].counts.instructions +=
+            profile->addresses[i].instructions;
+        entries[bank].counts.cycles += profile->addresses[i].cycles;
+    }
+    write_entries(file, "By bank", entries, bank_count, &total, -1);
+
+    // Subroutines, by the address they were called at; code run outside any
+    // subroutine counts towards its operation.
+    struct s_counts *subroutines =
+        check_alloc(calloc(slot_count, sizeof(struct s_counts)));
+    size_t count = 0;
+    for (int i = 0; i < profile->node_count; ++i) {
+        const struct s_node *node = &profile->nodes[i];
+        if (node->operation != 0) {
+            snprintf(entries[count].name, sizeof(entries[count].name),
+                     "(%s)", node->operation);
+            entries[count].counts = node->self;
+            ++count;
+        } else {
+            struct s_counts *counts =
+                &subroutines[slot(node->bank, node->address)];
+            counts->instructions += node->self.instructions;
+            counts->cycles += node->self.cycles;
+        }
+    }
+    for (int i = 0; i < slot_count; ++i) {
+        if (subroutines[i].instructions != 0) {
+            slot_name(profile, i, entries[count].name);
+            entries[count].counts = subroutines[i];
+            ++count;
+        }
+    }
+    free(subroutines);
+    write_entries(file, "By subroutine (excluding subroutines it calls)",
+                  entries, count, &total, -1);
+
+    // Individual addresses.
+    count = 0;
+    for (int i = 0; i < slot_count; ++i) {
+        if (profile->addresses[i].instructions == 0) {
+            continue;
+        }
+        entries[count].counts = profile->addresses[i];
+        slot_name(profile, i, entries[count].name);
+        ++count;
+    }
+    write_entries(file, "By address", entries, count, &total, top_addresses);
+
+    // Opcodes.
+    for (int opcode = 0; opcode < 256; ++opcode) {
+        snprintf(entries[opcode].name, sizeof(entries[opcode].name),
+                 "%02X %s", opcode, profile->mnemonics[opcode]);
+        entries[opcode].counts = profile->opcodes[opcode];
+    }
+    write_entries(file, "By opcode", entries, 256, &total, -1);
+
+    free(entries);
+}
+
+// Write the names of node 'i' and its callers, outermost first.
+static void write_stack(const struct s_profile *profile, FILE *file, int i) {
+    const struct s_node *node = &profile->nodes[i];
+    if (node->operation != 0) {
+        fputs(node->operation, file);
+        return;
+    }
+    char buffer[128];
+    write_stack(profile, file, node->parent);
+    fprintf(file, ";%s",
+            address_name(profile, node->bank, node->address, buffer));
+}
+
+static void write_folded(const struct s_profile *profile, FILE *file) {
+    for (int i = 0; i < profile->node_count; ++i) {
+        if (profile->nodes[i].self.instructions == 0) {
+            continue;
+        }
+        write_stack(profile, file, i);
+        fprintf(file, " %llu\n",
+                (unsigned long long) profile->nodes[i].self.cycles);
+    }
+}
+
+static void write_file(const struct s_profile *profile, const char *filename,
+                       void (*write_fn)(const struct s_profile *, FILE *)) {
+    FILE *file = fopen(filename, "w");
+    check(file != 0, "error: can't open output file \"%s\"", filename);
+    write_fn(profile, file);
+    check(!ferror(file) && (fclose(file) == 0),
+          "error: error writing to output file \"%s\"", filename);
+}
+
+void profile_write(const struct s_profile *profile, const char *filename) {
+    write_file(profile, filename, write_summary);
+    const char *suffix = ".folded";
+    char *folded_filename =
+        check_alloc(malloc(strlen(filename) + strlen(suffix) + 1));
+    strcpy(folded_filename, filename);
+    strcat(folded_filename, suffix);
+    write_file(profile, folded_filename, write_folded);
+    free(folded_filename);
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,39 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "lib6502.h"
+
+// An exact profile of the 6502 code an emulated machine runs: instructions
+// and cycles per address and per opcode, attributed to the ROM paged in at
+// the time (or RAM), plus a call tree built by following JSR and the stack
+// pointer. Only instructions the emulated CPU runs are counted, so routines
+// replaced natively by traps (see traps.h) don't appear; use --no-traps for a
+// profile of the ROM code alone.
+struct s_profile;
+
+// Return a new, empty profile.
+struct s_profile *profile_new(void);
+
+// Load names for addresses from the text file 'filename', so the profile
+// shows them instead of bare addresses. Each line is "BANK ADDRESS NAME",
+// where BANK is one of BASIC2, BASIC4, EDITORA, EDITORB or RAM and ADDRESS is
+// hexadecimal, optionally prefixed with "&" or "$"; blank lines and anything
+// after "#" are ignored. This can be called more than once.
+void profile_load_symbols(struct s_profile *profile, const char *filename);
+
+// Run 'mpu' one instruction at a time until M6502_run() would have returned,
+// returning the same value and recording every instruction in 'profile'.
+// Calls nest under a root named 'operation' in the call tree. 'mpu' must have
+// been created without M6502_NoCycles for the cycle counts to be useful.
+int profile_run(struct s_profile *profile, M6502 *mpu, const char *operation);
+
+// Write a readable summary of 'profile' to 'filename' and its call tree, as
+// folded stacks weighted by cycles for flame graph tools, to 'filename' with
+// ".folded" appended.
+void profile_write(const struct s_profile *profile, const char *filename);
+
+void profile_delete(struct s_profile *profile);
+
+// vi: colorcolumn=80
+
+#endif
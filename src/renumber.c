@@ -0,0 +1,246 @@
+// A native RENUMBER; see renumber.h.
+//
+// RENUMBER makes three passes over the program: it records each line's old
+// number in a table at TOP, gives each line its new number and then updates
+// each line number token to the new number of the line it refers to, found by
+// walking the table and the program together. BASIC 4 leaves tokens in
+// strings and after REM alone in the last pass; BASIC 2 doesn't, and it also
+// takes an extra step through the program after each table entry greater than
+// the number it's looking for, which the table being in order normally makes
+// harmless. Where it isn't, we walk through the program as BASIC 2 does,
+// unless the walk strays past HIMEM, in which case what it finds depends on
+// the state of the whole machine and we leave the job to the ROM. Without the
+// table at TOP there's nothing to walk, so then every reference is to the
+// first line with its number, as in BASIC 4.
+
+#include "renumber.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "detokenise.h"
+#include "emulation.h"
+#include "tokenise.h"
+#include "tokens.h"
+#include "utils.h"
+
+enum {
+    no_line = -1,  // no line has this number
+    walk_line = -2 // BASIC 2 can only find this line by walking
+};
+
+struct s_renumber {
+    uint8_t *memory;
+    int basic_version;
+    uint16_t page;
+    uint16_t himem;
+    uint16_t top;            // where the table of old line numbers starts
+    bool rom_table;          // the table is at TOP, as BASIC keeps it
+    size_t line_count;
+    uint16_t *lines;         // the address of each line's line number
+    int index[0x8000];       // each old line number's index in 'lines'
+    uint16_t max_line_number;
+    bool strayed;            // BASIC 2 walked past HIMEM
+
+    struct s_buffer output;
+};
+
+static void put(struct s_renumber *r, uint8_t c) {
+    buffer_put(&r->output, c);
+}
+
+static uint16_t read_line_number(const struct s_renumber *r,
+                                 uint16_t address) {
+    return (r->memory[address] << 8) | r->memory[(uint16_t) (address + 1)];
+}
+
+// Return the address of the end of the program, i.e. TOP, checking the
+// program's structure as BASIC does.
+static uint16_t find_top(const uint8_t *memory, uint16_t page) {
+    uint16_t line = page;
+    for (;;) {
+        check(memory[line] == cr, "error: Bad program");
+        if (memory[(uint16_t) (line + 1)] & 0x80) {
+            return line + 2;
+        }
+        uint8_t length = memory[(uint16_t) (line + 3)];
+        check(length != 0, "error: Bad program");
+        line += length;
+    }
+}
+
+// Walk through the table and the program together as BASIC 2 does, looking
+// for the line whose old number is 'number'; if it's found, set *line to the
+// address of its (new) line number and return true. If the walk strays out
+// past HIMEM, set 'strayed' and return false.
+static bool walk(struct s_renumber *r, uint16_t number, uint16_t *line) {
+    const uint8_t *m = r->memory;
+    uint32_t address = r->page + 1;
+    uint32_t entry = r->top;
+    for (;;) {
+        if ((address + 2 >= r->himem) || (entry + 1 >= r->himem)) {
+            r->strayed = true;
+            return false;
+        }
+        if (m[address] & 0x80) {
+            return false;
+        }
+        uint16_t old_number = read_line_number(r, entry);
+        if (old_number == number) {
+            *line = address;
+            return true;
+        }
+        address += m[address + 2] + (old_number > number);
+        entry += 2;
+    }
+}
+
+// Update the line number token at 'token' in the line at 'line', or report
+// that the line it refers to doesn't exist.
+static void update_reference(struct s_renumber *r, uint16_t line,
+                             uint16_t token) {
+    uint16_t number = detokenise_line_number(&r->memory[token]);
+    bool found = false;
+    uint16_t address;
+    if ((number < 0x8000) && (r->index[number] >= 0)) {
+        address = r->lines[r->index[number]];
+        found = true;
+    } else if (r->rom_table && (r->basic_version == basic_2) &&
+               (number <= r->max_line_number)) {
+        found = walk(r, number, &address);
+    }
+    if (found) {
+        tokenise_line_number(&r->memory[token],
+                             read_line_number(r, address));
+        return;
+    }
+    char message[32];
+    int length = sprintf(message, "Failed at %u",
+                         (unsigned int) read_line_number(r, line + 1));
+    for (int i = 0; i < length; ++i) {
+        put(r, message[i]);
+    }
+    put(r, lf); put(r, cr); // OSNEWL
+}
+
+// Update the line number tokens in the program.
+static void update_references(struct s_renumber *r, uint16_t page) {
+    const uint8_t *m = r->memory;
+    bool is_basic_2 = (r->basic_version == basic_2);
+    uint16_t line = page;
+    if (is_basic_2 && (m[line + 1] & 0x80)) {
+        return;
+    }
+    while (is_basic_2 || !(m[line + 1] & 0x80)) {
+        uint8_t y = 4; // an 8-bit register in the ROM
+        uint8_t quote = 0;
+        for (;;) {
+            uint8_t c = m[(uint16_t) (line + y)];
+            if (quote == 0) {
+                if (c == token_line_number) {
+                    update_reference(r, line, line + y);
+                    if (r->strayed) {
+                        return;
+                    }
+                    y += 4;
+                    continue;
+                }
+                if (!is_basic_2 && (c == token_rem)) {
+                    break;
+                }
+            }
+            ++y;
+            if (!is_basic_2 && (c == '"')) {
+                quote ^= c;
+            }
+            if (c == cr) {
+                break;
+            }
+        }
+        if (is_basic_2 && (m[(uint16_t) (line + y)] & 0x80)) {
+            return;
+        }
+        line += m[(uint16_t) (line + 3)];
+    }
+}
+
+bool renumber_program(struct s_machine *machine, int start, int step,
+                      bool rom_table, uint8_t **output,
+                      size_t *output_length) {
+    assert((start >= 0) && (start <= 0x7fff));
+    assert((step >= 1) && (step <= 0xff));
+    assert((output != 0) && (output_length != 0));
+    struct s_renumber *r = check_alloc(calloc(1, sizeof(*r)));
+    // We work on a copy of memory so we can leave it alone if we stray.
+    uint8_t *m = check_alloc(malloc(0x10000));
+    memcpy(m, machine->memory, 0x10000);
+    r->memory = m;
+    r->basic_version = machine->basic_version;
+    uint16_t page = m[0x18] << 8;
+    r->page = page;
+    r->himem = mpu_read_u16(machine, 0x06);
+    r->top = find_top(m, page);
+    r->rom_table = rom_table;
+
+    // Record the old line numbers, in the table at TOP as BASIC does and in
+    // 'index'. BASIC 2 only finds a line directly if every line before it
+    // has a lower number, or if it can't walk.
+    for (size_t i = 0; i < sizeof(r->index) / sizeof(r->index[0]); ++i) {
+        r->index[i] = no_line;
+    }
+    size_t lines_capacity = 0;
+    uint16_t table = r->top;
+    for (uint16_t line = page + 1; !(m[line] & 0x80); line += m[line + 2]) {
+        if (rom_table) {
+            m[table] = m[line];
+            m[table + 1] = m[line + 1];
+            table += 2;
+            check(table < r->himem, "error: RENUMBER space (0)");
+        }
+        if (r->line_count == lines_capacity) {
+            lines_capacity = (lines_capacity > 0) ? lines_capacity * 2 : 256;
+            r->lines = check_alloc(realloc(r->lines, lines_capacity *
+                                           sizeof(r->lines[0])));
+        }
+        uint16_t number = read_line_number(r, line);
+        if (r->index[number] == no_line) {
+            bool direct = !rom_table || (r->basic_version == basic_4) ||
+                          (r->line_count == 0) ||
+                          (r->max_line_number < number);
+            r->index[number] = direct ? r->line_count : walk_line;
+        }
+        if ((r->line_count == 0) || (number > r->max_line_number)) {
+            r->max_line_number = number;
+        }
+        r->lines[r->line_count++] = line;
+    }
+
+    uint16_t number = start;
+    for (size_t i = 0; i < r->line_count; ++i) {
+        m[r->lines[i]] = number >> 8;
+        m[r->lines[i] + 1] = number & 0xff;
+        number = (number + step) & 0x7fff;
+    }
+
+    update_references(r, page);
+    bool done = !r->strayed;
+    if (done) {
+        memcpy(&machine->memory[page], &m[page], table - page);
+        mpu_memory_written(machine, page, table - page);
+        // BASIC sets TOP as it checks the program.
+        machine->memory[0x12] = r->top & 0xff;
+        machine->memory[0x13] = r->top >> 8;
+        mpu_memory_written(machine, 0x12, 2);
+        *output = r->output.data;
+        *output_length = r->output.length;
+    } else {
+        free(r->output.data);
+    }
+    free(m);
+    free(r->lines);
+    free(r);
+    return done;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,32 @@
+#ifndef RENUMBER_H
+#define RENUMBER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// A native equivalent of RENUMBER, for --engine=native. It works on the
+// program in the emulated machine's memory just as the ROM's RENUMBER does,
+// so it gives exactly the same results, but looks up each line number
+// reference directly rather than by a search through the program.
+
+// Renumber the program in 'machine''s memory as "RENUMBER start,step" does,
+// setting *output to what BASIC writes via OSWRCH meanwhile (a "Failed at"
+// line for each reference to a line which doesn't exist) and *output_length
+// to its length; the caller must free *output. Return false, leaving memory
+// alone, if BASIC's search for a line would stray past HIMEM, which
+// can happen in BASIC 2 if the lines aren't in order.
+//
+// If 'rom_table' is false, the old line numbers are kept only in host memory
+// rather than in a table at TOP, so the program's size isn't limited by the
+// space above it and this always succeeds; each reference is then to the
+// first line with its number, even in BASIC 2.
+bool renumber_program(struct s_machine *machine, int start, int step,
+                      bool rom_table, uint8_t **output,
+                      size_t *output_length);
+
+// vi: colorcolumn=80
+
+#endif
@@ -1,4 +1,7 @@
 #include "roms.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
 
 const uint8_t rom_editor_a[] = {
 #include "zz-editor-a.c"
@@ -17,4 +20,30 @@ const uint8_t rom_basic[basic_count][rom_size] = {
     }
 };
 
+// The offsets of the keyword tables in the ROMs above. They're fixed by the
+// images, so they're constants rather than searched for at run time; a
+// different image must come with new offsets, which is checked in debug
+// builds.
+static const size_t basic_token_table[basic_count] = {0x71, 0x513};
+static const size_t editor_token_table = 0x54e;
+
+#ifndef NDEBUG
+static bool is_token_table(const uint8_t *rom, size_t offset) {
+    static const uint8_t first_entry[] = {'A', 'N', 'D', 0x80, 0x00};
+    return memcmp(&rom[offset], first_entry, sizeof(first_entry)) == 0;
+}
+#endif
+
+size_t rom_basic_token_table(int basic_version) {
+    assert((basic_version >= 0) && (basic_version < basic_count));
+    size_t table = basic_token_table[basic_version];
+    assert(is_token_table(rom_basic[basic_version], table));
+    return table;
+}
+
+size_t rom_editor_token_table(void) {
+    assert(is_token_table(rom_editor_b, editor_token_table));
+    return editor_token_table;
+}
+
 // vi: colorcolumn=80
@@ -26,6 +26,15 @@ extern const uint8_t rom_editor_a[rom_size];
 extern const uint8_t rom_editor_b[rom_size];
 extern const uint8_t rom_basic[basic_count][rom_size];
 
+// Return the offset in rom_basic[basic_version] of the keyword table; each
+// entry is a keyword, its token and a flags byte, starting with "AND". The
+// table's end isn't marked, but its last entry has the token &FE.
+size_t rom_basic_token_table(int basic_version);
+
+// Return the offset in rom_editor_b of ABE's own keyword table, which is laid
+// out in the same way; its last entry has the token &D3.
+size_t rom_editor_token_table(void);
+
 // vi: colorcolumn=80
 
 #endif
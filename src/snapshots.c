@@ -0,0 +1,13 @@
+#include "emulation.h"
+
+// Machine state at the first BASIC prompt for each BASIC version; these
+// auto-generated files are written by mksnapshot.
+#include "zz-snapshot-2.c"
+#include "zz-snapshot-4.c"
+
+const struct s_snapshot *const boot_snapshots[basic_count] = {
+    &snapshot_basic_2,
+    &snapshot_basic_4
+};
+
+// vi: colorcolumn=80
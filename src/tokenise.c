@@ -0,0 +1,276 @@
+// A native tokeniser; see tokenise.h.
+//
+// Both ROMs tokenise a typed line in place before doing anything else with
+// it, starting as if numbers are line numbers, so the line's own line number
+// becomes a line number token just like one after GOTO. BASIC 2 and BASIC 4
+// tokenise in the same way; they differ only in how they store the line,
+// BASIC 4 stripping spaces from its end (and its start, if LISTO isn't 0).
+
+#include "tokenise.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include "detokenise.h"
+#include "roms.h"
+#include "tokens.h"
+#include "utils.h"
+
+// Keyword table flags.
+enum {
+    flag_conditional = 0x01,    // not a keyword if followed by a name char
+    flag_middle = 0x02,         // continue in the middle of a statement
+    flag_start = 0x04,          // continue at the start of a statement
+    flag_fn_proc = 0x08,        // followed by a name, which isn't tokenised
+    flag_line_number = 0x10,    // followed by line numbers
+    flag_rest_of_line = 0x20,   // the rest of the line isn't tokenised
+    flag_pseudo_variable = 0x40 // token is &40 higher at start of statement
+};
+
+enum {
+    max_line_length = 238, // as BASIC asks OSWORD 0 for
+    // Each line number takes at least one character and becomes four bytes.
+    buffer_size = 4 * max_line_length + 1
+};
+
+static bool is_digit(uint8_t c) {
+    return (c >= '0') && (c <= '9');
+}
+
+// Return true if 'c' can be part of a variable name; as well as letters,
+// digits and '_', this includes '`' (i.e. the pound sign).
+static bool is_name_char(uint8_t c) {
+    return is_digit(c) || ((c >= 'A') && (c <= 'Z')) ||
+           ((c >= '_') && (c <= 'z'));
+}
+
+// Replace the 'length' bytes at buffer[i] with the 'count' bytes at 'data',
+// moving the rest of the CR-terminated line to suit.
+static void replace(uint8_t *buffer, size_t i, size_t length,
+                    const uint8_t *data, size_t count) {
+    const uint8_t *end = memchr(&buffer[i + length], cr,
+                                buffer_size - (i + length));
+    assert(end != 0);
+    size_t rest = end + 1 - &buffer[i + length];
+    assert(i + count + rest <= buffer_size);
+    memmove(&buffer[i + count], &buffer[i + length], rest);
+    memcpy(&buffer[i], data, count);
+}
+
+void tokenise_line_number(uint8_t *token, uint16_t number) {
+    uint8_t lo = number & 0xff;
+    uint8_t hi = number >> 8;
+    token[0] = token_line_number;
+    token[1] = (((lo & 0xc0) | ((hi & 0xc0) >> 2)) >> 2) ^ 0x54;
+    token[2] = (lo & 0x3f) | 0x40;
+    token[3] = (hi & 0x3f) | 0x40;
+}
+
+// Replace the number at buffer[*i] with a line number token and move *i past
+// it, returning true, or return false if it's too large to be a line number.
+static bool take_line_number(uint8_t *buffer, size_t *i) {
+    unsigned int number = 0;
+    size_t length = 0;
+    for (; is_digit(buffer[*i + length]); ++length) {
+        number = 10 * number + (buffer[*i + length] - '0');
+        if (number > 0x7fff) {
+            return false;
+        }
+    }
+    uint8_t token[4];
+    tokenise_line_number(token, number);
+    replace(buffer, *i, length, token, sizeof(token));
+    *i += sizeof(token);
+    return true;
+}
+
+// Return the offset in 'rom' of the token of the first entry in the keyword
+// table at 'table' which the text at 's' matches or, with a '.', abbreviates,
+// setting *length to the number of characters matched, or return 0 if there
+// isn't one. Like the ROM, this relies on the table being in order.
+static size_t find_keyword(const uint8_t *rom, size_t table, const uint8_t *s,
+                           size_t *length) {
+    for (size_t entry = table; s[0] >= rom[entry]; ) {
+        size_t i = 1;
+        if (s[0] == rom[entry]) {
+            while ((rom[entry + i] < 0x80) && (rom[entry + i] == s[i])) {
+                ++i;
+            }
+            if (rom[entry + i] >= 0x80) {
+                *length = i;
+                return entry + i;
+            }
+            if (s[i] == '.') {
+                *length = i + 1;
+                while (rom[entry + i] < 0x80) {
+                    ++i;
+                }
+                return entry + i;
+            }
+        }
+        while (rom[entry + i] < 0x80) {
+            ++i;
+        }
+        if (rom[entry + i] == token_last) {
+            break;
+        }
+        entry += i + 2;
+    }
+    return 0;
+}
+
+// Tokenise the CR-terminated line in 'buffer' in place.
+static void tokenise(uint8_t *buffer, int basic_version) {
+    const uint8_t *rom = rom_basic[basic_version];
+    size_t table = rom_basic_token_table(basic_version);
+    bool start = true;        // at the start of a statement
+    bool line_numbers = true; // numbers are line numbers
+    size_t i = 0;
+    for (;;) {
+        uint8_t c = buffer[i];
+        if (c == cr) {
+            return;
+        }
+        if (c == '&') {
+            do {
+                c = buffer[++i];
+            } while (is_digit(c) || ((c >= 'A') && (c <= 'F')));
+            continue;
+        }
+        if (c == '"') {
+            do {
+                c = buffer[++i];
+                if (c == cr) {
+                    return;
+                }
+            } while (c != '"');
+            ++i;
+            continue;
+        }
+        if (c == ':') {
+            start = true;
+            line_numbers = false;
+            ++i;
+            continue;
+        }
+        if ((c == ' ') || (c == ',')) {
+            ++i;
+            continue;
+        }
+        if ((c == '*') && start) {
+            return; // the rest of the line is a * command
+        }
+        if ((c == '.') || is_digit(c)) {
+            if (is_digit(c) && line_numbers && take_line_number(buffer, &i)) {
+                continue;
+            }
+            while ((buffer[i] == '.') || is_digit(buffer[i])) {
+                ++i;
+            }
+            start = false;
+            line_numbers = false;
+            continue;
+        }
+        if (!is_name_char(c)) {
+            start = false;
+            line_numbers = false;
+            ++i;
+            continue;
+        }
+
+        size_t keyword = 0;
+        size_t length;
+        if ((c >= 'A') && (c < 'X')) {
+            keyword = find_keyword(rom, table, &buffer[i], &length);
+        }
+        if ((keyword != 0) && (rom[keyword + 1] & flag_conditional) &&
+            is_name_char(buffer[i + length])) {
+            keyword = 0;
+        }
+        if (keyword == 0) {
+            // It's a variable name, or something else we just skip.
+            while (is_name_char(buffer[i])) {
+                ++i;
+            }
+            start = false;
+            line_numbers = false;
+            continue;
+        }
+
+        uint8_t token = rom[keyword];
+        uint8_t flags = rom[keyword + 1];
+        if ((flags & flag_pseudo_variable) && start) {
+            token += 0x40;
+        }
+        replace(buffer, i, length, &token, 1);
+        if (flags & flag_middle) {
+            start = false;
+            line_numbers = false;
+        }
+        if (flags & flag_start) {
+            start = true;
+            line_numbers = false;
+        }
+        if (flags & flag_fn_proc) {
+            while (is_name_char(buffer[i + 1])) {
+                ++i;
+            }
+        }
+        if (flags & flag_line_number) {
+            line_numbers = true;
+        }
+        if (flags & flag_rest_of_line) {
+            return;
+        }
+        ++i;
+    }
+}
+
+size_t tokenise_line(uint8_t *program, size_t length, size_t size,
+                     const char *line, int basic_version, int listo) {
+    assert((basic_version >= 0) && (basic_version < basic_count));
+    assert((length >= 2) && (program[length - 1] == 0xff));
+    size_t line_length = strlen(line);
+    check(line_length <= max_line_length, "error: line too long");
+    uint8_t buffer[buffer_size];
+    memcpy(buffer, line, line_length);
+    buffer[line_length] = cr;
+    tokenise(buffer, basic_version);
+
+    // BASIC now takes the line number from the start of the line.
+    size_t i = strspn((const char *) buffer, " ");
+    assert(buffer[i] == token_line_number);
+    uint16_t line_number = detokenise_line_number(&buffer[i]);
+    i += 4;
+    if ((basic_version == basic_4) && (listo != 0)) {
+        i += strspn((const char *) &buffer[i], " ");
+    }
+    const uint8_t *text = &buffer[i];
+    size_t text_length = (const uint8_t *) memchr(text, cr, buffer_size - i) -
+                         text;
+    if (text_length == 0) {
+        // This would delete the line, but there isn't one to delete.
+        return length;
+    }
+    if (basic_version == basic_4) {
+        while ((text_length > 1) && (text[text_length - 1] == ' ')) {
+            --text_length;
+        }
+    }
+
+    // Each line is stored as its line number, its length and its text; the
+    // CR at the end of the text is the one before the next line, or before
+    // the &FF which marks the end of the program.
+    size_t line_size = text_length + 4;
+    check(line_size <= 0xff, "error: line too long");
+    check(length + line_size <= size, "error: LINE space (0)");
+    uint8_t *p = &program[length - 1];
+    p[0] = line_number >> 8;
+    p[1] = line_number & 0xff;
+    p[2] = line_size;
+    memcpy(&p[3], text, text_length);
+    p[3 + text_length] = cr;
+    p[4 + text_length] = 0xff;
+    return length + line_size;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,26 @@
+#ifndef TOKENISE_H
+#define TOKENISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A native equivalent of typing a program in at the BASIC prompt, for
+// --engine=native. It follows each BASIC ROM's own tokeniser, using the ROM's
+// token table, and stores lines as the ROM does, so the program is exactly
+// what the emulated machine would have built.
+
+// Tokenise 'line', which starts with a line number greater than that of any
+// line in the program, as BASIC version 'basic_version' does when it's typed
+// at the prompt with LISTO 'listo', and add it to the end of the 'length'-byte
+// program at 'program', returning the program's new length. The program
+// starts off as NEW leaves it (a CR and &FF) and may grow to 'size' bytes,
+// i.e. HIMEM-PAGE.
+size_t tokenise_line(uint8_t *program, size_t length, size_t size,
+                     const char *line, int basic_version, int listo);
+
+// Store the line number token for 'number' (&8D and three bytes) at 'token'.
+void tokenise_line_number(uint8_t *token, uint16_t number);
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef TOKENS_H
+#define TOKENS_H
+
+// The BBC BASIC tokens the native engines need to recognise, the same in
+// BASIC 2 and BASIC 4. The keyword each one stands for is in the ROMs' own
+// keyword tables; see roms.h.
+enum {
+    token_error = 0x85,
+    token_else = 0x8b,
+    token_then = 0x8c,
+    token_line_number = 0x8d, // followed by the line number, encoded
+    token_fn = 0xa4,
+    token_to = 0xb8,
+    token_data = 0xdc,
+    token_def = 0xdd,
+    token_for = 0xe3,
+    token_if = 0xe7,
+    token_next = 0xed,
+    token_proc = 0xf2,
+    token_rem = 0xf4,
+    token_repeat = 0xf5,
+    token_until = 0xfd,
+    token_last = 0xfe // the last entry in the keyword table
+};
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,327 @@
+// Recording and replaying emulated machines' interaction with the outside
+// world; see trace.h.
+//
+// A log is a header (the machine model and BASIC version) followed by events,
+// each a tag byte and its operands; multi-byte numbers are little-endian and
+// strings are NUL-terminated. Consecutive output characters share one event.
+
+#include "trace.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulation.h"
+#include "traps.h"
+#include "utils.h"
+
+static const char magic[] = "basictool trace 3\n";
+
+enum {
+    event_end = 'E',
+    event_os_call = 'C',         // u16 address, A, X, Y
+    event_romsel = 'R',          // bank
+    event_output = 'O',          // length, then that many characters
+    event_operation = 'B',       // string, i64 instruction budget
+    event_input_line = 'L',      // string, whether it's echoed
+    event_osrdch = 'K',          // character
+    event_memory_written = 'M'   // u16 address, u16 size, then the data
+};
+
+struct s_trace {
+    const char *filename;
+    bool replaying;
+
+    // Recording.
+    FILE *file;
+    uint8_t output[255];
+    size_t output_length;
+
+    // Replaying.
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    size_t output_left; // of the current output event
+    unsigned long os_calls;
+    unsigned long output_bytes;
+};
+
+static void put_u8(struct s_trace *trace, uint8_t value) {
+    putc(value, trace->file);
+}
+
+static void put_u16(struct s_trace *trace, uint16_t value) {
+    put_u8(trace, value & 0xff);
+    put_u8(trace, value >> 8);
+}
+
+static void put_i64(struct s_trace *trace, int64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        put_u8(trace, ((uint64_t) value >> (8 * i)) & 0xff);
+    }
+}
+
+static void put_string(struct s_trace *trace, const char *s) {
+    fwrite(s, 1, strlen(s) + 1, trace->file);
+}
+
+static void flush_output(struct s_trace *trace) {
+    if (trace->output_length > 0) {
+        put_u8(trace, event_output);
+        put_u8(trace, trace->output_length);
+        fwrite(trace->output, 1, trace->output_length, trace->file);
+        trace->output_length = 0;
+    }
+}
+
+// Begin recording an event with tag 'event', returning false if we're
+// replaying instead.
+static bool put_event(struct s_trace *trace, uint8_t event) {
+    if (trace->replaying) {
+        return false;
+    }
+    flush_output(trace);
+    put_u8(trace, event);
+    return true;
+}
+
+NORETURN static void diverged(const struct s_trace *trace, const char *what) {
+    die("error: replay of \"%s\" diverged at offset %lu: %s", trace->filename,
+        (unsigned long) trace->offset, what);
+}
+
+static uint8_t get_u8(struct s_trace *trace) {
+    if (trace->offset >= trace->length) {
+        diverged(trace, "trace ended early");
+    }
+    return trace->data[trace->offset++];
+}
+
+static uint16_t get_u16(struct s_trace *trace) {
+    uint16_t value = get_u8(trace);
+    return value | (get_u8(trace) << 8);
+}
+
+static int64_t get_i64(struct s_trace *trace) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t) get_u8(trace) << (8 * i);
+    }
+    return (int64_t) value;
+}
+
+static const char *get_string(struct s_trace *trace) {
+    const char *s = (const char *) &trace->data[trace->offset];
+    while (get_u8(trace) != '\0') {
+    }
+    return s;
+}
+
+// Check that the next event in the log is 'event' and move past its tag.
+static void get_event(struct s_trace *trace, uint8_t event,
+                      const char *what) {
+    if ((trace->output_left > 0) || (trace->offset >= trace->length) ||
+        (trace->data[trace->offset] != event)) {
+        diverged(trace, what);
+    }
+    ++trace->offset;
+}
+
+struct s_trace *trace_record(const char *filename,
+                             const struct s_machine *machine) {
+    struct s_trace *trace = check_alloc(calloc(1, sizeof(*trace)));
+    trace->filename = filename;
+    trace->file = fopen(filename, "wb");
+    check(trace->file != 0, "error: can't open output file \"%s\"", filename);
+    fputs(magic, trace->file);
+    put_u8(trace, machine->model - machine_models);
+    put_u8(trace, machine->basic_version);
+    return trace;
+}
+
+void trace_close(struct s_trace *trace) {
+    put_event(trace, event_end);
+    check(!ferror(trace->file) && (fclose(trace->file) == 0),
+          "error: error writing to output file \"%s\"", trace->filename);
+    free(trace);
+}
+
+void trace_os_call(struct s_trace *trace, uint16_t address,
+                   const M6502_Registers *registers) {
+    if (put_event(trace, event_os_call)) {
+        put_u16(trace, address);
+        put_u8(trace, registers->a);
+        put_u8(trace, registers->x);
+        put_u8(trace, registers->y);
+        return;
+    }
+    get_event(trace, event_os_call, "unexpected OS call");
+    if ((get_u16(trace) != address) || (get_u8(trace) != registers->a) ||
+        (get_u8(trace) != registers->x) || (get_u8(trace) != registers->y)) {
+        diverged(trace, "different OS call");
+    }
+    ++trace->os_calls;
+}
+
+void trace_romsel(struct s_trace *trace, uint8_t bank) {
+    if (put_event(trace, event_romsel)) {
+        put_u8(trace, bank);
+        return;
+    }
+    get_event(trace, event_romsel, "unexpected ROMSEL write");
+    if (get_u8(trace) != bank) {
+        diverged(trace, "different ROM bank selected");
+    }
+}
+
+void trace_output(struct s_trace *trace, uint8_t c) {
+    if (!trace->replaying) {
+        if (trace->output_length == sizeof(trace->output)) {
+            flush_output(trace);
+        }
+        trace->output[trace->output_length++] = c;
+        return;
+    }
+    if (trace->output_left == 0) {
+        get_event(trace, event_output, "unexpected output");
+        trace->output_left = get_u8(trace);
+    }
+    --trace->output_left;
+    if (get_u8(trace) != c) {
+        diverged(trace, "different output");
+    }
+    ++trace->output_bytes;
+}
+
+void trace_operation(struct s_trace *trace, const char *operation,
+                     int64_t instructions) {
+    if (put_event(trace, event_operation)) {
+        put_string(trace, operation);
+        put_i64(trace, instructions);
+    }
+}
+
+void trace_input_line(struct s_trace *trace, const char *line, bool echo) {
+    if (put_event(trace, event_input_line)) {
+        put_string(trace, line);
+        put_u8(trace, echo);
+    }
+}
+
+void trace_osrdch(struct s_trace *trace, uint8_t c) {
+    if (put_event(trace, event_osrdch)) {
+        put_u8(trace, c);
+    }
+}
+
+void trace_memory_written(struct s_trace *trace, const uint8_t *memory,
+                          uint16_t address, size_t size) {
+    if (put_event(trace, event_memory_written)) {
+        put_u16(trace, address);
+        put_u16(trace, size);
+        fwrite(&memory[address], 1, size, trace->file);
+    }
+}
+
+// The output itself has already been checked against the log.
+static void replay_oswrch(struct s_machine *machine, const uint8_t *data,
+                          size_t length) {
+}
+
+static double seconds_since(clock_t start) {
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+// The replayed machine is large, so it isn't on the stack.
+static struct s_machine machine;
+
+void trace_replay(const char *filename, unsigned int mpu_flags,
+                  int trap_mode) {
+    struct s_trace trace = {filename, true};
+    char *data = load_binary(filename, &trace.length);
+    trace.data = (const uint8_t *) data;
+    size_t magic_length = strlen(magic);
+    check((trace.length > magic_length) &&
+          (memcmp(data, magic, magic_length) == 0),
+          "error: \"%s\" isn't a basictool trace", filename);
+    trace.offset = magic_length;
+    int model = get_u8(&trace);
+    int basic_version = get_u8(&trace);
+    check((model < model_count) && (basic_version < basic_count),
+          "error: \"%s\" isn't a basictool trace", filename);
+
+    emulation_init(&machine, model, basic_version, replay_oswrch, mpu_flags);
+    traps_install(&machine, trap_mode);
+    machine.trace = &trace;
+
+    const char *operation = 0;
+    clock_t start = clock();
+    clock_t operation_start = start;
+    bool ended = false;
+    while (!ended) {
+        if (trace.output_left > 0) {
+            diverged(&trace, "less output than recorded");
+        }
+        if (trace.offset == trace.length) {
+            // The recording machine stopped with an error, so the log wasn't
+            // finished.
+            break;
+        }
+        uint8_t event = get_u8(&trace);
+        if ((machine.state == ms_error) && (event != event_end)) {
+            --trace.offset;
+            diverged(&trace, "emulated machine stopped with an error");
+        }
+        switch (event) {
+            case event_end:
+                ended = true;
+                break;
+            case event_operation: {
+                if (operation != 0) {
+                    printf("%-28s %10.3f\n", operation,
+                           seconds_since(operation_start));
+                }
+                operation = get_string(&trace);
+                int64_t instructions = get_i64(&trace);
+                operation_start = clock();
+                emulation_set_budget(&machine, operation, instructions);
+                break;
+            }
+            case event_input_line: {
+                const char *line = get_string(&trace);
+                emulation_queue_input_line(&machine, line, get_u8(&trace), -1);
+                emulation_run_queue(&machine);
+                break;
+            }
+            case event_osrdch: {
+                char s[2] = {get_u8(&trace), '\0'};
+                execute_osrdch(&machine, s);
+                break;
+            }
+            case event_memory_written: {
+                uint16_t address = get_u16(&trace);
+                uint16_t size = get_u16(&trace);
+                check((trace.length - trace.offset >= size) &&
+                      (address + size <= sizeof(M6502_Memory)),
+                      "error: \"%s\" is corrupt", filename);
+                memcpy(&machine.memory[address], &trace.data[trace.offset],
+                       size);
+                trace.offset += size;
+                mpu_memory_written(&machine, address, size);
+                break;
+            }
+            default:
+                --trace.offset;
+                diverged(&trace, "emulated machine is waiting for input");
+        }
+    }
+    if (operation != 0) {
+        printf("%-28s %10.3f\n", operation, seconds_since(operation_start));
+    }
+    printf("%-28s %10.3f\n", "total", seconds_since(start));
+    printf("replayed %lu OS calls and %lu bytes of output from \"%s\"\n",
+           trace.os_calls, trace.output_bytes, filename);
+    free(data);
+}
+
+// vi: colorcolumn=80
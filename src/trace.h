@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lib6502.h"
+
+struct s_machine;
+
+// A log of everything which passes between an emulated machine and the
+// outside world: what the host gives it (input lines, OSRDCH characters,
+// direct memory writes and the start of each operation) and what it does in
+// response (OS calls, ROMSEL writes and output). Replaying a log feeds the
+// same input to a fresh machine without involving driver.c or any files and
+// checks that it responds in exactly the same way, so it times the emulation
+// alone.
+//
+// The results of OS calls aren't logged as they're computed from the call and
+// the machine's state; if they differed, so would what followed.
+struct s_trace;
+
+// Start logging 'machine', which must be waiting at the BASIC prompt, to
+// 'filename'; attach the result to it as its 'trace' member.
+struct s_trace *trace_record(const char *filename,
+                             const struct s_machine *machine);
+
+// Finish a log started by trace_record() and free 'trace'.
+void trace_close(struct s_trace *trace);
+
+// Replay the log in 'filename' on a new machine created with 'mpu_flags' and
+// 'trap_mode' (see emulation_init() and traps_install()), dying if the
+// machine doesn't do what it did when the log was recorded, and report how
+// long it took on stdout.
+void trace_replay(const char *filename, unsigned int mpu_flags, int trap_mode);
+
+// Called by emulation.c as things happen; when replaying, the machine's side
+// is checked against the log and the host's side is ignored.
+void trace_os_call(struct s_trace *trace, uint16_t address,
+                   const M6502_Registers *registers);
+void trace_romsel(struct s_trace *trace, uint8_t bank);
+void trace_output(struct s_trace *trace, uint8_t c);
+void trace_operation(struct s_trace *trace, const char *operation,
+                     int64_t instructions);
+void trace_input_line(struct s_trace *trace, const char *line, bool echo);
+void trace_osrdch(struct s_trace *trace, uint8_t c);
+void trace_memory_written(struct s_trace *trace, const uint8_t *memory,
+                          uint16_t address, size_t size);
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,333 @@
+// Native replacements ("traps") for a few hot BASIC ROM routines. Most of the
+// time spent tokenising and LISTing goes on simple loops such as the keyword
+// table search which expands a token; running these natively is much faster
+// than emulating them, and because they only read memory and update
+// registers, zero page and the stack, it's easy to make them exact.
+//
+// Each trap is hooked as a call callback on its routine's entry point, so it
+// runs whenever BASIC JSRs to it. It either leaves the machine in exactly the
+// state the ROM code would have done when reaching some later address and
+// returns that address, or returns 0 without changing anything to let the ROM
+// code run instead. Traps are written against particular ROM images and are
+// only installed if the ROM's CRC matches.
+
+#include "traps.h"
+#include <stdlib.h>
+#include <string.h>
+#include "emulation.h"
+#include "lib6502.h"
+#include "roms.h"
+#include "utils.h"
+
+enum {
+    flag_c = 1 << 0,
+    flag_z = 1 << 1,
+    flag_v = 1 << 6,
+    flag_n = 1 << 7
+};
+
+// Give up on anything which takes more steps than this, as the ROM code
+// probably won't terminate either.
+static const long step_limit = 0x10000;
+
+typedef int (*trap_fn)(struct s_machine *machine);
+
+struct s_trap {
+    int basic_version;
+    uint32_t rom_crc;
+    uint16_t address;
+    trap_fn native;
+};
+
+// Read 'address' as the emulated CPU would, or return -1 if that would call a
+// read callback; traps give up and leave the work to the ROM in that case.
+static int trap_read(M6502 *mpu, uint16_t address) {
+    if (M6502_getCallback(mpu, read, address) != 0) {
+        return -1;
+    }
+    return M6502_read(mpu, address);
+}
+
+// The V flag after ADC of 'a' and 'b' with carry in 'carry'.
+static bool adc_overflow(uint8_t a, uint8_t b, int carry) {
+    uint8_t result = a + b + carry;
+    return ((a ^ result) & (b ^ result) & 0x80) != 0;
+}
+
+static uint8_t set_flags(uint8_t p, uint8_t mask, uint8_t flags) {
+    return (p & ~mask) | flags;
+}
+
+// Both BASICs expand a token for LIST by searching the keyword table for it,
+// then printing the keyword a character at a time. We do the search; the
+// printing goes via OSWRCH and is left to the ROM, which we resume at
+// 'resume' with A=token, Y=offset of the token within the entry and the
+// entry's address at &38.
+static int print_token(struct s_machine *machine, uint16_t table,
+                       uint16_t resume) {
+    M6502 *mpu = machine->mpu;
+    uint8_t token = machine->registers.a;
+    if (token < 0x80) {
+        return 0;
+    }
+
+    uint16_t entry = table;
+    uint8_t y = 0;
+    bool v = (machine->registers.p & flag_v) != 0;
+    for (long steps = 0; ; ++steps) {
+        if (steps >= step_limit) {
+            return 0;
+        }
+        int c;
+        y = 0;
+        do {
+            if ((++y == 0) || ((c = trap_read(mpu, entry + y)) < 0)) {
+                return 0;
+            }
+        } while (c < 0x80);
+        if (c == token) {
+            break;
+        }
+        // Skip the token and the flags byte after it.
+        ++y;
+        v = adc_overflow(y, entry & 0xff, 1);
+        entry += y + 1;
+    }
+
+    machine->memory[0x37] = token;
+    machine->memory[0x38] = entry & 0xff;
+    machine->memory[0x39] = entry >> 8;
+    machine->registers.a = token;
+    machine->registers.y = y;
+    // CMP &37 found a match.
+    machine->registers.p = set_flags(machine->registers.p,
+                                     flag_n | flag_z | flag_c | flag_v,
+                                     flag_z | flag_c | (v ? flag_v : 0));
+    return resume;
+}
+
+// BASIC 2 saves Y in &3A while printing the token.
+static int basic_2_print_token(struct s_machine *machine) {
+    uint8_t y = machine->registers.y;
+    int resume = print_token(machine, 0x8071, 0xb536);
+    if (resume != 0) {
+        machine->memory[0x3a] = y;
+    }
+    return resume;
+}
+
+// BASIC 4 pushes Y while printing the token.
+static int basic_4_print_token(struct s_machine *machine) {
+    uint8_t y = machine->registers.y;
+    int resume = print_token(machine, 0x8513, 0xbd9e);
+    if (resume != 0) {
+        machine->memory[0x100 + machine->registers.s--] = y;
+    }
+    return resume;
+}
+
+// Both BASICs find the line numbered (&2A) by walking the program from PAGE,
+// leaving the address of the first line numbered at least that at &3D and
+// Y=2; they differ in what they return in A and the flags. This does the
+// walk and returns the line's address, or -1 to give up. *found says whether
+// the line number matched, *last is the line number byte compared last and *v
+// is the V flag left by the last ADC.
+static long find_line(struct s_machine *machine, bool *found, uint8_t *last,
+                      bool *v) {
+    M6502 *mpu = machine->mpu;
+    uint8_t target_lo = machine->memory[0x2a];
+    uint8_t target_hi = machine->memory[0x2b];
+
+    *v = (machine->registers.p & flag_v) != 0;
+    uint16_t line = machine->memory[0x18] << 8;
+    for (long steps = 0; steps < step_limit; ++steps) {
+        int hi = trap_read(mpu, line + 1);
+        if (hi < 0) {
+            return -1;
+        }
+        if (hi >= target_hi) {
+            *last = hi;
+            *found = false;
+            if (hi != target_hi) {
+                return line;
+            }
+            int lo = trap_read(mpu, line + 2);
+            if (lo < 0) {
+                return -1;
+            }
+            *last = lo;
+            if (lo >= target_lo) {
+                *found = (lo == target_lo);
+                return line;
+            }
+        }
+        int length = trap_read(mpu, line + 3);
+        if (length < 0) {
+            return -1;
+        }
+        *v = adc_overflow(length, line & 0xff, 0);
+        line += length;
+    }
+    return -1;
+}
+
+static void set_line_pointer(struct s_machine *machine, uint16_t line) {
+    machine->memory[0x3d] = line & 0xff;
+    machine->memory[0x3e] = line >> 8;
+}
+
+// BASIC 2 steps past the line number if it finds the line and returns with
+// C clear, or with C set if not; in both cases LDY #2 sets N and Z.
+static int basic_2_find_line(struct s_machine *machine) {
+    bool found, v;
+    uint8_t last;
+    long line = find_line(machine, &found, &last, &v);
+    if (line < 0) {
+        return 0;
+    }
+    if (found) {
+        v = adc_overflow(2, line & 0xff, 1);
+        line = (line + 3) & 0xffff;
+        last = line & 0xff;
+    }
+
+    set_line_pointer(machine, line);
+    machine->registers.a = last;
+    machine->registers.y = 2;
+    machine->registers.p = set_flags(machine->registers.p,
+                                     flag_n | flag_z | flag_c | flag_v,
+                                     (found ? 0 : flag_c) | (v ? flag_v : 0));
+    return pull_rts_target(machine);
+}
+
+// BASIC 4 returns the flags from the final CMP if it finds the line, or from
+// LDY #2:CLC if not.
+static int basic_4_find_line(struct s_machine *machine) {
+    bool found, v;
+    uint8_t last;
+    long line = find_line(machine, &found, &last, &v);
+    if (line < 0) {
+        return 0;
+    }
+
+    set_line_pointer(machine, line);
+    machine->registers.a = last;
+    machine->registers.y = 2;
+    machine->registers.p = set_flags(machine->registers.p,
+                                     flag_n | flag_z | flag_c | flag_v,
+                                     (found ? flag_z | flag_c : 0) |
+                                     (v ? flag_v : 0));
+    return pull_rts_target(machine);
+}
+
+static const uint32_t basic_2_crc = 0x79434781;
+static const uint32_t basic_4_crc = 0x6c6f5cd8;
+
+static const struct s_trap traps[] = {
+    {basic_2, basic_2_crc, 0xb50e, basic_2_print_token},
+    {basic_2, basic_2_crc, 0x9970, basic_2_find_line},
+    {basic_4, basic_4_crc, 0xbd77, basic_4_print_token},
+    {basic_4, basic_4_crc, 0x8191, basic_4_find_line},
+};
+
+static const struct s_trap *find_trap(struct s_machine *machine,
+                                      uint16_t address) {
+    for (size_t i = 0; i < sizeof(traps) / sizeof(traps[0]); ++i) {
+        if ((traps[i].basic_version == machine->basic_version) &&
+            (traps[i].address == address)) {
+            return &traps[i];
+        }
+    }
+    die("internal error: no trap at &%04X", address);
+}
+
+// Run 'trap' and then run the ROM code from the same starting point until it
+// reaches the address the trap returned, and die unless both left the machine
+// in the same state.
+static int verify_trap(struct s_machine *machine, const struct s_trap *trap) {
+    M6502 *mpu = machine->mpu;
+    const M6502_Registers before = machine->registers;
+    uint8_t *memory_before = check_alloc(malloc(sizeof(M6502_Memory)));
+    uint8_t *memory_native = check_alloc(malloc(sizeof(M6502_Memory)));
+    memcpy(memory_before, machine->memory, sizeof(M6502_Memory));
+
+    int resume = trap->native(machine);
+    if (resume == 0) {
+        check(memcmp(memory_before, machine->memory,
+                     sizeof(M6502_Memory)) == 0,
+              "internal error: trap at &%04X changed memory but declined",
+              trap->address);
+        free(memory_before);
+        free(memory_native);
+        return 0;
+    }
+    const M6502_Registers native = machine->registers;
+    memcpy(memory_native, machine->memory, sizeof(M6502_Memory));
+
+    machine->registers = before;
+    machine->registers.pc = trap->address;
+    memcpy(machine->memory, memory_before, sizeof(M6502_Memory));
+    for (long steps = 0; (machine->registers.pc != resume) ||
+                         (machine->registers.s != native.s); ++steps) {
+        check(steps < 16 * step_limit,
+              "error: ROM code for trap at &%04X didn't reach &%04X",
+              trap->address, resume);
+        M6502_step(mpu);
+    }
+
+    const M6502_Registers *rom = &machine->registers;
+    check((rom->a == native.a) && (rom->x == native.x) &&
+          (rom->y == native.y) && (rom->p == native.p),
+          "error: trap at &%04X left A=%02X X=%02X Y=%02X P=%02X, ROM left "
+          "A=%02X X=%02X Y=%02X P=%02X", trap->address, native.a, native.x,
+          native.y, native.p, rom->a, rom->x, rom->y, rom->p);
+    for (int i = 0; i < sizeof(M6502_Memory); ++i) {
+        check(machine->memory[i] == memory_native[i],
+              "error: trap at &%04X left &%02X at &%04X, ROM left &%02X",
+              trap->address, memory_native[i], i, machine->memory[i]);
+    }
+    free(memory_before);
+    free(memory_native);
+    return resume;
+}
+
+static int callback_trap(M6502 *mpu, uint16_t address, uint8_t data) {
+    struct s_machine *machine = mpu->context;
+    // Another ROM may be paged in and have its own code at this address.
+    if (mpu->pages[0x80] != rom_basic[machine->basic_version]) {
+        return 0;
+    }
+    const struct s_trap *trap = find_trap(machine, address);
+    if (machine->trap_mode == traps_verify) {
+        return verify_trap(machine, trap);
+    }
+    return trap->native(machine);
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+void traps_install(struct s_machine *machine, int mode) {
+    machine->trap_mode = mode;
+    if (mode == traps_off) {
+        return;
+    }
+    uint32_t crc = crc32(rom_basic[machine->basic_version], rom_size);
+    for (size_t i = 0; i < sizeof(traps) / sizeof(traps[0]); ++i) {
+        if ((traps[i].basic_version == machine->basic_version) &&
+            (traps[i].rom_crc == crc)) {
+            M6502_setCallback(machine->mpu, call, traps[i].address,
+                              callback_trap);
+        }
+    }
+}
+
+// vi: colorcolumn=80
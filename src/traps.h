@@ -0,0 +1,19 @@
+#ifndef TRAPS_H
+#define TRAPS_H
+
+struct s_machine;
+
+enum {
+    traps_off,    // always run the BASIC ROM code
+    traps_on,     // run native replacements for hot ROM routines
+    traps_verify  // run both and die if they don't leave identical state
+};
+
+// Install native replacements for hot routines in 'machine''s BASIC ROM
+// according to 'mode'. Replacements are keyed on a checksum of the ROM, so
+// this does nothing for a ROM they weren't written against.
+void traps_install(struct s_machine *machine, int mode);
+
+// vi: colorcolumn=80
+
+#endif
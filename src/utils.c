@@ -73,6 +73,17 @@ int max(int lhs, int rhs) {
     return (lhs > rhs) ? lhs : rhs;
 }
 
+void buffer_grow(struct s_buffer *buffer) {
+    buffer->capacity = (buffer->capacity > 0) ? buffer->capacity * 2 : 256;
+    buffer->data = check_alloc(realloc(buffer->data, buffer->capacity));
+}
+
+void buffer_put_string(struct s_buffer *buffer, const char *s) {
+    for (; *s != '\0'; ++s) {
+        buffer_put(buffer, *s);
+    }
+}
+
 char *ourstrdup(const char *s) {
     char *t = malloc(strlen(s) + 1);
     strcpy(t, s);
@@ -117,19 +128,27 @@ FILE *fopen_wrapper(const char *pathname, const char *mode) {
 char *load_binary(const char *filename, size_t *length) {
     assert(length != 0);
     FILE *file = fopen_wrapper(filename, "rb");
-    // Since we're dealing with BASIC programs on a 32K-ish machine, we don't
-    // need to handle arbitrarily large files.
-    const int max_size = 64 * 1024;
-    char *data = check_alloc(malloc(max_size));
-    *length = fread(data, 1, max_size, file);
+    // How much memory a program can fit in depends on the machine model, and
+    // a text program can be much larger than that anyway, so we read the
+    // whole file however large it is, doubling the buffer as we go.
+    size_t capacity = 64 * 1024;
+    char *data = check_alloc(malloc(capacity));
+    *length = 0;
+    for (;;) {
+        *length += fread(&data[*length], 1, capacity - *length, file);
+        if (*length < capacity) {
+            break;
+        }
+        capacity *= 2;
+        data = check_alloc(realloc(data, capacity));
+    }
     check(!ferror(file), "error: error reading from input file \"%s\"",
           filename);
-    check(feof(file), "error: input file \"%s\" is too large", filename);
     check(fclose(file) == 0, "error: error closing input file \"%s\"",
           filename);
-    // Shrink the allocated block down from max_size to the size we actually
-    // need. We secretly allocate an extra byte for get_line() to use in case
-    // the last line of a text file doesn't have a terminator.
+    // Shrink the allocated block down to the size we actually need. We
+    // secretly allocate an extra byte for get_line() to use in case the last
+    // line of a text file doesn't have a terminator.
     return check_alloc(realloc(data, *length + 1));
 }
 
@@ -2,6 +2,8 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef __GNUC__
@@ -58,6 +60,28 @@ void *check_alloc(void *p);
 // Return the larger of lhs and rhs.
 int max(int lhs, int rhs);
 
+// A block of memory output is written to, growing as needed; one initialised
+// to zero is empty. The owner frees 'data'.
+struct s_buffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Make room in 'buffer' for at least one more byte.
+void buffer_grow(struct s_buffer *buffer);
+
+// Append 'c' to 'buffer'.
+static inline void buffer_put(struct s_buffer *buffer, uint8_t c) {
+    if (buffer->length == buffer->capacity) {
+        buffer_grow(buffer);
+    }
+    buffer->data[buffer->length++] = c;
+}
+
+// Append the NUL-terminated string 's' to 'buffer'.
+void buffer_put_string(struct s_buffer *buffer, const char *s);
+
 // A simple implementation of strdup() so we don't assume it's available; it's
 // not part of C99.
 char *ourstrdup(const char *s);
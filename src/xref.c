@@ -0,0 +1,642 @@
+// A native "Table line references" and "Variables Xref"; see xref.h.
+//
+// "Table line references" makes two passes over the program. The first
+// reports each line number token which refers to a line ABE can't find, as
+// it looks for the first line numbered at least that high; the second takes
+// each line in turn and searches the whole program for tokens which refer
+// to it. ABE just scans each line for tokens, so it finds them even in
+// strings and REMs.
+//
+// "Variables Xref" catalogues the names in the program as "Pack" does, then
+// searches the whole program for each name in turn, counting where it
+// appears outside strings and listing the lines where it does. The search
+// knows nothing of keywords or REMs, so a name counts wherever it appears
+// without part of another name on either side: in a REM, in the bytes of a
+// line number token, after a number and so on.
+//
+// We make a single pass instead, noting each line number token as we come
+// to it and, at each place in a line where one of ABE's searches could
+// match, the names it would match there, so at the end we only have to look
+// up the names in the catalogue.
+
+#include "xref.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "catalogue.h"
+#include "config.h"
+#include "detokenise.h"
+#include "emulation.h"
+#include "tokens.h"
+#include "utils.h"
+
+// A line number token.
+struct s_reference {
+    uint16_t target;
+    uint16_t from; // the number of the line it's in
+    int order;     // its place in the program
+};
+
+// A name which at least one of ABE's searches would match, and where.
+struct s_name {
+    uint16_t text;   // the address of its first appearance
+    uint8_t length;  // 0 for an empty slot in the table
+    uint16_t count;
+    int last_line;   // the index of the last line it appeared in
+    uint16_t *lines; // the numbers of the lines it appears in
+    int line_count;
+    int line_capacity;
+};
+
+// A name as ABE lists it: "@%" and then each name in the catalogue.
+struct s_variable {
+    uint8_t initial;
+    const uint8_t *tail;
+    uint8_t tail_length;
+    const struct s_name *name; // 0 if it doesn't appear
+};
+
+struct s_xref {
+    const uint8_t *memory;
+    bool text;   // writing text, so following ABE exactly
+    bool failed; // hit a case we leave to ABE
+
+    uint16_t *numbers; // the line numbers, in program order
+    int line_count;
+    int line_capacity;
+    bool in_order;
+
+    struct s_reference *references;
+    int reference_count;
+    int reference_capacity;
+
+    // A hash table of names, with open addressing.
+    struct s_name *names;
+    int name_count;
+    int name_capacity;
+
+    struct s_catalogue catalogue;
+    struct s_variable *variables;
+    int variable_count;
+
+    struct s_buffer output;
+};
+
+static void put_newline(struct s_buffer *output) {
+    buffer_put(output, lf); buffer_put(output, cr); // OSNEWL
+}
+
+// Print 'number' right-justified in 'width' characters.
+static void put_number(struct s_buffer *output, unsigned int number,
+                       int width) {
+    char digits[16];
+    int length = sprintf(digits, "%*u", width, number);
+    for (int i = 0; i < length; ++i) {
+        buffer_put(output, digits[i]);
+    }
+}
+
+static void add_line(struct s_xref *x, uint16_t number) {
+    if (x->line_count == x->line_capacity) {
+        x->line_capacity = (x->line_capacity > 0) ? x->line_capacity * 2 :
+                                                    256;
+        x->numbers = check_alloc(realloc(x->numbers, x->line_capacity *
+                                         sizeof(x->numbers[0])));
+    }
+    if ((x->line_count > 0) && (number < x->numbers[x->line_count - 1])) {
+        x->in_order = false;
+    }
+    x->numbers[x->line_count++] = number;
+}
+
+static void add_reference(struct s_xref *x, uint16_t target, uint16_t from) {
+    if (x->reference_count == x->reference_capacity) {
+        x->reference_capacity = (x->reference_capacity > 0) ?
+                                x->reference_capacity * 2 : 256;
+        x->references = check_alloc(realloc(
+            x->references,
+            x->reference_capacity * sizeof(x->references[0])));
+    }
+    struct s_reference *reference = &x->references[x->reference_count];
+    reference->target = target;
+    reference->from = from;
+    reference->order = x->reference_count++;
+}
+
+static uint32_t hash(const uint8_t *text, uint8_t length) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; ++i) {
+        h = (h ^ text[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Return the slot in the table for the name 'length' bytes long at 'text',
+// which is empty if the name hasn't been seen.
+static struct s_name *find_name(const struct s_xref *x, const uint8_t *text,
+                                uint8_t length) {
+    uint32_t mask = x->name_capacity - 1;
+    for (uint32_t i = hash(text, length) & mask; ; i = (i + 1) & mask) {
+        struct s_name *name = &x->names[i];
+        if ((name->length == 0) ||
+            ((name->length == length) &&
+             (memcmp(&x->memory[name->text], text, length) == 0))) {
+            return name;
+        }
+    }
+}
+
+// Make the table big enough to add a name, keeping it no more than half
+// full.
+static void make_room_for_name(struct s_xref *x) {
+    if ((x->name_count + 1) * 2 <= x->name_capacity) {
+        return;
+    }
+    struct s_name *old_names = x->names;
+    int old_capacity = x->name_capacity;
+    x->name_capacity = (old_capacity > 0) ? old_capacity * 2 : 1024;
+    x->names = check_alloc(calloc(x->name_capacity, sizeof(x->names[0])));
+    for (int i = 0; i < old_capacity; ++i) {
+        const struct s_name *name = &old_names[i];
+        if (name->length != 0) {
+            *find_name(x, &x->memory[name->text], name->length) = *name;
+        }
+    }
+    free(old_names);
+}
+
+// Note that the name 'length' bytes long at 'text' appears in the line with
+// index 'line'.
+static void note_name(struct s_xref *x, uint16_t text, uint8_t length,
+                      int line) {
+    make_room_for_name(x);
+    struct s_name *name = find_name(x, &x->memory[text], length);
+    if (name->length == 0) {
+        name->text = text;
+        name->length = length;
+        name->last_line = -1;
+        ++x->name_count;
+    }
+    ++name->count;
+    if (name->last_line != line) {
+        if (name->line_count == name->line_capacity) {
+            name->line_capacity = (name->line_capacity > 0) ?
+                                  name->line_capacity * 2 : 8;
+            name->lines = check_alloc(realloc(
+                name->lines, name->line_capacity * sizeof(name->lines[0])));
+        }
+        name->lines[name->line_count++] = x->numbers[line];
+        name->last_line = line;
+    }
+}
+
+// Return true if 'c' can come before a variable name in ABE's search.
+static bool is_boundary_before(uint8_t c) {
+    return (c != '&') && !catalogue_is_initial(c) && (c != token_proc) &&
+           (c != token_fn);
+}
+
+// Return true if 'c' can come after a name in ABE's search; "name(" is an
+// array, unless the name is a PROC or FN.
+static bool is_boundary_after(uint8_t c, bool proc) {
+    if ((c == '&') || catalogue_is_initial(c)) {
+        return false;
+    }
+    if (((c >= '0') && (c <= '9')) || (c == '%') || (c == '$')) {
+        return false;
+    }
+    return (c != '(') || proc;
+}
+
+// Note the names which ABE's searches would match in the line with index
+// 'index', after the CR at 'line'. Like ABE's search, we don't look at the
+// character before a name at the start of the line, and a quote changes
+// whether we're in a string once we've moved past it.
+static void note_names(struct s_xref *x, int index, uint16_t line,
+                       uint8_t length) {
+    const uint8_t *m = &x->memory[line];
+    bool quote = false;
+    for (int y = 4; y < length; ++y) {
+        uint8_t before = m[y - 1];
+        if ((y > 4) && (before == '"')) {
+            quote = !quote;
+        }
+        uint8_t c = m[y];
+        bool proc = (c == token_proc) || (c == token_fn);
+        if (quote ||
+            (!proc && (y > 4) && !is_boundary_before(before))) {
+            continue;
+        }
+        if (c == '@') {
+            if ((y + 1 < length) && (m[y + 1] == '%')) {
+                note_name(x, line + y, 2, index);
+            }
+            continue;
+        }
+        if (!proc && !catalogue_is_initial(c)) {
+            continue;
+        }
+        // A name ending with a letter or digit must be followed by
+        // something which can't be part of a name, which '@' can be.
+        int end = y + 1;
+        while ((end < length) && (catalogue_char_class(m[end], end) != 0)) {
+            ++end;
+        }
+        for (int i = y + 1; i <= end; ++i) {
+            if (is_boundary_after((i < length) ? m[i] : cr, proc)) {
+                note_name(x, line + y, i - y, index);
+            }
+        }
+        if (proc || (end == length)) {
+            continue;
+        }
+        if ((m[end] == '%') || (m[end] == '$')) {
+            note_name(x, line + y, end + 1 - y, index);
+            ++end;
+        }
+        if ((end < length) && (m[end] == '(')) {
+            note_name(x, line + y, end + 1 - y, index);
+        }
+    }
+}
+
+// Note the line number tokens in the line after the CR at 'line', as ABE
+// finds them.
+static void note_references(struct s_xref *x, uint16_t line, uint8_t length) {
+    const uint8_t *m = &x->memory[line];
+    uint16_t from = (m[1] << 8) | m[2];
+    for (int y = 4; y < length; ++y) {
+        if (m[y] == token_line_number) {
+            if (y + 3 >= length) {
+                // ABE would carry on into the next line.
+                x->failed = true;
+                return;
+            }
+            add_reference(x, detokenise_line_number(&m[y]), from);
+            y += 3;
+        }
+    }
+}
+
+// Make the single pass over the program at 'page', returning false if it
+// isn't intact or, for text, if we've hit a case we leave to ABE.
+static bool analyse(struct s_xref *x, uint16_t page, uint16_t himem) {
+    const uint8_t *m = x->memory;
+    x->in_order = true;
+    uint16_t line = page;
+    for (;;) {
+        if ((m[line] != cr) || ((uint32_t) line + 4 > himem)) {
+            return false;
+        }
+        if (m[line + 1] & 0x80) {
+            return !(x->text && x->failed);
+        }
+        uint8_t length = m[line + 3];
+        if ((length < 4) || ((uint32_t) line + length >= himem)) {
+            return false;
+        }
+        if (memchr(&m[line + 4], cr, length - 4) != 0) {
+            x->failed = true;
+        }
+        int index = x->line_count;
+        add_line(x, (m[line + 1] << 8) | m[line + 2]);
+        note_references(x, line, length);
+        note_names(x, index, line, length);
+        if (!catalogue_line(&x->catalogue, line)) {
+            x->failed = true;
+            // Carry on with the next line for JSON and CSV.
+            x->catalogue.failed = false;
+        }
+        line += length;
+    }
+}
+
+// List the names as ABE does: "@%", then each list in the catalogue in turn.
+static void list_variables(struct s_xref *x) {
+    const struct s_catalogue *c = &x->catalogue;
+    x->variables = check_alloc(malloc((c->entry_count + 1) *
+                                      sizeof(x->variables[0])));
+    static const uint8_t at_percent_tail[] = {'%'};
+    x->variables[0].initial = '@';
+    x->variables[0].tail = at_percent_tail;
+    x->variables[0].tail_length = 1;
+    x->variable_count = 1;
+    for (int list = 'A'; list <= catalogue_list_fn; ++list) {
+        uint8_t initial = list;
+        if (list >= catalogue_list_proc) {
+            initial = (list == catalogue_list_proc) ? token_proc : token_fn;
+        }
+        for (int i = c->head[list]; i >= 0; i = c->entries[i].next) {
+            struct s_variable *v = &x->variables[x->variable_count++];
+            v->initial = initial;
+            v->tail = c->entries[i].tail;
+            v->tail_length = c->entries[i].tail_length;
+        }
+    }
+    for (int i = 0; i < x->variable_count; ++i) {
+        struct s_variable *v = &x->variables[i];
+        uint8_t key[257];
+        key[0] = v->initial;
+        memcpy(&key[1], v->tail, v->tail_length);
+        v->name = 0;
+        if (x->name_count > 0) {
+            const struct s_name *name = find_name(x, key,
+                                                  v->tail_length + 1);
+            v->name = (name->length != 0) ? name : 0;
+        }
+    }
+}
+
+// Write a variable's name, leaving out the bracket after an array's name
+// unless 'bracket' is true.
+static void put_variable_name(struct s_buffer *output,
+                              const struct s_variable *v, bool bracket) {
+    if (v->initial == token_proc) {
+        buffer_put_string(output, "PROC");
+    } else if (v->initial == token_fn) {
+        buffer_put_string(output, "FN");
+    } else {
+        buffer_put(output, v->initial);
+    }
+    int length = v->tail_length;
+    if (!bracket && (length > 0) && (v->tail[length - 1] == '(')) {
+        --length;
+    }
+    for (int i = 0; i < length; ++i) {
+        buffer_put(output, v->tail[i]);
+    }
+}
+
+static const char *variable_type(const struct s_variable *v) {
+    if (v->initial == token_proc) {
+        return "PROC";
+    }
+    if (v->initial == token_fn) {
+        return "FN";
+    }
+    int length = v->tail_length;
+    bool array = (length > 0) && (v->tail[length - 1] == '(');
+    if (array) {
+        --length;
+    }
+    uint8_t last = (length > 0) ? v->tail[length - 1] : v->initial;
+    if (last == '%') {
+        return array ? "integer array" : "integer";
+    }
+    if (last == '$') {
+        return array ? "string array" : "string";
+    }
+    return array ? "real array" : "real";
+}
+
+// Write what ABE's &9C16 writes, without renaming anything: each name with
+// the number of times it appears, padded to column 16 (the emulated cursor
+// is always at column 0), and the lines where it does, as &8E30 writes them.
+static void write_variables_text(struct s_xref *x) {
+    struct s_buffer *output = &x->output;
+    put_newline(output);
+    for (int i = 0; i < x->variable_count; ++i) {
+        const struct s_variable *v = &x->variables[i];
+        put_variable_name(output, v, true);
+        buffer_put_string(output, " [");
+        put_number(output, (v->name != 0) ? v->name->count : 0, 0);
+        buffer_put(output, ']');
+        for (int j = 0; j < 16; ++j) {
+            buffer_put(output, ' ');
+        }
+        for (int j = 0; (v->name != 0) && (j < v->name->line_count); ++j) {
+            put_number(output, v->name->lines[j], 8);
+        }
+        put_newline(output);
+    }
+}
+
+static void write_variables_data(struct s_xref *x, bool json) {
+    struct s_buffer *output = &x->output;
+    buffer_put_string(output, json ? "{\n  \"variables\": [" :
+                                     "name,type,count,lines\n");
+    for (int i = 0; i < x->variable_count; ++i) {
+        const struct s_variable *v = &x->variables[i];
+        buffer_put_string(output, !json ? "" :
+                                  (i > 0) ? ",\n    {\"name\": \"" :
+                                            "\n    {\"name\": \"");
+        put_variable_name(output, v, false);
+        buffer_put_string(output, json ? "\", \"type\": \"" : ",");
+        buffer_put_string(output, variable_type(v));
+        buffer_put_string(output, json ? "\", \"count\": " : ",");
+        put_number(output, (v->name != 0) ? v->name->count : 0, 0);
+        buffer_put_string(output, json ? ", \"lines\": [" : ",");
+        for (int j = 0; (v->name != 0) && (j < v->name->line_count); ++j) {
+            buffer_put_string(output, (j == 0) ? "" : json ? ", " : " ");
+            put_number(output, v->name->lines[j], 0);
+        }
+        buffer_put_string(output, json ? "]}" : "\n");
+    }
+    if (json) {
+        buffer_put_string(output, (x->variable_count > 0) ? "\n  ]\n}\n" :
+                                                            "]\n}\n");
+    }
+}
+
+// Return the index of the first line numbered at least 'number', assuming
+// the lines are in order.
+static int lower_bound(const struct s_xref *x, uint16_t number) {
+    int low = 0;
+    int high = x->line_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (x->numbers[middle] < number) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static bool line_exists(const struct s_xref *x, uint16_t number) {
+    if (x->in_order) {
+        int i = lower_bound(x, number);
+        return (i < x->line_count) && (x->numbers[i] == number);
+    }
+    for (int i = 0; i < x->line_count; ++i) {
+        if (x->numbers[i] == number) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Return true if ABE's &8FE9 finds the line numbered 'number', which it
+// does if the first line numbered at least that high has that number.
+static bool abe_finds_line(const struct s_xref *x, uint16_t number) {
+    if (x->in_order) {
+        return line_exists(x, number);
+    }
+    for (int i = 0; i < x->line_count; ++i) {
+        if (x->numbers[i] >= number) {
+            return x->numbers[i] == number;
+        }
+    }
+    return false;
+}
+
+static int compare_references(const void *lhs, const void *rhs) {
+    const struct s_reference *l = lhs;
+    const struct s_reference *r = rhs;
+    if (l->target != r->target) {
+        return (l->target < r->target) ? -1 : 1;
+    }
+    return l->order - r->order;
+}
+
+// Sort the references by target, keeping those to each target in program
+// order.
+static void sort_references(struct s_xref *x) {
+    // With no references, the array may not have been allocated at all.
+    if (x->reference_count > 0) {
+        qsort(x->references, x->reference_count, sizeof(x->references[0]),
+              compare_references);
+    }
+}
+
+// Return the index of the first reference to 'target' in the sorted
+// references, or reference_count if there isn't one.
+static int find_references(const struct s_xref *x, uint16_t target) {
+    int low = 0;
+    int high = x->reference_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (x->references[middle].target < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if ((low < x->reference_count) && (x->references[low].target == target)) {
+        return low;
+    }
+    return x->reference_count;
+}
+
+// Write what ABE's &946B writes.
+static void write_line_references_text(struct s_xref *x) {
+    struct s_buffer *output = &x->output;
+    if (x->line_count == 0) {
+        return;
+    }
+    for (int i = 0; i < x->reference_count; ++i) {
+        const struct s_reference *r = &x->references[i];
+        if (!abe_finds_line(x, r->target)) {
+            put_number(output, r->target, 5);
+            buffer_put_string(output, " Nonexistent (");
+            put_number(output, r->from, 0);
+            buffer_put(output, ')');
+            put_newline(output); // ABE writes CR with OSASCI
+        }
+    }
+    sort_references(x);
+    for (int i = 0; i < x->line_count; ++i) {
+        uint16_t number = x->numbers[i];
+        int j = find_references(x, number);
+        if (j == x->reference_count) {
+            continue;
+        }
+        put_newline(output);
+        put_number(output, number, 5);
+        buffer_put_string(output, "   ");
+        for (; (j < x->reference_count) &&
+               (x->references[j].target == number); ++j) {
+            buffer_put_string(output, " (");
+            put_number(output, x->references[j].from, 5);
+            buffer_put(output, ')');
+        }
+    }
+    put_newline(output);
+}
+
+static void write_line_references_data(struct s_xref *x, bool json) {
+    struct s_buffer *output = &x->output;
+    buffer_put_string(output, json ? "{\n  \"line_references\": [" :
+                                     "line,exists,count,from\n");
+    sort_references(x);
+    for (int i = 0; i < x->reference_count; ) {
+        uint16_t target = x->references[i].target;
+        int end = i;
+        while ((end < x->reference_count) &&
+               (x->references[end].target == target)) {
+            ++end;
+        }
+        buffer_put_string(output, !json ? "" :
+                                  (i > 0) ? ",\n    {\"line\": " :
+                                            "\n    {\"line\": ");
+        put_number(output, target, 0);
+        buffer_put_string(output, json ? ", \"exists\": " : ",");
+        buffer_put_string(output, line_exists(x, target) ? "true" : "false");
+        buffer_put_string(output, json ? ", \"count\": " : ",");
+        put_number(output, end - i, 0);
+        buffer_put_string(output, json ? ", \"from\": [" : ",");
+        for (int j = i; j < end; ++j) {
+            buffer_put_string(output, (j == i) ? "" : json ? ", " : " ");
+            put_number(output, x->references[j].from, 0);
+        }
+        buffer_put_string(output, json ? "]}" : "\n");
+        i = end;
+    }
+    if (json) {
+        buffer_put_string(output, (x->reference_count > 0) ? "\n  ]\n}\n" :
+                                                             "]\n}\n");
+    }
+}
+
+bool xref_program(const struct s_machine *machine, int table, int format,
+                  uint8_t **output, size_t *output_length) {
+    assert((table == xref_line_references) || (table == xref_variables));
+    assert((output != 0) && (output_length != 0));
+    struct s_xref *x = check_alloc(calloc(1, sizeof(*x)));
+    x->memory = machine->memory;
+    x->text = (format == xref_format_text);
+    catalogue_init(&x->catalogue, machine, x->memory,
+                   mpu_read_u16(machine, 0x12));
+    if (!x->text) {
+        // We aren't limited by ABE's memory.
+        x->catalogue.limit = UINT32_MAX;
+    }
+    bool done = analyse(x, machine->memory[0x18] << 8,
+                        mpu_read_u16(machine, 0x06));
+    if (done) {
+        bool json = (format == xref_format_json);
+        if (table == xref_line_references) {
+            if (x->text) {
+                write_line_references_text(x);
+            } else {
+                write_line_references_data(x, json);
+            }
+        } else {
+            list_variables(x);
+            if (x->text) {
+                write_variables_text(x);
+            } else {
+                write_variables_data(x, json);
+            }
+        }
+        *output = x->output.data;
+        *output_length = x->output.length;
+    } else {
+        free(x->output.data);
+    }
+    for (int i = 0; i < x->name_capacity; ++i) {
+        free(x->names[i].lines);
+    }
+    free(x->names);
+    free(x->numbers);
+    free(x->references);
+    free(x->variables);
+    catalogue_free(&x->catalogue);
+    free(x);
+    return done;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,34 @@
+#ifndef XREF_H
+#define XREF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct s_machine;
+
+// A native equivalent of ABE's "Table line references" and "Variables
+// Xref", for --engine=native, which also writes the tables as JSON or CSV.
+// One pass over the program builds both tables, counting references just as
+// ABE does, so the text is exactly what ABE would have written.
+
+// The tables xref_program() can write.
+enum {
+    xref_line_references,
+    xref_variables
+};
+
+// Set *output to table 'table' for the program in 'machine''s memory, in
+// 'format', one of the xref_format_* values in config.h, and *output_length
+// to its length; the caller must free *output. As text, the output is what
+// ABE writes via OSWRCH after its own command has been echoed, and we return
+// false for programs we leave to ABE: ones which aren't intact, contain CR
+// or a line number token which runs into the end of a line, or which ABE's
+// catalogue of names wouldn't have room for or would stray beyond the end
+// of. As JSON or CSV we return false only if the program isn't intact.
+bool xref_program(const struct s_machine *machine, int table, int format,
+                  uint8_t **output, size_t *output_length);
+
+// vi: colorcolumn=80
+
+#endif
@@ -0,0 +1,316 @@
+// Benchmark the emulated machine: time LISTing and packing a program and
+// running a compare-and-branch loop with each of the M6502_run() variants and
+// report instructions per second. This isn't run by test.sh; build it with
+// "make benchmark" in src and run it from this directory as
+// "./bench [FILE [LIST-REPEATS]]".
+//
+// Variants without polling don't count instructions, so the fully instrumented
+// variant runs first and its counts are used for the others; they all execute
+// exactly the same instructions, except that with traps some of them are
+// replaced by native code.
+//
+// It then times tokenising a generated text program, renumbering it, packing
+// it, formatting it, unpacking it, listing its line references and variable
+// cross references and listing it all and ten lines of it, with each engine, in
+// lines per second of the whole program. Finally it compares resetting a
+// machine between jobs with emulation_init() and with emulation_restore().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "driver.h"
+#include "emulation.h"
+#include "traps.h"
+#include "utils.h"
+
+// utils.c and driver.c expect these to be provided by the program.
+const char *program_name = "bench";
+const char *filenames[2] = {"-", "/dev/null"};
+
+static struct s_machine machine;
+
+static const struct {
+    const char *name;
+    unsigned int mpu_flags;
+    int traps;
+} variants[] = {
+    {"instrumented", 0, traps_off},
+    {"no cycles", M6502_NoCycles, traps_off},
+    {"no polling", M6502_NoPolling, traps_off},
+    {"fast", M6502_NoPolling | M6502_NoCycles, traps_off},
+    {"predecoded", M6502_NoPolling | M6502_NoCycles | M6502_Predecode,
+     traps_off},
+    {"jit", M6502_NoPolling | M6502_NoCycles | M6502_Jit, traps_off},
+    {"traps (default)", M6502_NoPolling | M6502_NoCycles | M6502_Jit,
+     traps_on},
+};
+
+enum {
+    workload_list,
+    workload_pack,
+    workload_loop,
+    workload_count
+};
+
+static const char *workload_names[workload_count] = {"LIST", "pack", "loop"};
+
+// The loop workload: 4M iterations of the sort of compare-and-branch code the
+// tokeniser and pack spend their time in, so it mostly measures flag handling.
+static const uint16_t loop_address = 0xc00;
+static const uint8_t loop_code[] = {
+    0xa9, 0x40,         //      LDA #&40
+    0x85, 0x70,         //      STA &70
+    0xa0, 0x00,         // .a   LDY #0
+    0xa2, 0x00,         //      LDX #0
+    0x8a,               // .b   TXA
+    0xc9, 0x80,         //      CMP #&80
+    0x90, 0x02,         //      BCC c
+    0x49, 0xff,         //      EOR #&FF
+    0xc9, 0x20,         // .c   CMP #&20
+    0xf0, 0x00,         //      BEQ P%+2
+    0xe8,               //      INX
+    0xd0, 0xf2,         //      BNE b
+    0x88,               //      DEY
+    0xd0, 0xef,         //      BNE b
+    0xc6, 0x70,         //      DEC &70
+    0xd0, 0xe7,         //      BNE a
+    0x60,               //      RTS
+};
+
+static double seconds_since(clock_t start) {
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static const int resets = 20000;
+static const int tokenise_repeats = 20;
+static const int renumber_repeats = 20;
+static const int pack_repeats = 5;
+static const int layout_repeats = 5;
+
+static const int tokenise_lines = 500;
+
+// Time tokenising a text program of 'tokenise_lines' lines, written to
+// 'filename', 'tokenise_repeats' times with engine 'engine'.
+static double time_tokenise(const char *filename, int engine) {
+    config.engine = engine;
+    FILE *file = fopen_wrapper(filename, "w");
+    for (int i = 0; i < tokenise_lines; ++i) {
+        fprintf(file, "FOR I%%=1 TO %d:PRINT \"Line \";I%%:NEXT:PROCfoo(A$):"
+                "IF A GOTO %d\n", i, i / 2);
+    }
+    check(fclose(file) == 0, "error: error writing to output file");
+    clock_t start = clock();
+    for (int i = 0; i < tokenise_repeats; ++i) {
+        load_basic(&machine, filename);
+    }
+    double seconds = seconds_since(start);
+    config.engine = engine_emulated;
+    return seconds;
+}
+
+// Time renumbering the program left by time_tokenise() 'renumber_repeats'
+// times with engine 'engine'.
+static double time_renumber(int engine) {
+    config.engine = engine;
+    config.renumber_start = 10;
+    config.renumber_step = 10;
+    clock_t start = clock();
+    for (int i = 0; i < renumber_repeats; ++i) {
+        renumber(&machine);
+    }
+    double seconds = seconds_since(start);
+    config.engine = engine_emulated;
+    return seconds;
+}
+
+// Time packing the program in 'filename', as written by time_tokenise(),
+// 'pack_repeats' times with engine 'engine', loading it afresh each time.
+static double time_pack(const char *filename, int engine) {
+    double seconds = 0;
+    for (int i = 0; i < pack_repeats; ++i) {
+        config.engine = engine_native;
+        load_basic(&machine, filename);
+        config.engine = engine;
+        clock_t start = clock();
+        pack(&machine);
+        seconds += seconds_since(start);
+    }
+    config.engine = engine_emulated;
+    return seconds;
+}
+
+// List ten lines from the middle of the program renumbered by time_layout().
+static void save_ten_lines(struct s_machine *machine) {
+    config.lines_first = config.renumber_start +
+                         config.renumber_step * (tokenise_lines / 2);
+    config.lines_last = config.lines_first + config.renumber_step * 9;
+    save_ascii_basic(machine);
+    config.lines_first = config.lines_last = -1;
+}
+
+// The operations time_layout() can time, each writing the program in some
+// form.
+static const struct {
+    const char *name;
+    void (*save)(struct s_machine *machine);
+} layouts[] = {
+    {"format", save_formatted_basic},
+    {"unpack", save_unpacked_basic},
+    {"line-ref", save_line_ref},
+    {"variable-xref", save_variable_xref},
+    {"list", save_ascii_basic},
+    {"list-ten-lines", save_ten_lines}
+};
+
+// Time layouts[layout] for the program in 'filename', as written by
+// time_tokenise(), 'layout_repeats' times with engine 'engine'. ABE is left
+// waiting for a key afterwards, so each time the machine is reset and the
+// program loaded and renumbered afresh.
+static double time_layout(const char *filename, int layout, int engine) {
+    double seconds = 0;
+    for (int i = 0; i < layout_repeats; ++i) {
+        M6502_delete(machine.mpu);
+        emulation_init(&machine, model_standard, basic_4, driver_oswrch,
+                       M6502_NoPolling | M6502_NoCycles | M6502_Jit);
+        traps_install(&machine, traps_on);
+        config.engine = engine_native;
+        load_basic(&machine, filename);
+        renumber(&machine);
+        config.engine = engine;
+        clock_t start = clock();
+        layouts[layout].save(&machine);
+        seconds += seconds_since(start);
+    }
+    config.engine = engine_emulated;
+    return seconds;
+}
+
+// Time 'resets' resets of the machine by emulation_init(). With M6502_Jit this
+// leaves out creating the translator, which the first job after each reset
+// would pay for, so it flatters emulation_init().
+static double time_init(unsigned int mpu_flags) {
+    clock_t start = clock();
+    for (int i = 0; i < resets; ++i) {
+        M6502_delete(machine.mpu);
+        emulation_init(&machine, model_standard, basic_4, driver_oswrch,
+                       mpu_flags);
+        traps_install(&machine, traps_on);
+    }
+    return seconds_since(start);
+}
+
+// Time 'resets' resets of the machine by emulation_restore() after it has
+// entered a program line, by marking the pages that job dirtied before each
+// one.
+static double time_restore(const struct s_machine_snapshot *snapshot) {
+    uint8_t job_dirty[sizeof(machine.mpu->dirty)];
+    execute_input_line(&machine, "10PRINT \"Hello, world!\"");
+    memcpy(job_dirty, machine.mpu->dirty, sizeof(job_dirty));
+    clock_t start = clock();
+    for (int i = 0; i < resets; ++i) {
+        memcpy(machine.mpu->dirty, job_dirty, sizeof(job_dirty));
+        emulation_restore(&machine, snapshot);
+    }
+    return seconds_since(start);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = (argc > 1) ? argv[1] : "loader.tok";
+    int list_repeats = (argc > 2) ? atoi(argv[2]) : 20;
+    check(list_repeats > 0, "error: invalid repeat count");
+    config.basic_version = basic_4;
+
+    unsigned long instructions[workload_count] = {0};
+    printf("%-16s %-5s %12s %10s %14s\n", "variant", "work", "instructions",
+           "seconds", "instructions/s");
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i) {
+        emulation_init(&machine, model_standard, basic_4, driver_oswrch,
+                       variants[i].mpu_flags);
+        traps_install(&machine, variants[i].traps);
+        load_basic(&machine, filename);
+        memcpy(&machine.memory[loop_address], loop_code, sizeof(loop_code));
+        mpu_memory_written(&machine, loop_address, sizeof(loop_code));
+
+        for (int workload = 0; workload < workload_count; ++workload) {
+            unsigned long start_instructions = machine.mpu->instructions;
+            clock_t start = clock();
+            if (workload == workload_list) {
+                for (int j = 0; j < list_repeats; ++j) {
+                    save_ascii_basic(&machine);
+                }
+            } else if (workload == workload_pack) {
+                pack(&machine);
+            } else {
+                execute_input_line(&machine, "CALL &C00");
+            }
+            double seconds = seconds_since(start);
+            if (i == 0) {
+                instructions[workload] =
+                    machine.mpu->instructions - start_instructions;
+            }
+            printf("%-16s %-5s %12lu %10.3f %14.0f\n", variants[i].name,
+                   workload_names[workload], instructions[workload], seconds,
+                   instructions[workload] / seconds);
+        }
+    }
+
+    const unsigned int mpu_flags = M6502_NoPolling | M6502_NoCycles | M6502_Jit;
+    const int lines = tokenise_lines * tokenise_repeats;
+    printf("\n%-17s %8s %10s %14s\n", "tokenise", "lines", "seconds",
+           "lines/s");
+    double seconds = time_tokenise("tmp/zz-bench.bas", engine_emulated);
+    printf("%-17s %8d %10.3f %14.0f\n", "emulated", lines, seconds,
+           lines / seconds);
+    seconds = time_tokenise("tmp/zz-bench.bas", engine_native);
+    printf("%-17s %8d %10.3f %14.0f\n", "native", lines, seconds,
+           lines / seconds);
+
+    const int renumbered_lines = tokenise_lines * renumber_repeats;
+    printf("\n%-17s %8s %10s %14s\n", "renumber", "lines", "seconds",
+           "lines/s");
+    seconds = time_renumber(engine_emulated);
+    printf("%-17s %8d %10.3f %14.0f\n", "emulated", renumbered_lines,
+           seconds, renumbered_lines / seconds);
+    seconds = time_renumber(engine_native);
+    printf("%-17s %8d %10.3f %14.0f\n", "native", renumbered_lines, seconds,
+           renumbered_lines / seconds);
+
+    const int packed_lines = tokenise_lines * pack_repeats;
+    printf("\n%-17s %8s %10s %14s\n", "pack", "lines", "seconds", "lines/s");
+    seconds = time_pack("tmp/zz-bench.bas", engine_emulated);
+    printf("%-17s %8d %10.3f %14.0f\n", "emulated", packed_lines, seconds,
+           packed_lines / seconds);
+    seconds = time_pack("tmp/zz-bench.bas", engine_native);
+    printf("%-17s %8d %10.3f %14.0f\n", "native", packed_lines, seconds,
+           packed_lines / seconds);
+
+    const int layout_lines = tokenise_lines * layout_repeats;
+    for (size_t layout = 0; layout < sizeof(layouts) / sizeof(layouts[0]);
+         ++layout) {
+        printf("\n%-17s %8s %10s %14s\n", layouts[layout].name, "lines",
+               "seconds", "lines/s");
+        seconds = time_layout("tmp/zz-bench.bas", layout, engine_emulated);
+        printf("%-17s %8d %10.3f %14.0f\n", "emulated", layout_lines, seconds,
+               layout_lines / seconds);
+        seconds = time_layout("tmp/zz-bench.bas", layout, engine_native);
+        printf("%-17s %8d %10.3f %14.0f\n", "native", layout_lines, seconds,
+               layout_lines / seconds);
+    }
+
+    static struct s_machine_snapshot snapshot;
+    printf("\n%-17s %8s %10s %14s\n", "reset", "resets", "seconds",
+           "resets/s");
+    seconds = time_init(mpu_flags);
+    printf("%-17s %8d %10.3f %14.0f\n", "emulation_init", resets, seconds,
+           resets / seconds);
+    emulation_snapshot(&machine, &snapshot);
+    seconds = time_restore(&snapshot);
+    printf("%-17s %8d %10.3f %14.0f\n", "emulation_restore", resets, seconds,
+           resets / seconds);
+
+    return EXIT_SUCCESS;
+}
+
+// vi: colorcolumn=80
@@ -0,0 +1,207 @@
+// Check that emulated machines are independent of each other: we type the same
+// program into two machines side by side, interleaving the work on each, and
+// check both end up with identical tokenised programs and LIST output. A third
+// machine running BASIC 2 with PAGE=&800 is driven alongside them to make sure
+// it doesn't perturb the other two. The second BASIC 4 machine runs translated
+// code, so this also checks the translator against the interpreter; the BASIC 2
+// machine runs its ROM predecoded, and both check their native ROM traps
+// against the ROM code.
+// Each BASIC 4 machine then does some more work after a snapshot and is
+// restored from it, which must put back everything that work changed. An
+// error in the second must stop only that machine, which a restore brings
+// back. Finally, the first machine is given a filing system rooted in tmp, types a program in
+// with *EXEC, saves and reloads it and reads back a file it writes, must
+// reject an OSGBPB control block which would overrun memory, and must close
+// the files a job leaves open when it's restored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulation.h"
+#include "filing.h"
+#include "roms.h"
+#include "traps.h"
+#include "utils.h"
+
+// utils.c expects these to be provided by the program.
+const char *program_name = "machines";
+const char *filenames[2] = {"-", "-"};
+
+enum {
+    machine_count = 3,
+    output_size = 64 * 1024
+};
+
+static struct s_machine machines[machine_count];
+static struct s_machine_snapshot snapshot;
+
+static struct {
+    char data[output_size];
+    size_t length;
+} outputs[machine_count];
+
+static void capture_oswrch(struct s_machine *machine, const uint8_t *data,
+                           size_t length) {
+    size_t i = machine - machines;
+    check(i < machine_count, "error: output from unknown machine");
+    check(outputs[i].length + length <= output_size, "error: too much output");
+    memcpy(&outputs[i].data[outputs[i].length], data, length);
+    outputs[i].length += length;
+}
+
+static const char *program[] = {
+    "10REM Two machines",
+    "20FOR I%=1 TO 10",
+    "30PRINT \"Hello \";I%",
+    "40NEXT",
+    "50DEF PROCfoo(A$):LOCAL B%:B%=LEN(A$)",
+    "60IF B%>3 THEN PRINT A$ ELSE GOTO 20",
+    "70ENDPROC",
+};
+
+static int failures = 0;
+
+static void expect(bool b, const char *what) {
+    if (!b) {
+        fprintf(stderr, "machines: %s\n", what);
+        ++failures;
+    }
+}
+
+int main(void) {
+    emulation_init(&machines[0], model_standard, basic_4, capture_oswrch,
+                   EMULATION_MPU_FLAGS);
+    emulation_init(&machines[2], model_page_800, basic_2, capture_oswrch,
+                   EMULATION_MPU_FLAGS | M6502_Predecode);
+    emulation_init(&machines[1], model_standard, basic_4, capture_oswrch,
+                   EMULATION_MPU_FLAGS | M6502_Jit);
+    traps_install(&machines[1], traps_verify);
+    traps_install(&machines[2], traps_verify);
+
+    execute_input_line(&machines[2], "NEW");
+    for (int i = 0; i < sizeof(program) / sizeof(program[0]); ++i) {
+        execute_input_line(&machines[i % 2], program[i]);
+        execute_input_line(&machines[2], program[i]);
+        execute_input_line(&machines[(i + 1) % 2], program[i]);
+    }
+
+    for (int i = 0; i < machine_count; ++i) {
+        outputs[i].length = 0;
+    }
+    execute_input_line(&machines[1], "LIST");
+    execute_input_line(&machines[2], "LIST");
+    execute_input_line(&machines[0], "LIST");
+
+    // The length of each tokenised program.
+    uint16_t top[machine_count];
+    for (int i = 0; i < machine_count; ++i) {
+        top[i] = mpu_read_u16(&machines[i], 0x12) - machines[i].model->page;
+    }
+    const uint16_t page = machines[0].model->page;
+    const uint16_t low_page = machines[2].model->page;
+    expect(top[0] == top[1], "TOP differs");
+    expect(memcmp(&machines[0].memory[page], &machines[1].memory[page],
+                  top[0]) == 0, "tokenised programs differ");
+    expect(outputs[0].length > 0, "no LIST output");
+    expect((outputs[0].length == outputs[1].length) &&
+           (memcmp(outputs[0].data, outputs[1].data, outputs[0].length) == 0),
+           "LIST output differs");
+    // BASIC 2 terminates lines differently in its LIST output, but it should
+    // tokenise this simple program just the same as BASIC 4.
+    expect(outputs[2].length > 0, "no BASIC 2 LIST output");
+    expect((top[0] == top[2]) &&
+           (memcmp(&machines[0].memory[page], &machines[2].memory[low_page],
+                   top[0]) == 0),
+           "BASIC 2 tokenised program differs");
+
+    static const char *job[] = {"80A%=1", "B%=2", "NEW", "10PRINT"};
+    for (int i = 0; i < 2; ++i) {
+        emulation_snapshot(&machines[i], &snapshot);
+        for (int j = 0; j < sizeof(job) / sizeof(job[0]); ++j) {
+            execute_input_line(&machines[i], job[j]);
+        }
+        emulation_restore(&machines[i], &snapshot);
+        expect(memcmp(machines[i].memory, snapshot.memory,
+                      sizeof(snapshot.memory)) == 0,
+               "restored memory differs from snapshot");
+        outputs[i].length = 0;
+        execute_input_line(&machines[i], "LIST");
+    }
+    expect((outputs[0].length == outputs[1].length) &&
+           (memcmp(outputs[0].data, outputs[1].data, outputs[0].length) == 0),
+           "LIST output differs after restore");
+
+    emulation_snapshot(&machines[1], &snapshot);
+    execute_input_line(&machines[1], "PRINT 1/0");
+    expect((machines[1].state == ms_error) &&
+           (machines[1].error.number == 18) &&
+           (strcmp(machines[1].error.message, "Division by zero") == 0),
+           "error didn't stop the machine");
+    execute_input_line(&machines[0], "A%=1");
+    expect(machines[0].state == ms_osword_input_line_pending,
+           "error in one machine stopped another");
+    emulation_restore(&machines[1], &snapshot);
+    outputs[0].length = outputs[1].length = 0;
+    execute_input_line(&machines[0], "LIST");
+    execute_input_line(&machines[1], "LIST");
+    expect((outputs[0].length == outputs[1].length) &&
+           (memcmp(outputs[0].data, outputs[1].data, outputs[0].length) == 0),
+           "LIST output differs after restoring from an error");
+
+    FILE *file = fopen("tmp/zz-exec.txt", "wb");
+    check(file != 0, "error: can't create tmp/zz-exec.txt");
+    fputs("NEW\r\n10REM Filing system\r\n20PRINT \"EXEC\"\n\r30END", file);
+    fclose(file);
+    struct s_machine *machine = &machines[0];
+    machine->filing_system = filing_system_new("tmp");
+    execute_input_line(machine, "*EXEC zz-exec.txt");
+    expect(machine->state == ms_osword_input_line_pending,
+           "*EXEC didn't return to the prompt");
+    uint16_t exec_top = mpu_read_u16(machine, 0x12);
+    static const char *fs_job[] = {
+        "SAVE \"zz-prog\"", "NEW", "LOAD \"zz-prog\"",
+        "F%=OPENOUT \"zz-data\":BPUT#F%,65:PRINT#F%,\"hi\":CLOSE#F%",
+        "F%=OPENIN \"zz-data\":A%=BGET#F%:B%=EXT#F%:C%=EOF#F%:CLOSE#F%"
+    };
+    for (int j = 0; j < sizeof(fs_job) / sizeof(fs_job[0]); ++j) {
+        execute_input_line(machine, fs_job[j]);
+    }
+    expect((exec_top > page + 4) &&
+           (mpu_read_u16(machine, 0x12) == exec_top),
+           "program typed with *EXEC not saved and loaded");
+    // A%, B% and C% are resident integer variables at &404, &408 and &40C.
+    expect((machine->memory[0x404] == 65) && (machine->memory[0x408] == 5) &&
+           (machine->memory[0x40c] == 0),
+           "file not read back as written");
+
+    // An OSGBPB control block at &A00 whose address and count wrap to a
+    // small number when added must be rejected, not read past the end of
+    // memory.
+    execute_input_line(machine, "F%=OPENIN \"zz-data\":?&A00=F%:"
+                                "!&A01=&FFFF:!&A05=-1");
+    M6502_Registers registers = machine->registers;
+    machine->registers.a = 4;
+    machine->registers.x = 0x00;
+    machine->registers.y = 0x0a;
+    uint16_t error = filing_osgbpb(machine);
+    machine->registers = registers;
+    expect((machine->memory[error] == 0x00) &&
+           (machine->memory[error + 1] == 0xfc),
+           "OSGBPB accepted a wrapping control block");
+    execute_input_line(machine, "CLOSE#F%");
+
+    // A job which leaves every file handle open mustn't leave them open for
+    // the next; G% is at &41C.
+    emulation_snapshot(machine, &snapshot);
+    execute_input_line(machine, "FOR I%=1 TO 5:F%=OPENOUT (\"zz-data\"+STR$I%)"
+                                ":NEXT");
+    emulation_restore(machine, &snapshot);
+    execute_input_line(machine, "G%=OPENIN \"zz-data5\":CLOSE#G%");
+    expect(machine->memory[0x41c] == 0x11,
+           "files left open by a job not closed by emulation_restore()");
+    filing_system_delete(machine->filing_system);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// vi: colorcolumn=80
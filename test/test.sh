@@ -7,9 +7,14 @@
 set -e
 
 VALGRIND=""
-if [ "$1" = "-v" ]; then
-	VALGRIND="valgrind --leak-check=yes"
-fi
+OPTIONS=""
+for OPT in "$@"; do
+	case "$OPT" in
+		-v) VALGRIND="valgrind --leak-check=yes" ;;
+		-i) OPTIONS="$OPTIONS --no-jit" ;;
+		-t) OPTIONS="$OPTIONS --verify-traps" ;;
+	esac
+done
 
 mkdir -p tmp
 mkdir -p out
@@ -27,9 +32,11 @@ echo -en "A=3\rB=4\rC=5\r" > zz-test-cr.bas
 echo -en "A=3\r\nB=4\r\nC=5\r\n" > zz-test-crlf.bas
 echo -en "A=3\n\rB=4\n\rC=5\n\r" > zz-test-lfcr.bas
 echo -en "A=3\n   B=4\nC=5   \n" >> zz-test-spaces.bas
+# Lines 10, 30, 20, 40 and 50, with references to lines in and out of order.
+echo -en "\x0d\x00\x0a\x09\xe5\x8d\x54\x54\x40\x0d\x00\x1e\x09\xe5\x8d\x54\x4a\x40\x0d\x00\x14\x0f\xe5\x8d\x54\x5e\x40\x3a\xe5\x8d\x64\x74\x41\x0d\x00\x28\x0a\x22\x8d\x54\x54\x40\x22\x0d\x00\x32\x09\xf4\x8d\x54\x68\x40\x0d\xff" > zz-unordered.tok
 cd ..
 
-BASICTOOL="$VALGRIND ../basictool --output-binary"
+BASICTOOL="$VALGRIND ../basictool --output-binary $OPTIONS"
 TESTS="hello.bas loader.tok loader-packed.tok embedded-lf.tok embedded-nul-and-trailing-data.tok tmp/zz-test-*.bas"
 
 # TODO: We could also test stderr (especially with -vv) but let's not get too
@@ -60,6 +67,170 @@ for TEST in $TESTS; do
 	fi
 done
 
+# An operation which runs out of its instruction budget should stop with an
+# error rather than hang.
+echo Running budget...
+$BASICTOOL --budget 1 -t --pack loader.tok 2>&1 > /dev/null | grep "^error:" > out/budget-err.out
+# ABE's pack never finishes with this program; a budget above 2^31 must
+# still stop it, with or without the JIT.
+$BASICTOOL --budget 2200 --pack tmp/zz-unordered.tok 2>&1 > /dev/null | grep "^error:" >> out/budget-err.out
+
+# The 6502 profile counts instructions exactly, so its totals only change if
+# the code the emulated machine runs does.
+echo Running profile...
+$BASICTOOL --no-traps --profile-6502 tmp/profile.txt --profile-symbols profile.sym loader.tok > /dev/null
+grep "^6502 profile:\|:print_token$" tmp/profile.txt > out/profile.out
+grep -c "^listing;BASIC4:print_token " tmp/profile.txt.folded >> out/profile.out
+
+# A program too large for the standard memory map fits with PAGE=&800.
+echo Running model...
+for LINE in $(seq 10 10 11890); do
+	echo "$LINE PRINT \"xxxxxxxxxxxxxxxx\""
+done > tmp/zz-big.bas
+$BASICTOOL --model=page-800 -t tmp/zz-big.bas tmp/zz-big.tok
+$BASICTOOL --model=page-800 tmp/zz-big.tok | tail -n 1 > out/model.out
+$BASICTOOL tmp/zz-big.tok 2>&1 > /dev/null | grep "^error:" >> out/model.out
+
+# The native unpack renumbers without RENUMBER's table at TOP, so it copes
+# with a program which leaves too little room for that table.
+echo Running unpack...
+for LINE in $(seq 1700); do
+	echo "$LINE A%=$LINE:B%=2"
+done > tmp/zz-unpack.bas
+$BASICTOOL -t tmp/zz-unpack.bas tmp/zz-unpack.tok
+$BASICTOOL -r tmp/zz-unpack.tok 2>&1 > /dev/null | grep -c "space" > out/unpack.out
+$BASICTOOL -u --engine=native tmp/zz-unpack.tok 2>&1 | sed -n '1p;$p' >> out/unpack.out
+
+# Running out of memory to tokenise or renumber in must be reported in the
+# same words by both engines, with the ROM's tokens expanded.
+echo Running space...
+for LINE in $(seq 3000); do
+	echo "PRINT \"Hello, world $LINE\""
+done > tmp/zz-space.bas
+for ENGINE in emulated native; do
+	$BASICTOOL --engine=$ENGINE tmp/zz-space.bas 2>&1 > /dev/null | grep "error:" >> out/space-err.out
+	$BASICTOOL --engine=$ENGINE -r tmp/zz-unpack.tok 2>&1 > /dev/null | grep "^error:" >> out/space-err.out
+done
+
+# A trace replays on a fresh machine only if it does exactly what the
+# recorded one did.
+echo Running trace...
+../basictool --record-trace tmp/pack.trc --pack loader.tok > /dev/null
+$BASICTOOL --replay-trace tmp/pack.trc | grep "^replayed" > out/trace.out
+
+# The native detokeniser must list every program exactly as the ROMs do...
+echo Running native...
+for TEST in $TESTS; do
+	BASENAME=$(basename $TEST)
+	STRIP=""
+	if [ "$(basename $BASENAME .tok)" == "$BASENAME" ]; then
+		STRIP=-s
+	fi
+	$BASICTOOL -a --engine=native $STRIP $TEST > tmp/zz-native.out
+	cmp -s tmp/zz-native.out mst/$BASENAME-a.mst || echo TEST FAILED: native $TEST
+	for BASIC in 2 4; do
+		$BASICTOOL -$BASIC -t $STRIP $TEST tmp/zz-native.tok 2> /dev/null
+		for LISTO in 0 1 2 3 4 5 6 7; do
+			$BASICTOOL -$BASIC -a --listo $LISTO tmp/zz-native.tok > tmp/zz-emulated.out
+			$BASICTOOL -$BASIC -a --listo $LISTO --engine=native tmp/zz-native.tok > tmp/zz-native.out
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC --listo $LISTO $TEST
+		done
+	done
+done
+
+# ... and the native tokeniser must build exactly the program the ROMs do
+# from each program listed as text, and from the awkward cases in tokens.bas.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas; do
+		$BASICTOOL -$BASIC -a $TEST > tmp/zz-native.bas 2> /dev/null
+		for INPUT in $TEST tmp/zz-native.bas; do
+			if [ "$(basename $INPUT .tok)" != "$(basename $INPUT)" ]; then
+				continue
+			fi
+			# Listings of packed programs have lines too long to
+			# type in, so the errors must match too.
+			$BASICTOOL -$BASIC -t $INPUT > tmp/zz-emulated.out 2>&1 || true
+			$BASICTOOL -$BASIC -t --engine=native $INPUT > tmp/zz-native.out 2>&1 || true
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC -t $INPUT from $TEST
+		done
+	done
+done
+
+# ... and native RENUMBER must do exactly what the ROMs' does, including
+# with lines out of order.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas tmp/zz-unordered.tok; do
+		for RENUMBER in "" "--renumber-start 32000 --renumber-step 255"; do
+			# Only the emulated machine shows the lines typed in at
+			# the prompt, but both show any "Failed at" lines.
+			$BASICTOOL -$BASIC -t --renumber $RENUMBER --show-all-output $TEST 2>&1 | grep -av "^bbc:>" > tmp/zz-emulated.out || true
+			$BASICTOOL -$BASIC -t --renumber $RENUMBER --show-all-output --engine=native $TEST 2>&1 | grep -av "^bbc:>" > tmp/zz-native.out || true
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC --renumber $RENUMBER $TEST
+		done
+	done
+done
+
+# ... and native pack must do exactly what ABE's does, with each question
+# answered both ways, reporting the same details with -vv.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas; do
+		for PACK in --pack --pack-rems-n --pack-spaces-n --pack-comments-n --pack-variables-n --pack-singles-n --pack-concatenate-n; do
+			$BASICTOOL -$BASIC -t -vv $PACK $TEST tmp/zz-emulated.tok 2>&1 | grep -av "^info:" > tmp/zz-emulated.out || true
+			$BASICTOOL -$BASIC -t -vv $PACK --engine=native $TEST tmp/zz-native.tok 2>&1 | grep -av "^info:" > tmp/zz-native.out || true
+			cmp -s tmp/zz-emulated.tok tmp/zz-native.tok && cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC $PACK $TEST
+		done
+	done
+done
+
+# ... and native format and unpack must write exactly what ABE's do, except
+# that native unpack renumbers a program whose lines are too close together
+# rather than giving up, as loader.tok's are with the default step.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas; do
+		for LAYOUT in -f "-u --renumber-step 100"; do
+			$BASICTOOL -$BASIC $LAYOUT $TEST > tmp/zz-emulated.out 2>&1 || true
+			$BASICTOOL -$BASIC $LAYOUT --engine=native $TEST > tmp/zz-native.out 2>&1 || true
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC $LAYOUT $TEST
+		done
+	done
+done
+$BASICTOOL -u --renumber loader.tok > tmp/zz-emulated.out
+$BASICTOOL -u --engine=native loader.tok > tmp/zz-native.out 2> /dev/null
+cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -u loader.tok
+
+# ... and native line references and variable cross references must be
+# exactly ABE's, including with lines out of order.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas tmp/zz-unordered.tok; do
+		for XREF in --line-ref --variable-xref; do
+			$BASICTOOL -$BASIC $XREF $TEST > tmp/zz-emulated.out 2>&1 || true
+			$BASICTOOL -$BASIC $XREF --engine=native $TEST > tmp/zz-native.out 2>&1 || true
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC $XREF $TEST
+		done
+	done
+done
+# ... and listing part of a program must list the same lines with either
+# engine, as LIST FIRST,LAST does.
+for BASIC in 2 4; do
+	for TEST in $TESTS tokens.bas tmp/zz-unordered.tok; do
+		for SELECT in "--lines 100-200" "--lines 1000-" "--lines -50" "--lines 1200" "--proc PROCerror" "--proc FNstrip --listo 7"; do
+			$BASICTOOL -$BASIC $SELECT $TEST > tmp/zz-emulated.out 2>&1 || true
+			$BASICTOOL -$BASIC $SELECT --engine=native $TEST > tmp/zz-native.out 2>&1 || true
+			cmp -s tmp/zz-emulated.out tmp/zz-native.out || echo TEST FAILED: native -$BASIC $SELECT $TEST
+		done
+	done
+done
+# The last definition in a program runs to the end of it.
+echo -en "PRINT FNa\nEND\nDEF FNa\nA=1\n=A\n" > tmp/zz-proc.bas
+$BASICTOOL --proc FNa tmp/zz-proc.bas > out/proc.out
+for FORMAT in json csv; do
+	$BASICTOOL --line-ref --xref-format=$FORMAT loader.tok > out/loader.tok-line-ref-$FORMAT.out
+	$BASICTOOL --variable-xref --xref-format=$FORMAT loader.tok > out/loader.tok-variable-xref-$FORMAT.out
+done
+
+echo Running machines...
+$VALGRIND ./machines || echo TEST FAILED: machines
+
 for RESULT in out/*.out; do
 	cmp -s $RESULT mst/$(basename $RESULT .out).mst || echo TEST FAILED: $RESULT
 done
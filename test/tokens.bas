@@ -0,0 +1,19 @@
+REM Lines which exercise the corners of BASIC's tokeniser.
+P.TIME:TIME=3:PRINT PAGE:PAGE=&1900:PTR#C=PTR#C+1
+GOTO 10:GOSUB 20,30:GOTO 99999:GOTO &10:GOTO 10.5
+ON X GOTO 10,20 ELSE 30:ON ERROR GOTO 40
+IF A THEN 10 ELSE 20
+PROCfoo:DEFPROCbar(A):Z=FNbaz+FNPRINT
+REM PRINT GOTO 10
+DATA PRINT,10
+*FX 200,3
+X=TIMER:Y=TIME+1:A$=LEFT$("GOTO",2):B=PAGEX+ERL
+RESTORE 40:TRACE 100:LIST 10,20:DELETE 10,20
+xPRINT=1:PRINTx:_PRINT=2:`PRINT=3:Q%=5
+E.:END:ENDPROC:F.I=1TO3:N.:REP.:U.0:G.10:O.0
+PRINT 1E5,.5,&FFG,1.2.3,Q1E5
+PRINT "unterminated GOTO 10
+   IF A THEN 10 ELSE 20   
+   
+A=1:*FX 0
+PRINT~A:A=-1:A=A AND1:A=A OR2:A=TRUEFALSE